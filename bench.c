@@ -0,0 +1,479 @@
+/*
+   bench.c : hash map and binary tree microbenchmarks
+
+   Copyright (C)2010 Rob Neff - All rights reserved.
+   Source code licensed under the new/simplified 2-clause BSD OSI license.
+
+   Built by `scons bench`, which runs them and writes their results to
+   bench.csv.
+
+   Each map type, and a bare bintree.asm tree, is filled with 1K up to
+   HASHMAP_BENCH_MAX keys of three distributions: sequential macro
+   names, random identifiers and long include paths. Every operation
+   is timed over at least HASHMAP_BENCH_OPS calls, repeating the run on
+   fresh maps for small key counts. One CSV line is printed per result,
+   with the cache misses per operation if the perf counters can be read
+   and the bytes the map allocated per key, counted by a
+   hash_map_counter_t.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "hashmap.h"
+
+#ifndef HASHMAP_BENCH_MAX
+#define HASHMAP_BENCH_MAX      10000000  /* most keys a map is filled with */
+#endif
+#define HASHMAP_BENCH_PATHS    1000000   /* most long path keys, they take ~70 bytes each */
+#define HASHMAP_BENCH_OPS      1000000   /* least calls timed per result */
+#define HASHMAP_BENCH_CHUNK    0x100000  /* bytes per block of key text */
+#define HASHMAP_BENCH_BATCH    32        /* keys per hash_map_find_batch() call */
+
+static char *HashmapBenchPrefix[] = { "WM_", "ERROR_", "IDS_STRING_", "SQL_ATTR_" };
+static char *HashmapBenchRoot[] = {
+   "C:/Program Files (x86)/Windows Kits/10/Include/10.0.19041.0",
+   "/usr/include/x86_64-linux-gnu",
+   "/opt/toolchains/sdk/include"
+};
+static char *HashmapBenchDir[] = { "um", "shared", "ucrt", "winrt", "sys", "bits", "net", "linux" };
+static char *HashmapBenchBase[] = { "winnt", "winuser", "objidl", "propidl", "stdio", "socket" };
+static char *HashmapBenchDist[] = { "sequential", "random", "paths" };
+
+/* keys of a distribution, the first count are inserted, the rest are missing */
+struct hashmap_bench_keys_t {
+   char **keys;
+   unsigned int *klens;
+   char **lookups;            /* inserted keys in random order */
+   unsigned int *llens;
+   unsigned int count;
+   unsigned int misses;
+   char *chunk;               /* last block of key text, linked through its first bytes */
+   unsigned int avail;        /* bytes left in chunk */
+};
+
+static unsigned int HashmapBenchSeed;
+
+static unsigned int hashmap_bench_rand(void)
+{
+   HashmapBenchSeed = HashmapBenchSeed * 1103515245 + 12345;
+   return HashmapBenchSeed >> 8;
+}
+
+/* time in ns */
+static double hashmap_bench_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#else
+   return (double)clock() * 1e9 / CLOCKS_PER_SEC;
+#endif
+}
+
+#ifdef __linux__
+static int HashmapBenchPerf = -1;
+
+/* open a counter of the cache misses of this process, if the kernel and cpu allow */
+static void hashmap_bench_perf_open(void)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.size = sizeof(attr);
+   attr.config = PERF_COUNT_HW_CACHE_MISSES;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   HashmapBenchPerf = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void hashmap_bench_perf_start(void)
+{
+   if ( HashmapBenchPerf >= 0 )
+   {
+      ioctl(HashmapBenchPerf, PERF_EVENT_IOC_RESET, 0);
+      ioctl(HashmapBenchPerf, PERF_EVENT_IOC_ENABLE, 0);
+   }
+}
+
+/* cache misses since hashmap_bench_perf_start(), -1 if not counted */
+static long long hashmap_bench_perf_stop(void)
+{
+   long long misses;
+
+   if ( HashmapBenchPerf < 0 )
+      return -1;
+   ioctl(HashmapBenchPerf, PERF_EVENT_IOC_DISABLE, 0);
+   if ( read(HashmapBenchPerf, &misses, sizeof(misses)) != sizeof(misses) )
+      return -1;
+   return misses;
+}
+#else
+#define hashmap_bench_perf_open()
+#define hashmap_bench_perf_start()
+#define hashmap_bench_perf_stop() (-1LL)
+#endif
+
+/* a timed region, summed over the rounds of a result */
+struct hashmap_bench_time_t {
+   double ns;
+   long long misses;
+   double start;
+};
+
+static void hashmap_bench_start(struct hashmap_bench_time_t *t)
+{
+   hashmap_bench_perf_start();
+   t->start = hashmap_bench_now();
+}
+
+static void hashmap_bench_stop(struct hashmap_bench_time_t *t)
+{
+   long long misses;
+
+   t->ns += hashmap_bench_now() - t->start;
+   misses = hashmap_bench_perf_stop();
+   if ( ( misses < 0 ) || ( t->misses < 0 ) )
+      t->misses = -1;
+   else
+      t->misses += misses;
+}
+
+/* print one CSV line */
+static void hashmap_bench_report(char *map, unsigned int dist, unsigned int count, char *op, struct hashmap_bench_time_t *t, double calls, double bytes)
+{
+   printf("%s,%s,%u,%s,%.1f,", map, HashmapBenchDist[dist], count, op, t->ns / calls);
+   if ( t->misses >= 0 )
+      printf("%.2f", (double)t->misses / calls);
+   printf(",%.1f\n", bytes);
+}
+
+/* copy a key to the key text, 0 if out of memory */
+static char* hashmap_bench_store(struct hashmap_bench_keys_t *k, char *key, unsigned int len)
+{
+   char *chunk;
+   char *p;
+
+   if ( len + 1 > k->avail )
+   {
+      chunk = malloc(HASHMAP_BENCH_CHUNK);
+      if ( !chunk )
+         return chunk;
+      *(char**)chunk = k->chunk;
+      k->chunk = chunk;
+      k->avail = HASHMAP_BENCH_CHUNK - sizeof(char*);
+   }
+   p = k->chunk + HASHMAP_BENCH_CHUNK - k->avail;
+   memcpy(p, key, len + 1);
+   k->avail -= len + 1;
+   return p;
+}
+
+/* write key i of a distribution to key, returns its length */
+static unsigned int hashmap_bench_key(unsigned int dist, unsigned int i, char *key)
+{
+   static char Chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+   unsigned int len;
+   unsigned int n;
+
+   switch ( dist )
+   {
+      case 0:
+         return sprintf(key, "%s%u", HashmapBenchPrefix[i & 3], i);
+
+      case 1:
+         /* 4 to 23 random chars, unique through a base 36 suffix */
+         n = 4 + hashmap_bench_rand() % 20;
+         key[0] = Chars[hashmap_bench_rand() % 53];
+         for ( len = 1; len < n; len++ )
+            key[len] = Chars[hashmap_bench_rand() % 63];
+         key[len++] = '_';
+         do
+         {
+            key[len++] = Chars[( i % 36 < 10 ) ? 53 + ( i % 36 ) : i % 36 - 10];
+            i /= 36;
+         } while ( i );
+         key[len] = 0;
+         return len;
+
+      default:
+         n = hashmap_bench_rand();
+         return sprintf(key, "%s/%s/%s_%u.h", HashmapBenchRoot[n % 3], HashmapBenchDir[(n >> 4) & 7],
+            HashmapBenchBase[(n >> 8) % 6], i);
+   }
+}
+
+static void hashmap_bench_free_keys(struct hashmap_bench_keys_t *k)
+{
+   char *chunk;
+
+   while ( k->chunk )
+   {
+      chunk = k->chunk;
+      k->chunk = *(char**)chunk;
+      free(chunk);
+   }
+   free(k->keys);
+   free(k->klens);
+   free(k->lookups);
+   free(k->llens);
+   memset(k, 0, sizeof(struct hashmap_bench_keys_t));
+}
+
+/* generate count keys and up to HASHMAP_BENCH_OPS missing ones, 0 if out of memory */
+static int hashmap_bench_make_keys(struct hashmap_bench_keys_t *k, unsigned int dist, unsigned int count)
+{
+   unsigned int i;
+   unsigned int j;
+   unsigned int len;
+   char *p;
+   char key[128];
+
+   memset(k, 0, sizeof(struct hashmap_bench_keys_t));
+   k->count = count;
+   k->misses = count < HASHMAP_BENCH_OPS ? count : HASHMAP_BENCH_OPS;
+   k->keys = malloc((count + k->misses) * sizeof(char*));
+   k->klens = malloc((count + k->misses) * sizeof(unsigned int));
+   k->lookups = malloc(count * sizeof(char*));
+   k->llens = malloc(count * sizeof(unsigned int));
+   if ( !k->keys || !k->klens || !k->lookups || !k->llens )
+      return 0;
+
+   HashmapBenchSeed = dist + 1;
+   for ( i = 0; i < count + k->misses; i++ )
+   {
+      len = hashmap_bench_key(dist, i, key);
+      p = hashmap_bench_store(k, key, len);
+      if ( !p )
+         return 0;
+      k->keys[i] = p;
+      k->klens[i] = len;
+   }
+
+   /* shuffle the lookups so they do not follow the insert order */
+   memcpy(k->lookups, k->keys, count * sizeof(char*));
+   memcpy(k->llens, k->klens, count * sizeof(unsigned int));
+   for ( i = count - 1; i > 0; i-- )
+   {
+      j = hashmap_bench_rand() % ( i + 1 );
+      p = k->lookups[i];
+      k->lookups[i] = k->lookups[j];
+      k->lookups[j] = p;
+      len = k->llens[i];
+      k->llens[i] = k->llens[j];
+      k->llens[j] = len;
+   }
+   return 1;
+}
+
+/* time all operations of one map type, 0 on error */
+static int hashmap_bench_map(struct hashmap_bench_keys_t *k, unsigned int dist, char *name, unsigned int flags)
+{
+   struct hashmap_bench_time_t t[7];
+   struct hash_map_counter_t counter;
+   struct bst_node_t *nodes[HASHMAP_BENCH_BATCH];
+   struct hash_map_t *map;
+   unsigned long errors;
+   unsigned int rounds;
+   unsigned int r, i, j, n;
+   double bytes;
+
+   memset(t, 0, sizeof(t));
+   rounds = k->count < HASHMAP_BENCH_OPS ? HASHMAP_BENCH_OPS / k->count : 1;
+   errors = 0;
+   bytes = 0;
+   for ( r = 0; r < rounds; r++ )
+   {
+      hash_map_counter_init(&counter, 0);
+      map = hash_map_alloc_with(64, flags, &counter.allocator);
+      if ( !map )
+         return 0;
+
+      hashmap_bench_start(&t[0]);
+      for ( i = 0; i < k->count; i++ )
+         errors += hash_map_insert(map, k->keys[i], k->klens[i], "0x00000001L", 11) != 0;
+      hashmap_bench_stop(&t[0]);
+      bytes = (double)counter.bytes / k->count;
+
+      hashmap_bench_start(&t[1]);
+      for ( i = 0; i < k->count; i++ )
+         errors += hash_map_find(map, k->lookups[i], k->llens[i]) == 0;
+      hashmap_bench_stop(&t[1]);
+
+      hashmap_bench_start(&t[2]);
+      for ( i = k->count; i < k->count + k->misses; i++ )
+         errors += hash_map_find(map, k->keys[i], k->klens[i]) != 0;
+      hashmap_bench_stop(&t[2]);
+
+      if ( !( flags & HASH_MAP_COMPACT ) )
+      {
+         hashmap_bench_start(&t[3]);
+         for ( i = 0; i < k->count; i += n )
+         {
+            n = k->count - i < HASHMAP_BENCH_BATCH ? k->count - i : HASHMAP_BENCH_BATCH;
+            hash_map_find_batch(map, n, (void**)(k->lookups + i), k->llens + i, nodes);
+            for ( j = 0; j < n; j++ )
+               errors += nodes[j] == 0;
+         }
+         hashmap_bench_stop(&t[3]);
+      }
+
+      hashmap_bench_start(&t[4]);
+      for ( i = 0; i < k->count; i++ )
+         errors += hash_map_delete(map, k->lookups[i], k->llens[i]) != 0;
+      hashmap_bench_stop(&t[4]);
+
+      for ( i = 0; i < k->count; i++ )
+         errors += hash_map_insert(map, k->keys[i], k->klens[i], "0x00000001L", 11) != 0;
+      hashmap_bench_start(&t[5]);
+      hash_map_free(map);
+      hashmap_bench_stop(&t[5]);
+   }
+
+   if ( errors )
+   {
+      printf("\nhashmap_bench: error: %lu failed calls on %s map\n", errors, name);
+      return 0;
+   }
+
+   hashmap_bench_report(name, dist, k->count, "insert", &t[0], (double)k->count * rounds, bytes);
+   hashmap_bench_report(name, dist, k->count, "find", &t[1], (double)k->count * rounds, bytes);
+   hashmap_bench_report(name, dist, k->count, "miss", &t[2], (double)k->misses * rounds, bytes);
+   if ( !( flags & HASH_MAP_COMPACT ) )
+      hashmap_bench_report(name, dist, k->count, "find_batch", &t[3], (double)k->count * rounds, bytes);
+   hashmap_bench_report(name, dist, k->count, "delete", &t[4], (double)k->count * rounds, bytes);
+   hashmap_bench_report(name, dist, k->count, "free", &t[5], (double)k->count * rounds, bytes);
+   return 1;
+}
+
+/* time the bintree.asm functions on a single tree, 0 on error */
+static int hashmap_bench_bintree(struct hashmap_bench_keys_t *k, unsigned int dist)
+{
+   struct hashmap_bench_time_t t[6];
+   struct hash_map_counter_t counter;
+   struct bst_node_t *root;
+   struct bst_node_t *node;
+   unsigned long errors;
+   unsigned int rounds;
+   unsigned int r, i;
+   double bytes;
+
+   memset(t, 0, sizeof(t));
+   rounds = k->count < HASHMAP_BENCH_OPS ? HASHMAP_BENCH_OPS / k->count : 1;
+   errors = 0;
+   bytes = 0;
+   hash_map_counter_init(&counter, 0);
+   hash_map_set_allocator(&counter.allocator);
+   for ( r = 0; r < rounds; r++ )
+   {
+      root = (struct bst_node_t*)0;
+
+      hashmap_bench_start(&t[0]);
+      for ( i = 0; i < k->count; i++ )
+      {
+         node = binarytree_alloc_node(k->keys[i], k->klens[i], "0x00000001L", 11);
+         errors += !node || binarytree_insert_node(&root, node);
+      }
+      hashmap_bench_stop(&t[0]);
+      bytes = (double)counter.bytes / k->count;
+
+      hashmap_bench_start(&t[1]);
+      for ( i = 0; i < k->count; i++ )
+         errors += binarytree_find_node(&root, k->lookups[i], k->llens[i]) == 0;
+      hashmap_bench_stop(&t[1]);
+
+      hashmap_bench_start(&t[2]);
+      for ( i = k->count; i < k->count + k->misses; i++ )
+         errors += binarytree_find_node(&root, k->keys[i], k->klens[i]) != 0;
+      hashmap_bench_stop(&t[2]);
+
+      hashmap_bench_start(&t[3]);
+      for ( i = 0; i < k->count; i++ )
+         errors += binarytree_delete_node(&root, k->lookups[i], k->llens[i]) != 0;
+      hashmap_bench_stop(&t[3]);
+
+      for ( i = 0; i < k->count; i++ )
+      {
+         node = binarytree_alloc_node(k->keys[i], k->klens[i], "0x00000001L", 11);
+         errors += !node || binarytree_insert_node(&root, node);
+      }
+      hashmap_bench_start(&t[4]);
+      binarytree_delete_tree(&root);
+      hashmap_bench_stop(&t[4]);
+   }
+   hash_map_set_allocator((struct hash_map_allocator_t*)0);
+
+   if ( errors )
+   {
+      printf("\nhashmap_bench: error: %lu failed calls on bintree\n", errors);
+      return 0;
+   }
+
+   hashmap_bench_report("bintree", dist, k->count, "insert", &t[0], (double)k->count * rounds, bytes);
+   hashmap_bench_report("bintree", dist, k->count, "find", &t[1], (double)k->count * rounds, bytes);
+   hashmap_bench_report("bintree", dist, k->count, "miss", &t[2], (double)k->misses * rounds, bytes);
+   hashmap_bench_report("bintree", dist, k->count, "delete", &t[3], (double)k->count * rounds, bytes);
+   hashmap_bench_report("bintree", dist, k->count, "free", &t[4], (double)k->count * rounds, bytes);
+   return 1;
+}
+
+/* run all benchmarks, writing CSV to stdout */
+static int hashmap_bench(void)
+{
+   static unsigned int Flags[] = {
+      HASH_MAP_OPEN | HASH_MAP_WIDE | HASH_MAP_ARENA,
+      HASH_MAP_CHAINED | HASH_MAP_WIDE | HASH_MAP_ARENA,
+      HASH_MAP_CHAINED | HASH_MAP_WIDE,
+      HASH_MAP_COMPACT | HASH_MAP_WIDE,
+      HASH_MAP_CONCURRENT | HASH_MAP_WIDE
+   };
+   static char *Names[] = { "open", "chained", "chained_malloc", "compact", "concurrent" };
+   struct hashmap_bench_keys_t k;
+   unsigned int count;
+   unsigned int dist;
+   unsigned int t;
+
+   hashmap_bench_perf_open();
+   printf("map,distribution,keys,op,ns_per_op,misses_per_op,bytes_per_key\n");
+   for ( dist = 0; dist < 3; dist++ )
+   {
+      for ( count = 1000; count <= HASHMAP_BENCH_MAX; count *= 10 )
+      {
+         if ( ( dist == 2 ) && ( count > HASHMAP_BENCH_PATHS ) )
+            break;
+         if ( !hashmap_bench_make_keys(&k, dist, count) )
+         {
+            printf("\nhashmap_bench: error: insufficient memory for %u keys\n", count);
+            hashmap_bench_free_keys(&k);
+            return 0;
+         }
+         for ( t = 0; t < sizeof(Flags) / sizeof(Flags[0]); t++ )
+         {
+            if ( !hashmap_bench_map(&k, dist, Names[t], Flags[t]) )
+               return 0;
+            fflush(stdout);
+         }
+         if ( !hashmap_bench_bintree(&k, dist) )
+            return 0;
+         hashmap_bench_free_keys(&k);
+      }
+   }
+   return 1;
+}
+
+int main(void)
+{
+   /* the benchmarks make their own keys, no input file is needed */
+   return hashmap_bench() ? 0 : 1;
+}
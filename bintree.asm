@@ -40,6 +40,17 @@
 ; 64-bit code makes use of the fastcall calling convention of
 ; the target operating system.
 ;
+; The 64-bit Unix/Linux code keeps each tree height balanced ( AVL )
+; on insert and remove, using the height field of the node, so a tree
+; of n nodes is never more than about 1.44 * log2(n) levels deep even
+; when keys are inserted in sorted order. The other targets do not
+; rebalance and leave the height field unused.
+;
+; The 64-bit Unix/Linux code also keeps the first 8 key bytes of each
+; node in its prefix field, so most key comparisons are one integer
+; compare and memcmp is only called for long keys sharing those 8
+; bytes. The hash field is left for the caller, e.g. hashmap.c.
+;
 ; This implementation does not support duplicate node keys.
 ; If inserting a node into a tree that already contains an
 ; identical key the existing key and associated data value is
@@ -50,6 +61,16 @@
 ; a single node containing the key, or binarytree_delete_tree()
 ; to delete the entire tree.
 ;
+; Nodes are allocated and freed through the binarytree_malloc and
+; binarytree_free ptrs, which hold malloc() and free() unless the
+; caller replaces them before allocating any node, e.g. by calling
+; hash_map_set_allocator() in hashmap.c.
+;
+; Nodes that were not allocated by binarytree_alloc_node() may be
+; inserted and found as well, but must then be taken out of the tree
+; with binarytree_remove_node(), which unlinks a node without
+; freeing it.
+;
 ; To assemble this code using Nasm use one of the following commands.
 ;
 ; For 32-bit Unix/Linux:
@@ -84,8 +105,25 @@ extern free
 global binarytree_alloc_node
 global binarytree_find_node
 global binarytree_insert_node
+global binarytree_remove_node
 global binarytree_delete_node
 global binarytree_delete_tree
+global binarytree_first_node
+global binarytree_next_node
+global binarytree_find_prefix
+global binarytree_malloc
+global binarytree_free
+
+[section .data]
+
+; allocation routines used for nodes, malloc() and free() unless
+; replaced by the caller
+binarytree_malloc:
+   dd malloc
+binarytree_free:
+   dd free
+
+[section .text]
 
 ;
 ; Paramaters and Stack Local Variables (SLV)
@@ -140,7 +178,7 @@ binarytree_alloc_node:
    add  eax, ebx               ;     + key length
    add  eax, ecx               ;     + value length
    push eax
-   call malloc
+   call dword [binarytree_malloc]
    add  esp, 4
    cmp  eax, 0
    je   BST_A_N_X              ; if eax == 0 jmp to exit
@@ -442,7 +480,7 @@ BST_I_N_10:
 BST_I_N_11:
    ; safe to free old node in edi
    push edi
-   call free
+   call dword [binarytree_free]
    pop  eax
    jmp  BST_I_N_RET_0
 
@@ -461,27 +499,27 @@ BST_I_N_X:
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;
-; int binarytree_delete_node(struct _bst_node_t **root, void *key, unsigned int klen)
+; struct _bst_node_t * binarytree_remove_node(struct _bst_node_t **root, void *key, unsigned int klen)
 ;
 ; Purpose
-;    To delete a node from the binary tree
+;    To unlink a node from the binary tree without freeing it
 ;
 ; Params
 ;    root = address of ptr to binary tree root node
-;     key = ptr to key to find and delete
+;     key = ptr to key to find and remove
 ;    klen = length of key
 ;
 ; Returns
 ;    eax
-;       = 0 if successful
-;       = 1 if parameter error
-;       = 2 if key not found
+;       = ptr to removed node
+;       = null ptr if root == null, key == null, len == 0, or key not found
 ;
 ; Notes
-;    If the only node in the tree is the root node and it compares
-;    to the key param it is deleted and will be set to null
+;    The caller owns the returned node. Its link ptrs are no longer
+;    valid. This allows nodes to be allocated by something other than
+;    binarytree_alloc_node(), e.g. a memory pool.
 ;
-binarytree_delete_node:
+binarytree_remove_node:
    push ebp                    ; set up stack frame
    mov  ebp, esp
    push esi                    ; save registers used
@@ -491,30 +529,30 @@ binarytree_delete_node:
    ; validate parameters to ensure tree integrity
    mov  edi, dword param1      ; edi = pptr to node
    cmp  edi, 0
-   je   BST_D_N_RET_1          ; if pptr == null return param error
+   je   BST_R_N_RET_1          ; if pptr == null return null ptr
 
    mov  esi, dword param2      ; esi = key
    cmp  esi, 0
-   je   BST_D_N_RET_1          ; if key == null return param error
+   je   BST_R_N_RET_1          ; if key == null return null ptr
 
    mov  edx, dword param3      ; edx = key length
    cmp  edx, 0
-   je   BST_D_N_RET_1          ; if len == 0 return param error
+   je   BST_R_N_RET_1          ; if len == 0 return null ptr
 
    mov  edi, dword [edi]       ; get node ptr
    cmp  edi, 0
-   je   BST_D_N_RET_1          ; if edi == 0 return param error
+   je   BST_R_N_RET_1          ; if edi == 0 return null ptr
 
    mov  ebx, edi               ; save ptr to current node
 
    ; get shortest key length
    mov  eax, dword[edi + _bst_node_t.klen]
    cmp  edx, eax
-   jle  BST_D_N_1
+   jle  BST_R_N_1
 
    mov  edx, eax               ; edx = shortest key length
 
-BST_D_N_1:
+BST_R_N_1:
    ; compare user key to this nodes key
    push edx
    mov  eax, dword[edi + _bst_node_t.key]
@@ -526,65 +564,65 @@ BST_D_N_1:
    mov  edi, ebx
    pop  edx
    cmp  eax, 0
-   je   BST_D_N_5
-   jg   BST_D_N_4
+   je   BST_R_N_5
+   jg   BST_R_N_4
 
-BST_D_N_2:
+BST_R_N_2:
    ; assert: user key less than node key
    add  edi, _bst_node_t.left  ; edi = ptr to node.left
    mov  eax, dword[edi]
    cmp  eax, 0
-   je   BST_D_N_RET_2          ; if left ptr == null return not found
+   je   BST_R_N_RET_2          ; if left ptr == null return null ptr
 
-BST_D_N_3:
+BST_R_N_3:
    push edx
    push esi
    push edi
-   call binarytree_delete_node
+   call binarytree_remove_node
    add  esp, 12
-   jmp  BST_D_N_X              ; eax = error code
+   jmp  BST_R_N_X              ; eax = removed node
 
-BST_D_N_4:
+BST_R_N_4:
    ; assert: user key greater than node key
    add  edi, _bst_node_t.right ; edi = ptr to node.right
    mov  eax, dword[edi]
    cmp  eax, 0
-   je   BST_D_N_RET_2          ; if right ptr == null return not found
-   jmp  BST_D_N_3
+   je   BST_R_N_RET_2          ; if right ptr == null return null ptr
+   jmp  BST_R_N_3
 
-BST_D_N_5:
+BST_R_N_5:
    ; assert: keys are equal, check lengths
    mov  eax, dword[edi + _bst_node_t.klen]
    cmp  edx, eax
-   jl   BST_D_N_2
-   jg   BST_D_N_4
+   jl   BST_R_N_2
+   jg   BST_R_N_4
 
    ; assert: keys are identical. find replacement node, if any
    mov  ecx, dword[edi + _bst_node_t.right]
    cmp  ecx, 0
-   je   BST_D_N_9              ; if right ptr == null try left
+   je   BST_R_N_9              ; if right ptr == null try left
 
    ; special case: check child node for valid left ptr
    mov  eax, dword[ecx + _bst_node_t.left]
    cmp  eax, 0
-   jne  BST_D_N_7B
+   jne  BST_R_N_7B
 
    ; assert: ecx = replacement node
    ; set node to delete right ptr to replacement node right ptr
    mov  eax, dword[ecx + _bst_node_t.right]
    mov  dword[edi + _bst_node_t.right], eax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_7A:
+BST_R_N_7A:
    ; find left-most node
    mov  eax, dword[ecx + _bst_node_t.left]
    cmp  eax, 0
-   je   BST_D_N_8
-BST_D_N_7B:
+   je   BST_R_N_8
+BST_R_N_7B:
    mov  ecx, eax
-   jmp  BST_D_N_7A
+   jmp  BST_R_N_7A
 
-BST_D_N_8:
+BST_R_N_8:
    ; assert: ecx = replacement node
    ; set left ptr of parent node to replacement nodes right ptr
    mov  eax, dword[ecx + _bst_node_t.parent]
@@ -592,43 +630,43 @@ BST_D_N_8:
    mov  dword[eax + _bst_node_t.left], edx
    ; set child node new parent
    cmp  edx, 0
-   je   BST_D_N_14A
+   je   BST_R_N_14A
    mov  dword[edx + _bst_node_t.parent], eax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_9:
+BST_R_N_9:
    ; replace with right-most child of left branch
    mov  ecx, dword[edi + _bst_node_t.left]
    cmp  ecx, 0
-   jne  BST_D_N_10
+   jne  BST_R_N_10
 
    ; assert: both child ptrs are null, update parent.
    ; This also handles special case of deleting last
    ; node from tree ( root )
-   jmp  BST_D_N_15
+   jmp  BST_R_N_15
 
-BST_D_N_10:
+BST_R_N_10:
    ; special case: check child node for valid right ptr
    mov  eax, dword[ecx + _bst_node_t.right]
    cmp  eax, 0
-   jne  BST_D_N_12B
+   jne  BST_R_N_12B
 
    ; assert: ecx = replacement node
    ; set node to delete left ptr to replacement node left ptr
    mov  eax, dword[ecx + _bst_node_t.left]
    mov  dword[edi + _bst_node_t.left], eax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_12A:
+BST_R_N_12A:
    ; find right-most node
    mov  eax, dword[ecx + _bst_node_t.right]
    cmp  eax, 0
-   je   BST_D_N_13
-BST_D_N_12B:
+   je   BST_R_N_13
+BST_R_N_12B:
    mov  ecx, eax
-   jmp  BST_D_N_12A
+   jmp  BST_R_N_12A
 
-BST_D_N_13:
+BST_R_N_13:
    ; assert: ecx = replacement node
    ; set right child of parent to replacement nodes left child
    mov  eax, dword[ecx + _bst_node_t.parent]
@@ -636,32 +674,95 @@ BST_D_N_13:
    mov  dword[eax + _bst_node_t.right], edx
    ; set child node new parent
    cmp  edx, 0
-   je   BST_D_N_14A
+   je   BST_R_N_14A
    mov  dword[edx], eax
 
-BST_D_N_14A:
+BST_R_N_14A:
    ; copy node ptrs from edi to rcx
    mov  eax, dword[edi + _bst_node_t.parent]
    mov  dword[ecx + _bst_node_t.parent], eax
    mov  eax, dword[edi + _bst_node_t.left]
    mov  dword[ecx + _bst_node_t.left], eax
    cmp  eax, 0
-   je   BST_D_N_14B
+   je   BST_R_N_14B
    mov  dword[eax + _bst_node_t.parent], ecx
-BST_D_N_14B:
+BST_R_N_14B:
    mov  eax, dword[edi + _bst_node_t.right]
    mov  dword[ecx + _bst_node_t.right], eax
    cmp  eax, 0
-   je   BST_D_N_15
+   je   BST_R_N_15
    mov  dword[eax + _bst_node_t.parent], ecx
 
-BST_D_N_15:
+BST_R_N_15:
    mov  eax, dword param1      ; eax = pptr to new node
    mov  dword[eax], ecx
 
-BST_D_N_16:
-   push edi
-   call free
+BST_R_N_16:
+   mov  eax, edi               ; eax = removed node
+   jmp  BST_R_N_X
+
+BST_R_N_RET_2:
+BST_R_N_RET_1:
+   xor  eax, eax               ; eax = null ptr
+
+BST_R_N_X:
+   pop  ebx
+   pop  edi
+   pop  esi
+   pop  ebp
+   ret                         ; eax = removed node
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; int binarytree_delete_node(struct _bst_node_t **root, void *key, unsigned int klen)
+;
+; Purpose
+;    To delete a node from the binary tree
+;
+; Params
+;    root = address of ptr to binary tree root node
+;     key = ptr to key to find and delete
+;    klen = length of key
+;
+; Returns
+;    eax
+;       = 0 if successful
+;       = 1 if parameter error
+;       = 2 if key not found
+;
+; Notes
+;    If the only node in the tree is the root node and it compares
+;    to the key param it is deleted and will be set to null
+;
+binarytree_delete_node:
+   push ebp                    ; set up stack frame
+   mov  ebp, esp
+
+   ; validate parameters to ensure tree integrity
+   mov  eax, dword param1      ; eax = pptr to node
+   cmp  eax, 0
+   je   BST_D_N_RET_1          ; if pptr == null return param error
+
+   cmp  dword[eax], 0
+   je   BST_D_N_RET_1          ; if root ptr == null return param error
+
+   cmp  dword param2, 0
+   je   BST_D_N_RET_1          ; if key == null return param error
+
+   cmp  dword param3, 0
+   je   BST_D_N_RET_1          ; if len == 0 return param error
+
+   push dword param3
+   push dword param2
+   push eax
+   call binarytree_remove_node
+   add  esp, 12
+   cmp  eax, 0
+   je   BST_D_N_RET_2          ; if node == null return not found
+
+   push eax
+   call dword [binarytree_free]
    add  esp, 4
    jmp  BST_D_N_RET_0
 
@@ -677,9 +778,6 @@ BST_D_N_RET_0:
    xor  eax, eax               ; eax = 0 ( no error )
 
 BST_D_N_X:
-   pop  ebx
-   pop  edi
-   pop  esi
    pop  ebp
    ret                         ; eax = error code
 
@@ -739,7 +837,7 @@ BST_D_T_2:
    mov  edi, dword param1      ; edi = pptr to root
    mov  eax, [edi]             ; eax = root ptr
    push eax
-   call free
+   call dword [binarytree_free]
    pop  eax
 
    mov  dword[edi], 0          ; pptr = null
@@ -757,6 +855,226 @@ BST_D_T_X:
    pop  ebp
    ret
 
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_first_node(struct _bst_node_t **root)
+;
+; Purpose
+;    To find the node with the lowest key in the binary tree
+;
+; Params
+;    root = address of ptr to binary tree root
+;
+; Returns
+;    eax
+;       = ptr to first node
+;       = null ptr if root == null or the tree is empty
+;
+; Notes
+;    Together with binarytree_next_node() this walks the tree in key
+;    order without allocating memory. The tree must not be changed
+;    during the walk.
+;
+binarytree_first_node:
+   push ebp
+   mov  ebp, esp
+
+   xor  eax, eax               ; eax = null ptr
+
+   mov  ecx, dword param1      ; ecx = pptr to root
+   cmp  ecx, 0
+   je   BST_FS_N_X             ; if pptr == null jmp to exit
+
+   mov  eax, dword[ecx]        ; eax = ptr to root
+
+BST_FS_N_1:
+   cmp  eax, 0
+   je   BST_FS_N_X             ; if tree is empty jmp to exit
+
+   mov  edx, dword[eax + _bst_node_t.left]
+   cmp  edx, 0
+   je   BST_FS_N_X             ; if no left child eax is the first node
+
+   mov  eax, edx
+   jmp  BST_FS_N_1
+
+BST_FS_N_X:
+   pop  ebp
+   ret                         ; eax = first node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_next_node(struct _bst_node_t *node)
+;
+; Purpose
+;    To find the node following node in key order
+;
+; Params
+;    node = ptr to node within a binary tree
+;
+; Returns
+;    eax
+;       = ptr to next node
+;       = null ptr if node == null or node has the highest key
+;
+; Notes
+;    Follows the parent ptrs, so no stack is needed.
+;
+binarytree_next_node:
+   push ebp
+   mov  ebp, esp
+
+   xor  eax, eax               ; eax = null ptr
+
+   mov  ecx, dword param1      ; ecx = node
+   cmp  ecx, 0
+   je   BST_NX_N_X             ; if node == null jmp to exit
+
+   mov  eax, dword[ecx + _bst_node_t.right]
+   cmp  eax, 0
+   je   BST_NX_N_2             ; if no right child go up
+
+BST_NX_N_1:
+   ; find left-most node of the right subtree
+   mov  edx, dword[eax + _bst_node_t.left]
+   cmp  edx, 0
+   je   BST_NX_N_X
+   mov  eax, edx
+   jmp  BST_NX_N_1
+
+BST_NX_N_2:
+   ; go up until coming from a left child
+   mov  eax, dword[ecx + _bst_node_t.parent]
+   cmp  eax, 0
+   je   BST_NX_N_X             ; if node is the root there is no next node
+
+   cmp  dword[eax + _bst_node_t.right], ecx
+   jne  BST_NX_N_X             ; if node is a left child eax is next
+
+   mov  ecx, eax
+   jmp  BST_NX_N_2
+
+BST_NX_N_X:
+   pop  ebp
+   ret                         ; eax = next node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_find_prefix(struct _bst_node_t **root, void *key, unsigned int klen)
+;
+; Purpose
+;    To find the node with the lowest key starting with key
+;
+; Params
+;    root = address of ptr to binary tree root
+;     key = ptr to key prefix
+;    klen = length of key prefix
+;
+; Returns
+;    eax
+;       = ptr to first node whose key starts with key
+;       = null ptr if root == null, key == null, len == 0, or no key
+;         starts with key
+;
+; Notes
+;    All keys starting with key follow each other in key order, so
+;    the others are found with binarytree_next_node() until a key no
+;    longer starts with key.
+;
+binarytree_find_prefix:
+   push ebp                    ; set up stack frame
+   mov  ebp, esp
+   sub  esp, 8                 ; create SLV
+   push esi                    ; save registers used
+   push edi                    ;
+   push ebx                    ;
+
+   xor  eax, eax               ; eax = null ptr
+   mov  dword slv_pnode, eax   ; slv_pnode = lowest node not below key
+
+   mov  edi, dword param1      ; edi = pptr to root
+   cmp  edi, 0
+   je   BST_FP_N_X             ; if pptr == null jmp to exit
+
+   mov  edi, dword[edi]        ; edi = ptr to root
+
+   mov  esi, dword param2      ; esi = key
+   cmp  esi, 0
+   je   BST_FP_N_X             ; if key == 0 jmp to exit
+
+   mov  ebx, dword param3      ; ebx = length
+   cmp  ebx, 0
+   je   BST_FP_N_X             ; if klen == 0 jmp to exit
+
+BST_FP_N_1:
+   cmp  edi, 0
+   je   BST_FP_N_4             ; if node == null slv_pnode is the candidate
+
+   ; get shortest key length
+   mov  eax, dword[edi + _bst_node_t.klen]
+   cmp  eax, ebx
+   jbe  BST_FP_N_2
+
+   mov  eax, ebx               ; eax = shortest key length
+
+BST_FP_N_2:
+
+   ; compare user key to this nodes key
+   push eax
+   mov  eax, dword[edi + _bst_node_t.key]
+   push eax
+   push esi
+   call memcmp
+   add  esp, 12
+   cmp  eax, 0
+   jl   BST_FP_N_3
+   jg   BST_FP_N_5
+
+   ; assert: since keys are equal check lengths
+   cmp  ebx, dword[edi + _bst_node_t.klen]
+   ja   BST_FP_N_5
+
+BST_FP_N_3:
+   ; assert: user key not above node key, lower nodes are to the left
+   mov  dword slv_pnode, edi
+   mov  edi, dword[edi + _bst_node_t.left]
+   jmp  BST_FP_N_1
+
+BST_FP_N_5:
+   ; assert: user key greater than node key
+   mov  edi, dword[edi + _bst_node_t.right]
+   jmp  BST_FP_N_1
+
+BST_FP_N_4:
+   ; check the candidate key starts with the user key
+   xor  eax, eax
+   mov  edi, dword slv_pnode
+   cmp  edi, 0
+   je   BST_FP_N_X
+
+   cmp  ebx, dword[edi + _bst_node_t.klen]
+   ja   BST_FP_N_X             ; if node key is shorter it cannot match
+
+   push ebx
+   mov  eax, dword[edi + _bst_node_t.key]
+   push eax
+   push esi
+   call memcmp
+   add  esp, 12
+   cmp  eax, 0
+   mov  eax, 0                 ; eax = null ptr
+   jne  BST_FP_N_X
+
+   mov  eax, edi               ; eax = found node
+
+BST_FP_N_X:
+   pop  ebx                    ; restore registers used
+   pop  edi
+   pop  esi
+   add  esp, 8
+   pop  ebp
+   ret                         ; eax = found node
+
 %elifidni __BITS__,64
 
 ;
@@ -786,8 +1104,25 @@ extern free
 global binarytree_alloc_node
 global binarytree_find_node
 global binarytree_insert_node
+global binarytree_remove_node
 global binarytree_delete_node
 global binarytree_delete_tree
+global binarytree_first_node
+global binarytree_next_node
+global binarytree_find_prefix
+global binarytree_malloc
+global binarytree_free
+
+[section .data]
+
+; allocation routines used for nodes, malloc() and free() unless
+; replaced by the caller
+binarytree_malloc:
+   dq malloc
+binarytree_free:
+   dq free
+
+[section .text]
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;
@@ -832,7 +1167,7 @@ binarytree_alloc_node:
    mov  rdi, _bst_node_t_size  ; rdi = sizeof(_bst_node_t)
    add  rdi, rsi               ;       + key length
    add  rdi, rcx               ;       + value length
-   call malloc
+   call [rel binarytree_malloc]
    cmp  rax, 0
    je   BST_A_N_X
 
@@ -846,6 +1181,7 @@ binarytree_alloc_node:
    mov  qword[rax + _bst_node_t.right], 0
    mov  qword[rax + _bst_node_t.value], 0
    mov  dword[rax + _bst_node_t.vlen], 0
+   mov  dword[rax + _bst_node_t.hash], 0
 
    ;
    ; copy user key data to node key buffer
@@ -860,6 +1196,12 @@ binarytree_alloc_node:
    call memcpy
 
    mov  rax, qword slv_pnode   ; reload node ptr
+   mov  rdi, qword[rax + _bst_node_t.key]
+   mov  rsi, qword slv_klen
+   call bst_key_prefix
+   mov  rdx, qword slv_pnode
+   mov  qword[rdx + _bst_node_t.prefix], rax
+   mov  rax, rdx               ; reload node ptr
 
    ;
    ; copy user value, if any, to node value buffer
@@ -902,11 +1244,18 @@ BST_A_N_X:
 ;       = null ptr if root == null, key == null, len == 0, or key not found
 ;
 ; Notes
+;    The key prefix decides most comparisons, memcmp is only called
+;    when both keys are longer than 8 bytes and share the first 8.
 ;
 binarytree_find_node:
    push rbp                    ; set up stack frame
    mov  rbp, rsp
-   sub  rsp, 64                ; create SLV and RSS
+   push rbx
+   push r12
+   push r13
+   push r14
+   push r15
+   sub  rsp, 8                 ; keep stack aligned
 
    xor  rax, rax               ; rax = null ptr
 
@@ -919,68 +1268,76 @@ binarytree_find_node:
    cmp  rdx, 0
    je   BST_F_N_X              ; if klen == 0 jmp to exit
 
-   mov  rdi, [rdi]             ; rdi = ptr to root
-   cmp  rdi, 0
-   je   BST_F_N_X              ; if root ptr == null jmp to exit
+   mov  rbx, qword[rdi]        ; rbx = ptr to root
+   mov  r12, rsi               ; r12 = user key
+   mov  r13d, edx              ; r13d = user key length
 
-   mov  qword slv_proot, rdi   ; save parameter values to SLV
-   mov  qword slv_key, rsi     ;
-   mov  qword slv_klen, rdx    ;
+   mov  rdi, rsi
+   mov  esi, edx
+   call bst_key_prefix
+   mov  r15, rax               ; r15 = user key prefix
 
-   ; get shortest key length
-   mov  eax, dword[rdi + _bst_node_t.klen]
-   cmp  edx, eax
-   jle  BST_F_N_1
+BST_F_N_1:
+   cmp  rbx, 0
+   je   BST_F_N_4              ; if node == null key not found
 
-   mov  edx, eax               ; edx = shortest key length
+   ; compare user key prefix to this nodes key prefix
+   cmp  r15, qword[rbx + _bst_node_t.prefix]
+   jb   BST_F_N_3
+   ja   BST_F_N_5
 
-BST_F_N_1:
+   ; get shortest key length
+   mov  r14d, dword[rbx + _bst_node_t.klen]
+   mov  edx, r13d
+   cmp  edx, r14d
+   jbe  BST_F_N_2
 
-   ; compare user key to this nodes key
-   mov  rsi, qword[rdi + _bst_node_t.key]
-   mov  rdi, qword slv_key
-   call memcmp
-   mov  rdi, qword slv_pnode   ; rdi = root node ptr
-   cmp  eax, 0
-   je   BST_F_N_5
-   jg   BST_F_N_4
+   mov  edx, r14d              ; edx = shortest key length
 
 BST_F_N_2:
-   ; assert: user key less than node key
-   mov  rax, qword[rdi + _bst_node_t.left]
-   cmp  rax, 0
-   je   BST_F_N_X              ; if left ptr == null then jmp to exit
+   cmp  edx, 8
+   jbe  BST_F_N_6              ; if shortest key fits the prefix check lengths
+
+   ; compare rest of user key to this nodes key
+   sub  edx, 8
+   lea  rdi, [r12 + 8]
+   mov  rsi, qword[rbx + _bst_node_t.key]
+   add  rsi, 8
+   call memcmp
+   cmp  eax, 0
+   jl   BST_F_N_3
+   jg   BST_F_N_5
 
-   add  rdi, _bst_node_t.left  ; rdi = address of node.left
+BST_F_N_6:
+   ; assert: since keys are equal check lengths
+   cmp  r13d, r14d
+   jb   BST_F_N_3
+   ja   BST_F_N_5
 
-BST_F_N_3:
-   mov  rsi, qword slv_key
-   mov  rdx, qword slv_klen
-   call binarytree_find_node
+   ; assert: keys are identical
+   mov  rax, rbx
    jmp  BST_F_N_X
 
-BST_F_N_4:
-   ; assert: user key greater than node key
-   mov  rax, qword[rdi + _bst_node_t.right]
-   cmp  rax, 0
-   je   BST_F_N_X              ; if right ptr == null then jmp to exit
-
-   add  rdi, _bst_node_t.right ; rdi = address of node.right
-   jmp  BST_F_N_3
+BST_F_N_3:
+   ; assert: user key less than node key
+   mov  rbx, qword[rbx + _bst_node_t.left]
+   jmp  BST_F_N_1
 
 BST_F_N_5:
-   ; assert: since keys are equal check lengths
-   mov  eax, dword[rdi + _bst_node_t.klen]
-   mov  rdx,  qword slv_klen   ; rdx = user key length
-   cmp  edx, eax
-   jl   BST_F_N_2
-   jg   BST_F_N_4
+   ; assert: user key greater than node key
+   mov  rbx, qword[rbx + _bst_node_t.right]
+   jmp  BST_F_N_1
 
-   ; assert: keys are identical
-   mov  rax, rdi
+BST_F_N_4:
+   xor  rax, rax               ; rax = null ptr
 
 BST_F_N_X:
-   add  rsp, 64                ; remove SLV
+   add  rsp, 8
+   pop  r15
+   pop  r14
+   pop  r13
+   pop  r12
+   pop  rbx
    pop  rbp
    ret
 
@@ -1004,11 +1361,20 @@ BST_F_N_X:
 ;    Any node contained within the binary tree (including the root node)
 ;    that compares to the node param key is replaced with the new node
 ;    and the old node is deleted.  Duplicate nodes are not supported.
+;    The node is inserted as a leaf, its link ptrs are overwritten.
+;    The tree is then rebalanced so no path is more than about 1.44
+;    times longer than the shortest possible one. The key prefix of
+;    the node is filled in here.
 ;
 binarytree_insert_node:
    push rbp                    ; set up stack frame
    mov  rbp, rsp
-   sub  rsp, 32                ; create SLV
+   push rbx
+   push r12
+   push r13
+   push r14
+   push r15
+   sub  rsp, 8                 ; keep stack aligned
 
    ; validate parameters to ensure tree integrity
    cmp  rdi, 0
@@ -1017,108 +1383,110 @@ binarytree_insert_node:
    cmp  rsi, 0
    je   BST_I_N_RET_1          ; if pnode == 0 jmp to exit
 
-   mov  rax, qword[rdi]        ; rax = root ptr
-   cmp  rax, 0
-   jne  BST_I_N_1              ; if proot != 0 find insert point
+   mov  r12, rdi               ; r12 = address of root ptr
+   mov  rbx, rsi               ; rbx = node to insert
 
-   ; assert: null root, make node new root
-   mov  qword[rdi], rsi
-   jmp  BST_I_N_X              ; rax = 0 ( success )
+   ; make node a leaf
+   xor  rax, rax
+   mov  qword[rbx + _bst_node_t.parent], rax
+   mov  qword[rbx + _bst_node_t.left], rax
+   mov  qword[rbx + _bst_node_t.right], rax
+   mov  dword[rbx + _bst_node_t.height], 1
+
+   mov  rdi, qword[rbx + _bst_node_t.key]
+   mov  esi, dword[rbx + _bst_node_t.klen]
+   call bst_key_prefix
+   mov  qword[rbx + _bst_node_t.prefix], rax
+   mov  r15, rax               ; r15 = node key prefix
+
+   mov  r13, r12               ; r13 = address of link to follow
+   xor  r14, r14               ; r14 = parent of link
 
 BST_I_N_1:
+   mov  rax, qword[r13]
+   cmp  rax, 0
+   je   BST_I_N_6              ; if link == null insert node here
+
+   mov  r14, rax               ; r14 = current node
 
-   mov  qword slv_pptr, rdi    ; save register param values
-   mov  qword slv_proot, rax   ; save root ptr
-   mov  qword slv_pnode, rsi   ; save node ptr
+   ; compare user key prefix to this nodes key prefix
+   cmp  r15, qword[r14 + _bst_node_t.prefix]
+   jb   BST_I_N_3
+   ja   BST_I_N_4
 
    ; get shortest key length
-   mov  edx, dword[rax + _bst_node_t.klen]
-   mov  r8d, dword[rsi + _bst_node_t.klen]
-   cmp  edx, r8d
-   jle  BST_I_N_2
+   mov  edx, dword[r14 + _bst_node_t.klen]
+   mov  ecx, dword[rbx + _bst_node_t.klen]
+   cmp  edx, ecx
+   jbe  BST_I_N_2
 
-   mov  edx, r8d               ; edx = shortest key length
+   mov  edx, ecx               ; edx = shortest key length
 
 BST_I_N_2:
-
-   ; compare user key to this nodes key
-   mov  rdi, qword[rsi + _bst_node_t.key]
-   mov  rsi, qword[rax + _bst_node_t.key]
+   cmp  edx, 8
+   jbe  BST_I_N_7              ; if shortest key fits the prefix check lengths
+
+   ; compare rest of user key to this nodes key
+   sub  edx, 8
+   mov  rdi, qword[rbx + _bst_node_t.key]
+   add  rdi, 8
+   mov  rsi, qword[r14 + _bst_node_t.key]
+   add  rsi, 8
    call memcmp
-   mov  rdi, qword slv_proot   ; rdi = root ptr
-   mov  rsi, qword slv_pnode   ; rsi = node ptr
    cmp  eax, 0
-   je   BST_I_N_8
-   jg   BST_I_N_5
+   jl   BST_I_N_3
+   jg   BST_I_N_4
+
+BST_I_N_7:
+   ; assert: since keys are equal check lengths
+   mov  eax, dword[rbx + _bst_node_t.klen]
+   cmp  eax, dword[r14 + _bst_node_t.klen]
+   jb   BST_I_N_3
+   ja   BST_I_N_4
+   jmp  BST_I_N_5
 
 BST_I_N_3:
    ; assert: user key less than node key
-   mov  rax, qword[rdi + _bst_node_t.left]
-   cmp  rax, 0
-   je   BST_I_N_6
-
-   add  rdi, _bst_node_t.left  ; rdi = address of node.left
+   lea  r13, [r14 + _bst_node_t.left]
+   jmp  BST_I_N_1
 
 BST_I_N_4:
-   call binarytree_insert_node
-   jmp  BST_I_N_X              ; rax = error code
-
-BST_I_N_5:
    ; assert: user key greater than node key
-   mov  rax, qword[rdi + _bst_node_t.right]
-   cmp  rax, 0
-   je   BST_I_N_7
-
-   add  rdi, _bst_node_t.right ; rdi = address of node.right
-   jmp  BST_I_N_4
-
-BST_I_N_6:
-   ; insert into left child ptr
-   mov  qword[rdi + _bst_node_t.left], rsi
-   ; update user node parent
-   mov  qword[rsi + _bst_node_t.parent], rdi
-   jmp  BST_I_N_X              ; rax = 0 ( success )
+   lea  r13, [r14 + _bst_node_t.right]
+   jmp  BST_I_N_1
 
-BST_I_N_7:
-   ; insert into right child ptr
-   mov  qword[rdi + _bst_node_t.right], rsi
-   ; update user node parent
-   mov  qword[rsi + _bst_node_t.parent], rdi
-   jmp  BST_I_N_X              ; rax = 0 ( success )
-
-BST_I_N_8:
-   ; assert: since keys are equal check lengths
-   xor  r8, r8
-   mov  eax, dword[rdi + _bst_node_t.klen]
-   mov  r8d, dword[rsi + _bst_node_t.klen]
-   cmp  r8d, eax
-   jl   BST_I_N_3
-   jg   BST_I_N_5
-
-BST_I_N_9A:
-   ; assert: keys are identical, prepare for node swap
-   mov  rax, qword[rdi + _bst_node_t.parent]
-   mov  qword[rsi + _bst_node_t.parent], rax
-   mov  rax, qword[rdi + _bst_node_t.left]
-   mov  qword[rsi + _bst_node_t.left], rax
+BST_I_N_5:
+   ; assert: keys are identical, node takes the place of r14
+   mov  eax, dword[r14 + _bst_node_t.height]
+   mov  dword[rbx + _bst_node_t.height], eax
+   mov  rax, qword[r14 + _bst_node_t.parent]
+   mov  qword[rbx + _bst_node_t.parent], rax
+   mov  rax, qword[r14 + _bst_node_t.left]
+   mov  qword[rbx + _bst_node_t.left], rax
    cmp  rax, 0
-   je   BST_I_N_9B
-   mov  qword[rax + _bst_node_t.parent], rsi
-BST_I_N_9B:
-   mov  rax, qword[rdi + _bst_node_t.right]
-   mov  qword[rsi + _bst_node_t.right], rax
+   je   BST_I_N_5A
+   mov  qword[rax + _bst_node_t.parent], rbx
+BST_I_N_5A:
+   mov  rax, qword[r14 + _bst_node_t.right]
+   mov  qword[rbx + _bst_node_t.right], rax
    cmp  rax, 0
-   je   BST_I_N_10
-   mov  qword[rax + _bst_node_t.parent], rsi
-
-BST_I_N_10:
-   ; assert: swapping out root node
-   mov  rax, qword slv_pptr    ; rax = address of root ptr
-   mov  qword [rax], rsi       ; store new root node ptr
+   je   BST_I_N_5B
+   mov  qword[rax + _bst_node_t.parent], rbx
+BST_I_N_5B:
+   mov  qword[r13], rbx        ; store new node ptr
+
+   ; safe to free old node, the shape of the tree is unchanged
+   mov  rdi, r14
+   call [rel binarytree_free]
+   jmp  BST_I_N_RET_0
 
-BST_I_N_11:
-   ; safe to free old node in rdi
-   call free
+BST_I_N_6:
+   ; link node and rebalance from its parent upwards
+   mov  qword[r13], rbx
+   mov  qword[rbx + _bst_node_t.parent], r14
+   mov  rdi, r12
+   mov  rsi, r14
+   call bst_rebalance
    jmp  BST_I_N_RET_0
 
 BST_I_N_RET_1:
@@ -1129,102 +1497,117 @@ BST_I_N_RET_0:
    xor  rax, rax               ; rax = 0 ( success )
 
 BST_I_N_X:
-   add  rsp, 32
+   add  rsp, 8
+   pop  r15
+   pop  r14
+   pop  r13
+   pop  r12
+   pop  rbx
    pop  rbp
    ret
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;
-; int binarytree_delete_node(struct _bst_node_t **root, void *key, unsigned int klen)
+; struct _bst_node_t * binarytree_remove_node(struct _bst_node_t **root, void *key, unsigned int klen)
 ;
 ; Purpose
-;    To delete a node from the binary tree
+;    To unlink a node from the binary tree without freeing it
 ;
 ; Params
 ;    root = address of ptr to binary tree root node
-;     key = ptr to key to find and delete
+;     key = ptr to key to find and remove
 ;    klen = length of key
 ;
 ; Returns
-;    eax
-;       = 0 if successful
-;       = 1 if parameter error
-;       = 2 if key not found
+;    rax
+;       = ptr to removed node
+;       = null ptr if root == null, key == null, len == 0, or key not found
 ;
 ; Notes
-;    If the only node in the tree is the root node and it compares
-;    to the key param it is deleted and will be set to null
+;    The caller owns the returned node. Its link ptrs are no longer
+;    valid. This allows nodes to be allocated by something other than
+;    binarytree_alloc_node(), e.g. a memory pool. The tree is
+;    rebalanced after the node is unlinked.
 ;
-binarytree_delete_node:
+binarytree_remove_node:
    push rbp                    ; set up stack frame
    mov  rbp, rsp
-   sub  rsp, 64                ; create SLV
+   push rbx
+   push r12
+   push r13
+   push r14
+   push r15
+   sub  rsp, 8                 ; keep stack aligned
 
    cmp  rdi, 0
-   je   BST_D_N_RET_1          ; if pptr == null return param error
+   je   BST_R_N_RET_1          ; if pptr == null return null ptr
 
    cmp  rsi, 0
-   je   BST_D_N_RET_1          ; if key == null return param error
+   je   BST_R_N_RET_1          ; if key == null return null ptr
 
    cmp  rdx, 0
-   je   BST_D_N_RET_1          ; if len == 0 return param error
+   je   BST_R_N_RET_1          ; if len == 0 return null ptr
+
+   mov  r12, rdi               ; r12 = address of root ptr
+   mov  rbx, rsi               ; rbx = user key
+   mov  r13d, edx              ; r13d = user key length
+   mov  r14, rdi               ; r14 = address of link to follow
 
-   mov  qword slv_pptr, rdi    ; save parameter values to SLV
-   mov  qword slv_key, rsi     ;
-   mov  qword slv_klen, rdx    ;
+   mov  rdi, rsi
+   mov  esi, edx
+   call bst_key_prefix
+   mov  r15, rax               ; r15 = user key prefix
 
-   mov  rdi, [rdi]             ; get node ptr
+BST_R_N_1:
+   mov  rdi, qword[r14]        ; rdi = node ptr
    cmp  rdi, 0
-   je   BST_D_N_RET_1          ; if rdi == 0 return param error
+   je   BST_R_N_RET_2          ; if link == null return null ptr
 
-   mov  qword slv_pnode, rdi   ; save ptr to current node
+   ; compare user key prefix to this nodes key prefix
+   cmp  r15, qword[rdi + _bst_node_t.prefix]
+   jb   BST_R_N_3
+   ja   BST_R_N_4
 
    ; get shortest key length
-   mov  eax, dword[rdi + _bst_node_t.klen]
-   cmp  edx, eax
-   jle  BST_D_N_1
+   mov  edx, dword[rdi + _bst_node_t.klen]
+   cmp  edx, r13d
+   jbe  BST_R_N_2
 
-   mov  edx, eax               ; edx = shortest key length
+   mov  edx, r13d              ; edx = shortest key length
 
-BST_D_N_1:
+BST_R_N_2:
+   cmp  edx, 8
+   jbe  BST_R_N_6              ; if shortest key fits the prefix check lengths
 
-   ; compare user key to this nodes key
-   xchg rdi, rsi
-   mov  rsi, qword[rsi + _bst_node_t.key]
+   ; compare rest of user key to this nodes key
+   sub  edx, 8
+   mov  rsi, qword[rdi + _bst_node_t.key]
+   add  rsi, 8
+   lea  rdi, [rbx + 8]
    call memcmp
-   mov  rdi, qword slv_pnode   ; rdi = node ptr
-   mov  rdx, qword slv_klen
+   mov  rdi, qword[r14]        ; rdi = node ptr
    cmp  eax, 0
-   je   BST_D_N_5
-   jg   BST_D_N_4
+   jl   BST_R_N_3
+   jg   BST_R_N_4
 
-BST_D_N_2:
-   ; assert: user key less than node key
-   add  rdi, _bst_node_t.left  ; rdi = ptr to node.left
-   mov  rax, qword[rdi]
-   cmp  rax, 0
-   je   BST_D_N_RET_2          ; if left ptr == null return not found
+BST_R_N_6:
+   ; assert: keys are equal, check lengths
+   cmp  r13d, dword[rdi + _bst_node_t.klen]
+   jb   BST_R_N_3
+   ja   BST_R_N_4
+   jmp  BST_R_N_5
 
-BST_D_N_3:
-   mov  rsi, qword slv_key
-   call binarytree_delete_node
-   jmp  BST_D_N_X              ; rax = error code
+BST_R_N_3:
+   ; assert: user key less than node key
+   lea  r14, [rdi + _bst_node_t.left]
+   jmp  BST_R_N_1
 
-BST_D_N_4:
+BST_R_N_4:
    ; assert: user key greater than node key
-   add  rdi, _bst_node_t.right ; rdi = ptr to node.right
-   mov  rax, qword[rdi]
-   cmp  rax, 0
-   je   BST_D_N_RET_2          ; if right ptr == null return not found
-   jmp  BST_D_N_3
-
-BST_D_N_5:
-   ; assert: keys are equal, check lengths
-   mov  eax, dword[rdi + _bst_node_t.klen]
-   cmp  edx, eax
-   jl   BST_D_N_2
-   jg   BST_D_N_4
+   lea  r14, [rdi + _bst_node_t.right]
+   jmp  BST_R_N_1
 
+BST_R_N_5:
    ; assert: keys are identical
    mov  r9, rdi                ; r9 = node to delete
    mov  r8, qword[r9]          ; r8 = _bst_node_t.parent
@@ -1232,106 +1615,178 @@ BST_D_N_5:
    ; find replacement node, if any
    mov  rcx, qword[r9 + _bst_node_t.right]
    cmp  rcx, 0
-   je   BST_D_N_9              ; if right ptr == null try left
+   je   BST_R_N_9              ; if right ptr == null try left
 
    ; special case: check child node for valid left ptr
    mov  rax, qword[rcx + _bst_node_t.left]
    cmp  rax, 0
-   jne  BST_D_N_7B
+   jne  BST_R_N_7B
 
    ; assert: rcx = replacement node
    ; set node to delete right ptr to replacement node right ptr
    mov  rax, qword[rcx + _bst_node_t.right]
    mov  qword[r9 + _bst_node_t.right], rax
-   jmp  BST_D_N_14A
+   mov  r10, rcx               ; r10 = changed node
+   jmp  BST_R_N_14A
 
-BST_D_N_7A:
+BST_R_N_7A:
    ; find left-most node
    mov  rax, qword[rcx + _bst_node_t.left]
    cmp  rax, 0
-   je   BST_D_N_8
-BST_D_N_7B:
+   je   BST_R_N_8
+BST_R_N_7B:
    mov  rcx, rax
-   jmp  BST_D_N_7A
+   jmp  BST_R_N_7A
 
-BST_D_N_8:
+BST_R_N_8:
    ; assert: rcx = replacement node
    ; set left ptr of parent node to replacement nodes right ptr
    mov  rax, qword[rcx + _bst_node_t.parent]
+   mov  r10, rax               ; r10 = changed node
    mov  rdx, qword[rcx + _bst_node_t.right]
    mov  qword[rax + _bst_node_t.left], rdx
    ; set child node new parent
    cmp  rdx, 0
-   je   BST_D_N_14A
+   je   BST_R_N_14A
    mov  qword[rdx], rax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_9:
+BST_R_N_9:
    ; replace with right-most child of left branch
    mov  rcx, qword[r9 + _bst_node_t.left]
    cmp  rcx, 0
-   jne  BST_D_N_10
+   jne  BST_R_N_10
 
    ; assert: both child ptrs are null, update parent.
    ; This also handles special case of deleting last
    ; node from tree ( root )
-   jmp  BST_D_N_15
+   mov  r10, r8                ; r10 = changed node
+   jmp  BST_R_N_15
 
-BST_D_N_10:
+BST_R_N_10:
    ; special case: check child node for valid right ptr
    mov  rax, qword[rcx + _bst_node_t.right]
    cmp  rax, 0
-   jne  BST_D_N_12B
+   jne  BST_R_N_12B
 
    ; assert: rcx = replacement node
    ; set node to delete left ptr to replacement node left ptr
    mov  rax, qword[rcx + _bst_node_t.left]
    mov  qword[r9 + _bst_node_t.left], rax
-   jmp  BST_D_N_14A
+   mov  r10, rcx               ; r10 = changed node
+   jmp  BST_R_N_14A
 
-BST_D_N_12A:
+BST_R_N_12A:
    ; find right-most node
    mov  rax, qword[rcx + _bst_node_t.right]
    cmp  rax, 0
-   je   BST_D_N_13
-BST_D_N_12B:
+   je   BST_R_N_13
+BST_R_N_12B:
    mov  rcx, rax
-   jmp  BST_D_N_12A
+   jmp  BST_R_N_12A
 
-BST_D_N_13:
+BST_R_N_13:
    ; assert: rcx = replacement node
    ; set right child of parent to replacement nodes left child
    mov  rax, qword[rcx + _bst_node_t.parent]
+   mov  r10, rax               ; r10 = changed node
    mov  rdx, qword[rcx + _bst_node_t.left]
    mov  qword[rax + _bst_node_t.right], rdx
    ; set child node new parent
    cmp  rdx, 0
-   je   BST_D_N_14A
+   je   BST_R_N_14A
    mov  qword[rdx], rax
 
-BST_D_N_14A:
-   ; copy node ptrs from r9 to rcx
+BST_R_N_14A:
+   ; copy node ptrs and height from r9 to rcx
+   mov  eax, dword[r9+_bst_node_t.height]
+   mov  dword[rcx+_bst_node_t.height], eax
    mov  rax, qword[r9+_bst_node_t.parent]
    mov  qword[rcx+_bst_node_t.parent], rax
    mov  rax, qword[r9+_bst_node_t.left]
    mov  qword[rcx+_bst_node_t.left], rax
    cmp  rax, 0
-   je   BST_D_N_14B
+   je   BST_R_N_14B
    mov  qword[rax + _bst_node_t.parent], rcx
-BST_D_N_14B:
+BST_R_N_14B:
    mov  rax, qword[r9+_bst_node_t.right]
    mov  qword[rcx+_bst_node_t.right], rax
    cmp  rax, 0
-   je   BST_D_N_15
+   je   BST_R_N_15
    mov  qword[rax + _bst_node_t.parent], rcx
 
-BST_D_N_15:
-   mov  rax, slv_pptr          ; rax = pptr to new node
-   mov  qword[rax], rcx
+BST_R_N_15:
+   mov  qword[r14], rcx        ; link replacement node
+
+BST_R_N_16:
+   ; rebalance from the lowest node whose subtree changed
+   mov  rbx, r9                ; rbx = removed node
+   mov  rdi, r12
+   mov  rsi, r10
+   call bst_rebalance
+   mov  rax, rbx               ; rax = removed node
+   jmp  BST_R_N_X
+
+BST_R_N_RET_2:
+BST_R_N_RET_1:
+   xor  rax, rax               ; rax = null ptr
+
+BST_R_N_X:
+   add  rsp, 8
+   pop  r15
+   pop  r14
+   pop  r13
+   pop  r12
+   pop  rbx
+   pop  rbp
+   ret                         ; rax = removed node
+
 
-BST_D_N_16:
-   mov  rdi, r9                ; rdi = node to delete
-   call free
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; int binarytree_delete_node(struct _bst_node_t **root, void *key, unsigned int klen)
+;
+; Purpose
+;    To delete a node from the binary tree
+;
+; Params
+;    root = address of ptr to binary tree root node
+;     key = ptr to key to find and delete
+;    klen = length of key
+;
+; Returns
+;    eax
+;       = 0 if successful
+;       = 1 if parameter error
+;       = 2 if key not found
+;
+; Notes
+;    If the only node in the tree is the root node and it compares
+;    to the key param it is deleted and will be set to null
+;
+binarytree_delete_node:
+   push rbp                    ; set up stack frame
+   mov  rbp, rsp
+   sub  rsp, 16                ; keep stack aligned
+
+   cmp  rdi, 0
+   je   BST_D_N_RET_1          ; if pptr == null return param error
+
+   cmp  qword[rdi], 0
+   je   BST_D_N_RET_1          ; if root ptr == null return param error
+
+   cmp  rsi, 0
+   je   BST_D_N_RET_1          ; if key == null return param error
+
+   cmp  rdx, 0
+   je   BST_D_N_RET_1          ; if len == 0 return param error
+
+   call binarytree_remove_node
+   cmp  rax, 0
+   je   BST_D_N_RET_2          ; if node == null return not found
+
+   mov  rdi, rax               ; rdi = node to delete
+   call [rel binarytree_free]
    jmp  BST_D_N_RET_0
 
 BST_D_N_RET_2:
@@ -1346,7 +1801,7 @@ BST_D_N_RET_0:
    xor  rax, rax               ; rax = 0 ( no error )
 
 BST_D_N_X:
-   add  rsp, 64
+   add  rsp, 16
    pop  rbp
    ret                         ; rax = error code
 
@@ -1373,40 +1828,42 @@ BST_D_N_X:
 binarytree_delete_tree:
    push rbp                    ; set up stack frame
    mov  rbp, rsp
-   sub  rsp, 32                ; create SLV
+   push rbx
+   push r12
 
    cmp  rdi, 0
    je   BST_D_T_RET_1          ; if pptr == null return param error
 
-   mov  qword slv_pptr, rdi    ; save pptr to root
+   mov  r12, rdi               ; r12 = pptr to root
 
-   mov  rdi, [rdi]             ; rdi = ptr to root node
-   cmp  rdi, 0
+   mov  rbx, [rdi]             ; rbx = ptr to root node
+   cmp  rbx, 0
    je   BST_D_T_RET_1          ; if ptr == null return param error
 
-   mov  qword slv_proot, rdi   ; save ptr
-
-   add  rdi, _bst_node_t.left
-   mov  rax, qword[rdi]
-   cmp  rax, 0
-   je   BST_D_T_1
-
-   call binarytree_delete_tree
-
 BST_D_T_1:
-   mov  rdi, qword slv_proot   ; rdi = ptr to root
-   add  rdi, _bst_node_t.right
-   mov  rax, qword[rdi]
+   cmp  rbx, 0
+   je   BST_D_T_3              ; if node == null all nodes are freed
+
+   mov  rax, qword[rbx + _bst_node_t.left]
    cmp  rax, 0
    je   BST_D_T_2
 
-   call binarytree_delete_tree
+   ; rotate left child up, so no stack is needed to find the way back
+   mov  rcx, qword[rax + _bst_node_t.right]
+   mov  qword[rbx + _bst_node_t.left], rcx
+   mov  qword[rax + _bst_node_t.right], rbx
+   mov  rbx, rax
+   jmp  BST_D_T_1
 
 BST_D_T_2:
-   mov  rdi, qword slv_proot   ; rdi = ptr to node
-   call free                  ; free node ptr
-   mov  rax, qword slv_pptr    ; rax = pptr to root
-   mov  qword[rax],0           ; set ptr to null
+   ; assert: no left child, free node and continue with right child
+   mov  rdi, rbx
+   mov  rbx, qword[rbx + _bst_node_t.right]
+   call [rel binarytree_free]  ; free node ptr
+   jmp  BST_D_T_1
+
+BST_D_T_3:
+   mov  qword[r12], 0          ; set root ptr to null
    jmp  BST_D_T_RET_0
 
 BST_D_T_RET_1:
@@ -1417,8 +1874,441 @@ BST_D_T_RET_0:
    xor  rax, rax
 
 BST_D_T_X:
-   add  rsp, 32
+   pop  r12
+   pop  rbx
+   pop  rbp
+   ret
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_first_node(struct _bst_node_t **root)
+;
+; Purpose
+;    To find the node with the lowest key in the binary tree
+;
+; Params
+;    root = address of ptr to binary tree root
+;
+; Returns
+;    rax
+;       = ptr to first node
+;       = null ptr if root == null or the tree is empty
+;
+; Notes
+;    Together with binarytree_next_node() this walks the tree in key
+;    order without allocating memory. The tree must not be changed
+;    during the walk.
+;
+binarytree_first_node:
+   xor  rax, rax               ; rax = null ptr
+
+   cmp  rdi, 0
+   je   BST_FS_N_X             ; if pptr == null jmp to exit
+
+   mov  rax, qword[rdi]        ; rax = ptr to root
+
+BST_FS_N_1:
+   cmp  rax, 0
+   je   BST_FS_N_X             ; if tree is empty jmp to exit
+
+   mov  rdx, qword[rax + _bst_node_t.left]
+   cmp  rdx, 0
+   je   BST_FS_N_X             ; if no left child rax is the first node
+
+   mov  rax, rdx
+   jmp  BST_FS_N_1
+
+BST_FS_N_X:
+   ret                         ; rax = first node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_next_node(struct _bst_node_t *node)
+;
+; Purpose
+;    To find the node following node in key order
+;
+; Params
+;    node = ptr to node within a binary tree
+;
+; Returns
+;    rax
+;       = ptr to next node
+;       = null ptr if node == null or node has the highest key
+;
+; Notes
+;    Follows the parent ptrs, so no stack is needed.
+;
+binarytree_next_node:
+   xor  rax, rax               ; rax = null ptr
+
+   cmp  rdi, 0
+   je   BST_NX_N_X             ; if node == null jmp to exit
+
+   mov  rax, qword[rdi + _bst_node_t.right]
+   cmp  rax, 0
+   je   BST_NX_N_2             ; if no right child go up
+
+BST_NX_N_1:
+   ; find left-most node of the right subtree
+   mov  rdx, qword[rax + _bst_node_t.left]
+   cmp  rdx, 0
+   je   BST_NX_N_X
+   mov  rax, rdx
+   jmp  BST_NX_N_1
+
+BST_NX_N_2:
+   ; go up until coming from a left child
+   mov  rax, qword[rdi + _bst_node_t.parent]
+   cmp  rax, 0
+   je   BST_NX_N_X             ; if node is the root there is no next node
+
+   cmp  qword[rax + _bst_node_t.right], rdi
+   jne  BST_NX_N_X             ; if node is a left child rax is next
+
+   mov  rdi, rax
+   jmp  BST_NX_N_2
+
+BST_NX_N_X:
+   ret                         ; rax = next node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_find_prefix(struct _bst_node_t **root, void *key, unsigned int klen)
+;
+; Purpose
+;    To find the node with the lowest key starting with key
+;
+; Params
+;    root = address of ptr to binary tree root
+;     key = ptr to key prefix
+;    klen = length of key prefix
+;
+; Returns
+;    rax
+;       = ptr to first node whose key starts with key
+;       = null ptr if root == null, key == null, len == 0, or no key
+;         starts with key
+;
+; Notes
+;    All keys starting with key follow each other in key order, so
+;    the others are found with binarytree_next_node() until a key no
+;    longer starts with key.
+;
+binarytree_find_prefix:
+   push rbp                    ; set up stack frame
+   mov  rbp, rsp
+   push rbx
+   push r12
+   push r13
+   push r14
+   push r15
+   sub  rsp, 8                 ; keep stack aligned
+
+   xor  rax, rax               ; rax = null ptr
+
+   cmp  rdi, 0
+   je   BST_FP_N_X             ; if pptr == null jmp to exit
+
+   cmp  rsi, 0
+   je   BST_FP_N_X             ; if key == null jmp to exit
+
+   cmp  rdx, 0
+   je   BST_FP_N_X             ; if klen == 0 jmp to exit
+
+   mov  rbx, qword[rdi]        ; rbx = ptr to root
+   mov  r12, rsi               ; r12 = user key
+   mov  r13d, edx              ; r13d = user key length
+   xor  r14, r14               ; r14 = lowest node not below user key
+
+   mov  rdi, rsi
+   mov  esi, edx
+   call bst_key_prefix
+   mov  r15, rax               ; r15 = user key prefix
+
+BST_FP_N_1:
+   cmp  rbx, 0
+   je   BST_FP_N_4             ; if node == null r14 is the candidate
+
+   ; compare user key prefix to this nodes key prefix
+   cmp  r15, qword[rbx + _bst_node_t.prefix]
+   jb   BST_FP_N_3
+   ja   BST_FP_N_5
+
+   ; get shortest key length
+   mov  edx, dword[rbx + _bst_node_t.klen]
+   cmp  edx, r13d
+   jbe  BST_FP_N_2
+
+   mov  edx, r13d              ; edx = shortest key length
+
+BST_FP_N_2:
+   cmp  edx, 8
+   jbe  BST_FP_N_6             ; if shortest key fits the prefix check lengths
+
+   ; compare rest of user key to this nodes key
+   sub  edx, 8
+   lea  rdi, [r12 + 8]
+   mov  rsi, qword[rbx + _bst_node_t.key]
+   add  rsi, 8
+   call memcmp
+   cmp  eax, 0
+   jl   BST_FP_N_3
+   jg   BST_FP_N_5
+
+BST_FP_N_6:
+   ; assert: since keys are equal check lengths
+   cmp  r13d, dword[rbx + _bst_node_t.klen]
+   ja   BST_FP_N_5
+
+BST_FP_N_3:
+   ; assert: user key not above node key, lower nodes are to the left
+   mov  r14, rbx
+   mov  rbx, qword[rbx + _bst_node_t.left]
+   jmp  BST_FP_N_1
+
+BST_FP_N_5:
+   ; assert: user key greater than node key
+   mov  rbx, qword[rbx + _bst_node_t.right]
+   jmp  BST_FP_N_1
+
+BST_FP_N_4:
+   ; check the candidate key starts with the user key
+   xor  rax, rax
+   cmp  r14, 0
+   je   BST_FP_N_X
+
+   cmp  r13d, dword[r14 + _bst_node_t.klen]
+   ja   BST_FP_N_X             ; if node key is shorter it cannot match
+
+   mov  rdi, r12
+   mov  rsi, qword[r14 + _bst_node_t.key]
+   mov  edx, r13d
+   call memcmp
+   cmp  eax, 0
+   mov  eax, 0                 ; rax = null ptr
+   jne  BST_FP_N_X
+
+   mov  rax, r14               ; rax = found node
+
+BST_FP_N_X:
+   add  rsp, 8
+   pop  r15
+   pop  r14
+   pop  r13
+   pop  r12
+   pop  rbx
    pop  rbp
+   ret                         ; rax = found node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; bst_rebalance
+;
+; Purpose
+;    To restore the AVL balance of a tree after a node was linked
+;    or unlinked
+;
+; Params
+;    rdi = address of ptr to binary tree root node
+;    rsi = lowest node whose subtree changed, may be null
+;
+; Notes
+;    Walks up the parent ptrs to the root, updating the height of each
+;    node and rotating every node whose subtrees differ in height by
+;    more than one. rdi is preserved, no external calls are made.
+;
+bst_rebalance:
+   cmp  rsi, 0
+   je   BST_B_X                ; if node == null we are done
+
+   ; eax = height of left subtree, ecx = height of right subtree
+   mov  r8, qword[rsi + _bst_node_t.left]
+   xor  eax, eax
+   cmp  r8, 0
+   je   BST_B_1
+   mov  eax, dword[r8 + _bst_node_t.height]
+BST_B_1:
+   mov  r9, qword[rsi + _bst_node_t.right]
+   xor  ecx, ecx
+   cmp  r9, 0
+   je   BST_B_2
+   mov  ecx, dword[r9 + _bst_node_t.height]
+BST_B_2:
+   lea  edx, [ecx + 1]
+   cmp  eax, edx
+   ja   BST_B_4                ; if left is too high rotate right
+   lea  edx, [eax + 1]
+   cmp  ecx, edx
+   ja   BST_B_6                ; if right is too high rotate left
+
+   ; assert: balanced, height = 1 + max(left, right)
+   cmp  eax, ecx
+   jae  BST_B_3
+   mov  eax, ecx
+BST_B_3:
+   inc  eax
+   mov  dword[rsi + _bst_node_t.height], eax
+   mov  rsi, qword[rsi + _bst_node_t.parent]
+   jmp  bst_rebalance
+
+BST_B_4:
+   ; assert: r8 = left child, rotate it left first if right heavy
+   mov  r10, qword[r8 + _bst_node_t.left]
+   xor  eax, eax
+   cmp  r10, 0
+   je   BST_B_4A
+   mov  eax, dword[r10 + _bst_node_t.height]
+BST_B_4A:
+   mov  r11, qword[r8 + _bst_node_t.right]
+   xor  ecx, ecx
+   cmp  r11, 0
+   je   BST_B_4B
+   mov  ecx, dword[r11 + _bst_node_t.height]
+BST_B_4B:
+   cmp  ecx, eax
+   jbe  BST_B_5
+   mov  rdx, r8
+   call bst_rotate_left
+BST_B_5:
+   mov  rdx, rsi
+   call bst_rotate_right
+   mov  rsi, qword[rax + _bst_node_t.parent]
+   jmp  bst_rebalance
+
+BST_B_6:
+   ; assert: r9 = right child, rotate it right first if left heavy
+   mov  r10, qword[r9 + _bst_node_t.left]
+   xor  eax, eax
+   cmp  r10, 0
+   je   BST_B_6A
+   mov  eax, dword[r10 + _bst_node_t.height]
+BST_B_6A:
+   mov  r11, qword[r9 + _bst_node_t.right]
+   xor  ecx, ecx
+   cmp  r11, 0
+   je   BST_B_6B
+   mov  ecx, dword[r11 + _bst_node_t.height]
+BST_B_6B:
+   cmp  eax, ecx
+   jbe  BST_B_7
+   mov  rdx, r9
+   call bst_rotate_right
+BST_B_7:
+   mov  rdx, rsi
+   call bst_rotate_left
+   mov  rsi, qword[rax + _bst_node_t.parent]
+   jmp  bst_rebalance
+
+BST_B_X:
+   ret
+
+;
+; bst_rotate_left / bst_rotate_right
+;
+; Rotate the subtree rooted at rdx, replacing it by its right
+; ( left ) child. rdi = address of ptr to binary tree root node.
+; Returns the new subtree root in rax. Uses rcx, r8, r9, r10, r11.
+;
+bst_rotate_left:
+   mov  rax, qword[rdx + _bst_node_t.right]
+   mov  rcx, qword[rax + _bst_node_t.left]
+   mov  qword[rdx + _bst_node_t.right], rcx
+   cmp  rcx, 0
+   je   BST_RL_1
+   mov  qword[rcx + _bst_node_t.parent], rdx
+BST_RL_1:
+   mov  qword[rax + _bst_node_t.left], rdx
+   jmp  BST_RT_1
+
+bst_rotate_right:
+   mov  rax, qword[rdx + _bst_node_t.left]
+   mov  rcx, qword[rax + _bst_node_t.right]
+   mov  qword[rdx + _bst_node_t.left], rcx
+   cmp  rcx, 0
+   je   BST_RR_1
+   mov  qword[rcx + _bst_node_t.parent], rdx
+BST_RR_1:
+   mov  qword[rax + _bst_node_t.right], rdx
+
+BST_RT_1:
+   ; link new subtree root rax into the parent of rdx
+   mov  rcx, qword[rdx + _bst_node_t.parent]
+   mov  qword[rax + _bst_node_t.parent], rcx
+   mov  qword[rdx + _bst_node_t.parent], rax
+   cmp  rcx, 0
+   jne  BST_RT_2
+   mov  qword[rdi], rax        ; new root of the tree
+   jmp  BST_RT_4
+BST_RT_2:
+   cmp  qword[rcx + _bst_node_t.left], rdx
+   jne  BST_RT_3
+   mov  qword[rcx + _bst_node_t.left], rax
+   jmp  BST_RT_4
+BST_RT_3:
+   mov  qword[rcx + _bst_node_t.right], rax
+
+BST_RT_4:
+   ; update heights, lower node first
+   mov  r8, rdx
+   call bst_set_height
+   mov  r8, rax
+   call bst_set_height
+   ret
+
+;
+; bst_set_height
+;
+; Sets the height of node r8 from its children. Uses r9, r10, r11.
+;
+bst_set_height:
+   mov  r9, qword[r8 + _bst_node_t.left]
+   xor  r10d, r10d
+   cmp  r9, 0
+   je   BST_SH_1
+   mov  r10d, dword[r9 + _bst_node_t.height]
+BST_SH_1:
+   mov  r9, qword[r8 + _bst_node_t.right]
+   xor  r11d, r11d
+   cmp  r9, 0
+   je   BST_SH_2
+   mov  r11d, dword[r9 + _bst_node_t.height]
+BST_SH_2:
+   cmp  r10d, r11d
+   jae  BST_SH_3
+   mov  r10d, r11d
+BST_SH_3:
+   inc  r10d
+   mov  dword[r8 + _bst_node_t.height], r10d
+   ret
+
+;
+; bst_key_prefix
+;
+; Returns in rax the first 8 bytes of key rdi, length esi, as a big
+; endian number padded with zero bytes. Two prefixes compare in the
+; same order as the keys do, unless they are equal. Uses rcx, rdx.
+;
+bst_key_prefix:
+   cmp  esi, 8
+   jb   BST_KP_1
+   mov  rax, qword[rdi]
+   bswap rax
+   ret
+BST_KP_1:
+   ; short key, read it a byte at a time
+   xor  eax, eax
+   xor  ecx, ecx
+BST_KP_2:
+   shl  rax, 8
+   cmp  ecx, esi
+   jae  BST_KP_3
+   movzx edx, byte[rdi + rcx]
+   or   rax, rdx
+BST_KP_3:
+   inc  ecx
+   cmp  ecx, 8
+   jb   BST_KP_2
    ret
 
 %elifidni __OUTPUT_FORMAT__,win64
@@ -1443,8 +2333,25 @@ extern memcmp
 global binarytree_alloc_node
 global binarytree_find_node
 global binarytree_insert_node
+global binarytree_remove_node
 global binarytree_delete_node
 global binarytree_delete_tree
+global binarytree_first_node
+global binarytree_next_node
+global binarytree_find_prefix
+global binarytree_malloc
+global binarytree_free
+
+[section .data]
+
+; allocation routines used for nodes, malloc() and free() unless
+; replaced by the caller
+binarytree_malloc:
+   dq malloc
+binarytree_free:
+   dq free
+
+[section .text]
 
 ;
 ; define stack Register Shadow Storage (RSS) space
@@ -1501,7 +2408,7 @@ binarytree_alloc_node:
    mov  rcx, _bst_node_t_size  ; rcx = sizeof(_bst_node_t)
    add  rcx, rdx               ;       + key length
    add  rcx, r9                ;       + value length
-   call malloc
+   call [rel binarytree_malloc]
    cmp  rax, 0
    je   BST_A_N_X
 
@@ -1779,7 +2686,7 @@ BST_I_N_9:
    mov  qword [rax], rdx       ; store new node ptr
    cmp  rcx, 0                 ; check for null root
    je   BST_I_N_RET_0          ; if rcx == null jmp to exit
-   call free                   ; free old node
+   call [rel binarytree_free]  ; free old node
    jmp  BST_I_N_RET_0
 
 BST_I_N_RET_1:
@@ -1796,39 +2703,39 @@ BST_I_N_X:
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;
-; int binarytree_delete_node(struct _bst_node_t **root, void *key, unsigned int klen)
+; struct _bst_node_t * binarytree_remove_node(struct _bst_node_t **root, void *key, unsigned int klen)
 ;
 ; Purpose
-;    To delete a node from the binary tree
+;    To unlink a node from the binary tree without freeing it
 ;
 ; Params
 ;    root = address of ptr to binary tree root node
-;     key = ptr to key to find and delete
+;     key = ptr to key to find and remove
 ;    klen = length of key
 ;
 ; Returns
-;    eax
-;       = 0 if successful
-;       = 1 if parameter error
-;       = 2 if key not found
+;    rax
+;       = ptr to removed node
+;       = null ptr if root == null, key == null, len == 0, or key not found
 ;
 ; Notes
-;    If the only node remaining in the tree is the root node and it
-;    compares to the key param it is deleted and will be set to null
+;    The caller owns the returned node. Its link ptrs are no longer
+;    valid. This allows nodes to be allocated by something other than
+;    binarytree_alloc_node(), e.g. a memory pool.
 ;
-binarytree_delete_node:
+binarytree_remove_node:
    push rbp                    ; set up stack frame
    mov  rbp, rsp
    sub  rsp, 48                ; create SLV and RSS
 
    cmp  rcx, 0
-   je   BST_D_N_RET_1          ; if pptr == null return param error
+   je   BST_R_N_RET_1          ; if pptr == null return null ptr
 
    cmp  rdx, 0
-   je   BST_D_N_RET_1          ; if key == null return param error
+   je   BST_R_N_RET_1          ; if key == null return null ptr
 
    cmp  r8, 0
-   je   BST_D_N_RET_1          ; if len == 0 return param error
+   je   BST_R_N_RET_1          ; if len == 0 return null ptr
 
    mov  qword win64_rss1, rcx  ; save register param values to RSS
    mov  qword win64_rss2, rdx  ;
@@ -1836,18 +2743,18 @@ binarytree_delete_node:
 
    mov  rcx, [rcx]             ; get root ptr
    cmp  rcx, 0
-   je   BST_D_N_RET_1          ; if rcx == 0 return param error
+   je   BST_R_N_RET_1          ; if rcx == 0 return null ptr
 
    mov  qword slv_pnode, rcx   ; save ptr to current node
 
    ; get shortest key length
    mov  eax, dword[rcx + _bst_node_t.klen]
    cmp  r8d, eax
-   jle  BST_D_N_1
+   jle  BST_R_N_1
 
    mov  r8d, eax               ; r8 = shortest key length
 
-BST_D_N_1:
+BST_R_N_1:
 
    ; compare user key to this nodes key
    mov  rdx, qword[rcx + _bst_node_t.key]
@@ -1855,37 +2762,37 @@ BST_D_N_1:
    call memcmp
    mov  rcx, qword slv_pnode   ; rcx = node ptr
    cmp  eax, 0
-   je   BST_D_N_5
-   jg   BST_D_N_4
+   je   BST_R_N_5
+   jg   BST_R_N_4
 
-BST_D_N_2:
+BST_R_N_2:
    ; assert: user key less than node key
    add  rcx, _bst_node_t.left  ; rcx = ptr to node.left
    mov  rax, qword[rcx]
    cmp  rax, 0
-   je   BST_D_N_RET_2          ; if left ptr == null return not found
+   je   BST_R_N_RET_2          ; if left ptr == null return null ptr
 
-BST_D_N_3:
+BST_R_N_3:
    mov  rdx, qword win64_rss2
    mov  r8, qword win64_rss3
-   call binarytree_delete_node
-   jmp  BST_D_N_X              ; rax = error code
+   call binarytree_remove_node
+   jmp  BST_R_N_X              ; rax = removed node
 
-BST_D_N_4:
+BST_R_N_4:
    ; assert: user key greater than node key
    add  rcx, _bst_node_t.right ; rcx = ptr to node.right
    mov  rax, qword[rcx]
    cmp  rax, 0
-   je   BST_D_N_RET_2          ; if right ptr == null return not found
-   jmp  BST_D_N_3
+   je   BST_R_N_RET_2          ; if right ptr == null return null ptr
+   jmp  BST_R_N_3
 
-BST_D_N_5:
+BST_R_N_5:
    ; assert: keys are equal, check lengths
    mov  eax, dword[rcx + _bst_node_t.klen]
    mov  r8,  qword win64_rss3  ; r8 = user key length
    cmp  r8d, eax
-   jl   BST_D_N_2
-   jg   BST_D_N_4
+   jl   BST_R_N_2
+   jg   BST_R_N_4
 
    ; assert: keys are identical
    mov  r9, rcx                ; r9 = node to delete
@@ -1894,29 +2801,29 @@ BST_D_N_5:
    ; find replacement node, if any
    mov  rcx, qword[r9 + _bst_node_t.right]
    cmp  rcx, 0
-   je   BST_D_N_9              ; if right ptr == null try left
+   je   BST_R_N_9              ; if right ptr == null try left
 
    ; special case: check child node for valid left ptr
    mov  rax, qword[rcx + _bst_node_t.left]
    cmp  rax, 0
-   jne  BST_D_N_7B
+   jne  BST_R_N_7B
 
    ; assert: rcx = replacement node
    ; set node to delete right ptr to replacement node right ptr
    mov  rax, qword[rcx + _bst_node_t.right]
    mov  qword[r9 + _bst_node_t.right], rax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_7A:
+BST_R_N_7A:
    ; find left-most node
    mov  rax, qword[rcx + _bst_node_t.left]
    cmp  rax, 0
-   je   BST_D_N_8
-BST_D_N_7B:
+   je   BST_R_N_8
+BST_R_N_7B:
    mov  rcx, rax
-   jmp  BST_D_N_7A
+   jmp  BST_R_N_7A
 
-BST_D_N_8:
+BST_R_N_8:
    ; assert: rcx = replacement node
    ; set left ptr of parent node to replacement nodes right ptr
    mov  rax, qword[rcx]        ; rax = _bst_node_t.parent
@@ -1924,43 +2831,43 @@ BST_D_N_8:
    mov  qword[rax + _bst_node_t.left], rdx
    ; set child node new parent
    cmp  rdx, 0
-   je   BST_D_N_14A
+   je   BST_R_N_14A
    mov  qword[rdx], rax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_9:
+BST_R_N_9:
    ; replace with right-most child of left branch
    mov  rcx, qword[r9 + _bst_node_t.left]
    cmp  rcx, 0
-   jne  BST_D_N_10
+   jne  BST_R_N_10
 
    ; assert: both child ptrs are null, update parent.
    ; This also handles special case of deleting last
    ; node from tree ( root )
-   jmp  BST_D_N_15
+   jmp  BST_R_N_15
 
-BST_D_N_10:
+BST_R_N_10:
    ; special case: check child node for valid right ptr
    mov  rax, qword[rcx + _bst_node_t.right]
    cmp  rax, 0
-   jne  BST_D_N_12B
+   jne  BST_R_N_12B
 
    ; assert: rcx = replacement node
    ; set node to delete left ptr to replacement node left ptr
    mov  rax, qword[rcx + _bst_node_t.left]
    mov  qword[r9 + _bst_node_t.left], rax
-   jmp  BST_D_N_14A
+   jmp  BST_R_N_14A
 
-BST_D_N_12A:
+BST_R_N_12A:
    ; find right-most node
    mov  rax, qword[rcx + _bst_node_t.right]
    cmp  rax, 0
-   je   BST_D_N_13
-BST_D_N_12B:
+   je   BST_R_N_13
+BST_R_N_12B:
    mov  rcx, rax
-   jmp  BST_D_N_12A
+   jmp  BST_R_N_12A
 
-BST_D_N_13:
+BST_R_N_13:
    ; assert: rcx = replacement node
    ; set right child of parent to replacement nodes left child
    mov  rax, qword[rcx + _bst_node_t.parent]
@@ -1968,32 +2875,88 @@ BST_D_N_13:
    mov  qword[rax + _bst_node_t.right], rdx
    ; set child node new parent
    cmp  rdx, 0
-   je   BST_D_N_14A
+   je   BST_R_N_14A
    mov  qword[rdx], rax
 
-BST_D_N_14A:
+BST_R_N_14A:
    ; copy node ptrs from r9 to rcx
    mov  rax, qword[r9+_bst_node_t.parent]
    mov  qword[rcx+_bst_node_t.parent], rax
    mov  rax, qword[r9+_bst_node_t.left]
    mov  qword[rcx+_bst_node_t.left], rax
    cmp  rax, 0
-   je   BST_D_N_14B
+   je   BST_R_N_14B
    mov  qword[rax + _bst_node_t.parent], rcx
-BST_D_N_14B:
+BST_R_N_14B:
    mov  rax, qword[r9+_bst_node_t.right]
    mov  qword[rcx+_bst_node_t.right], rax
    cmp  rax, 0
-   je   BST_D_N_15
+   je   BST_R_N_15
    mov  qword[rax + _bst_node_t.parent], rcx
 
-BST_D_N_15:
+BST_R_N_15:
    mov  rax, win64_rss1        ; rax = pptr to new node
    mov  qword[rax], rcx
 
-BST_D_N_16:
-   mov  rcx, r9                ; rcx = node to delete
-   call free
+BST_R_N_16:
+   mov  rax, r9                ; rax = removed node
+   jmp  BST_R_N_X
+
+BST_R_N_RET_2:
+BST_R_N_RET_1:
+   xor  rax, rax               ; rax = null ptr
+
+BST_R_N_X:
+   add  rsp, 48
+   pop  rbp
+   ret                         ; rax = removed node
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; int binarytree_delete_node(struct _bst_node_t **root, void *key, unsigned int klen)
+;
+; Purpose
+;    To delete a node from the binary tree
+;
+; Params
+;    root = address of ptr to binary tree root node
+;     key = ptr to key to find and delete
+;    klen = length of key
+;
+; Returns
+;    eax
+;       = 0 if successful
+;       = 1 if parameter error
+;       = 2 if key not found
+;
+; Notes
+;    If the only node remaining in the tree is the root node and it
+;    compares to the key param it is deleted and will be set to null
+;
+binarytree_delete_node:
+   push rbp                    ; set up stack frame
+   mov  rbp, rsp
+   sub  rsp, 48                ; create SLV and RSS
+
+   cmp  rcx, 0
+   je   BST_D_N_RET_1          ; if pptr == null return param error
+
+   cmp  qword[rcx], 0
+   je   BST_D_N_RET_1          ; if root ptr == null return param error
+
+   cmp  rdx, 0
+   je   BST_D_N_RET_1          ; if key == null return param error
+
+   cmp  r8, 0
+   je   BST_D_N_RET_1          ; if len == 0 return param error
+
+   call binarytree_remove_node
+   cmp  rax, 0
+   je   BST_D_N_RET_2          ; if node == null return not found
+
+   mov  rcx, rax               ; rcx = node to delete
+   call [rel binarytree_free]
    jmp  BST_D_N_RET_0
 
 BST_D_N_RET_2:
@@ -2066,7 +3029,7 @@ BST_D_T_1:
 
 BST_D_T_2:
    mov  rcx, qword slv_proot   ; rcx = ptr to node
-   call free                   ; free node ptr
+   call [rel binarytree_free]  ; free node ptr
    mov  rax, win64_rss1        ; rax = pptr to root
    mov  qword[rax],0           ; set ptr to null
    jmp  BST_D_T_RET_0
@@ -2083,6 +3046,211 @@ BST_D_T_X:
    pop  rbp
    ret
 
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_first_node(struct _bst_node_t **root)
+;
+; Purpose
+;    To find the node with the lowest key in the binary tree
+;
+; Params
+;    root = address of ptr to binary tree root
+;
+; Returns
+;    rax
+;       = ptr to first node
+;       = null ptr if root == null or the tree is empty
+;
+; Notes
+;    Together with binarytree_next_node() this walks the tree in key
+;    order without allocating memory. The tree must not be changed
+;    during the walk.
+;
+binarytree_first_node:
+   xor  rax, rax               ; rax = null ptr
+
+   cmp  rcx, 0
+   je   BST_FS_N_X             ; if pptr == null jmp to exit
+
+   mov  rax, qword[rcx]        ; rax = ptr to root
+
+BST_FS_N_1:
+   cmp  rax, 0
+   je   BST_FS_N_X             ; if tree is empty jmp to exit
+
+   mov  rdx, qword[rax + _bst_node_t.left]
+   cmp  rdx, 0
+   je   BST_FS_N_X             ; if no left child rax is the first node
+
+   mov  rax, rdx
+   jmp  BST_FS_N_1
+
+BST_FS_N_X:
+   ret                         ; rax = first node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_next_node(struct _bst_node_t *node)
+;
+; Purpose
+;    To find the node following node in key order
+;
+; Params
+;    node = ptr to node within a binary tree
+;
+; Returns
+;    rax
+;       = ptr to next node
+;       = null ptr if node == null or node has the highest key
+;
+; Notes
+;    Follows the parent ptrs, so no stack is needed.
+;
+binarytree_next_node:
+   xor  rax, rax               ; rax = null ptr
+
+   cmp  rcx, 0
+   je   BST_NX_N_X             ; if node == null jmp to exit
+
+   mov  rax, qword[rcx + _bst_node_t.right]
+   cmp  rax, 0
+   je   BST_NX_N_2             ; if no right child go up
+
+BST_NX_N_1:
+   ; find left-most node of the right subtree
+   mov  rdx, qword[rax + _bst_node_t.left]
+   cmp  rdx, 0
+   je   BST_NX_N_X
+   mov  rax, rdx
+   jmp  BST_NX_N_1
+
+BST_NX_N_2:
+   ; go up until coming from a left child
+   mov  rax, qword[rcx + _bst_node_t.parent]
+   cmp  rax, 0
+   je   BST_NX_N_X             ; if node is the root there is no next node
+
+   cmp  qword[rax + _bst_node_t.right], rcx
+   jne  BST_NX_N_X             ; if node is a left child rax is next
+
+   mov  rcx, rax
+   jmp  BST_NX_N_2
+
+BST_NX_N_X:
+   ret                         ; rax = next node
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+;
+; struct _bst_node_t * binarytree_find_prefix(struct _bst_node_t **root, void *key, unsigned int klen)
+;
+; Purpose
+;    To find the node with the lowest key starting with key
+;
+; Params
+;    root = address of ptr to binary tree root
+;     key = ptr to key prefix
+;    klen = length of key prefix
+;
+; Returns
+;    rax
+;       = ptr to first node whose key starts with key
+;       = null ptr if root == null, key == null, len == 0, or no key
+;         starts with key
+;
+; Notes
+;    All keys starting with key follow each other in key order, so
+;    the others are found with binarytree_next_node() until a key no
+;    longer starts with key.
+;
+binarytree_find_prefix:
+   push rbp                    ; set up stack frame
+   mov  rbp, rsp
+   push rbx                    ; save nonvolatile registers used
+   push rsi
+   push rdi
+   push r12
+   sub  rsp, 32                ; create RSS
+
+   xor  rax, rax               ; rax = null ptr
+
+   cmp  rcx, 0
+   je   BST_FP_N_X             ; if pptr == null jmp to exit
+
+   cmp  rdx, 0
+   je   BST_FP_N_X             ; if key == null jmp to exit
+
+   cmp  r8, 0
+   je   BST_FP_N_X             ; if klen == 0 jmp to exit
+
+   mov  rbx, qword[rcx]        ; rbx = ptr to root
+   mov  rsi, rdx               ; rsi = user key
+   mov  edi, r8d               ; edi = user key length
+   xor  r12, r12               ; r12 = lowest node not below user key
+
+BST_FP_N_1:
+   cmp  rbx, 0
+   je   BST_FP_N_4             ; if node == null r12 is the candidate
+
+   ; get shortest key length
+   mov  r8d, dword[rbx + _bst_node_t.klen]
+   cmp  r8d, edi
+   jbe  BST_FP_N_2
+
+   mov  r8d, edi               ; r8d = shortest key length
+
+BST_FP_N_2:
+
+   ; compare user key to this nodes key
+   mov  rcx, rsi
+   mov  rdx, qword[rbx + _bst_node_t.key]
+   call memcmp
+   cmp  eax, 0
+   jl   BST_FP_N_3
+   jg   BST_FP_N_5
+
+   ; assert: since keys are equal check lengths
+   cmp  edi, dword[rbx + _bst_node_t.klen]
+   ja   BST_FP_N_5
+
+BST_FP_N_3:
+   ; assert: user key not above node key, lower nodes are to the left
+   mov  r12, rbx
+   mov  rbx, qword[rbx + _bst_node_t.left]
+   jmp  BST_FP_N_1
+
+BST_FP_N_5:
+   ; assert: user key greater than node key
+   mov  rbx, qword[rbx + _bst_node_t.right]
+   jmp  BST_FP_N_1
+
+BST_FP_N_4:
+   ; check the candidate key starts with the user key
+   xor  rax, rax
+   cmp  r12, 0
+   je   BST_FP_N_X
+
+   cmp  edi, dword[r12 + _bst_node_t.klen]
+   ja   BST_FP_N_X             ; if node key is shorter it cannot match
+
+   mov  rcx, rsi
+   mov  rdx, qword[r12 + _bst_node_t.key]
+   mov  r8d, edi
+   call memcmp
+   cmp  eax, 0
+   mov  eax, 0                 ; rax = null ptr
+   jne  BST_FP_N_X
+
+   mov  rax, r12               ; rax = found node
+
+BST_FP_N_X:
+   add  rsp, 32
+   pop  r12
+   pop  rdi
+   pop  rsi
+   pop  rbx
+   pop  rbp
+   ret                         ; rax = found node
+
 %else
    %fatal unknown output format: __OUTPUT_FORMAT__
 %endif
@@ -0,0 +1,620 @@
+/*
+   bintree.c : binary tree routines
+
+   Copyright (C)2010 Rob Neff - All rights reserved.
+   Source code licensed under the new/simplified 2-clause BSD OSI license.
+
+   A portable C version of bintree.asm, selected with `scons bintree=c`.
+   It implements the same binarytree_* functions with the same results:
+   each tree is kept height balanced ( AVL ) on insert and remove, and
+   keys are ordered by the big endian number of their first 8 bytes, then
+   by memcmp of the remaining bytes, then by length. Unlike the asm, the
+   compiler can inline these functions into hashmap.c when the program is
+   linked with -flto, see SConstruct.
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "hashmap.h"
+
+/* allocation routines used for nodes, malloc() and free() unless replaced by the caller */
+void* (*binarytree_malloc)(size_t size) = malloc;
+void (*binarytree_free)(void *p) = free;
+
+/* height of a subtree, 0 if empty */
+#define BST_HEIGHT(node)  ( (node) ? (node)->height : 0 )
+
+/* first 8 bytes of a key as a big endian number padded with zero bytes */
+static unsigned long long bst_key_prefix(const unsigned char *key, unsigned int klen)
+{
+   unsigned long long prefix;
+   unsigned int i;
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && ( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ )
+   if ( klen >= 8 )
+   {
+      memcpy(&prefix, key, 8);
+      return __builtin_bswap64(prefix);
+   }
+#endif
+
+   prefix = 0;
+   for ( i = 0; i < 8; i++ )
+      prefix = ( prefix << 8 ) | ( i < klen ? key[i] : 0 );
+   return prefix;
+}
+
+/* compare a key with the key of node, memcmp is only called for long keys sharing their prefix */
+static int bst_compare(unsigned long long prefix, const unsigned char *key, unsigned int klen, const struct bst_node_t *node)
+{
+   unsigned int len;
+   int cmp;
+
+   if ( prefix != node->prefix )
+      return ( prefix < node->prefix ) ? -1 : 1;
+
+   len = ( klen < node->klen ) ? klen : node->klen;
+   if ( len > 8 )
+   {
+      cmp = memcmp(key + 8, (unsigned char*)node->key + 8, len - 8);
+      if ( cmp )
+         return cmp;
+   }
+
+   if ( klen != node->klen )
+      return ( klen < node->klen ) ? -1 : 1;
+   return 0;
+}
+
+static void bst_set_height(struct bst_node_t *node)
+{
+   unsigned int left = BST_HEIGHT(node->left);
+   unsigned int right = BST_HEIGHT(node->right);
+
+   node->height = ( ( left > right ) ? left : right ) + 1;
+}
+
+/* replace the subtree rooted at node by its right child, returns the new subtree root */
+static struct bst_node_t* bst_rotate_left(struct bst_node_t **root, struct bst_node_t *node)
+{
+   struct bst_node_t *top = node->right;
+   struct bst_node_t *parent = node->parent;
+
+   node->right = top->left;
+   if ( node->right )
+      node->right->parent = node;
+   top->left = node;
+
+   top->parent = parent;
+   node->parent = top;
+   if ( !parent )
+      *root = top;
+   else if ( parent->left == node )
+      parent->left = top;
+   else
+      parent->right = top;
+
+   bst_set_height(node);
+   bst_set_height(top);
+   return top;
+}
+
+/* replace the subtree rooted at node by its left child, returns the new subtree root */
+static struct bst_node_t* bst_rotate_right(struct bst_node_t **root, struct bst_node_t *node)
+{
+   struct bst_node_t *top = node->left;
+   struct bst_node_t *parent = node->parent;
+
+   node->left = top->right;
+   if ( node->left )
+      node->left->parent = node;
+   top->right = node;
+
+   top->parent = parent;
+   node->parent = top;
+   if ( !parent )
+      *root = top;
+   else if ( parent->left == node )
+      parent->left = top;
+   else
+      parent->right = top;
+
+   bst_set_height(node);
+   bst_set_height(top);
+   return top;
+}
+
+/* restore the AVL balance from node, the lowest node whose subtree changed, up to the root */
+static void bst_rebalance(struct bst_node_t **root, struct bst_node_t *node)
+{
+   unsigned int left;
+   unsigned int right;
+
+   while ( node )
+   {
+      left = BST_HEIGHT(node->left);
+      right = BST_HEIGHT(node->right);
+      if ( left > right + 1 )
+      {
+         if ( BST_HEIGHT(node->left->right) > BST_HEIGHT(node->left->left) )
+            bst_rotate_left(root, node->left);
+         node = bst_rotate_right(root, node);
+      }
+      else if ( right > left + 1 )
+      {
+         if ( BST_HEIGHT(node->right->left) > BST_HEIGHT(node->right->right) )
+            bst_rotate_right(root, node->right);
+         node = bst_rotate_left(root, node);
+      }
+      else
+         node->height = ( ( left > right ) ? left : right ) + 1;
+      node = node->parent;
+   }
+}
+
+/*****************************************************************************
+
+struct bst_node_t * binarytree_alloc_node(void *key, unsigned int klen, char *value, unsigned int vlen)
+
+Purpose
+   To allocate memory for a binary tree node structure and initialize with key/value pair
+
+Params
+   key - ptr to key
+   klen - length of key
+   value - ptr to data, if any
+   vlen - length of data
+
+Returns
+   ptr to node, null if key == null, klen == 0, or insufficient memory
+
+Notes
+   Params value and vlen may be null/zero if using the binary tree for keys only
+
+*/
+struct bst_node_t * binarytree_alloc_node(void *key, unsigned int klen, char *value, unsigned int vlen)
+{
+   struct bst_node_t *node;
+
+   if ( !key || !klen )
+      return (struct bst_node_t*)0;
+
+   node = binarytree_malloc(sizeof(struct bst_node_t) + (size_t)klen + vlen);
+   if ( !node )
+      return node;
+
+   node->parent = (struct bst_node_t*)0;
+   node->left = (struct bst_node_t*)0;
+   node->right = (struct bst_node_t*)0;
+   node->value = (void*)0;
+   node->vlen = 0;
+   node->hash = 0;
+
+   node->key = node + 1;
+   node->klen = klen;
+   memcpy(node->key, key, klen);
+   node->prefix = bst_key_prefix(node->key, klen);
+
+   if ( value && vlen )
+   {
+      node->value = (unsigned char*)node->key + klen;
+      node->vlen = vlen;
+      memcpy(node->value, value, vlen);
+   }
+   return node;
+}
+
+/*****************************************************************************
+
+struct bst_node_t * binarytree_find_node(struct bst_node_t **root, void *key, unsigned int klen)
+
+Purpose
+   To find a node within the binary tree root containing key
+
+Params
+   root - address of ptr to root of binary tree to search
+   key - ptr to key
+   klen - length of key
+
+Returns
+   ptr to found node, null if root == null, key == null, klen == 0, or key not found
+
+*/
+struct bst_node_t * binarytree_find_node(struct bst_node_t **root, void *key, unsigned int klen)
+{
+   struct bst_node_t *node;
+   unsigned long long prefix;
+   int cmp;
+
+   if ( !root || !key || !klen )
+      return (struct bst_node_t*)0;
+
+   prefix = bst_key_prefix(key, klen);
+   node = *root;
+   while ( node )
+   {
+      cmp = bst_compare(prefix, key, klen, node);
+      if ( !cmp )
+         break;
+      node = ( cmp < 0 ) ? node->left : node->right;
+   }
+   return node;
+}
+
+/*****************************************************************************
+
+int binarytree_insert_node(struct bst_node_t **root, struct bst_node_t *node)
+
+Purpose
+   To insert a node into the binary tree
+
+Params
+   root - address of ptr to binary tree root node
+   node - ptr to node to insert into binary tree
+
+Returns
+   0 if successful, 1 if parameter error
+
+Notes
+   Any node within the tree with the same key is replaced with the new
+   node and freed. The node is inserted as a leaf, its link ptrs are
+   overwritten and its key prefix is filled in, then the tree is
+   rebalanced.
+
+*/
+int binarytree_insert_node(struct bst_node_t **root, struct bst_node_t *node)
+{
+   struct bst_node_t **link;
+   struct bst_node_t *parent;
+   struct bst_node_t *old;
+   int cmp;
+
+   if ( !root || !node )
+      return 1;  /* param error */
+
+   node->parent = (struct bst_node_t*)0;
+   node->left = (struct bst_node_t*)0;
+   node->right = (struct bst_node_t*)0;
+   node->height = 1;
+   node->prefix = bst_key_prefix(node->key, node->klen);
+
+   link = root;
+   parent = (struct bst_node_t*)0;
+   while ( *link )
+   {
+      old = *link;
+      cmp = bst_compare(node->prefix, node->key, node->klen, old);
+      if ( !cmp )
+      {
+         /* node takes the place of old, the shape of the tree is unchanged */
+         node->height = old->height;
+         node->parent = old->parent;
+         node->left = old->left;
+         if ( node->left )
+            node->left->parent = node;
+         node->right = old->right;
+         if ( node->right )
+            node->right->parent = node;
+         *link = node;
+         binarytree_free(old);
+         return 0;
+      }
+      parent = old;
+      link = ( cmp < 0 ) ? &old->left : &old->right;
+   }
+
+   *link = node;
+   node->parent = parent;
+   bst_rebalance(root, parent);
+   return 0;
+}
+
+/*****************************************************************************
+
+struct bst_node_t * binarytree_remove_node(struct bst_node_t **root, void *key, unsigned int klen)
+
+Purpose
+   To unlink a node from the binary tree without freeing it
+
+Params
+   root - address of ptr to binary tree root node
+   key - ptr to key to find and remove
+   klen - length of key
+
+Returns
+   ptr to removed node, null if root == null, key == null, klen == 0, or key not found
+
+Notes
+   The caller owns the returned node, its link ptrs are no longer valid.
+   The node is replaced by the lowest node of its right subtree, or the
+   highest of its left one, and the tree is rebalanced.
+
+*/
+struct bst_node_t * binarytree_remove_node(struct bst_node_t **root, void *key, unsigned int klen)
+{
+   struct bst_node_t **link;
+   struct bst_node_t *node;
+   struct bst_node_t *repl;
+   struct bst_node_t *changed;
+   unsigned long long prefix;
+   int cmp;
+
+   if ( !root || !key || !klen )
+      return (struct bst_node_t*)0;
+
+   prefix = bst_key_prefix(key, klen);
+   link = root;
+   while ( ( node = *link ) )
+   {
+      cmp = bst_compare(prefix, key, klen, node);
+      if ( !cmp )
+         break;
+      link = ( cmp < 0 ) ? &node->left : &node->right;
+   }
+   if ( !node )
+      return node;
+
+   repl = node->right;
+   if ( repl )
+   {
+      if ( !repl->left )
+      {
+         node->right = repl->right;
+         changed = repl;
+      }
+      else
+      {
+         while ( repl->left )
+            repl = repl->left;
+         changed = repl->parent;
+         changed->left = repl->right;
+         if ( repl->right )
+            repl->right->parent = changed;
+      }
+   }
+   else
+   {
+      repl = node->left;
+      if ( !repl )
+         changed = node->parent;
+      else if ( !repl->right )
+      {
+         node->left = repl->left;
+         changed = repl;
+      }
+      else
+      {
+         while ( repl->right )
+            repl = repl->right;
+         changed = repl->parent;
+         changed->right = repl->left;
+         if ( repl->left )
+            repl->left->parent = changed;
+      }
+   }
+
+   if ( repl )
+   {
+      /* replacement takes the place of node */
+      repl->height = node->height;
+      repl->parent = node->parent;
+      repl->left = node->left;
+      if ( repl->left )
+         repl->left->parent = repl;
+      repl->right = node->right;
+      if ( repl->right )
+         repl->right->parent = repl;
+   }
+   *link = repl;
+
+   bst_rebalance(root, changed);
+   return node;
+}
+
+/*****************************************************************************
+
+int binarytree_delete_node(struct bst_node_t **root, void *key, unsigned int klen)
+
+Purpose
+   To delete a node from the binary tree
+
+Params
+   root - address of ptr to binary tree root node
+   key - ptr to key to find and delete
+   klen - length of key
+
+Returns
+   0 if successful, 1 if parameter error, 2 if key not found
+
+Notes
+   If the only node in the tree is the root node and it compares
+   to the key param it is deleted and will be set to null
+
+*/
+int binarytree_delete_node(struct bst_node_t **root, void *key, unsigned int klen)
+{
+   struct bst_node_t *node;
+
+   if ( !root || !*root || !key || !klen )
+      return 1;  /* param error */
+
+   node = binarytree_remove_node(root, key, klen);
+   if ( !node )
+      return 2;  /* not found */
+
+   binarytree_free(node);
+   return 0;
+}
+
+/*****************************************************************************
+
+int binarytree_delete_tree(struct bst_node_t **root)
+
+Purpose
+   To delete all nodes from the binary tree
+
+Params
+   root - address of ptr to binary tree root
+
+Returns
+   0 if successful, 1 if parameter error
+
+Notes
+   Left children are rotated up while freeing, so no stack is needed.
+   The root ptr is set to null.
+
+*/
+int binarytree_delete_tree(struct bst_node_t **root)
+{
+   struct bst_node_t *node;
+   struct bst_node_t *left;
+
+   if ( !root || !*root )
+      return 1;  /* param error */
+
+   node = *root;
+   while ( node )
+   {
+      left = node->left;
+      if ( left )
+      {
+         node->left = left->right;
+         left->right = node;
+         node = left;
+      }
+      else
+      {
+         left = node;
+         node = node->right;
+         binarytree_free(left);
+      }
+   }
+
+   *root = (struct bst_node_t*)0;
+   return 0;
+}
+
+/*****************************************************************************
+
+struct bst_node_t * binarytree_first_node(struct bst_node_t **root)
+
+Purpose
+   To find the node with the lowest key in the binary tree
+
+Params
+   root - address of ptr to binary tree root
+
+Returns
+   ptr to first node, null if root == null or the tree is empty
+
+Notes
+   Together with binarytree_next_node() this walks the tree in key
+   order without allocating memory. The tree must not be changed
+   during the walk.
+
+*/
+struct bst_node_t * binarytree_first_node(struct bst_node_t **root)
+{
+   struct bst_node_t *node;
+
+   if ( !root )
+      return (struct bst_node_t*)0;
+
+   node = *root;
+   if ( node )
+   {
+      while ( node->left )
+         node = node->left;
+   }
+   return node;
+}
+
+/*****************************************************************************
+
+struct bst_node_t * binarytree_next_node(struct bst_node_t *node)
+
+Purpose
+   To find the node following node in key order
+
+Params
+   node - ptr to node within a binary tree
+
+Returns
+   ptr to next node, null if node == null or node has the highest key
+
+*/
+struct bst_node_t * binarytree_next_node(struct bst_node_t *node)
+{
+   struct bst_node_t *next;
+
+   if ( !node )
+      return node;
+
+   next = node->right;
+   if ( next )
+   {
+      while ( next->left )
+         next = next->left;
+      return next;
+   }
+
+   /* go up until coming from a left child */
+   next = node->parent;
+   while ( next && ( next->right == node ) )
+   {
+      node = next;
+      next = node->parent;
+   }
+   return next;
+}
+
+/*****************************************************************************
+
+struct bst_node_t * binarytree_find_prefix(struct bst_node_t **root, void *key, unsigned int klen)
+
+Purpose
+   To find the node with the lowest key starting with key
+
+Params
+   root - address of ptr to binary tree root
+   key - ptr to key prefix
+   klen - length of key prefix
+
+Returns
+   ptr to first node whose key starts with key, null if root == null,
+   key == null, klen == 0, or no key starts with key
+
+Notes
+   All keys starting with key follow each other in key order, so
+   the others are found with binarytree_next_node() until a key no
+   longer starts with key.
+
+*/
+struct bst_node_t * binarytree_find_prefix(struct bst_node_t **root, void *key, unsigned int klen)
+{
+   struct bst_node_t *node;
+   struct bst_node_t *found;
+   unsigned long long prefix;
+
+   if ( !root || !key || !klen )
+      return (struct bst_node_t*)0;
+
+   /* find the lowest node not below key */
+   prefix = bst_key_prefix(key, klen);
+   found = (struct bst_node_t*)0;
+   node = *root;
+   while ( node )
+   {
+      if ( bst_compare(prefix, key, klen, node) <= 0 )
+      {
+         found = node;
+         node = node->left;
+      }
+      else
+         node = node->right;
+   }
+
+   if ( !found || ( klen > found->klen ) || memcmp(key, found->key, klen) )
+      return (struct bst_node_t*)0;
+   return found;
+}
@@ -29,6 +29,10 @@
 ; /* if desired - convert from a 32-bit to 16-bit hash */
 ; hash = ((hash >> 16) ^ (hash & 0xFFFF));
 ;
+; Both the 32-bit and 64-bit versions compute the same 32-bit hash so
+; that hash values are identical regardless of the target CPU.
+; A zero length buffer returns the offset_basis unchanged.
+;
 ; uncomment the following line to get FNV1A behavior
 
 %define FNV1A 1
@@ -45,9 +49,13 @@
 %define len [ebp+12]
 %define offset_basis [ebp+16]
 
-global _FNV1Hash
+%ifidni __OUTPUT_FORMAT__,win32
+%define FNV1Hash _FNV1Hash
+%endif
 
-_FNV1Hash:
+global FNV1Hash
+
+FNV1Hash:
    push ebp                    ; set up stack frame
    mov  ebp, esp
    push esi                    ; save registers used
@@ -59,6 +67,7 @@ _FNV1Hash:
    mov  eax, offset_basis      ; set to 2166136261 for FNV-1
    mov  edi, 1000193h          ; FNV_32_PRIME = 16777619
    xor  ebx, ebx               ; ebx = 0
+   jecxz done32                ; if len == 0 jmp to exit
 nextbyte:
 %ifdef FNV1A
    mov  bl, byte[esi]          ; bl = byte from esi
@@ -73,6 +82,7 @@ nextbyte:
    dec  ecx                    ; ecx = ecx - 1 (counter)
    jnz  nextbyte               ; if ecx != 0, jmp to nextbyte
 
+done32:
    pop  ebx                    ; restore registers
    pop  edi
    pop  esi
@@ -107,32 +117,32 @@ FNV1Hash:
 ;    ints/longs/ptrs: RDI, RSI, RDX, RCX, R8, R9
 ;     floats/doubles: XMM0 to XMM7
 
-global _FNV1Hash
+global FNV1Hash
 
-_FNV1Hash:
-   mov  rcx, rsi
-   mov  r8, rdi
+FNV1Hash:
+   mov  ecx, esi               ; rcx = length of buffer
+   mov  r8, rdi                ; r8 = ptr to buffer
 
 %endif
 
-   mov  rax, rdx               ; rax = offset_basis - set to 14695981039346656037 for FNV-1
-   mov  r9, 100000001B3h       ; r9 = FNV_64_PRIME = 1099511628211
-   mov  r10, rbx               ; r10 = saved copy of rbx
-   xor  rbx, rbx               ; rbx = 0
+   mov  eax, edx               ; eax = offset_basis - set to 2166136261 for FNV-1
+   mov  r9d, 1000193h          ; r9d = FNV_32_PRIME = 16777619
+   test ecx, ecx
+   jz   done64                 ; if len == 0 jmp to exit
 nextbyte:
 %ifdef FNV1A
-   mov  bl, byte[r8]           ; bl = byte from r8
-   xor  rax, rbx               ; al = al xor bl
-   mul  r9                     ; rax = rax * FNV_64_PRIME
+   movzx r10d, byte[r8]        ; r10d = byte from r8
+   xor  eax, r10d              ; al = al xor byte
+   imul eax, r9d               ; eax = eax * FNV_32_PRIME
 %else
-   mul  r9                     ; rax = rax * FNV_64_PRIME
-   mov  bl, byte[r8]           ; bl = byte from r8
-   xor  rax, rbx               ; al = al xor bl
+   imul eax, r9d               ; eax = eax * FNV_32_PRIME
+   movzx r10d, byte[r8]        ; r10d = byte from r8
+   xor  eax, r10d              ; al = al xor byte
 %endif
    inc  r8                     ; inc buffer pos
-   dec  rcx                    ; rcx = rcx - 1 (counter)
-   jnz  nextbyte               ; if rcx != 0, jmp to nextbyte
-   mov  rbx, r10               ; restore rbx
-   ret                         ; rax = fnv1 hash
+   dec  ecx                    ; ecx = ecx - 1 (counter)
+   jnz  nextbyte               ; if ecx != 0, jmp to nextbyte
+done64:
+   ret                         ; eax = fnv1 hash
 
 %endif
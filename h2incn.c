@@ -35,22 +35,71 @@
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define H2INCN_MMAP 1
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+#ifdef HASHMAP_STRESS
+#include <pthread.h>
+#endif
 #include "h2incn.h"
 #include "hashmap.h"
+#include "scan.h"
 
 
 #define SUPPORT_TYPEDEFS    0
 
+/* hash map flags of the maps keyed on symbol IDs, the ID is its own hash */
+#define SYMBOL_MAP_FLAGS(flags)  ( ( (flags) & ~HASH_MAP_HASH_MASK ) | HASH_MAP_ID )
+
 static int h2incn_read(struct parser_t *parser);
 
 static struct options_t options;
 
-/* a maintained list of include filenames to prevent endless recursion */
-static struct hash_map_t *pHeadersMap;
+/* include filenames, define names and define values, each kept once */
+static struct hash_intern_t *pSymbols;
 
-/* used to map defines for quick access */
+/* defined macros keyed on the ID of their name, the value is the ID of their value */
 static struct hash_map_t *pDefinesMap;
 
+/* a maintained list of include filename IDs to prevent endless recursion */
+static struct hash_map_t *pHeadersMap;
+
+/* counts all memory allocated when printing statistics */
+static struct hash_map_counter_t MemCounter;
+
+/* directive names indexed by DIRECTIVE_xxx */
+static const char *DirectiveNames[DIRECTIVE_COUNT] = {
+   "", "include", "define", "undef", "if", "ifdef", "ifndef", "elif", "elifdef",
+   "elifndef", "else", "endif", "error", "warning", "pragma", "line"
+};
+
+/* DIRECTIVE_xxx indexed by DIRECTIVE_HASH() of its name, filled in by main(),
+   the hash is perfect for the names above */
+#define DIRECTIVE_HASH(p, len)  ( ( (len) * 5 + (unsigned char)(p)[0] + (unsigned char)(p)[(len)-1] ) & 31 )
+static unsigned char DirectiveTable[32];
+
+/* chars ending a run, for scan_stop() */
+static unsigned char StopBrace[256];     /* struct body */
+static unsigned char StopTag[256];       /* struct tag name */
+static unsigned char StopTagEnd[256];    /* struct tag name after the body */
+static unsigned char StopStatement[256]; /* typedef on one line */
+static unsigned char StopSemicolon[256]; /* typedef */
+static unsigned char StopName[256];      /* name, hashed while it is lexed */
+
+/* mark the chars of delims, and the nul char, as ending a token */
+static void init_stop_table(unsigned char *table, char *delims)
+{
+   memset(table, 0, 256);
+   table[0] = 1;
+   while ( *delims )
+      table[(unsigned char)*delims++] = 1;
+}
+
 static void print_usage(void)
 {
    printf("\nh2incn v%d.%d.%d\nCopyright (C)2010 Piranha Designs, LLC - All rights reserved.\n\n",
@@ -61,6 +110,8 @@ static void print_usage(void)
    printf(
       "usage: h2incn [options] file\n\n"
       "Options:\n"
+      "  -a   select hash function (hash16, fnv1a, wide)\n"
+      "  -b   stream input in chunks of this size (ie: -b 64K ), file '-' is stdin\n"
       "  -c   convert and emit comments\n"
       "  -e   emit code as comments\n"
       "  -d   define macro (ie: -d FOO=1,BAR=1 )\n"
@@ -68,9 +119,12 @@ static void print_usage(void)
       "  -i   set additional include search path\n"
       "  -L   print license information\n"
       "  -m   emit C-like function call macros\n"
-      "  -o   specify output file name\n"
+      "  -n   allocate hash map nodes individually instead of from an arena\n"
+      "  -o   specify output file name, '-' is stdout\n"
       "  -p   preprocess files\n"
       "  -r   recursively convert files included with '#include \"file\"'\n"
+      "  -s   print hash map statistics\n"
+      "  -t   select hash table type (open, chained, fixed, compact, concurrent)\n"
       "  -v   verbose\n"
       "\n");
 }
@@ -104,21 +158,154 @@ static void print_license(void)
       "EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.\n");
 }
 
-static void h2incn_print_err(struct parser_t *parser, char* funcname, char* errmsg)
+/* end of the text parsed so far, which is after the last token consumed */
+static char* h2incn_parsed(struct parser_t *parser)
+{
+   struct tokens_t *tokens = &parser->tokens;
+
+   if ( !tokens->pBase )
+      return parser->pFileBuffer;
+   if ( !tokens->uNext || !tokens->pOffset )
+      return tokens->pBase;
+   return tokens->pBase + tokens->pOffset[tokens->uNext-1] + tokens->pLength[tokens->uNext-1];
+}
+
+/* lines ended in pFileBuffer before end, counted on from the last call as the parser only moves on */
+static int h2incn_count_lines(struct parser_t *parser, char *end)
+{
+   char *p;
+
+   p = parser->pFileBuffer;
+   if ( (size_t)(end - p) < parser->uCounted )
+   {
+      parser->uCounted = 0;
+      parser->iCountedLines = 0;
+   }
+   parser->iCountedLines += (int)scan_lines(p + parser->uCounted, end);
+   parser->uCounted = (size_t)(end - parser->pFileBuffer);
+   return parser->iCountedLines;
+}
+
+/* line of the file at p, with the lines ended and the continued lines joined before p, see h2incn_splice() */
+static int h2incn_line(struct parser_t *parser, char *p)
+{
+   size_t offset;
+   size_t lo;
+   size_t hi;
+   size_t mid;
+
+   /* count the lines joined at or before p */
+   lo = 0;
+   hi = parser->uSplices;
+   if ( hi && p )
+   {
+      offset = (size_t)(p - parser->pFileBuffer);
+      while ( lo < hi )
+      {
+         mid = lo + ( hi - lo ) / 2;
+         if ( parser->pSplices[mid] <= offset )
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+   }
+   return 1 + parser->iChunkLines + h2incn_count_lines(parser, p) + parser->iSplicedLines + (int)lo;
+}
+
+/* prints the line of the text at p and the error, with the line number of p */
+static void h2incn_print_err_at(struct parser_t *parser, char *p, char* funcname, char* errmsg)
 {
+   char *head;
    char *tail;
 
-   tail = parser->pLine;
-   while ( ( *tail != 0 ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-   *tail = 0;  /* safe to nul-terminate since we will end */
+   /* the file buffer may be a mapped file, so print the line without terminating it */
+   head = p;
+   if ( head )
+   {
+      while ( ( head > parser->pFileBuffer ) && ( *(head-1) != '\n' ) ) head--;
+      tail = scan_eol(head);
+      printf("%.*s\n", (int)(tail - head), head);
+   }
+   printf("(%s::%d) %s: %s\n", parser->pFileName, h2incn_line(parser, p), funcname, errmsg);
+}
+
+/* prints the error at the end of the text parsed so far */
+static void h2incn_print_err(struct parser_t *parser, char* funcname, char* errmsg)
+{
+   h2incn_print_err_at(parser, h2incn_parsed(parser), funcname, errmsg);
+}
+
+static void print_map_stats(char *name, struct hash_map_t *map)
+{
+   struct hash_map_dist_t dist;
+   struct hash_map_stats_t stats;
+
+   if ( hash_map_distribution(map, &dist) || hash_map_stats(map, &stats) )
+      return;
+
+   printf("%s: %u nodes in %u of %u buckets, %u max nodes per bucket\n",
+      name, dist.nodes, dist.used, dist.buckets, dist.max_nodes);
+   printf("%s: max tree depth %u, avg tree depth %.2f\n",
+      name, stats.max_depth, stats.avg_depth);
+   printf("%s: %lu inserts, %lu collisions, %lu deletes, %lu lookups, %lu hits\n",
+      name, stats.inserts, stats.collisions, stats.deletes, stats.lookups, stats.hits);
+   printf("%s: %lu bytes allocated\n", name, stats.bytes);
+}
+
+static void print_mem_stats(struct hash_map_counter_t *counter)
+{
+   unsigned int i;
+
+   printf("memory: %lu bytes peak, %lu bytes in use, %lu allocations, %lu frees\n",
+      counter->peak, counter->bytes, counter->allocs, counter->frees);
+   for ( i = 0; i < HASH_MAP_COUNTER_CLASSES; i++ )
+   {
+      if ( !counter->sizes[i] )
+         continue;
+      if ( i == HASH_MAP_COUNTER_CLASSES - 1 )
+         printf("memory: %lu allocations over %lu bytes\n", counter->sizes[i], 8UL << i);
+      else
+         printf("memory: %lu allocations up to %lu bytes\n", counter->sizes[i], 16UL << i);
+   }
+}
+
+/* parser memory comes from the same allocator as the hash maps */
+static void* h2incn_alloc(size_t size)
+{
+   struct hash_map_allocator_t *allocator = hash_map_get_allocator();
+
+   return allocator->alloc(allocator->ctx, size);
+}
+
+static void h2incn_free(void *p)
+{
+   struct hash_map_allocator_t *allocator = hash_map_get_allocator();
+
+   allocator->free(allocator->ctx, p);
+}
+
+/* define the name of an ID, interning its value */
+static int h2incn_add_define(unsigned int id, char *vhead, char *vtail)
+{
+   unsigned int vid;
+
+   if ( !id )
+      return 1;  /* empty name or insufficient memory */
 
-   printf("%s\n", parser->pLine);
-   printf("(%s::%d) %s: %s\n", parser->pFileName, parser->iLineNum, funcname, errmsg);
+   if ( vtail > vhead )
+   {
+      vid = hash_intern(pSymbols, vhead, (unsigned int)(vtail - vhead));
+      if ( !vid )
+         return 2;  /* insufficient memory */
+      return hash_map_insert_hashed(pDefinesMap, id, &id, sizeof(id), &vid, sizeof(vid));
+   }
+   return hash_map_insert_hashed(pDefinesMap, id, &id, sizeof(id), (void*)0, 0);
 }
 
 static void parse_cmdln(int argc, char **argv)
 {
    int i, cmd;
+   char *suffix;
 
    if (argc < 2)
    {
@@ -128,10 +315,48 @@ static void parse_cmdln(int argc, char **argv)
 
    for ( i = 1; i < argc; i++)
    {
-      if ( *argv[i] ==  '-' )
+      if ( ( *argv[i] ==  '-' ) && ( *(argv[i]+1) != 0 ) )  /* a lone '-' is stdin */
       {
          cmd = *(argv[i]+1);
          switch (cmd) {
+            case 'A':
+            case 'a':
+               if ( ++i >= argc )
+               {
+                  print_usage();
+                  exit(1);
+               }
+               options.uHashFlags &= ~HASH_MAP_HASH_MASK;
+               if ( !strcmp(argv[i], "hash16") )
+                  options.uHashFlags |= HASH_MAP_HASH16;
+               else if ( !strcmp(argv[i], "fnv1a") )
+                  options.uHashFlags |= HASH_MAP_FNV1A;
+               else if ( !strcmp(argv[i], "wide") )
+                  options.uHashFlags |= HASH_MAP_WIDE;
+               else
+               {
+                  print_usage();
+                  exit(1);
+               }
+               break;
+            case 'B':
+            case 'b':
+               if ( ++i >= argc )
+               {
+                  print_usage();
+                  exit(1);
+               }
+               options.uChunkSize = (size_t)strtoul(argv[i], &suffix, 0);
+               if ( ( *suffix == 'k' ) || ( *suffix == 'K' ) )
+                  options.uChunkSize <<= 10;
+               else if ( ( *suffix == 'm' ) || ( *suffix == 'M' ) )
+                  options.uChunkSize <<= 20;
+               if ( !options.uChunkSize )
+               {
+                  print_usage();
+                  exit(1);
+               }
+               break;
             case 'C':
             case 'c':
                options.fComments = 1;
@@ -162,6 +387,10 @@ static void parse_cmdln(int argc, char **argv)
             case 'm':
                options.fMacros = 1;
                break;
+            case 'N':
+            case 'n':
+               options.uHashFlags &= ~HASH_MAP_ARENA;
+               break;
             case 'O':
             case 'o':
                options.pOutFileName = argv[++i];
@@ -174,6 +403,34 @@ static void parse_cmdln(int argc, char **argv)
             case 'r':
                options.fRecurse = 1;
                break;
+            case 'S':
+            case 's':
+               options.fStats = 1;
+               break;
+            case 'T':
+            case 't':
+               if ( ++i >= argc )
+               {
+                  print_usage();
+                  exit(1);
+               }
+               options.uHashFlags &= ~(HASH_MAP_OPEN | HASH_MAP_FIXED | HASH_MAP_COMPACT | HASH_MAP_CONCURRENT);
+               if ( !strcmp(argv[i], "open") )
+                  options.uHashFlags |= HASH_MAP_OPEN;
+               else if ( !strcmp(argv[i], "chained") )
+                  options.uHashFlags |= HASH_MAP_CHAINED;
+               else if ( !strcmp(argv[i], "fixed") )
+                  options.uHashFlags |= HASH_MAP_FIXED;
+               else if ( !strcmp(argv[i], "compact") )
+                  options.uHashFlags |= HASH_MAP_COMPACT;
+               else if ( !strcmp(argv[i], "concurrent") )
+                  options.uHashFlags |= HASH_MAP_CONCURRENT;
+               else
+               {
+                  print_usage();
+                  exit(1);
+               }
+               break;
             case 'V':
             case 'v':
                options.fVerbose = 1;
@@ -196,178 +453,512 @@ static void parse_cmdln(int argc, char **argv)
    }
 }
 
-static int h2incn_parse_comment(struct parser_t *parser)
+/* text of token i */
+static char* h2incn_token(struct parser_t *parser, unsigned int i)
 {
-   char *head;
-   char *tail;
+   return parser->tokens.pBase + parser->tokens.pOffset[i];
+}
 
-   head = parser->pNextToken;
-   if ( *head != '/' )
+/* hash of token i for the symbols, names were hashed by h2incn_lex() */
+static unsigned int h2incn_token_hash(struct parser_t *parser, unsigned int i)
+{
+   struct tokens_t *tokens = &parser->tokens;
+
+   if ( tokens->pKind[i] == TOKEN_NAME )
+      return tokens->pHash[i];
+   return hash_intern_hash(pSymbols, h2incn_token(parser, i), tokens->pLength[i]);
+}
+
+static void h2incn_tokens_free(struct tokens_t *tokens)
+{
+   if ( tokens->pKind )
+      h2incn_free(tokens->pKind);
+   if ( tokens->pOffset )
+      h2incn_free(tokens->pOffset);
+   if ( tokens->pLength )
+      h2incn_free(tokens->pLength);
+   if ( tokens->pHash )
+      h2incn_free(tokens->pHash);
+   if ( tokens->pLines )
+      h2incn_free(tokens->pLines);
+   tokens->pKind = 0;
+   tokens->pOffset = 0;
+   tokens->pLength = 0;
+   tokens->pHash = 0;
+   tokens->pLines = 0;
+   tokens->uMax = 0;
+}
+
+/* make room for count tokens, keeping the tokens lexed, 0 if insufficient memory */
+static int h2incn_tokens_alloc(struct tokens_t *tokens, unsigned int count)
+{
+   struct tokens_t grown;
+
+   grown.pKind = h2incn_alloc(count);
+   grown.pOffset = h2incn_alloc(count * sizeof(unsigned int));
+   grown.pLength = h2incn_alloc(count * sizeof(unsigned int));
+   grown.pHash = h2incn_alloc(count * sizeof(unsigned int));
+   grown.pLines = h2incn_alloc(count * sizeof(unsigned int));
+   if ( !grown.pKind || !grown.pOffset || !grown.pLength || !grown.pHash || !grown.pLines )
    {
-      h2incn_print_err(parser, "h2incn_parse_comment", "comment expected");
+      h2incn_tokens_free(&grown);
       return 0;
    }
-   tail = head;
-   tail++;
-   if ( *tail == '/' )
+   if ( tokens->uCount )
+   {
+      memcpy(grown.pKind, tokens->pKind, tokens->uCount);
+      memcpy(grown.pOffset, tokens->pOffset, tokens->uCount * sizeof(unsigned int));
+      memcpy(grown.pLength, tokens->pLength, tokens->uCount * sizeof(unsigned int));
+      memcpy(grown.pHash, tokens->pHash, tokens->uCount * sizeof(unsigned int));
+      memcpy(grown.pLines, tokens->pLines, tokens->uCount * sizeof(unsigned int));
+   }
+   h2incn_tokens_free(tokens);
+   tokens->pKind = grown.pKind;
+   tokens->pOffset = grown.pOffset;
+   tokens->pLength = grown.pLength;
+   tokens->pHash = grown.pHash;
+   tokens->pLines = grown.pLines;
+   tokens->uMax = count;
+   return 1;
+}
+
+/* double the room for tokens of a long line, 0 if insufficient memory */
+static int h2incn_tokens_grow(struct tokens_t *tokens)
+{
+   if ( ( tokens->uMax > 0x7FFFFFFF ) || !h2incn_tokens_alloc(tokens, tokens->uMax * 2) )
+   {
+      printf("h2incn_lex: insufficient memory\n");
+      return 0;
+   }
+   return 1;
+}
+
+/* end of the comment at p, counting the lines it ends */
+static char* h2incn_lex_comment(char *p, unsigned int *lines)
+{
+   *lines = 0;
+   if ( *(p+1) == '/' )
+      return scan_eol(p);
+
+   p += 2;
+   for (;;)
+   {
+      p = scan_comment(p);
+      if ( *p != '\n' )
+         break;
+      p++;
+      (*lines)++;
+   }
+   if ( *p == '*' )
+      p += 2;
+   return p;  /* at the nul byte if unterminated */
+}
+
+/* skip a string or char literal, or the <name> of an #include, up to the closing quote or the eol */
+static char* h2incn_lex_string(char *p, char quote)
+{
+   p++;
+   while ( ( *p != 0 ) && ( *p != '\n' ) && ( *p != quote ) )
+   {
+      if ( ( *p == '\\' ) && ( quote != '>' ) && ( *(p+1) != 0 ) && ( *(p+1) != '\n' ) )
+         p++;
+      p++;
+   }
+   if ( *p == quote )
+      p++;
+   return p;
+}
+
+/****************************************************
+
+   h2incn_lex
+
+   Purpose
+     To split text into tokens, a batch of lines at a time
+
+   Params
+      parser - ptr to struct used for parsing
+      p - start of a line in the text
+
+   Returns
+      0 if error, otherwise 1
+
+   Notes
+      The tokens are kept in parallel arrays of parser->tokens, which
+      the handlers of h2incn_parse() walk instead of the text. Lines
+      are lexed until H2INCN_TOKENS tokens are reached, so the arrays
+      stay small, and a batch always ends with an end of line token,
+      the end of text token, or before a line of code or a comment,
+      which are not lexed at all but copied from the text by
+      h2incn_parse_code(). tokens->pEnd is where the next batch starts.
+      A directive line is split whole into names, numbers, strings,
+      punctuation and comments, and each name is hashed for the
+      symbols while it is scanned, see hash_intern_scan(), so handlers
+      look names up without hashing them again. Comments are one token
+      each, also when they span lines, with the lines they end in
+      pLines. Whitespace is not a token, the text between two tokens
+      is.
+*/
+static int h2incn_lex(struct parser_t *parser, char *p)
+{
+   struct tokens_t *tokens;
+   char *head;
+   unsigned int lines;
+   unsigned int hash;
+   unsigned int i;
+   int kind;
+   int bInclude;
+   int bFirst;
+
+   tokens = &parser->tokens;
+   tokens->pBase = p;
+   tokens->uCount = 0;
+   tokens->uNext = 0;
+
+   for (;;)
    {
-      /* assert: single-line comment */
-      while ( ( *tail != 0 ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-      while ( *(tail-1) == '\\' )
+      /* assert: p is at the start of a line */
+      while ( scan_class[(unsigned char)*p] & SCAN_SPACE ) p++;
+      head = p;
+      if ( (size_t)(p - tokens->pBase) >= 0x7FFFFFFF )
       {
-         printf("(%s::%d) %s: %s\n", parser->pFileName, parser->iLineNum, "h2incn_parse_comment", "warning: continuation character found in single-line comment");
-         if ( options.fComments )
-         {
-            fwrite(";", 1, 1, parser->pOutFile);
-            fwrite(head, 1, tail-head, parser->pOutFile);
-            fwrite("\n", 1, 1, parser->pOutFile);
-         }
-         if ( *tail == '\r' )
-            tail++;
-         if ( *tail == '\n' )
-         {
-            tail++;
-            parser->pLine = tail;
-            parser->pNextToken = tail;
-            parser->iLineNum++;
-         }
-         head = tail;
-         while ( ( *tail != 0 ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
+         /* offsets and lengths are 32 bits, the tokens so far end before p */
+         printf("h2incn_lex: line too long\n");
+         return 0;
       }
+      if ( ( tokens->uCount == tokens->uMax ) && !h2incn_tokens_grow(tokens) )
+         return 0;
 
-      if ( *tail == '\r' )
-         tail++;
-      if ( *tail == '\n' )
+      if ( *p == 0 )
+         kind = TOKEN_END;
+      else if ( *p == '\n' )
       {
-         tail++;
-         parser->iLineNum++;
-         parser->pLine = tail;
+         kind = TOKEN_EOL;
+         p++;
       }
-      if ( options.fComments )
+      else if ( *p != '#' )
       {
-         fwrite(";", 1, 1, parser->pOutFile);
-         fwrite(head, 1, tail-head, parser->pOutFile);
+         /* code and the comments between it are only copied, if at all */
+         tokens->pEnd = p;
+         return 1;
       }
-   }
-   else if ( *tail == '*' )
-   {
-      /* assert: multi-line comment */
-      tail++;
-      while ( *tail != 0 )
+      else
+      {
+         kind = TOKEN_PUNCT;
+         p++;
+      }
+      i = tokens->uCount++;
+      tokens->pKind[i] = (unsigned char)kind;
+      tokens->pOffset[i] = (unsigned int)(head - tokens->pBase);
+      tokens->pLength[i] = (unsigned int)(p - head);
+
+      tokens->pEnd = p;
+      if ( kind == TOKEN_END )
+         return 1;
+      if ( kind == TOKEN_EOL )
+      {
+         if ( tokens->uCount >= H2INCN_TOKENS )
+            return 1;
+         continue;
+      }
+      if ( kind != TOKEN_PUNCT )
+         continue;
+
+      /* assert: directive, its end of line is lexed above */
+      bInclude = 0;
+      bFirst = 1;
+      for (;;)
       {
-         if ( *tail == '\n' )
+         while ( scan_class[(unsigned char)*p] & SCAN_SPACE ) p++;
+         head = p;
+         if ( ( *p == 0 ) || ( *p == '\n' ) )
+            break;
+         if ( ( tokens->uCount == tokens->uMax ) && !h2incn_tokens_grow(tokens) )
+            return 0;
+
+         if ( ( *p == '/' ) && ( ( *(p+1) == '/' ) || ( *(p+1) == '*' ) ) )
+         {
+            kind = TOKEN_COMMENT;
+            p = h2incn_lex_comment(p, &lines);
+         }
+         else if ( ( *p >= '0' ) && ( *p <= '9' ) )
          {
-            tail++;
-            parser->pLine = tail;
-            parser->iLineNum++;
-            if ( options.fComments )
+            /* preprocessing number, e.g. 0x1F, 1.5e+3 or 10UL */
+            kind = TOKEN_NUMBER;
+            p++;
+            for (;;)
             {
-               fwrite(";", 1, 1, parser->pOutFile);
-               fwrite(head, 1, tail-head, parser->pOutFile);
+               if ( ( scan_class[(unsigned char)*p] & SCAN_IDENT ) || ( *p == '.' ) )
+                  p++;
+               else if ( ( ( *p == '+' ) || ( *p == '-' ) ) &&
+                         ( ( ( *(p-1) | 0x20 ) == 'e' ) || ( ( *(p-1) | 0x20 ) == 'p' ) ) )
+                  p++;
+               else
+                  break;
             }
-            head = tail;
-            continue;
          }
-         if ( *tail == '*' )
+         else if ( scan_class[(unsigned char)*p] & SCAN_IDENT )
          {
-            tail++;
-            if ( *tail == '/' )
-               break;
+            kind = TOKEN_NAME;
+            hash = hash_intern_scan(pSymbols, p, StopName, &p);
+            if ( bFirst && ( p - head == 7 ) && !memcmp(head, "include", 7) )
+               bInclude = 1;
+         }
+         else if ( ( *p == '\"' ) || ( *p == '\'' ) || ( ( *p == '<' ) && bInclude ) )
+         {
+            kind = TOKEN_STRING;
+            p = h2incn_lex_string(p, ( *p == '<' ) ? '>' : *p);
          }
          else
          {
-            tail++;
+            kind = TOKEN_PUNCT;
+            p++;
          }
+         if ( kind != TOKEN_COMMENT )
+            bFirst = ( kind == TOKEN_PUNCT ) && ( *head == '#' );  /* also a directive after a comment */
+
+         i = tokens->uCount++;
+         tokens->pKind[i] = (unsigned char)kind;
+         tokens->pOffset[i] = (unsigned int)(head - tokens->pBase);
+         tokens->pLength[i] = (unsigned int)(p - head);
+         if ( kind == TOKEN_NAME )
+            tokens->pHash[i] = hash;
+         else if ( kind == TOKEN_COMMENT )
+            tokens->pLines[i] = lines;
       }
-      if ( *tail != '/' )
-      {
-         h2incn_print_err(parser, "h2incn_parse_comment", "unterminated comment");
-         return 0;
-      }
-      tail++;
+   }
+}
+
+/* skip the tokens up to the end of line, true if a comment ended lines on the way */
+static int h2incn_skip_line(struct parser_t *parser)
+{
+   struct tokens_t *tokens = &parser->tokens;
+   int bLines;
+
+   bLines = 0;
+   while ( ( tokens->pKind[tokens->uNext] != TOKEN_EOL ) && ( tokens->pKind[tokens->uNext] != TOKEN_END ) )
+   {
+      if ( ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT ) && tokens->pLines[tokens->uNext] )
+         bLines = 1;
+      tokens->uNext++;
+   }
+   return bLines;
+}
+
+/* consume the end of line token, if it is next */
+static void h2incn_next_line(struct parser_t *parser)
+{
+   struct tokens_t *tokens = &parser->tokens;
+
+   if ( tokens->pKind[tokens->uNext] == TOKEN_EOL )
+      tokens->uNext++;
+}
+
+/* directive of the '#' token i, DIRECTIVE_NONE if unknown */
+static int h2incn_directive(struct parser_t *parser, unsigned int i)
+{
+   struct tokens_t *tokens = &parser->tokens;
+   const char *name;
+   unsigned int len;
+   int directive;
+
+   /* the lexer skipped any whitespace between the '#' and the name */
+   i++;
+   if ( tokens->pKind[i] != TOKEN_NAME )
+      return DIRECTIVE_NONE;
+   name = h2incn_token(parser, i);
+   len = tokens->pLength[i];
+   directive = DirectiveTable[DIRECTIVE_HASH(name, len)];
+   if ( strncmp(name, DirectiveNames[directive], len) || DirectiveNames[directive][len] )
+      return DIRECTIVE_NONE;
+   return directive;
+}
+
+/* write the comment from head up to tail as nasm comments if -c, 0 if it is unterminated */
+static int h2incn_copy_comment(struct parser_t *parser, char *head, char *tail)
+{
+   char *start;
+   char *eol;
 
+   if ( *(head+1) == '/' )
+   {
+      /* assert: single-line comment, continued lines were spliced by h2incn_splice() */
       if ( options.fComments )
       {
          fwrite(";", 1, 1, parser->pOutFile);
          fwrite(head, 1, tail-head, parser->pOutFile);
-         fwrite("\n", 1, 1, parser->pOutFile);
       }
-      else
+      return 1;
+   }
+
+   /* assert: multi-line comment */
+   start = head;
+   if ( options.fComments )
+   {
+      while ( ( eol = memchr(head, '\n', tail - head) ) != NULL )
       {
-         while ( ( *tail == ' ' ) || ( *tail == '\t' ) ) tail++;
-         if ( *tail == '\r' )
-            tail++;
-         if ( *tail == '\n' )
-         {
-            tail++;  /* no need to print blank line */
-            parser->iLineNum++;
-            parser->pLine = tail;
-         }
+         eol++;
+         fwrite(";", 1, 1, parser->pOutFile);
+         fwrite(head, 1, eol-head, parser->pOutFile);
+         head = eol;
       }
    }
-   else
+   if ( ( tail - start < 4 ) || ( *(tail-2) != '*' ) || ( *(tail-1) != '/' ) )
+      return 0;
+
+   if ( options.fComments )
+   {
+      fwrite(";", 1, 1, parser->pOutFile);
+      fwrite(head, 1, tail-head, parser->pOutFile);
+      fwrite("\n", 1, 1, parser->pOutFile);
+   }
+   return 1;
+}
+
+static int h2incn_parse_comment(struct parser_t *parser)
+{
+   struct tokens_t *tokens;
+   char *head;
+   char *tail;
+   unsigned int i;
+
+   tokens = &parser->tokens;
+   i = tokens->uNext;
+   head = h2incn_token(parser, i);
+   parser->pNextToken = head;
+   if ( tokens->pKind[i] != TOKEN_COMMENT )
    {
       h2incn_print_err(parser, "h2incn_parse_comment", "comment expected");
       return 0;
    }
+   tail = head + tokens->pLength[i];
+   tokens->uNext++;
 
-   while ( (*tail == ' ') || (*tail == '\t') ) tail++;
-   parser->pNextToken = tail;
+   if ( ( *(head+1) == '/' ) && ( tokens->pKind[tokens->uNext] == TOKEN_EOL ) )
+   {
+      /* the single-line comment takes its end of line */
+      tail++;
+      h2incn_next_line(parser);
+   }
+   if ( !h2incn_copy_comment(parser, head, tail) )
+   {
+      h2incn_print_err_at(parser, head, "h2incn_parse_comment", "unterminated comment");
+      return 0;
+   }
+   if ( ( *(head+1) == '*' ) && !options.fComments )
+      h2incn_next_line(parser);  /* no need to print blank line */
 
    return 1;
 
 }
 
 
+/* consume the rest of a line, emitting it as a comment if bEmit */
+static void h2incn_parse_line(struct parser_t *parser, int bEmit)
+{
+   struct tokens_t *tokens;
+   char *head;
+   char *tail;
+   char *end;
+   char *eol;
+   int bLines;
+
+   tokens = &parser->tokens;
+   head = h2incn_token(parser, tokens->uNext);
+   bLines = h2incn_skip_line(parser);
+   end = h2incn_token(parser, tokens->uNext);
+   tail = end;
+   if ( tokens->pKind[tokens->uNext] == TOKEN_EOL )
+   {
+      tail++;
+      h2incn_next_line(parser);
+   }
+   if ( !bEmit )
+      return;
+
+   fwrite(";", 1, 1, parser->pOutFile);
+   while ( bLines && ( ( eol = memchr(head, '\n', end - head) ) != NULL ) )
+   {
+      /* the lines of a comment in the line go on as comments */
+      eol++;
+      fwrite(head, 1, eol - head, parser->pOutFile);
+      fwrite(";", 1, 1, parser->pOutFile);
+      head = eol;
+   }
+   fwrite(head, 1, tail - head, parser->pOutFile);
+}
+
+
+/* true if the inline comment parsed last also took the end of its line */
+static int h2incn_comment_ended_line(struct parser_t *parser)
+{
+   return ( parser->tokens.pKind[parser->tokens.uNext-1] == TOKEN_EOL );
+}
+
+
 static int h2incn_parse_include(struct parser_t *parser)
 {
+   struct tokens_t *tokens;
    char *head;
    char *tail;
    struct parser_t *incparser;
    struct bst_node_t *node;
+   unsigned int hash;
+   unsigned int id;
    int bSuccess;
 
-   head = parser->pNextToken;
+   tokens = &parser->tokens;
+   tokens->uNext += 2;
+
+   /* find the file name */
+   while ( ( tokens->pKind[tokens->uNext] != TOKEN_STRING ) &&
+           ( tokens->pKind[tokens->uNext] != TOKEN_EOL ) && ( tokens->pKind[tokens->uNext] != TOKEN_END ) )
+      tokens->uNext++;
 
-   while ( ( *head != 0 ) && ( *head != '<' ) && ( *head != '\"' ) && ( *head != '\n' ) ) head++;
    if ( options.fRecurse )
    {
-      if ( ( *head != '<' ) && ( *head != '\"' ) )
+      head = h2incn_token(parser, tokens->uNext);
+      tail = head + tokens->pLength[tokens->uNext];
+      if ( ( tokens->pKind[tokens->uNext] != TOKEN_STRING ) || ( ( *head != '<' ) && ( *head != '\"' ) ) ||
+           ( tail - head < 2 ) || ( ( *(tail-1) != '\"' ) && ( *(tail-1) != '>' ) ) )
       {
          h2incn_print_err(parser, "h2incn_parse_include", "syntax error");
          return 0;
       }
       head++;
-      tail = head;
-      while ( ( *tail != 0 ) && ( *tail != '>' ) && ( *tail != '\"' ) && ( *tail != '\n' ) ) tail++;
-      if ( ( *tail != '\"' ) && ( *tail != '>' ) )
+      tail--;
+      hash = hash_intern_hash(pSymbols, head, (unsigned int)(tail-head));
+      id = hash_intern_hashed(pSymbols, hash, head, (unsigned int)(tail-head));
+      if ( !id )
       {
-         h2incn_print_err(parser, "h2incn_parse_include", "syntax error");
+         h2incn_print_err(parser, "h2incn_parse_include", "insufficient memory");
          return 0;
       }
 
-      /* have we parsed this include header already? */
-      node = hash_map_find(pHeadersMap, head, (unsigned int)(tail-head));
+      /* have we parsed this include header already? the ID is its own hash */
+      node = hash_map_find_hashed(pHeadersMap, id, &id, sizeof(id));
       if ( node )
+      {
+         h2incn_skip_line(parser);
+         h2incn_next_line(parser);
          return 1;
+      }
 
       /* add this header to the HeadersMap */
-      node = binarytree_alloc_node(head, (unsigned int)(tail-head), (void*)0, 0);
-      if ( !node )
+      if ( hash_map_insert_hashed(pHeadersMap, id, &id, sizeof(id), (void*)0, 0) )
       {
          h2incn_print_err(parser, "h2incn_parse_include", "insufficient memory");
          return 0;
       }
-      hash_map_insert(pHeadersMap, head, (unsigned int)(tail-head), (void*)0, 0);
 #ifdef _DEBUG
       /* verify node insertion */
-      if ( !hash_map_find(pHeadersMap, head, (unsigned int)(tail-head)) )
+      if ( !hash_map_find_hashed(pHeadersMap, id, &id, sizeof(id)) )
       {
          h2incn_print_err(parser, "h2incn_parse_include", "hash_map_find error!");
          return 0;
       }
 #endif
-      incparser = malloc(sizeof(struct parser_t));
+      incparser = h2incn_alloc(sizeof(struct parser_t));
       if ( !incparser )
       {
          h2incn_print_err(parser, "h2incn_parse_include", "insufficient memory");
@@ -375,7 +966,7 @@ static int h2incn_parse_include(struct parser_t *parser)
       }
       memset(incparser, 0, sizeof(struct parser_t));
       incparser->pPrevParser = parser;
-      incparser->pFileName = malloc(tail-head+2);
+      incparser->pFileName = h2incn_alloc(tail-head+2);
       if ( !incparser->pFileName )
       {
          h2incn_print_err(parser, "h2incn_parse_include", "insufficient memory");
@@ -387,24 +978,17 @@ static int h2incn_parse_include(struct parser_t *parser)
 
       bSuccess = h2incn_read(incparser);
 
-      free(incparser->pFileName);
-      free(incparser);
+      h2incn_free(incparser->pFileName);
+      h2incn_free(incparser);
 
    }
    else
    {
       bSuccess = 1;
-      tail = head;
    }
 
-   while ( ( *tail != 0 ) && ( *tail != '\n' ) ) tail++;
-   if ( *tail == '\n' )
-   {
-      tail++;  /* no need to print blank line */
-      parser->iLineNum++;
-   }
-
-   parser->pNextToken = tail;
+   h2incn_skip_line(parser);
+   h2incn_next_line(parser);  /* no need to print blank line */
 
    return bSuccess;
 
@@ -425,17 +1009,13 @@ static int h2incn_parse_struct(struct parser_t *parser)
 
    while ( *head != 0 )
    {
-      while ( ( *head == ' ' ) || ( *head == '\t' ) ) head++;
-      if ( *head == '\r' )
-         head++;
+      head = scan_space(head);
       if ( *head == '\n' )
       {
          head++;
-         parser->iLineNum++;
-         parser->pLine = head;
          parser->pNextToken = head;
       }
-      if ( (*head != ' ') && (*head != '\t') && (*head != '\r') && (*head != '\n') )
+      if ( (*head != ' ') && (*head != '\t') && (*head != '\n') )
          break;
    }
 
@@ -447,7 +1027,7 @@ static int h2incn_parse_struct(struct parser_t *parser)
       vhead = head;
       while ( *vhead != 0 )
       {
-         while ( ( *vhead != 0 ) && ( *vhead != '{' ) && ( *vhead != '}' ) ) vhead++;
+         vhead = scan_stop(vhead, StopBrace);
          if ( *vhead == '{' )
          {
             vhead++;
@@ -465,14 +1045,14 @@ static int h2incn_parse_struct(struct parser_t *parser)
             if ( !braces )
             {
                /* assert: we found end of struct */
-               while ( ( *vhead == ' ') || ( *vhead == '\t' ) ) vhead++;
+               vhead = scan_space(vhead);
                if ( *vhead == ';' )
                {
                   h2incn_print_err(parser, "h2incn_parse_struct", "no struct tag defined");
                   return 0;
                }
                vtail = vhead;
-               while ( ( *vtail != 0 ) && (*vtail != ' ') && (*vtail != '\t') && (*vtail != ',') && (*vtail != ';') && (*vtail != '\r') && (*vtail != '\n') ) vtail++;
+               vtail = scan_stop(vtail, StopTagEnd);
                fwrite(vhead, 1, vtail - vhead, parser->pOutFile);
                break;
             }
@@ -489,7 +1069,7 @@ static int h2incn_parse_struct(struct parser_t *parser)
    {
       /* assert: struct tag name available */
       tail = head;
-      while ( ( *tail != 0 ) && ( *tail != ' ' ) && ( *tail != '\t' ) && ( *tail != ',' ) && ( *tail != '(' ) && ( *tail != ';' ) && ( *tail != '{' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
+      tail = scan_stop(tail, StopTag);
       if ( tail > head )
       {
          fwrite(head, 1, tail-head, parser->pOutFile);
@@ -504,21 +1084,14 @@ static int h2incn_parse_struct(struct parser_t *parser)
       head = tail;
       while ( *head != 0 )
       {
-         while ( ( *head == ' ' ) || ( *head == '\t' ) ) head++;
-         if ( *head == '\r' )
-         {
-            fwrite(head, 1, 1, parser->pOutFile);
-            head++;
-         }
+         head = scan_space(head);
          if ( *head == '\n' )
          {
             fwrite(head, 1, 1, parser->pOutFile);
             head++;
-            parser->iLineNum++;
-            parser->pLine = head;
             parser->pNextToken = head;
          }
-         if ( (*head != ' ') && (*head != '\t') && (*head != '\r') && (*head != '\n') )
+         if ( (*head != ' ') && (*head != '\t') && (*head != '\n') )
             break;
       }
    }
@@ -537,13 +1110,11 @@ static int h2incn_parse_typedef(struct parser_t *parser)
    char *vhead;
    char *vtail;
    int errcode;
-#ifdef _DEBUG
-   struct bst_node_t *node;
-#endif
+   unsigned int id;
 
    vhead = parser->pNextToken;
    vhead += 7;
-   while ( ( *vhead == ' ' ) || ( *vhead == '\t' ) ) vhead++;
+   vhead = scan_space(vhead);
 
    if ( !memcmp(vhead, "struct", 6) )
    {
@@ -555,7 +1126,7 @@ static int h2incn_parse_typedef(struct parser_t *parser)
 
    /* key comes after value */
    tail = vhead;
-   while ( (*tail != 0) && (*tail != ';') && (*tail != '\n') ) tail++;
+   tail = scan_stop(tail, StopStatement);
    if ( *tail != ';' )
    {
       h2incn_print_err(parser, "h2incn_parse_typedef", "expected ';'");
@@ -575,7 +1146,7 @@ static int h2incn_parse_typedef(struct parser_t *parser)
    if ( *head == ')' )
    {
       /* assert: function typedef, emit a commented line */
-      while ( (*tail != 0) && (*tail != '\r') && (*tail != '\n') ) tail++;
+      tail = scan_eol(tail);
       fwrite("; ", 1, 2, parser->pOutFile);
       fwrite(vhead, 1, tail-vhead, parser->pOutFile);
       parser->pNextToken = tail;
@@ -639,18 +1210,18 @@ static int h2incn_parse_typedef(struct parser_t *parser)
    }
 #endif
 
-   /* add this define to the DefinesMap */
-   errcode = hash_map_insert(pDefinesMap, head, (unsigned int)(tail - head), vhead, (unsigned int)(vtail - vhead));
+   /* add this define to the symbols */
+   id = hash_intern(pSymbols, head, (unsigned int)(tail - head));
+   errcode = h2incn_add_define(id, vhead, vtail);
 #ifdef _DEBUG
-   node = hash_map_find(pDefinesMap, head, (unsigned int)(tail - head));
-   if ( !node )
+   if ( !errcode && !hash_map_find_hashed(pDefinesMap, id, &id, sizeof(id)) )
    {
       h2incn_print_err(parser, "h2incn_parse_define", "binary tree corrupt");
       return 0;
    }
 #endif
 
-   while ( (*tail != 0) && (*tail != ';') ) tail++;
+   tail = scan_stop(tail, StopSemicolon);
    if (*tail == ';')
       tail++;
 
@@ -663,364 +1234,399 @@ static int h2incn_parse_typedef(struct parser_t *parser)
 
 static int h2incn_parse_define(struct parser_t *parser)
 {
+   struct tokens_t *tokens;
    char *head;
    char *tail;
    char *vhead;
    char *vtail;
    int bSuccess;
    int bComments;
-   struct bst_node_t *node;
+   int bEnded;
+   unsigned int hash;
+   unsigned int id;
+   unsigned int i;
+
+   tokens = &parser->tokens;
+   tokens->uNext += 2;
+
+   /* look past inline comments for the name before writing anything, a define without one is unknown */
+   i = tokens->uNext;
+   while ( tokens->pKind[i] == TOKEN_COMMENT )
+      i++;
+   if ( ( tokens->pKind[i] != TOKEN_NAME ) && ( tokens->pKind[i] != TOKEN_NUMBER ) )
+   {
+      tokens->uNext -= 2;
+      h2incn_parse_line(parser, options.fCode);
+      return 1;
+   }
 
-   head = parser->pNextToken;
    fwrite("%define ", 1, 8, parser->pOutFile);
-   head += 8;
-   while ( *head != 0 )
+   while ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT )
    {
-      while ( ( *head == ' ' ) || ( *head == '\t' ) ) head++;
-      if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
-      {
-         if ( ( *head == '/' ) && ( *(head+1) == '/' ) )
-         {
-            h2incn_print_err(parser, "h2incn_parse_define", "error: define syntax");
-            return 0;
-         }
-         /* parse out inline comment */
-         bComments = options.fComments;
-         options.fComments = 0;
-         parser->pNextToken = head;
-         bSuccess = h2incn_parse_comment(parser);
-         options.fComments = bComments;
-         if ( !bSuccess )
-            return bSuccess;
-         head = parser->pNextToken;
-      }
-      else
-      {
-         break;
-      }
+      /* parse out inline comment, the name follows it on the same line */
+      bComments = options.fComments;
+      options.fComments = 0;
+      bSuccess = h2incn_parse_comment(parser);
+      options.fComments = bComments;
+      if ( !bSuccess )
+         return bSuccess;
    }
 
-   tail = head;
-   while ( ( *tail != 0 ) && ( *tail != ' ' ) && ( *tail != '\t' ) && ( *tail != '(' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
+   /* the name is interned once for both the lookup and the insert */
+   head = h2incn_token(parser, tokens->uNext);
+   tail = head + tokens->pLength[tokens->uNext];
+   hash = h2incn_token_hash(parser, tokens->uNext);
+   tokens->uNext++;
    fwrite(head, 1, tail-head, parser->pOutFile);
+   id = hash_intern_hashed(pSymbols, hash, head, (unsigned int)(tail - head));
 
-   if ( options.fPreprocess )
+   if ( options.fPreprocess && id )
    {
-      node = hash_map_find(pDefinesMap, head, (unsigned int)(tail - head));
-      if ( node )
-         printf("(%s::%d) %s: %s\n", parser->pFileName, parser->iLineNum, "h2incn_parse_define", "warning: redefinition");
+      if ( hash_map_find_hashed(pDefinesMap, id, &id, sizeof(id)) )
+         printf("(%s::%d) %s: %s\n", parser->pFileName, h2incn_line(parser, head), "h2incn_parse_define", "warning: redefinition");
    }
 
-   vhead = tail;
-   while ( *vhead != 0 )
+   bEnded = 0;
+   while ( ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT ) && !tokens->pLines[tokens->uNext] )
    {
-      /* value may, or may not, be defined */
-      while ( ( *vhead == ' ' ) || ( *vhead == '\t' ) ) vhead++;
-      if ( ( *vhead == '/' ) && ( ( *(vhead+1) == '/' ) || ( *(vhead+1) == '*' ) ) )
-      {
-         /* parse out inline comment */
-         bComments = options.fComments;
-         options.fComments = 0;
-         parser->pNextToken = vhead;
-         bSuccess = h2incn_parse_comment(parser);
-         options.fComments = bComments;
-         if ( !bSuccess )
-            return bSuccess;
-         vhead = parser->pNextToken;
-      }
-      else
+      /* value may, or may not, be defined, parse out inline comment */
+      bComments = options.fComments;
+      options.fComments = 0;
+      bSuccess = h2incn_parse_comment(parser);
+      options.fComments = bComments;
+      if ( !bSuccess )
+         return bSuccess;
+      if ( h2incn_comment_ended_line(parser) )
       {
+         /* the comment took the end of line with it, there is no value */
+         bEnded = 1;
          break;
       }
    }
-   vtail = vhead;
 
-   while ( ( *vtail != 0 ) && ( *vtail != '\r' ) && ( *vtail != '\n' ) ) vtail++;
-   while ( *(vtail-1) == '\\' )
+   vhead = tail;
+   vtail = tail;
+   if ( !bEnded )
    {
-      if ( *vtail == '\r' )
-         vtail++;
-      if ( *vtail == '\n' )
-      {
-         vtail++;
-         parser->iLineNum++;
-      }
-      while ( *vtail != 0 )
+      /* the value ends with the line, or before a comment ending lines, which is parsed on its own */
+      vhead = h2incn_token(parser, tokens->uNext);
+      while ( ( tokens->pKind[tokens->uNext] != TOKEN_EOL ) && ( tokens->pKind[tokens->uNext] != TOKEN_END ) )
       {
-         while ( (*vtail != 0) && (*vtail != '/') && ( *vtail != '\r' ) && ( *vtail != '\n' ) ) vtail++;
-         if (( *vtail == '/' ) && ( ( *(vhead+1) == '/' ) || ( *(vhead+1) == '*' ) ) )
-         {
-            /* parse out inline comment */
-            bComments = options.fComments;
-            options.fComments = 0;
-            parser->pNextToken = vtail;
-            bSuccess = h2incn_parse_comment(parser);
-            options.fComments = bComments;
-            if ( !bSuccess )
-               return bSuccess;
-            vtail = parser->pNextToken;
-         }
-         else
-         {
-            vtail++;
-         }
+         if ( ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT ) && tokens->pLines[tokens->uNext] )
+            break;
+         tokens->uNext++;
       }
+      vtail = h2incn_token(parser, tokens->uNext);
+      if ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT )
+         while ( ( vtail > vhead ) && ( scan_class[(unsigned char)*(vtail-1)] & SCAN_SPACE ) ) vtail--;
    }
    if ( vtail > vhead )
    {
-      if ( *vhead != '(' )
+      /* only a '(' right after the name makes a macro function-like */
+      if ( ( *vhead != '(' ) || ( vhead != tail ) )
          fwrite(" ", 1, 1, parser->pOutFile);
       fwrite(vhead, 1, vtail - vhead, parser->pOutFile);
    }
+   if ( bEnded )
+      fwrite("\n", 1, 1, parser->pOutFile);
+   else if ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT )
+   {
+      /* a comment ending lines cannot be part of the value, it is kept as a comment also without -c */
+      fwrite(" ", 1, 1, parser->pOutFile);
+      bComments = options.fComments;
+      options.fComments = 1;
+      bSuccess = h2incn_parse_comment(parser);
+      options.fComments = bComments;
+      if ( !bSuccess )
+         return bSuccess;
+      h2incn_next_line(parser);  /* the comment wrote the end of its line */
+   }
 
-   /* add this define to the DefinesMap */
-   bSuccess = hash_map_insert(pDefinesMap, head, (unsigned int)(tail - head), vhead, (unsigned int)(vtail - vhead));
+   /* add this define to the symbols */
+   bSuccess = h2incn_add_define(id, vhead, vtail);
 #ifdef _DEBUG
-   node = hash_map_find(pDefinesMap, head, (unsigned int)(tail - head));
-   if ( !node )
+   if ( !bSuccess && !hash_map_find_hashed(pDefinesMap, id, &id, sizeof(id)) )
    {
       h2incn_print_err(parser, "h2incn_parse_define", "binary tree corrupt");
       return 0;
    }
 #endif
 
-   parser->pNextToken = vtail;
-
    return (bSuccess == 0 ? 1 : 0);
 
 }
 
 
-static int h2incn_parse_if(struct parser_t *parser)
+/* write the expression of a conditional directive, up to the end of its line */
+static int h2incn_parse_expr(struct parser_t *parser)
 {
+   struct tokens_t *tokens;
    char *head;
    char *tail;
    int bSuccess;
 
-   head = parser->pNextToken;
-   fwrite("%if ", 1, 4, parser->pOutFile);
-   head += 4;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   while ( ( *head != '\r' ) && ( *head != '\n' ) )
+   tokens = &parser->tokens;
+   head = h2incn_token(parser, tokens->uNext);
+   while ( ( tokens->pKind[tokens->uNext] != TOKEN_EOL ) && ( tokens->pKind[tokens->uNext] != TOKEN_END ) )
    {
-      tail = head;
-      while ( ( *tail != 0 ) && ( *tail != '/' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
+      if ( tokens->pKind[tokens->uNext] != TOKEN_COMMENT )
+      {
+         tokens->uNext++;
+         continue;
+      }
+
+      tail = h2incn_token(parser, tokens->uNext);
       if ( tail > head )
          fwrite(head, 1, tail - head, parser->pOutFile);
 
-      head = tail;
-      if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
+      /* parse inline comment */
+      if ( options.fComments )
+         fwrite(" ", 1, 1, parser->pOutFile);
+      bSuccess = h2incn_parse_comment(parser);
+      if ( !bSuccess )
+         return bSuccess;
+      if ( h2incn_comment_ended_line(parser) )
       {
-         /* parse inline comment */
-         parser->pNextToken = head;
-         if ( options.fComments )
-            fwrite(" ", 1, 1, parser->pOutFile);
-         bSuccess = h2incn_parse_comment(parser);
-         if ( !bSuccess )
-            return bSuccess;
-         head = parser->pNextToken;
+         /* the comment took the end of line with it, so the directive ends here */
+         if ( !options.fComments )
+            fwrite("\n", 1, 1, parser->pOutFile);
+         return 1;
       }
+      head = h2incn_token(parser, tokens->uNext);
    }
 
-   parser->pNextToken = head;
+   tail = h2incn_token(parser, tokens->uNext);
+   if ( tail > head )
+      fwrite(head, 1, tail - head, parser->pOutFile);
 
    return 1;
 }
 
-static int h2incn_parse_ifdef(struct parser_t *parser)
+static int h2incn_parse_if(struct parser_t *parser)
 {
-   char *head;
-   char *tail;
-   int bSuccess;
+   fwrite("%if ", 1, 4, parser->pOutFile);
+   parser->tokens.uNext += 2;
+   return h2incn_parse_expr(parser);
+}
 
-   head = parser->pNextToken;
+static int h2incn_parse_ifdef(struct parser_t *parser)
+{
    fwrite("%ifdef ", 1, 7, parser->pOutFile);
-   head += 7;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   while ( ( *head != '\r' ) && ( *head != '\n' ) )
-   {
-      tail = head;
-      while ( ( *tail != 0 ) && ( *tail != '/' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-      if ( tail > head )
-         fwrite(head, 1, tail - head, parser->pOutFile);
-
-      head = tail;
-      if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
-      {
-         /* parse inline comment */
-         parser->pNextToken = head;
-         if ( options.fComments )
-            fwrite(" ", 1, 1, parser->pOutFile);
-         bSuccess = h2incn_parse_comment(parser);
-         if ( !bSuccess )
-            return bSuccess;
-         head = parser->pNextToken;
-      }
-   }
-
-   parser->pNextToken = head;
-
-   return 1;
+   parser->tokens.uNext += 2;
+   return h2incn_parse_expr(parser);
 }
 
 static int h2incn_parse_ifndef(struct parser_t *parser)
 {
-   char *head;
-   char *tail;
-   int bSuccess;
-
-   head = parser->pNextToken;
    fwrite("%ifndef ", 1, 8, parser->pOutFile);
-   head += 8;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   while ( ( *head != '\r' ) && ( *head != '\n' ) )
-   {
-      tail = head;
-      while ( ( *tail != 0 ) && ( *tail != '/' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-      if ( tail > head )
-         fwrite(head, 1, tail - head, parser->pOutFile);
-
-      head = tail;
-      if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
-      {
-         /* parse inline comment */
-         parser->pNextToken = head;
-         if ( options.fComments )
-            fwrite(" ", 1, 1, parser->pOutFile);
-         bSuccess = h2incn_parse_comment(parser);
-         if ( !bSuccess )
-            return bSuccess;
-         head = parser->pNextToken;
-      }
-   }
-
-   parser->pNextToken = head;
-
-   return 1;
+   parser->tokens.uNext += 2;
+   return h2incn_parse_expr(parser);
 }
 
 static int h2incn_parse_elif(struct parser_t *parser)
 {
-   char *head;
-   char *tail;
-   int bSuccess;
-
-   head = parser->pNextToken;
    fwrite("%elif ", 1, 6, parser->pOutFile);
-   head += 5;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   while ( ( *head != '\r' ) && ( *head != '\n' ) )
-   {
-      tail = head;
-      while ( ( *tail != 0 ) && ( *tail != '/' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-      if ( tail > head )
-         fwrite(head, 1, tail - head, parser->pOutFile);
-
-      head = tail;
-      if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
-      {
-         /* parse inline comment */
-         parser->pNextToken = head;
-         if ( options.fComments )
-            fwrite(" ", 1, 1, parser->pOutFile);
-         bSuccess = h2incn_parse_comment(parser);
-         if ( !bSuccess )
-            return bSuccess;
-         head = parser->pNextToken;
-      }
-   }
+   parser->tokens.uNext += 2;
+   return h2incn_parse_expr(parser);
+}
 
-   parser->pNextToken = head;
 
-   return 1;
+static int h2incn_parse_elifdef(struct parser_t *parser)
+{
+   fwrite("%elifdef ", 1, 9, parser->pOutFile);
+   parser->tokens.uNext += 2;
+   return h2incn_parse_expr(parser);
 }
 
+static int h2incn_parse_elifndef(struct parser_t *parser)
+{
+   fwrite("%elifndef ", 1, 10, parser->pOutFile);
+   parser->tokens.uNext += 2;
+   return h2incn_parse_expr(parser);
+}
 
-static int h2incn_parse_else(struct parser_t *parser)
+/* parse an inline comment ending a directive, or skip the rest of its line */
+static int h2incn_parse_trailer(struct parser_t *parser)
 {
-   char *head;
    int bSuccess;
 
-   head = parser->pNextToken;
-   fwrite("%else", 1, 5, parser->pOutFile);
-   head += 5;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
+   if ( parser->tokens.pKind[parser->tokens.uNext] == TOKEN_COMMENT )
    {
       /* parse inline comment */
-      parser->pNextToken = head;
       if ( options.fComments )
          fwrite(" ", 1, 1, parser->pOutFile);
       bSuccess = h2incn_parse_comment(parser);
       if ( !bSuccess )
          return bSuccess;
+      if ( !options.fComments && h2incn_comment_ended_line(parser) )
+         fwrite("\n", 1, 1, parser->pOutFile);
    }
    else
    {
-      while ( ( *head != 0 ) && ( *head != '\r' ) && ( *head != '\n' ) ) head++;
-      parser->pNextToken = head;
+      h2incn_skip_line(parser);
    }
 
    return 1;
 }
 
+static int h2incn_parse_else(struct parser_t *parser)
+{
+   fwrite("%else", 1, 5, parser->pOutFile);
+   parser->tokens.uNext += 2;
+   return h2incn_parse_trailer(parser);
+}
+
 
 static int h2incn_parse_endif(struct parser_t *parser)
 {
+   fwrite("%endif", 1, 6, parser->pOutFile);
+   parser->tokens.uNext += 2;
+   return h2incn_parse_trailer(parser);
+}
+
+
+/* write an #error or #warning as a NASM diagnostic, quoting its message */
+static int h2incn_parse_message(struct parser_t *parser, const char *directive)
+{
+   struct tokens_t *tokens;
    char *head;
-   int bSuccess;
+   char *tail;
+   unsigned int i;
 
-   head = parser->pNextToken;
-   fwrite("%endif", 1, 6, parser->pOutFile);
-   head += 6;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
-   {
-      /* parse inline comment */
-      parser->pNextToken = head;
-      if ( options.fComments )
-         fwrite(" ", 1, 1, parser->pOutFile);
-      bSuccess = h2incn_parse_comment(parser);
-      if ( !bSuccess )
-         return bSuccess;
-   }
-   else
+   tokens = &parser->tokens;
+   fwrite(directive, 1, strlen(directive), parser->pOutFile);
+   tokens->uNext += 2;
+
+   /* the message runs up to a comment or the eol */
+   i = tokens->uNext;
+   head = h2incn_token(parser, i);
+   while ( ( tokens->pKind[i] != TOKEN_COMMENT ) && ( tokens->pKind[i] != TOKEN_EOL ) && ( tokens->pKind[i] != TOKEN_END ) )
+      i++;
+   tail = h2incn_token(parser, i);
+   while ( ( tail > head ) && ( scan_class[(unsigned char)*(tail-1)] & SCAN_SPACE ) ) tail--;
+
+   if ( tail > head )
    {
-      while ( ( *head != 0 ) && ( *head != '\r' ) && ( *head != '\n' ) ) head++;
-      parser->pNextToken = head;
+      /* a message that is one string is quoted already */
+      fwrite(" ", 1, 1, parser->pOutFile);
+      if ( ( i == tokens->uNext + 1 ) && ( tokens->pKind[tokens->uNext] == TOKEN_STRING ) && ( *head == '\"' ) )
+         fwrite(head, 1, tail - head, parser->pOutFile);
+      else if ( !memchr(head, '\"', tail - head) )
+      {
+         fwrite("\"", 1, 1, parser->pOutFile);
+         fwrite(head, 1, tail - head, parser->pOutFile);
+         fwrite("\"", 1, 1, parser->pOutFile);
+      }
+      else if ( !memchr(head, '\'', tail - head) )
+      {
+         fwrite("'", 1, 1, parser->pOutFile);
+         fwrite(head, 1, tail - head, parser->pOutFile);
+         fwrite("'", 1, 1, parser->pOutFile);
+      }
+      else
+         fwrite(head, 1, tail - head, parser->pOutFile);
    }
+   tokens->uNext = i;
 
-   return 1;
+   return h2incn_parse_trailer(parser);
 }
 
 
 static int h2incn_parse_undef(struct parser_t *parser)
 {
+   struct tokens_t *tokens;
    char *head;
-   char *tail;
+   unsigned int id;
 
-   head = parser->pNextToken;
+   tokens = &parser->tokens;
    fwrite("%undef ", 1, 7, parser->pOutFile);
-   head += 7;
-   while ( ( *head != 0 ) && ( ( *head == ' ' ) || ( *head == '\t' ) ) ) head++;
-   tail = head;
-   while ( ( *tail != 0 ) && ( *tail != ' ' ) && ( *tail != '\t' ) && ( *tail != '/' ) && ( *tail != '(' ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-
-   fwrite(head, 1, tail-head, parser->pOutFile);
+   tokens->uNext += 2;
 
-   /* remove this define from the DefinesMap */
-   hash_map_delete(pDefinesMap, head, (unsigned int)(tail - head));
+   if ( ( tokens->pKind[tokens->uNext] == TOKEN_NAME ) || ( tokens->pKind[tokens->uNext] == TOKEN_NUMBER ) )
+   {
+      head = h2incn_token(parser, tokens->uNext);
+      fwrite(head, 1, tokens->pLength[tokens->uNext], parser->pOutFile);
+
+      /* remove this define from the symbols, a name never seen is not defined */
+      id = hash_intern_find_hashed(pSymbols, h2incn_token_hash(parser, tokens->uNext), head, tokens->pLength[tokens->uNext]);
+      if ( id )
+         hash_map_delete_hashed(pDefinesMap, id, &id, sizeof(id));
+      tokens->uNext++;
+   }
 
-   /* scan to eol or next token */
-   while ( ( *tail != 0 ) && ( ( *tail == ' ' ) || ( *tail == '\t' ) ) ) tail++;
-   if ( ( *tail != '\r' ) && ( *tail != '\n' ) )
+   /* the rest of the line is parsed on its own */
+   if ( tokens->pKind[tokens->uNext] != TOKEN_EOL )
       fwrite(" ", 1, 1, parser->pOutFile);
-   parser->pNextToken = tail;
 
    return 1;
 
 }
 
+/* copy the lines of code and comments from p, emitting them as comments if
+   -e and -c, up to a directive, which is returned, NULL if error */
+static char* h2incn_parse_code(struct parser_t *parser, char *p)
+{
+   char *head;
+   char *tail;
+   unsigned int lines;
+
+   for (;;)
+   {
+      while ( scan_class[(unsigned char)*p] & SCAN_SPACE ) p++;
+      head = p;
+      if ( *p == '\n' )
+      {
+         /* blank line */
+         fwrite(head, 1, 1, parser->pOutFile);
+         p++;
+         continue;
+      }
+      if ( ( *p == 0 ) || ( *p == '#' ) )
+         return p;
+
+      if ( ( *p == '/' ) && ( ( *(p+1) == '/' ) || ( *(p+1) == '*' ) ) )
+      {
+         /* the comment is parsed as by h2incn_parse_comment(), what follows it on its line goes on */
+         p = h2incn_lex_comment(p, &lines);
+         if ( ( *(head+1) == '/' ) && ( *p == '\n' ) )
+            p++;
+         if ( !h2incn_copy_comment(parser, head, p) )
+         {
+            h2incn_print_err_at(parser, head, "h2incn_parse_comment", "unterminated comment");
+            return NULL;
+         }
+         if ( ( *(head+1) == '*' ) && !options.fComments )
+         {
+            /* no need to print blank line */
+            tail = p;
+            while ( scan_class[(unsigned char)*tail] & SCAN_SPACE ) tail++;
+            if ( *tail == '\n' )
+               p = tail + 1;
+         }
+         continue;
+      }
+
+      if ( SUPPORT_TYPEDEFS && !memcmp(head, "typedef ", 8) )
+      {
+         /* the typedef is parsed from the text */
+         parser->pNextToken = head;
+         if ( !h2incn_parse_typedef(parser) )
+            return NULL;
+         p = parser->pNextToken;
+         continue;
+      }
+
+      p = scan_eol(p);
+      if ( *p == '\n' )
+         p++;
+      if ( options.fCode )
+      {
+         fwrite(";", 1, 1, parser->pOutFile);
+         fwrite(head, 1, p - head, parser->pOutFile);
+      }
+   }
+}
+
 /****************************************************
 
    h2incn_parse
@@ -1036,159 +1642,500 @@ static int h2incn_parse_undef(struct parser_t *parser)
 */
 static int h2incn_parse(struct parser_t *parser)
 {
+   struct tokens_t *tokens;
    char *head;
-   char *tail;
-   char *outbuf;
    int bSuccess;
 
-   outbuf = malloc(H2INCN_BUFSIZE + 2);
-   if ( !outbuf )
+   tokens = &parser->tokens;
+   memset(tokens, 0, sizeof(struct tokens_t));
+   if ( !h2incn_tokens_alloc(tokens, H2INCN_TOKENS + 0x100) )
    {
       printf("h2incn_parse: insufficient memory\n");
       return 0;
    }
 
-   if ( options.fVerbose )
-      printf("processing file %s\n", parser->pFileName);
-
-   bSuccess = 1;
+   bSuccess = h2incn_lex(parser, parser->pNextToken);
 
-   while ( *parser->pNextToken != 0 )
+   while ( bSuccess )
    {
-      /* skip leading space */
-      head = parser->pNextToken;
-      while ( ( *head == ' ' ) || ( *head == '\t' ) ) head++;
+      if ( tokens->uNext == tokens->uCount )
+      {
+         /* assert: the batch ended with a line or before a line of code, copy the code and lex the lines after it */
+         head = h2incn_parse_code(parser, tokens->pEnd);
+         bSuccess = ( head != NULL ) && h2incn_lex(parser, head);
+         continue;
+      }
 
-      /* check for eol, account for differences in Windows/Linux CR/NL */
-      tail = head ;
-      if ( *tail == '\r' )
-         tail++;
-      if ( *tail == '\n' )
+      /* check for eol, line ends were normalized by h2incn_splice() */
+      head = h2incn_token(parser, tokens->uNext);
+      if ( tokens->pKind[tokens->uNext] == TOKEN_EOL )
       {
-         tail++;
-         fwrite(head, 1, tail - head, parser->pOutFile);
-         parser->iLineNum++;
-         parser->pNextToken = tail;
-         parser->pLine = tail;
+         fwrite(head, 1, 1, parser->pOutFile);
+         h2incn_next_line(parser);
          continue;
       }
 
-      /* assert: tail is positioned at a token or eof */
-      parser->pNextToken = tail;
-      head = tail;
-      if ( *head == 0 )
+      /* assert: head is positioned at a token or eof */
+      parser->pNextToken = head;
+      if ( tokens->pKind[tokens->uNext] == TOKEN_END )
          break;
 
-      memset(outbuf, 0, H2INCN_BUFSIZE + 2);
-
       if ( *head == '#' )
       {
-         if ( !memcmp(head, "#include ", 9) )
+         switch ( h2incn_directive(parser, tokens->uNext) )
          {
-            if ( !h2incn_parse_include(parser) )
-               return 0;
-         }
-         else if ( !memcmp(head, "#define ", 8) )
-         {
-            if ( !h2incn_parse_define(parser) )
-               return 0;
-         }
-         else if ( !memcmp(head, "#undef ", 7) )
-         {
-            if ( !h2incn_parse_undef(parser) )
-               return 0;
+            case DIRECTIVE_INCLUDE:
+               bSuccess = h2incn_parse_include(parser);
+               break;
+            case DIRECTIVE_DEFINE:
+               bSuccess = h2incn_parse_define(parser);
+               break;
+            case DIRECTIVE_UNDEF:
+               bSuccess = h2incn_parse_undef(parser);
+               break;
+            case DIRECTIVE_IF:
+               bSuccess = h2incn_parse_if(parser);
+               break;
+            case DIRECTIVE_IFDEF:
+               bSuccess = h2incn_parse_ifdef(parser);
+               break;
+            case DIRECTIVE_IFNDEF:
+               bSuccess = h2incn_parse_ifndef(parser);
+               break;
+            case DIRECTIVE_ELIF:
+               bSuccess = h2incn_parse_elif(parser);
+               break;
+            case DIRECTIVE_ELIFDEF:
+               bSuccess = h2incn_parse_elifdef(parser);
+               break;
+            case DIRECTIVE_ELIFNDEF:
+               bSuccess = h2incn_parse_elifndef(parser);
+               break;
+            case DIRECTIVE_ELSE:
+               bSuccess = h2incn_parse_else(parser);
+               break;
+            case DIRECTIVE_ENDIF:
+               bSuccess = h2incn_parse_endif(parser);
+               break;
+            case DIRECTIVE_ERROR:
+               bSuccess = h2incn_parse_message(parser, "%error");
+               break;
+            case DIRECTIVE_WARNING:
+               bSuccess = h2incn_parse_message(parser, "%warning");
+               break;
+            case DIRECTIVE_PRAGMA:
+            case DIRECTIVE_LINE:
+               /* assert: for the C compiler only, emit as comment like code */
+               h2incn_parse_line(parser, options.fCode);
+               break;
+            default:
+               /* assert: emit unknown preprocessor directive as comment */
+               h2incn_parse_line(parser, options.fCode);
+               break;
          }
-         else if ( !memcmp(head, "#if ", 4) )
-         {
-            if ( !h2incn_parse_if(parser) )
-               return 0;
-         }
-         else if ( !memcmp(head, "#ifdef ", 7) )
-         {
-            if ( !h2incn_parse_ifdef(parser) )
-               return 0;
-         }
-         else if ( !memcmp(head, "#ifndef ", 8) )
-         {
-            if ( !h2incn_parse_ifndef(parser) )
-               return 0;
-         }
-         else if ( !memcmp(head, "#elif", 5) )
+      }
+      else if ( tokens->pKind[tokens->uNext] == TOKEN_COMMENT )
+      {
+         bSuccess = h2incn_parse_comment(parser);
+      }
+      else
+      {
+         /* emit the rest of a directive line left by its handler as comment, like code */
+         h2incn_parse_line(parser, options.fCode);
+      }
+   }
+
+   h2incn_tokens_free(tokens);
+
+   return bSuccess;
+}
+
+
+#ifdef H2INCN_MMAP
+/* map a regular file read-only with a nul byte after its data, 0 if it cannot be mapped */
+static int h2incn_map_file(struct parser_t *parser, FILE *pInFile)
+{
+   struct stat st;
+   size_t page;
+   size_t len;
+   char *base;
+
+   if ( fstat(fileno(pInFile), &st) || !S_ISREG(st.st_mode) )
+      return 0;
+   if ( ( st.st_size < 1 ) || ( (unsigned long long)st.st_size > (size_t)-1 / 2 ) )
+      return 0;
+
+   /* reserve zeroed pages for the file and at least one more byte, then
+      map the file over them, so the byte after the file is always nul:
+      either the zeroed tail of its last page or the next reserved page */
+   page = (size_t)sysconf(_SC_PAGESIZE);
+   len = ( (size_t)st.st_size + page ) & ~( page - 1 );
+   base = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if ( base == MAP_FAILED )
+      return 0;
+   if ( mmap(base, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(pInFile), 0) == MAP_FAILED )
+   {
+      munmap(base, len);
+      return 0;
+   }
+#ifdef MADV_SEQUENTIAL
+   madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+   parser->pFileBuffer = base;
+   parser->uFileSize = (size_t)st.st_size;
+   parser->uMapSize = len;
+   return 1;
+}
+#endif
+
+/* read a file into an allocated nul terminated buffer, also works for pipes, 0 if error */
+static int h2incn_load_file(struct parser_t *parser, FILE *pInFile)
+{
+   char *buffer;
+   char *grown;
+   size_t size;
+   size_t avail;
+   long hint;
+
+   /* a seekable file is read in one go, others grow the buffer as needed */
+   avail = H2INCN_BUFSIZE;
+   if ( !fseek(pInFile, 0, SEEK_END) )
+   {
+      hint = ftell(pInFile);
+      if ( ( hint > 0 ) && ( (unsigned long)hint < (size_t)-1 / 4 ) )
+         avail = (size_t)hint + 1;
+      fseek(pInFile, 0, SEEK_SET);
+   }
+
+   size = 0;
+   buffer = h2incn_alloc(avail + 2);
+   while ( buffer )
+   {
+      size += fread(buffer + size, 1, avail - size, pInFile);
+      if ( size < avail )
+         break;  /* end of file or error */
+
+      if ( avail > (size_t)-1 / 4 )
+      {
+         h2incn_free(buffer);
+         printf("file too large: %s\n", parser->pFileName);
+         return 0;
+      }
+      grown = h2incn_alloc(avail * 2 + 2);
+      if ( grown )
+         memcpy(grown, buffer, size);
+      h2incn_free(buffer);
+      buffer = grown;
+      avail *= 2;
+   }
+
+   if ( !buffer )
+   {
+      printf("insufficient memory\n");
+      return 0;
+   }
+   if ( ferror(pInFile) )
+   {
+      h2incn_free(buffer);
+      printf("error reading file: %s\n", parser->pFileName);
+      return 0;
+   }
+
+   buffer[size] = 0;
+   parser->pFileBuffer = buffer;
+   parser->uFileSize = size;
+   parser->uMapSize = 0;
+   return 1;
+}
+
+/****************************************************
+
+   h2incn_splice
+
+   Purpose
+     To prepare text for the parsers
+
+   Params
+      parser - ptr to struct used for parsing
+      buffer - nul terminated text to prepare, parser->pFileBuffer
+
+   Returns
+      0 if error, otherwise 1
+
+   Notes
+      Line ends "\r\n" and a lone '\r' become '\n', and a line ending
+      with a backslash is joined with the next one, as C does before
+      preprocessing. The parsers then only see complete lines ending
+      with '\n'. The offset of every join is recorded in pSplices, so
+      h2incn_line() still reports lines of the file as it was read.
+      The text is only written from the first change on, in place. A
+      mapped file is read-only, so from its first change on the text is
+      written to an allocated buffer instead, which then replaces the
+      mapping. A file without '\r' or continued lines, the common case,
+      is not copied and stays shared with the page cache.
+*/
+static int h2incn_splice(struct parser_t *parser, char *buffer)
+{
+   char *out;
+   char *src;
+   char *dst;
+   char *next;
+   size_t *grown;
+
+   /* the lines are counted again in the text joined */
+   parser->uSplices = 0;
+   parser->uCounted = 0;
+   parser->iCountedLines = 0;
+   out = buffer;
+   src = buffer;
+   dst = buffer;
+   for (;;)
+   {
+      next = scan_splice(src);
+      if ( dst != src )
+         memmove(dst, src, next - src);
+      dst += next - src;
+      src = next;
+      if ( *src == 0 )
+         break;
+
+#ifdef H2INCN_MMAP
+      if ( ( out == buffer ) && parser->uMapSize &&
+           ( ( *src == '\r' ) || ( *(src+1) == '\n' ) || ( *(src+1) == '\r' ) ) )
+      {
+         /* assert: first change, the text before it is unchanged */
+         out = h2incn_alloc(parser->uFileSize + 2);
+         if ( !out )
          {
-            if ( !h2incn_parse_elif(parser) )
-               return 0;
+            printf("insufficient memory\n");
+            return 0;
          }
-         else if ( !memcmp(head, "#else", 5) )
+         memcpy(out, buffer, src - buffer);
+         dst = out + ( src - buffer );
+      }
+#endif
+
+      if ( *src == '\r' )
+      {
+         src++;
+         if ( *src != '\n' )
+            *dst++ = '\n';
+         continue;
+      }
+
+      /* assert: backslash, which joins lines if it ends one */
+      if ( ( *(src+1) != '\n' ) && ( *(src+1) != '\r' ) )
+      {
+         if ( dst != src )
+            *dst = *src;
+         dst++;
+         src++;
+         continue;
+      }
+      src += ( ( *(src+1) == '\r' ) && ( *(src+2) == '\n' ) ) ? 3 : 2;
+
+      if ( parser->uSplices == parser->uSplicesMax )
+      {
+         grown = h2incn_alloc(( parser->uSplicesMax * 2 + 64 ) * sizeof(size_t));
+         if ( !grown )
          {
-            if ( !h2incn_parse_else(parser) )
-               return 0;
+            if ( out != buffer )
+               h2incn_free(out);
+            printf("insufficient memory\n");
+            return 0;
          }
-         else if ( !memcmp(head, "#endif", 6) )
+         if ( parser->pSplices )
          {
-            if ( !h2incn_parse_endif(parser) )
-               return 0;
+            memcpy(grown, parser->pSplices, parser->uSplices * sizeof(size_t));
+            h2incn_free(parser->pSplices);
          }
-         else
+         parser->pSplices = grown;
+         parser->uSplicesMax = parser->uSplicesMax * 2 + 64;
+      }
+      parser->pSplices[parser->uSplices++] = (size_t)(dst - out);
+   }
+
+   if ( dst != src )
+      *dst = 0;
+#ifdef H2INCN_MMAP
+   if ( out != buffer )
+   {
+      munmap(parser->pFileBuffer, parser->uMapSize);
+      parser->pFileBuffer = out;
+      parser->uMapSize = 0;
+   }
+#endif
+   return 1;
+}
+
+/* offset after the last line of buffer that ends outside of a comment and is not continued, 0 if none */
+static size_t h2incn_stream_cut(char *buffer, size_t size)
+{
+   size_t cut;
+   size_t i;
+   size_t eol;
+   int bComment;
+
+   cut = 0;
+   bComment = 0;
+   for ( i = 0; i < size; i++ )
+   {
+      if ( bComment )
+      {
+         if ( ( buffer[i] == '*' ) && ( i + 1 < size ) && ( buffer[i+1] == '/' ) )
          {
-            tail = head;
-            while ( ( *tail != 0 ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-            if ( *tail == '\r')
-               tail++;
-            if ( *tail == '\n')
-            {
-               tail++;
-               parser->iLineNum++;
-               parser->pLine = tail;
-            }
-            if ( options.fCode )
-            {
-               /* assert: emit unknown preprocessor directive as comment */
-               fwrite(";", 1, 1, parser->pOutFile);
-               fwrite(head, 1, tail - head, parser->pOutFile);
-            }
-            parser->pNextToken = tail;
+            bComment = 0;
+            i++;
          }
       }
-      else if ( ( *head == '/' ) && ( ( *(head+1) == '/' ) || ( *(head+1) == '*' ) ) )
+      else if ( ( buffer[i] == '/' ) && ( i + 1 < size ) && ( buffer[i+1] == '*' ) )
       {
-         if ( !h2incn_parse_comment(parser) )
-            return 0;
+         bComment = 1;
+         i++;
       }
-      else
+      else if ( ( buffer[i] == '/' ) && ( i + 1 < size ) && ( buffer[i+1] == '/' ) )
+      {
+         /* a single-line comment cannot open a multi-line one */
+         while ( ( i + 1 < size ) && ( buffer[i+1] != '\n' ) ) i++;
+      }
+      else if ( buffer[i] == '\n' )
+      {
+         eol = i;
+         if ( eol && ( buffer[eol-1] == '\r' ) )
+            eol--;
+         if ( !eol || ( buffer[eol-1] != '\\' ) )
+            cut = i + 1;
+      }
+   }
+   return cut;
+}
+
+/****************************************************
+
+   h2incn_stream_file
+
+   Purpose
+     To parse a file a chunk at a time
+
+   Params
+      parser - ptr to struct used for parsing
+      pInFile - file to read, may be a pipe
+
+   Returns
+      0 if error, otherwise 1
+
+   Notes
+      Each chunk of options.uChunkSize bytes is parsed up to the end
+      of its last complete line, see h2incn_stream_cut(). The rest,
+      e.g. a partial line or an open comment, is carried over to the
+      front of the next chunk. A construct longer than the buffer
+      grows it, so memory is bounded by the chunk size or the longest
+      construct, not by the size of the file.
+*/
+static int h2incn_stream_file(struct parser_t *parser, FILE *pInFile)
+{
+   char *buffer;
+   char *grown;
+   size_t size;
+   size_t avail;
+   size_t cut;
+   char saved;
+   int bEof;
+   int bSuccess;
+
+   avail = options.uChunkSize;
+   buffer = h2incn_alloc(avail + 2);
+   if ( !buffer )
+   {
+      printf("insufficient memory\n");
+      return 0;
+   }
+
+   size = 0;
+   parser->uFileSize = 0;
+   bSuccess = 1;
+   do
+   {
+      cut = fread(buffer + size, 1, avail - size, pInFile);
+      parser->uFileSize += cut;
+      size += cut;
+      bEof = ( size < avail );
+      if ( ferror(pInFile) )
+      {
+         printf("error reading file: %s\n", parser->pFileName);
+         bSuccess = 0;
+         break;
+      }
+      if ( !parser->uFileSize )
+      {
+         printf("no data in file: %s\n", parser->pFileName);
+         bSuccess = 0;
+         break;
+      }
+      if ( !size )
+         break;
+
+      cut = bEof ? size : h2incn_stream_cut(buffer, size);
+      if ( !cut )
       {
-         if ( SUPPORT_TYPEDEFS && !memcmp(head, "typedef ", 8) )
+         /* no complete line in the buffer, make room for more */
+         if ( avail > (size_t)-1 / 4 )
          {
-            if ( !h2incn_parse_typedef(parser) )
-               return 0;
+            printf("line too long in file: %s\n", parser->pFileName);
+            bSuccess = 0;
+            break;
          }
-         else
+         grown = h2incn_alloc(avail * 2 + 2);
+         if ( !grown )
          {
-            tail = head;
-            while ( ( *tail != 0 ) && ( *tail != '\r' ) && ( *tail != '\n' ) ) tail++;
-            if ( *tail == '\r')
-               tail++;
-            if ( *tail == '\n')
-            {
-               tail++;
-               parser->iLineNum++;
-               parser->pLine = tail;
-            }
-            if ( options.fCode )
-            {
-               /* emit code as comment */
-               fwrite(";", 1, 1, parser->pOutFile);
-               fwrite(head, 1, tail-head, parser->pOutFile);
-            }
-            parser->pNextToken = tail;
+            printf("insufficient memory\n");
+            bSuccess = 0;
+            break;
          }
+         memcpy(grown, buffer, size);
+         h2incn_free(buffer);
+         buffer = grown;
+         avail *= 2;
+         continue;
       }
-   }
-
-   free(outbuf);
 
+      saved = buffer[cut];
+      buffer[cut] = 0;
+      parser->pFileBuffer = buffer;
+      parser->pNextToken = buffer;
+      bSuccess = h2incn_splice(parser, buffer);
+      if ( bSuccess )
+         bSuccess = h2incn_parse(parser);
+      parser->iChunkLines += h2incn_count_lines(parser, buffer + strlen(buffer));
+      parser->iSplicedLines += (int)parser->uSplices;
+      parser->uSplices = 0;
+      buffer[cut] = saved;
+
+      memmove(buffer, buffer + cut, size - cut);
+      size -= cut;
+   } while ( bSuccess && !bEof );
+
+   h2incn_free(buffer);
+   if ( parser->pSplices )
+      h2incn_free(parser->pSplices);
    return bSuccess;
 }
 
+/* release the buffer of h2incn_map_file() or h2incn_load_file() */
+static void h2incn_unload_file(struct parser_t *parser)
+{
+   if ( parser->pSplices )
+      h2incn_free(parser->pSplices);
+#ifdef H2INCN_MMAP
+   if ( parser->uMapSize )
+   {
+      munmap(parser->pFileBuffer, parser->uMapSize);
+      return;
+   }
+#endif
+   h2incn_free(parser->pFileBuffer);
+}
 
 /****************************************************
 
@@ -1202,6 +2149,14 @@ static int h2incn_parse(struct parser_t *parser)
 
    Returns
       0 if error, otherwise 1
+
+   Notes
+      Regular files are mapped read-only where mmap is available,
+      so no copy of them is made and their pages are shared with
+      the page cache, unless h2incn_splice() has to change them.
+      Other files, e.g. pipes, are read into memory.
+      With options.uChunkSize set, files are streamed instead, see
+      h2incn_stream_file(). File name '-' is stdin.
 */
 int h2incn_read(struct parser_t *parser)
 {
@@ -1215,7 +2170,10 @@ int h2incn_read(struct parser_t *parser)
    }
 
    /* open input file */
-   pInFile = fopen(parser->pFileName, "r");
+   if ( !strcmp(parser->pFileName, "-") )
+      pInFile = stdin;
+   else
+      pInFile = fopen(parser->pFileName, "r");
    if ( !pInFile )
    {
 #if 0
@@ -1229,36 +2187,41 @@ int h2incn_read(struct parser_t *parser)
       return 0;
    }
 
-   fseek(pInFile, 0, SEEK_END);
-   parser->iFileSize = ftell(pInFile);
-   fseek(pInFile, 0, SEEK_SET);
+   if ( options.fVerbose )
+      printf("processing file %s\n", parser->pFileName);
 
-   if ( parser->iFileSize < 1 )
+   if ( options.uChunkSize )
    {
+      bSuccess = h2incn_stream_file(parser, pInFile);
+      if ( pInFile != stdin )
+         fclose(pInFile);
+      return bSuccess;
+   }
+
+   bSuccess = 0;
+#ifdef H2INCN_MMAP
+   bSuccess = h2incn_map_file(parser, pInFile);
+#endif
+   if ( !bSuccess )
+      bSuccess = h2incn_load_file(parser, pInFile);
+   if ( pInFile != stdin )
       fclose(pInFile);
-      printf("no data in file: %s\n", parser->pFileName);
+   if ( !bSuccess )
       return 0;
-   }
 
-   parser->pFileBuffer = malloc(parser->iFileSize + 2);
-   if ( !parser->pFileBuffer )
+   if ( parser->uFileSize < 1 )
    {
-      fclose(pInFile);
-      printf("insufficient memory\n");
+      h2incn_unload_file(parser);
+      printf("no data in file: %s\n", parser->pFileName);
       return 0;
    }
 
-   fread(parser->pFileBuffer, 1, parser->iFileSize, pInFile);
-   parser->pFileBuffer[parser->iFileSize] = 0;
-   fclose(pInFile);
-
-   parser->pLine = parser->pFileBuffer;
+   bSuccess = h2incn_splice(parser, parser->pFileBuffer);
    parser->pNextToken = parser->pFileBuffer;
-   parser->iLineNum  = 1;
+   if ( bSuccess )
+      bSuccess = h2incn_parse(parser);
 
-   bSuccess = h2incn_parse(parser);
-
-   free(parser->pFileBuffer);
+   h2incn_unload_file(parser);
 
    return bSuccess;
 }
@@ -1330,75 +2293,1084 @@ int binarytree_test(void)
 
    return 1;
 }
-#endif /* ifdef BINTREE_TEST */
 
-int main(int argc, char **argv)
+/* verify links and heights of a tree, returns its height or -1 if invalid */
+static int binarytree_test_height(struct bst_node_t *node, struct bst_node_t *parent)
 {
-   struct parser_t *parser;
-   char *tptr;
-   int bSuccess;
-
-   parse_cmdln(argc, argv);
+   int hl, hr;
 
-#ifdef BINTREE_TEST
-   if ( !binarytree_test() )
-      return 1;
-   printf("binarytree_test: info: completed\n");
-   return 0;
-#endif
+   if ( !node )
+      return 0;
+   if ( node->parent != parent )
+      return -1;
+   hl = binarytree_test_height(node->left, node);
+   hr = binarytree_test_height(node->right, node);
+   if ( ( hl < 0 ) || ( hr < 0 ) || ( hl - hr > 1 ) || ( hr - hl > 1 ) )
+      return -1;
+   if ( (int)node->height != 1 + ( hl > hr ? hl : hr ) )
+      return -1;
+   return 1 + ( hl > hr ? hl : hr );
+}
 
-   parser = malloc(sizeof(struct parser_t));
-   if ( !parser )
+/* the tallest AVL tree possible with count nodes */
+static int binarytree_test_max_height(unsigned long count)
+{
+   unsigned long a, b, c;
+   int h;
+
+   /* fewest nodes for height h: n(h) = n(h-1) + n(h-2) + 1 */
+   a = 0;
+   b = 1;
+   h = 0;
+   while ( b <= count )
    {
-      printf("insufficient memory\n");
-      return 1;
+      c = a + b + 1;
+      a = b;
+      b = c;
+      h++;
    }
+   return h;
+}
 
-   if ( !options.pOutFileName )
+/* insert keys in sorted order, the worst case for an unbalanced tree */
+int binarytree_balance_test(void)
+{
+   struct bst_node_t *root;
+   struct bst_node_t *node;
+   char key[16];
+   int i, h, count;
+
+   root = (struct bst_node_t*)0;
+   count = 100000;
+   for ( i = 0; i < count; i++ )
    {
-      /* set up default out_file name */
-      options.pOutFileName = malloc(strlen(options.pInFileName)+8);
-      strcpy(options.pOutFileName, options.pInFileName);
-      tptr = strrchr(options.pOutFileName, '.');
-      if ( !tptr )
-         strcat(options.pOutFileName, ".inc");
-      else
-         strcpy(tptr, ".inc");
+      sprintf(key, "FOO_%06d", i);
+      node = binarytree_alloc_node(key, 10, (void*)0, 0);
+      if ( !node || binarytree_insert_node(&root, node) )
+      {
+         printf("\nbinarytree_balance_test: error: insert failed\n");
+         return 0;
+      }
    }
 
-   /* open output file */
-   parser->pOutFile = fopen(options.pOutFileName, "w");
-   if ( !parser->pOutFile )
+   h = binarytree_test_height(root, (struct bst_node_t*)0);
+   if ( ( h < 0 ) || ( h > binarytree_test_max_height(count) ) )
    {
-      printf("error opening output file: %s\n", options.pOutFileName);
-      return 1;
+      printf("\nbinarytree_balance_test: error: height %d after inserts\n", h);
+      return 0;
    }
 
-   pHeadersMap = hash_map_alloc(0x80);
-   if ( !pHeadersMap )
+   /* delete every other key, again in sorted order */
+   for ( i = 0; i < count; i += 2 )
    {
-      printf("insufficient memory\n");
-      return 1;
+      sprintf(key, "FOO_%06d", i);
+      if ( binarytree_delete_node(&root, key, 10) )
+      {
+         printf("\nbinarytree_balance_test: error: delete failed\n");
+         return 0;
+      }
    }
 
-   pDefinesMap = hash_map_alloc(0x8000);
-   if ( !pDefinesMap )
+   h = binarytree_test_height(root, (struct bst_node_t*)0);
+   if ( ( h < 0 ) || ( h > binarytree_test_max_height(count / 2) ) )
    {
-      printf("insufficient memory\n");
-      return 1;
+      printf("\nbinarytree_balance_test: error: height %d after deletes\n", h);
+      return 0;
    }
 
-   parser->pFileName = options.pInFileName;
-
-   bSuccess = h2incn_read(parser);
+   for ( i = 1; i < count; i += 2 )
+   {
+      sprintf(key, "FOO_%06d", i);
+      if ( !binarytree_find_node(&root, key, 10) )
+      {
+         printf("\nbinarytree_balance_test: error: node not found!\n");
+         return 0;
+      }
+   }
 
-   fflush(parser->pOutFile);
-   fclose(parser->pOutFile);
+   binarytree_delete_tree(&root);
+   return 1;
+}
 
-   free(parser);
+/* walk a tree in key order, in full and by key prefix */
+int binarytree_walk_test(void)
+{
+   struct bst_node_t *root;
+   struct bst_node_t *node;
+   struct bst_node_t *next;
+   char key[16];
+   int i, count, cmp;
+   unsigned int len;
+
+   root = (struct bst_node_t*)0;
+   count = 1000;
+   for ( i = count - 1; i >= 0; i-- )
+   {
+      sprintf(key, "%s_%d", i & 1 ? "WM" : "WMX", i);
+      node = binarytree_alloc_node(key, strlen(key), (void*)0, 0);
+      if ( !node || binarytree_insert_node(&root, node) )
+      {
+         printf("\nbinarytree_walk_test: error: insert failed\n");
+         return 0;
+      }
+   }
 
-   hash_map_free(pHeadersMap);
-   hash_map_free(pDefinesMap);
+   i = 0;
+   for ( node = binarytree_first_node(&root); node; node = next )
+   {
+      next = binarytree_next_node(node);
+      if ( next )
+      {
+         len = node->klen < next->klen ? node->klen : next->klen;
+         cmp = memcmp(node->key, next->key, len);
+         if ( ( cmp > 0 ) || ( ( cmp == 0 ) && ( node->klen >= next->klen ) ) )
+         {
+            printf("\nbinarytree_walk_test: error: keys out of order\n");
+            return 0;
+         }
+      }
+      i++;
+   }
+   if ( i != count )
+   {
+      printf("\nbinarytree_walk_test: error: walked %d of %d nodes\n", i, count);
+      return 0;
+   }
+
+   /* WM_1, WM_11, WM_13, ... WM_199 */
+   i = 0;
+   for ( node = binarytree_find_prefix(&root, "WM_1", 4); node; node = binarytree_next_node(node) )
+   {
+      if ( ( node->klen < 4 ) || memcmp(node->key, "WM_1", 4) )
+         break;
+      i++;
+   }
+   if ( ( i != 56 ) || binarytree_find_prefix(&root, "WM_2000", 7) )
+   {
+      printf("\nbinarytree_walk_test: error: prefix walk found %d nodes\n", i);
+      return 0;
+   }
+
+   binarytree_delete_tree(&root);
+   return 1;
+}
+#endif /* ifdef BINTREE_TEST */
+
+#ifdef HASHMAP_STRESS
+/* Stress test of a HASH_MAP_CONCURRENT map, built with -DHASHMAP_STRESS
+   and linked with -pthread, see `scons stress`. Reader threads look up keys without any
+   locking, one at a time and with hash_map_find_batch(), while writer
+   threads insert, replace and delete their own keys, and every value
+   found must belong to its key.
+*/
+
+#define HASHMAP_STRESS_READERS  6
+#define HASHMAP_STRESS_WRITERS  2
+#define HASHMAP_STRESS_STABLE   2000     /* keys present throughout */
+#define HASHMAP_STRESS_KEYS     20000    /* keys owned by each writer */
+#define HASHMAP_STRESS_OPS      400000   /* changes made by each writer */
+#define HASHMAP_STRESS_BATCH    8        /* keys per hash_map_find_batch() */
+
+struct hashmap_stress_t {
+   struct hash_map_t *map;
+   unsigned int id;
+   unsigned int seed;
+   unsigned long lookups;
+   unsigned long found;
+   unsigned long errors;
+   unsigned char *present;             /* writers: keys currently inserted */
+};
+
+static int HashmapStressDone;
+
+static unsigned int hashmap_stress_rand(unsigned int *seed)
+{
+   *seed ^= *seed << 13;
+   *seed ^= *seed >> 17;
+   *seed ^= *seed << 5;
+   return *seed;
+}
+
+/* a value is its key followed by '=' and a generation number */
+static int hashmap_stress_check(struct bst_node_t *node, char *key, unsigned int klen)
+{
+   if ( ( node->klen != klen ) || memcmp(node->key, key, klen) )
+      return 0;
+   if ( ( node->vlen <= klen ) || memcmp(node->value, key, klen) || ( ((char*)node->value)[klen] != '=' ) )
+      return 0;
+   return 1;
+}
+
+/* look up a batch of keys, half of them stable and half owned by writers */
+static void hashmap_stress_batch(struct hashmap_stress_t *t)
+{
+   struct bst_node_t *nodes[HASHMAP_STRESS_BATCH];
+   void *keys[HASHMAP_STRESS_BATCH];
+   unsigned int klens[HASHMAP_STRESS_BATCH];
+   unsigned int i;
+   unsigned int r;
+   char key[HASHMAP_STRESS_BATCH][32];
+
+   for ( i = 0; i < HASHMAP_STRESS_BATCH; i++ )
+   {
+      r = hashmap_stress_rand(&t->seed);
+      if ( i & 1 )
+         klens[i] = sprintf(key[i], "STABLE_%u", r % HASHMAP_STRESS_STABLE);
+      else
+         klens[i] = sprintf(key[i], "W%u_%u", r % HASHMAP_STRESS_WRITERS, (r >> 2) % HASHMAP_STRESS_KEYS);
+      keys[i] = key[i];
+   }
+
+   if ( hash_map_find_batch(t->map, HASHMAP_STRESS_BATCH, keys, klens, nodes) )
+   {
+      t->errors++;
+      return;
+   }
+   for ( i = 0; i < HASHMAP_STRESS_BATCH; i++ )
+   {
+      if ( nodes[i] && !hashmap_stress_check(nodes[i], key[i], klens[i]) )
+         t->errors++;
+      else if ( !nodes[i] && ( i & 1 ) )
+         t->errors++;
+      if ( nodes[i] )
+         t->found++;
+      t->lookups++;
+   }
+}
+
+static void* hashmap_stress_reader(void *arg)
+{
+   struct hashmap_stress_t *t = arg;
+   struct bst_node_t *node;
+   unsigned int klen;
+   unsigned int r;
+   char key[32];
+
+   while ( !__atomic_load_n(&HashmapStressDone, __ATOMIC_RELAXED) )
+   {
+      r = hashmap_stress_rand(&t->seed);
+      if ( ( r & 0xF ) == 0 )
+      {
+         hashmap_stress_batch(t);
+         continue;
+      }
+      if ( r & 1 )
+      {
+         klen = sprintf(key, "STABLE_%u", (r >> 1) % HASHMAP_STRESS_STABLE);
+         node = hash_map_find(t->map, key, klen);
+         if ( !node || !hashmap_stress_check(node, key, klen) )
+            t->errors++;
+      }
+      else
+      {
+         klen = sprintf(key, "W%u_%u", (r >> 1) % HASHMAP_STRESS_WRITERS, (r >> 3) % HASHMAP_STRESS_KEYS);
+         node = hash_map_find(t->map, key, klen);
+         if ( node && !hashmap_stress_check(node, key, klen) )
+            t->errors++;
+      }
+      if ( node )
+         t->found++;
+      t->lookups++;
+   }
+   return arg;
+}
+
+static void* hashmap_stress_writer(void *arg)
+{
+   struct hashmap_stress_t *t = arg;
+   unsigned int klen;
+   unsigned int vlen;
+   unsigned int i;
+   unsigned int k;
+   char key[32];
+   char value[48];
+
+   for ( i = 0; i < HASHMAP_STRESS_OPS; i++ )
+   {
+      k = hashmap_stress_rand(&t->seed) % HASHMAP_STRESS_KEYS;
+      klen = sprintf(key, "W%u_%u", t->id, k);
+      if ( ( i & 3 ) || !t->present[k] )
+      {
+         vlen = sprintf(value, "%s=%u", key, i);
+         if ( hash_map_insert(t->map, key, klen, value, vlen) )
+            t->errors++;
+         t->present[k] = 1;
+      }
+      else
+      {
+         if ( hash_map_delete(t->map, key, klen) )
+            t->errors++;
+         t->present[k] = 0;
+      }
+   }
+   return arg;
+}
+
+static int hashmap_stress(void)
+{
+   struct hashmap_stress_t threads[HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS];
+   pthread_t tids[HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS];
+   struct hashmap_stress_t *t;
+   struct hash_map_dist_t dist;
+   struct hash_map_t *map;
+   struct bst_node_t *node;
+   unsigned long lookups;
+   unsigned long found;
+   unsigned long errors;
+   unsigned int count;
+   unsigned int klen;
+   unsigned int i;
+   unsigned int k;
+   char key[32];
+   char value[48];
+
+   map = hash_map_alloc(64, HASH_MAP_CONCURRENT | HASH_MAP_WIDE);
+   if ( !map )
+      return 0;
+   for ( i = 0; i < HASHMAP_STRESS_STABLE; i++ )
+   {
+      klen = sprintf(key, "STABLE_%u", i);
+      if ( hash_map_insert(map, key, klen, value, sprintf(value, "%s=0", key)) )
+         return 0;
+   }
+
+   memset(threads, 0, sizeof(threads));
+   for ( i = 0; i < HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS; i++ )
+   {
+      t = &threads[i];
+      t->map = map;
+      t->seed = 0x9e3779b9 * (i + 1);
+      if ( i >= HASHMAP_STRESS_READERS )
+      {
+         t->id = i - HASHMAP_STRESS_READERS;
+         t->present = calloc(HASHMAP_STRESS_KEYS, 1);
+         if ( !t->present )
+            return 0;
+      }
+   }
+
+   for ( i = 0; i < HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS; i++ )
+   {
+      if ( pthread_create(&tids[i], 0, ( i < HASHMAP_STRESS_READERS ) ? hashmap_stress_reader : hashmap_stress_writer, &threads[i]) )
+      {
+         printf("\nhashmap_stress: error: unable to start thread\n");
+         return 0;
+      }
+   }
+   for ( i = HASHMAP_STRESS_READERS; i < HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS; i++ )
+      pthread_join(tids[i], 0);
+   __atomic_store_n(&HashmapStressDone, 1, __ATOMIC_RELAXED);
+   for ( i = 0; i < HASHMAP_STRESS_READERS; i++ )
+      pthread_join(tids[i], 0);
+
+   lookups = found = errors = 0;
+   for ( i = 0; i < HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS; i++ )
+   {
+      lookups += threads[i].lookups;
+      found += threads[i].found;
+      errors += threads[i].errors;
+   }
+
+   /* with all threads done, the map must hold exactly what the writers left */
+   hash_map_reclaim(map);
+   count = HASHMAP_STRESS_STABLE;
+   for ( i = HASHMAP_STRESS_READERS; i < HASHMAP_STRESS_READERS + HASHMAP_STRESS_WRITERS; i++ )
+   {
+      t = &threads[i];
+      for ( k = 0; k < HASHMAP_STRESS_KEYS; k++ )
+      {
+         klen = sprintf(key, "W%u_%u", t->id, k);
+         node = hash_map_find(map, key, klen);
+         if ( ( node != 0 ) != t->present[k] )
+            errors++;
+         if ( node && !hashmap_stress_check(node, key, klen) )
+            errors++;
+         count += t->present[k];
+      }
+      free(t->present);
+   }
+   if ( hash_map_distribution(map, &dist) || ( dist.nodes != count ) || ( map->count != count ) )
+      errors++;
+
+   /* concurrent lookups, batched or not, must not have touched the counters */
+   if ( map->stats.lookups || map->stats.hits )
+      errors++;
+
+   printf("hashmap_stress: %u readers, %u writers, %lu lookups, %lu found, %u keys in %u buckets\n",
+      HASHMAP_STRESS_READERS, HASHMAP_STRESS_WRITERS, lookups, found, count, dist.buckets);
+   hash_map_free(map);
+
+   if ( errors )
+   {
+      printf("\nhashmap_stress: error: %lu errors\n", errors);
+      return 0;
+   }
+   printf("hashmap_stress: info: completed\n");
+   return 1;
+}
+#endif /* ifdef HASHMAP_STRESS */
+
+#ifdef HASHMAP_FORK_TEST
+/* Differential test of hash_map_fork(), built with -DHASHMAP_FORK_TEST.
+   For every table type a chain of forks deeper than HASH_MAP_FORK_DEPTH
+   is built, each fork is changed at random, and every map of the chain
+   is checked against an array of the values its keys should have, by
+   lookup, batched lookup, full walk and prefix walk. The bases are freed
+   before their forks, so the last fork frees the chain.
+*/
+
+#define HASHMAP_FORK_LEVELS  12       /* forks in a chain */
+#define HASHMAP_FORK_KEYS    3000     /* keys K0 .. K2999 */
+#define HASHMAP_FORK_OPS     1500     /* changes made to each map */
+#define HASHMAP_FORK_BATCH   16       /* keys per hash_map_find_batch() */
+
+/* generation of the value of each key in each map, 0 if not held */
+static unsigned int HashmapForkExpect[HASHMAP_FORK_LEVELS + 1][HASHMAP_FORK_KEYS];
+
+static unsigned int hashmap_fork_rand(unsigned int *seed)
+{
+   *seed ^= *seed << 13;
+   *seed ^= *seed >> 17;
+   *seed ^= *seed << 5;
+   return *seed;
+}
+
+/* true if node is what a lookup of key k should find */
+static int hashmap_fork_match(struct bst_node_t *node, unsigned int k, unsigned int gen)
+{
+   char value[32];
+   unsigned int vlen;
+
+   if ( !gen )
+      return node == 0;
+   vlen = sprintf(value, "K%u=%u", k, gen);
+   return node && ( node->vlen == vlen ) && !memcmp(node->value, value, vlen);
+}
+
+/* key number of a node, HASHMAP_FORK_KEYS if it is none of ours */
+static unsigned int hashmap_fork_key(struct bst_node_t *node)
+{
+   unsigned int k;
+   char key[32];
+
+   if ( ( node->klen < 2 ) || ( node->klen >= sizeof(key) ) || ( *(char*)node->key != 'K' ) )
+      return HASHMAP_FORK_KEYS;
+   memcpy(key, node->key, node->klen);
+   key[node->klen] = 0;
+   k = (unsigned int)strtoul(key + 1, 0, 10);
+   return ( k < HASHMAP_FORK_KEYS ) ? k : HASHMAP_FORK_KEYS;
+}
+
+/* walk a map by prefix, every key must be visited once and hold its value */
+static int hashmap_fork_walk(struct hash_map_t *map, unsigned int *expect, char *prefix)
+{
+   static unsigned char seen[HASHMAP_FORK_KEYS];
+   struct hash_map_iter_t iter;
+   struct bst_node_t *node;
+   unsigned int count;
+   unsigned int plen;
+   unsigned int k;
+   char key[32];
+
+   plen = strlen(prefix);
+   memset(seen, 0, sizeof(seen));
+   count = 0;
+   for ( node = hash_map_first(map, &iter, prefix, plen); node; node = hash_map_next(map, &iter) )
+   {
+      k = hashmap_fork_key(node);
+      if ( ( k == HASHMAP_FORK_KEYS ) || seen[k] || !expect[k] || !hashmap_fork_match(node, k, expect[k]) )
+         return 0;
+      seen[k] = 1;
+      count++;
+   }
+
+   for ( k = 0; k < HASHMAP_FORK_KEYS; k++ )
+   {
+      if ( expect[k] && ( sprintf(key, "K%u", k) >= (int)plen ) && !memcmp(key, prefix, plen) )
+         count--;
+   }
+   return count == 0;
+}
+
+/* check a map against what it should hold */
+static int hashmap_fork_check(struct hash_map_t *map, unsigned int *expect, char *name, unsigned int level)
+{
+   struct bst_node_t *nodes[HASHMAP_FORK_BATCH];
+   void *keys[HASHMAP_FORK_BATCH];
+   unsigned int klens[HASHMAP_FORK_BATCH];
+   unsigned int i;
+   unsigned int k;
+   char key[HASHMAP_FORK_BATCH][32];
+
+   for ( k = 0; k < HASHMAP_FORK_KEYS; k++ )
+   {
+      klens[0] = sprintf(key[0], "K%u", k);
+      if ( !hashmap_fork_match(hash_map_find(map, key[0], klens[0]), k, expect[k]) )
+      {
+         printf("\nhashmap_fork_test: error: %s level %u: lookup of %s\n", name, level, key[0]);
+         return 0;
+      }
+   }
+
+   /* the node found in a compact map is a copy, so it cannot be batched */
+   for ( k = 0; !( map->flags & HASH_MAP_COMPACT ) && ( k < HASHMAP_FORK_KEYS ); k += HASHMAP_FORK_BATCH )
+   {
+      for ( i = 0; i < HASHMAP_FORK_BATCH; i++ )
+      {
+         klens[i] = sprintf(key[i], "K%u", ( k + i ) % HASHMAP_FORK_KEYS);
+         keys[i] = key[i];
+      }
+      if ( hash_map_find_batch(map, HASHMAP_FORK_BATCH, keys, klens, nodes) )
+         return 0;
+      for ( i = 0; i < HASHMAP_FORK_BATCH; i++ )
+      {
+         if ( !hashmap_fork_match(nodes[i], ( k + i ) % HASHMAP_FORK_KEYS, expect[( k + i ) % HASHMAP_FORK_KEYS]) )
+         {
+            printf("\nhashmap_fork_test: error: %s level %u: batched lookup of %s\n", name, level, key[i]);
+            return 0;
+         }
+      }
+   }
+
+   if ( !hashmap_fork_walk(map, expect, "") || !hashmap_fork_walk(map, expect, "K12") )
+   {
+      printf("\nhashmap_fork_test: error: %s level %u: walk\n", name, level);
+      return 0;
+   }
+   return 1;
+}
+
+static int hashmap_fork_test(void)
+{
+   static unsigned int Types[] = { HASH_MAP_CHAINED, HASH_MAP_CHAINED | HASH_MAP_ARENA, HASH_MAP_FIXED, HASH_MAP_OPEN, HASH_MAP_COMPACT };
+   static char *Names[] = { "chained", "arena", "fixed", "open", "compact" };
+   struct hash_map_t *maps[HASHMAP_FORK_LEVELS + 1];
+   struct hash_map_t *base;
+   unsigned int *expect;
+   unsigned int depth;
+   unsigned int level;
+   unsigned int seed;
+   unsigned int klen;
+   unsigned int vlen;
+   unsigned int gen;
+   unsigned int op;
+   unsigned int t;
+   unsigned int k;
+   int err;
+   char key[32];
+   char value[32];
+
+   for ( t = 0; t < sizeof(Types) / sizeof(Types[0]); t++ )
+   {
+      seed = 0x9e3779b9;
+      for ( level = 0; level <= HASHMAP_FORK_LEVELS; level++ )
+      {
+         expect = HashmapForkExpect[level];
+         if ( level == 0 )
+         {
+            maps[0] = hash_map_alloc(0x40, Types[t] | HASH_MAP_WIDE);
+            memset(expect, 0, sizeof(HashmapForkExpect[0]));
+         }
+         else
+         {
+            maps[level] = hash_map_fork(maps[level - 1]);
+            memcpy(expect, HashmapForkExpect[level - 1], sizeof(HashmapForkExpect[0]));
+         }
+         if ( !maps[level] )
+         {
+            printf("\nhashmap_fork_test: error: %s level %u: out of memory\n", Names[t], level);
+            return 0;
+         }
+
+         /* a fork leaves its base read only, unless the chain was flattened */
+         depth = 0;
+         for ( base = maps[level]->base; base; base = base->base )
+            depth++;
+         if ( ( depth > HASH_MAP_FORK_DEPTH ) || ( level && maps[level]->base && ( maps[level]->base != maps[level - 1] ) )
+            || ( level && maps[level]->base && ( hash_map_insert(maps[level - 1], "K0", 2, "x", 1) != 3 ) ) )
+         {
+            printf("\nhashmap_fork_test: error: %s level %u: chain of %u bases\n", Names[t], level, depth);
+            return 0;
+         }
+
+         if ( !hashmap_fork_check(maps[level], expect, Names[t], level) )
+            return 0;
+
+         for ( op = 0; op < HASHMAP_FORK_OPS; op++ )
+         {
+            k = hashmap_fork_rand(&seed) % HASHMAP_FORK_KEYS;
+            klen = sprintf(key, "K%u", k);
+            if ( hashmap_fork_rand(&seed) & 3 )
+            {
+               gen = ( level * HASHMAP_FORK_OPS ) + op + 1;
+               vlen = sprintf(value, "K%u=%u", k, gen);
+               err = hash_map_insert(maps[level], key, klen, value, vlen) ? 1 : 0;
+               expect[k] = gen;
+            }
+            else
+            {
+               err = ( hash_map_delete(maps[level], key, klen) == 0 ) != ( expect[k] != 0 );
+               expect[k] = 0;
+            }
+            if ( err )
+            {
+               printf("\nhashmap_fork_test: error: %s level %u: change of %s\n", Names[t], level, key);
+               return 0;
+            }
+         }
+
+         if ( !hashmap_fork_check(maps[level], expect, Names[t], level) )
+            return 0;
+      }
+
+      /* no map was changed by changing its forks */
+      for ( level = 0; level <= HASHMAP_FORK_LEVELS; level++ )
+      {
+         if ( !hashmap_fork_check(maps[level], HashmapForkExpect[level], Names[t], level) )
+            return 0;
+      }
+
+      for ( level = 0; level <= HASHMAP_FORK_LEVELS; level++ )
+      {
+         if ( hash_map_free(maps[level]) )
+         {
+            printf("\nhashmap_fork_test: error: %s level %u: free failed\n", Names[t], level);
+            return 0;
+         }
+      }
+      printf("hashmap_fork_test: %s: %u forks checked\n", Names[t], HASHMAP_FORK_LEVELS);
+   }
+
+   printf("hashmap_fork_test: info: completed\n");
+   return 1;
+}
+#endif /* ifdef HASHMAP_FORK_TEST */
+
+#ifdef SCAN_TEST
+/* Test of the scanning kernels, built with -DSCAN_TEST. Each kernel the
+   cpu supports must return the same ptr as the scalar kernel, for text
+   of every length starting at every alignment.
+*/
+
+#define SCAN_TEST_SIZE    256
+#define SCAN_TEST_ROUNDS  2000
+#define SCAN_TEST_LINES   100000
+
+static int scan_test(void)
+{
+   static char chars[] = " \t\r\n*/_aZ09#(\\\x80\xff";
+   char *buffer;
+   char *expect[5];
+   size_t lines;
+   char *p;
+   unsigned int seed;
+   unsigned int round;
+   unsigned int len;
+   unsigned int i;
+   int kernels;
+   int supported;
+   unsigned long errors;
+
+   /* the vector kernels may load up to 31 bytes past the nul */
+   buffer = malloc(SCAN_TEST_SIZE + 64);
+   if ( !buffer )
+   {
+      printf("\nscan_test: error: insufficient memory\n");
+      return 0;
+   }
+
+   supported = scan_init(SCAN_AVX2);
+   seed = 1;
+   errors = 0;
+   for ( round = 0; round < SCAN_TEST_ROUNDS; round++ )
+   {
+      seed = seed * 1103515245 + 12345;
+      len = ( seed >> 8 ) % SCAN_TEST_SIZE;
+      for ( i = 0; i < len; i++ )
+      {
+         seed = seed * 1103515245 + 12345;
+         buffer[i] = chars[( seed >> 16 ) % ( sizeof(chars) - 1 )];
+      }
+      memset(buffer + len, 0, SCAN_TEST_SIZE + 64 - len);
+
+      for ( p = buffer; p <= buffer + len; p++ )
+      {
+         scan_init(SCAN_SCALAR);
+         expect[0] = scan_eol(p);
+         expect[1] = scan_space(p);
+         expect[2] = scan_ident(p);
+         expect[3] = scan_comment(p);
+         expect[4] = scan_splice(p);
+         lines = scan_lines(p, buffer + len);
+         for ( kernels = SCAN_SSE2; kernels <= supported; kernels++ )
+         {
+            scan_init(kernels);
+            if ( ( scan_eol(p) != expect[0] ) || ( scan_space(p) != expect[1] ) ||
+                 ( scan_ident(p) != expect[2] ) || ( scan_comment(p) != expect[3] ) ||
+                 ( scan_splice(p) != expect[4] ) || ( scan_lines(p, buffer + len) != lines ) )
+            {
+               if ( !errors )
+                  printf("\nscan_test: error: %s kernels differ at offset %u of %u bytes\n",
+                     scan_name(kernels), (unsigned int)(p - buffer), len);
+               errors++;
+            }
+         }
+      }
+   }
+
+   free(buffer);
+
+   /* the vector kernels sum their line counts before a byte lane overflows */
+   buffer = malloc(SCAN_TEST_LINES);
+   if ( !buffer )
+   {
+      printf("\nscan_test: error: insufficient memory\n");
+      return 0;
+   }
+   memset(buffer, '\n', SCAN_TEST_LINES);
+   for ( kernels = SCAN_SCALAR; kernels <= supported; kernels++ )
+   {
+      scan_init(kernels);
+      if ( scan_lines(buffer + 1, buffer + SCAN_TEST_LINES) != SCAN_TEST_LINES - 1 )
+      {
+         printf("\nscan_test: error: %s kernels miscount lines\n", scan_name(kernels));
+         errors++;
+      }
+   }
+   free(buffer);
+
+   scan_init(SCAN_AVX2);
+   if ( errors )
+   {
+      printf("\nscan_test: error: %lu errors\n", errors);
+      return 0;
+   }
+   printf("scan_test: %s kernels checked, info: completed\n", scan_name(supported));
+   return 1;
+}
+#endif /* ifdef SCAN_TEST */
+
+#ifdef LEX_TEST
+/* Test of the lexer, built with -DLEX_TEST. The tokens of a sample must
+   be as expected, up to its line of code, with the hash of each name the
+   same as hashing it on its own, and a long text must be lexed in batches
+   that end with a line, with its names whole.
+*/
+
+#define LEX_TEST_LINES  3000
+
+static int lex_test(void)
+{
+   static char sample[] =
+      "#define A(x) ((x)+0x1Fu) /* c */\n"
+      "# include <a/b.h> /* a\n b */ // x\n"
+      "\n"
+      "#if 'a' == \"s\\\"\" /* 1 */\n"
+      "  /* code */ int y;\n";
+   static unsigned char kinds[] = {
+      TOKEN_PUNCT, TOKEN_NAME, TOKEN_NAME, TOKEN_PUNCT, TOKEN_NAME, TOKEN_PUNCT, TOKEN_PUNCT,
+      TOKEN_PUNCT, TOKEN_NAME, TOKEN_PUNCT, TOKEN_PUNCT, TOKEN_NUMBER, TOKEN_PUNCT, TOKEN_COMMENT, TOKEN_EOL,
+      TOKEN_PUNCT, TOKEN_NAME, TOKEN_STRING, TOKEN_COMMENT, TOKEN_COMMENT, TOKEN_EOL,
+      TOKEN_EOL,
+      TOKEN_PUNCT, TOKEN_NAME, TOKEN_STRING, TOKEN_PUNCT, TOKEN_PUNCT, TOKEN_STRING, TOKEN_COMMENT, TOKEN_EOL };
+   static unsigned int lengths[] = {
+      1, 6, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 5, 1, 7, 1,
+      1, 7, 7, 10, 4, 1,
+      1,
+      1, 2, 3, 1, 1, 5, 7, 1 };
+   struct parser_t parser;
+   struct tokens_t *tokens;
+   struct hash_map_t *map;
+   char *text;
+   char *end;
+   char *p;
+   unsigned int count;
+   unsigned int i;
+   int batches;
+   int errors;
+
+   memset(&parser, 0, sizeof(parser));
+   tokens = &parser.tokens;
+   text = malloc(LEX_TEST_LINES * 32);
+   pSymbols = hash_intern_alloc(0x400, options.uHashFlags);
+   map = hash_map_alloc(0x10, options.uHashFlags);
+   if ( !text || !pSymbols || !map || !h2incn_tokens_alloc(tokens, H2INCN_TOKENS + 0x100) )
+   {
+      printf("\nlex_test: error: insufficient memory\n");
+      return 0;
+   }
+
+   errors = 0;
+   if ( !h2incn_lex(&parser, sample) || ( tokens->uCount != sizeof(kinds) ) )
+   {
+      printf("\nlex_test: error: %u tokens in sample, %u expected\n", tokens->uCount, (unsigned int)sizeof(kinds));
+      errors++;
+   }
+   for ( i = 0; !errors && ( i < tokens->uCount ); i++ )
+   {
+      if ( ( tokens->pKind[i] != kinds[i] ) || ( tokens->pLength[i] != lengths[i] ) )
+      {
+         printf("\nlex_test: error: token %u is kind %u of %u chars\n", i, tokens->pKind[i], tokens->pLength[i]);
+         errors++;
+      }
+   }
+   for ( i = 0; !errors && ( i < tokens->uCount ); i++ )
+   {
+      /* a name hashed while it is lexed or scanned hashes as on its own */
+      if ( ( tokens->pKind[i] == TOKEN_NAME ) &&
+           ( ( tokens->pHash[i] != hash_intern_hash(pSymbols, h2incn_token(&parser, i), tokens->pLength[i]) ) ||
+             ( hash_map_scan(map, h2incn_token(&parser, i), StopName, &end) !=
+               hash_map_hash(map, h2incn_token(&parser, i), tokens->pLength[i]) ) ||
+             ( end != h2incn_token(&parser, i) + tokens->pLength[i] ) ) )
+      {
+         printf("\nlex_test: error: hash of name token %u\n", i);
+         errors++;
+      }
+   }
+   if ( !errors && ( tokens->pLines[18] != 1 ) )
+   {
+      printf("\nlex_test: error: comment ends %u lines\n", tokens->pLines[18]);
+      errors++;
+   }
+   if ( !errors && ( tokens->pEnd != strstr(sample, "/* code") ) )
+   {
+      printf("\nlex_test: error: batch does not end before the code\n");
+      errors++;
+   }
+
+   /* each directive is found through its name only, after any whitespace */
+   for ( i = 0; !errors && ( i < DIRECTIVE_COUNT + 2 ); i++ )
+   {
+      if ( i < DIRECTIVE_COUNT )
+         sprintf(text, "# \t%s\tX\n", DirectiveNames[i]);
+      else
+         strcpy(text, ( i == DIRECTIVE_COUNT ) ? "#elsewhere\n" : "#e\n");
+      if ( !h2incn_lex(&parser, text) ||
+           ( h2incn_directive(&parser, 0) != ( ( i < DIRECTIVE_COUNT ) ? (int)i : DIRECTIVE_NONE ) ) )
+      {
+         printf("\nlex_test: error: directive %s\n", text);
+         errors++;
+      }
+   }
+
+   /* a batch holds whole lines */
+   p = text;
+   for ( i = 0; i < LEX_TEST_LINES; i++ )
+      p += sprintf(p, "#define NAME_%u %u\n", i, i);
+   p = text;
+   count = 0;
+   batches = 0;
+   while ( !errors )
+   {
+      if ( !h2incn_lex(&parser, p) )
+      {
+         errors++;
+         break;
+      }
+      batches++;
+      for ( i = 0; i < tokens->uCount; i++ )
+      {
+         /* names of 8 chars and more, a whole word and a rest to hash */
+         if ( ( tokens->pKind[i] == TOKEN_NAME ) &&
+              ( ( scan_class[(unsigned char)h2incn_token(&parser, i)[tokens->pLength[i]]] & SCAN_IDENT ) ||
+                ( tokens->pHash[i] != hash_intern_hash(pSymbols, h2incn_token(&parser, i), tokens->pLength[i]) ) ||
+                ( hash_map_scan(map, h2incn_token(&parser, i), StopName, &end) !=
+                  hash_map_hash(map, h2incn_token(&parser, i), tokens->pLength[i]) ) ) )
+         {
+            printf("\nlex_test: error: name of token %u in batch %d\n", i, batches);
+            errors++;
+         }
+      }
+      count += tokens->uCount;
+      i = tokens->uCount - 1;
+      if ( tokens->pKind[i] == TOKEN_END )
+         break;
+      if ( tokens->pKind[i] != TOKEN_EOL )
+      {
+         printf("\nlex_test: error: batch %d ends with kind %u\n", batches, tokens->pKind[i]);
+         errors++;
+      }
+      p = h2incn_token(&parser, i) + tokens->pLength[i];
+   }
+   if ( !errors && ( count != LEX_TEST_LINES * 5 + 1 ) )
+   {
+      printf("\nlex_test: error: %u tokens in %d batches, %u expected\n", count, batches, LEX_TEST_LINES * 5 + 1);
+      errors++;
+   }
+
+   h2incn_tokens_free(tokens);
+   hash_map_free(map);
+   hash_intern_free(pSymbols);
+   free(text);
+   if ( errors )
+      return 0;
+   printf("lex_test: %u tokens in %d batches, info: completed\n", count, batches);
+   return 1;
+}
+#endif /* ifdef LEX_TEST */
+
+int main(int argc, char **argv)
+{
+   struct parser_t *parser;
+   char *tptr;
+   int bSuccess;
+   int kernels;
+   int i;
+
+   /* measured on the headers of /usr/include in one 126 MB file: the
+      names of the symbol table are hashed with the -a hash, hash16 took
+      145 s there against 0.40 s with wide, as 170K names do not spread
+      over its 64K values; the arena costs no time but 300 allocations
+      take the place of 400K. The maps are keyed on 4-byte IDs, so a
+      compact node is 24 bytes against 72 and a slot, and the defines
+      map takes 3.9 MB there instead of 9.6 MB with open addressing, for
+      about 2% more time */
+   options.uHashFlags = HASH_MAP_COMPACT | HASH_MAP_WIDE | HASH_MAP_ARENA;
+
+   parse_cmdln(argc, argv);
+
+   /* count all memory from here on when printing statistics */
+   if ( options.fStats )
+   {
+      hash_map_counter_init(&MemCounter, 0);
+      hash_map_set_allocator(&MemCounter.allocator);
+   }
+
+   init_stop_table(StopBrace, "{}");
+   init_stop_table(StopTag, " \t,(;{\r\n");
+   init_stop_table(StopTagEnd, " \t,;\r\n");
+   init_stop_table(StopStatement, ";\n");
+   init_stop_table(StopSemicolon, ";");
+   for ( i = 0; i < 256; i++ )
+      StopName[i] = !( scan_class[i] & SCAN_IDENT );
+   for ( i = 1; i < DIRECTIVE_COUNT; i++ )
+      DirectiveTable[DIRECTIVE_HASH(DirectiveNames[i], strlen(DirectiveNames[i]))] = (unsigned char)i;
+
+   kernels = scan_init(SCAN_AVX2);
+
+#ifdef BINTREE_TEST
+   if ( !binarytree_test() )
+      return 1;
+   if ( !binarytree_balance_test() )
+      return 1;
+   if ( !binarytree_walk_test() )
+      return 1;
+   printf("binarytree_test: info: completed\n");
+   return 0;
+#endif
+
+#ifdef HASHMAP_STRESS
+   return hashmap_stress() ? 0 : 1;
+#endif
+
+#ifdef HASHMAP_FORK_TEST
+   return hashmap_fork_test() ? 0 : 1;
+#endif
+
+#ifdef SCAN_TEST
+   return scan_test() ? 0 : 1;
+#endif
+
+#ifdef LEX_TEST
+   return lex_test() ? 0 : 1;
+#endif
+
+   parser = h2incn_alloc(sizeof(struct parser_t));
+   if ( !parser )
+   {
+      printf("insufficient memory\n");
+      return 1;
+   }
+   memset(parser, 0, sizeof(struct parser_t));
+
+   /* stdin is converted as a filter, a chunk at a time, to stdout */
+   if ( !strcmp(options.pInFileName, "-") )
+   {
+      if ( !options.uChunkSize )
+         options.uChunkSize = H2INCN_CHUNKSIZE;
+      if ( !options.pOutFileName )
+         options.pOutFileName = "-";
+   }
+
+   if ( !options.pOutFileName )
+   {
+      /* set up default out_file name */
+      options.pOutFileName = h2incn_alloc(strlen(options.pInFileName)+8);
+      strcpy(options.pOutFileName, options.pInFileName);
+      tptr = strrchr(options.pOutFileName, '.');
+      if ( !tptr )
+         strcat(options.pOutFileName, ".inc");
+      else
+         strcpy(tptr, ".inc");
+   }
+
+   /* open output file */
+   if ( !strcmp(options.pOutFileName, "-") )
+   {
+      /* messages are printed to stdout, move them to stderr */
+      parser->pOutFile = fdopen(dup(fileno(stdout)), "w");
+      dup2(fileno(stderr), fileno(stdout));
+   }
+   else
+      parser->pOutFile = fopen(options.pOutFileName, "w");
+   if ( !parser->pOutFile )
+   {
+      printf("error opening output file: %s\n", options.pOutFileName);
+      return 1;
+   }
+
+   /* fixed size maps start out at their final size, others grow */
+   if ( options.uHashFlags & HASH_MAP_FIXED )
+   {
+      pDefinesMap = hash_map_alloc(0x8000, SYMBOL_MAP_FLAGS(options.uHashFlags));
+      pHeadersMap = hash_map_alloc(0x80, SYMBOL_MAP_FLAGS(options.uHashFlags));
+   }
+   else
+   {
+      pDefinesMap = hash_map_alloc(0x40, SYMBOL_MAP_FLAGS(options.uHashFlags));
+      pHeadersMap = hash_map_alloc(0x10, SYMBOL_MAP_FLAGS(options.uHashFlags));
+   }
+   if ( !pDefinesMap || !pHeadersMap )
+   {
+      printf("insufficient memory\n");
+      return 1;
+   }
+
+   /* the names are hashed with the hash function selected by -a */
+   pSymbols = hash_intern_alloc(0x400, options.uHashFlags);
+   if ( !pSymbols )
+   {
+      printf("insufficient memory\n");
+      return 1;
+   }
+
+   if ( options.fVerbose )
+      printf("scanning with %s kernels\n", scan_name(kernels));
+
+   parser->pFileName = options.pInFileName;
+
+   bSuccess = h2incn_read(parser);
+
+   fflush(parser->pOutFile);
+   fclose(parser->pOutFile);
+
+   h2incn_free(parser);
+
+   if ( options.fStats )
+   {
+      print_map_stats("DefinesMap", pDefinesMap);
+      print_map_stats("HeadersMap", pHeadersMap);
+      printf("Symbols: %u names and values of %lu bytes in %u slots, %lu bytes allocated\n",
+         pSymbols->count, pSymbols->bytes, pSymbols->mask + 1, hash_intern_bytes(pSymbols));
+   }
+
+   hash_map_free(pDefinesMap);
+   hash_map_free(pHeadersMap);
+   hash_intern_free(pSymbols);
+
+   if ( options.fStats )
+      print_mem_stats(&MemCounter);
 
    return ( bSuccess == 0 ? 1 : 0 );
 }
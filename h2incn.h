@@ -13,17 +13,68 @@
 #define __H2INCN_VERSION_BUILD__ 1
 
 #define H2INCN_BUFSIZE 4096
+#define H2INCN_CHUNKSIZE 0x100000  /* bytes read at a time when streaming stdin */
+#define H2INCN_TOKENS 4096         /* tokens lexed at a time, see h2incn_lex() */
+
+/* token kinds */
+#define TOKEN_END      0  /* end of the text */
+#define TOKEN_EOL      1  /* '\n' */
+#define TOKEN_COMMENT  2  /* multi-line comment, or single-line comment up to the eol */
+#define TOKEN_NAME     3  /* identifier */
+#define TOKEN_NUMBER   4
+#define TOKEN_STRING   5  /* string or char literal, or <name> of an #include */
+#define TOKEN_PUNCT    6  /* any other char */
+
+/* directives, see h2incn_directive() */
+#define DIRECTIVE_NONE      0  /* unknown, or no name after the '#' */
+#define DIRECTIVE_INCLUDE   1
+#define DIRECTIVE_DEFINE    2
+#define DIRECTIVE_UNDEF     3
+#define DIRECTIVE_IF        4
+#define DIRECTIVE_IFDEF     5
+#define DIRECTIVE_IFNDEF    6
+#define DIRECTIVE_ELIF      7
+#define DIRECTIVE_ELIFDEF   8
+#define DIRECTIVE_ELIFNDEF  9
+#define DIRECTIVE_ELSE      10
+#define DIRECTIVE_ENDIF     11
+#define DIRECTIVE_ERROR     12
+#define DIRECTIVE_WARNING   13
+#define DIRECTIVE_PRAGMA    14
+#define DIRECTIVE_LINE      15
+#define DIRECTIVE_COUNT     16
 
 extern struct list_t *pFileList;
 
+/* tokens in parallel arrays, a batch of lines at a time */
+struct tokens_t {
+   char *pBase;              /* text the offsets are from */
+   unsigned char *pKind;     /* TOKEN_xxx */
+   unsigned int *pOffset;
+   unsigned int *pLength;
+   unsigned int *pHash;      /* hash of a TOKEN_NAME for the symbols, see hash_intern_scan(), only set for names */
+   unsigned int *pLines;     /* lines ended in a TOKEN_COMMENT, only set for comments */
+   char *pEnd;               /* text after the batch, see h2incn_lex() */
+   unsigned int uCount;
+   unsigned int uNext;       /* next token to parse */
+   unsigned int uMax;
+};
+
 struct parser_t {
    struct parser_t *pPrevParser;
    char *pFileName;
    char *pFileBuffer;
-   char *pLine;
    char *pNextToken;
-   int  iLineNum;
-   int  iFileSize;
+   size_t uFileSize;
+   size_t uMapSize;    /* bytes mapped at pFileBuffer, 0 if it was allocated */
+   size_t *pSplices;   /* offsets in pFileBuffer where a continued line was joined */
+   size_t uSplices;
+   size_t uSplicesMax;
+   int  iSplicedLines; /* lines joined in earlier chunks of the file */
+   int  iChunkLines;   /* lines ended in earlier chunks of the file */
+   size_t uCounted;    /* bytes of pFileBuffer whose lines are counted, see h2incn_line() */
+   int  iCountedLines; /* lines ended in those bytes */
+   struct tokens_t tokens;
    FILE *pOutFile;
 };
 
@@ -32,12 +83,15 @@ struct options_t {
    char *pOutFileName;
    char *pDefines;
    char *pIncludePath;
+   unsigned int uHashFlags;
+   size_t uChunkSize;  /* bytes of input parsed at a time, 0 to read whole files */
 
    int fComments: 1,
        fCode: 1,
        fMacros: 1,
        fPreprocess: 1,
        fRecurse: 1,
+       fStats: 1,
        fVerbose: 1;
 };
 
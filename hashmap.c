@@ -10,8 +10,52 @@
 #include <malloc.h>
 #include "hashmap.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HASH_OPEN_SSE2 1
+#define HASH_MAP_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define HASH_MAP_PREFETCH(p)
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#define HASH_CONC_YIELD()  SwitchToThread()
+#else
+#include <sched.h>
+#define HASH_CONC_YIELD()  sched_yield()
+#endif
+
 #define HASH_MAP_MAGIC  0x6d686470  // 'pdhm'
 
+/* internal flag, map was freed while it still had forks */
+#define HASH_MAP_RELEASED  0x80000000
+
+/* open addressing control bytes, a full slot holds 7 bits of its hash */
+#define HASH_OPEN_EMPTY    0x80
+#define HASH_OPEN_DELETED  0xFE
+#define HASH_OPEN_GROUP    16          /* slots probed at a time */
+#define HASH_OPEN_NONE     0xFFFFFFFF  /* no slot */
+
+#define HASH_MAP_REHASH_STEP  4  /* buckets moved per insert/delete while growing */
+#define HASH_MAP_BATCH       32  /* keys prefetched at a time by hash_map_find_batch() */
+
+/* fold a 32-bit hash before masking it into a bucket index */
+#define HASH_MAP_FOLD(hash) ((((hash) >> 16) ^ (hash)))
+
+/* true if a key is visited by a hash_map_first() walk */
+#define HASH_MAP_ITER_MATCH(iter, key, klen) \
+   ( ( (klen) >= (iter)->plen ) && !memcmp((key), (iter)->prefix, (iter)->plen) )
+
+/* hash_fnv1a() and hash_wide() steps, shared with hash_map_scan() */
+#define HASH_FNV1A_BASIS  2166136261u
+#define HASH_FNV1A_PRIME  16777619u
+#define HASH_WIDE_SEED    0x9e3779b97f4a7c15ULL
+#define HASH_WIDE_MIX(h, w) \
+   { (h) = ((h) ^ (w)) * 0xff51afd7ed558ccdULL; (h) ^= (h) >> 32; }
+#define HASH_WIDE_FINAL(h, len) \
+   ( (h) ^= (len), (h) ^= (h) >> 33, (h) *= 0xc4ceb9fe1a85ec53ULL, (h) ^= (h) >> 33, (unsigned int)(h) )
+
 /*
 
 unsigned int hash16(unsigned char* p, unsigned int len)
@@ -48,239 +92,3474 @@ static unsigned int hash16(unsigned char* buf, unsigned int len)
    return ( (sum2 << 8) | sum1 );
 }
 
-/***********************************************************
+/*
 
-hash_map_t* hash_map_alloc(unsigned int buckets)
+unsigned int hash_fnv1a(unsigned char* p, unsigned int len)
 
 Purpose
-   To allow memory for the hashmap
+   To calculate a 32-bit FNV-1a hash of a buffer of memory
 
 Params
-   buckets - power of 2 number of buckets
+   p - ptr to memory
+   len - length of buffer to hash
 
 Returns
-   ptr to hashmap, null ptr if error
+   a 32-bit hash
+
+Notes
+   The hash itself is computed by FNV1Hash() in fnv1hash.asm
 
 */
-struct hash_map_t* hash_map_alloc(unsigned int buckets)
+static unsigned int hash_fnv1a(unsigned char* buf, unsigned int len)
 {
-   struct hash_map_t *pHashMap;
-   unsigned int len;
+   return FNV1Hash((char*)buf, len, HASH_FNV1A_BASIS);
+}
 
-   /* ensure correct buckets bitmask */
-   if ( buckets == 0 )
-      return (struct hash_map_t*)0;
+/*
 
-   /* we don't support hashmaps > 32K */
-   if ( buckets > 0x8000 )
-      buckets = 0x8000;
+unsigned int hash_wide(unsigned char* p, unsigned int len)
 
-   /* find uppermost bit */
-   len = (1 << ((sizeof(int)*8) - 1));
-   while ( (buckets & len) == 0 )
-      len = len >> 1;
-   len--;  /* create the mask */
-   buckets = len;  /* assign bucket size / bit mask */
+Purpose
+   To calculate a 32-bit hash of a buffer of memory 8 bytes at a time
 
-   /* alloc memory space */
-   len = sizeof(struct hash_map_t);
-   len += ((buckets + 1) * sizeof(void*));
-   pHashMap = malloc(len);
-   if ( pHashMap )
+Params
+   p - ptr to memory
+   len - length of buffer to hash
+
+Returns
+   a 32-bit hash
+
+Notes
+   Each 64-bit word is mixed into the hash with a multiply and
+   xor-shift, followed by a final avalanche step. Identifiers are
+   mostly shorter than 16 bytes so this typically takes 1 or 2 rounds
+   instead of one round per byte. The length is mixed in last so that
+   hash_map_scan() can compute the same hash while it looks for the
+   end of a token.
+
+*/
+static unsigned int hash_wide(unsigned char* buf, unsigned int len)
+{
+   unsigned long long h;
+   unsigned long long w;
+   unsigned int n;
+
+   h = HASH_WIDE_SEED;
+   n = len;
+   while ( n >= 8 )
    {
-      memset(pHashMap, 0, len);
-      pHashMap->magic   = HASH_MAP_MAGIC;
-      pHashMap->buckets = buckets;
+      memcpy(&w, buf, 8);
+      HASH_WIDE_MIX(h, w);
+      buf += 8;
+      n -= 8;
    }
-   return pHashMap;
+   if ( n )
+   {
+      w = 0;
+      memcpy(&w, buf, n);
+      HASH_WIDE_MIX(h, w);
+   }
+
+   return HASH_WIDE_FINAL(h, len);
 }
 
-/******************************************************************************************
+/*
 
-struct bst_node_t* hash_map_find(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+unsigned int hash_id(unsigned char* p, unsigned int len)
 
 Purpose
-   To find a node within the hashmap containing key
+   To use a 32-bit key, such as an ID returned by hash_intern(), as its
+   own hash
 
 Params
-   pHashMap - ptr to hash map to search
-   key - ptr to key to search for
-   klen - length of key
+   p - ptr to key
+   len - length of key
 
 Returns
-   ptr to node if found, otherwise null
+   the key itself if it is 4 bytes long, else hash_wide() of it
+
+Notes
+   IDs are unique and mostly dense, so they spread over the buckets
+   as well as any hash would, and a lookup by ID costs no hashing at
+   all when the ID is passed to the hash_map_*_hashed() functions.
 
 */
-struct bst_node_t* hash_map_find(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+static unsigned int hash_id(unsigned char* buf, unsigned int len)
 {
-   unsigned int hash;
-   struct bst_node_t** root;
+   unsigned int id;
 
-#if 0
-   /* compute the 32-bit hash value of key */
-   hash = FNV1Hash(key, klen, 2166136261);
+   if ( len != sizeof(id) )
+      return hash_wide(buf, len);
+   memcpy(&id, buf, sizeof(id));
+   return id;
+}
 
-   /* xor-fold into 16-bit value */
-   hash = (((hash >> 16) ^ hash) & pHashMap->buckets);
-#endif
+/* hash function selected by the HASH_MAP_* hash flags */
+static unsigned int (*hash_map_function(unsigned int flags))(unsigned char *buf, unsigned int len)
+{
+   switch ( flags & HASH_MAP_HASH_MASK )
+   {
+      case HASH_MAP_FNV1A:
+         return hash_fnv1a;
+      case HASH_MAP_WIDE:
+         return hash_wide;
+      case HASH_MAP_ID:
+         return hash_id;
+      default:
+         return hash16;
+   }
+}
 
-   hash = hash16(key, klen) & pHashMap->buckets;
+/*
+
+   Allocators
+
+   All memory of a map comes from the allocator it was created with,
+   the global one unless hash_map_alloc_with() was used. The global
+   allocator starts out as malloc() and free() and is also used for
+   the nodes bintree.asm allocates. The counting allocator wraps
+   malloc() and free(), keeping the size of each block in a header
+   in front of it.
+
+*/
+
+#define HASH_MAP_MALLOC(pHashMap, size) \
+   ((pHashMap)->allocator->alloc((pHashMap)->allocator->ctx, (size)))
+#define HASH_MAP_MFREE(pHashMap, p) \
+   ((pHashMap)->allocator->free((pHashMap)->allocator->ctx, (p)))
 
-   root = (struct bst_node_t**)((char*)(((char*)pHashMap) + sizeof(struct hash_map_t)) + (hash * sizeof(void*)));
+#define HASH_COUNTER_HEADER  16  /* keeps the blocks 16-byte aligned */
 
-   return binarytree_find_node(root, key, klen);
+static void* hash_std_alloc(void *ctx, size_t size)
+{
+   (void)ctx;
+   return malloc(size);
 }
 
-/*************************************************************************************************************
+static void hash_std_free(void *ctx, void *p)
+{
+   (void)ctx;
+   free(p);
+}
 
-int hash_map_insert(struct hash_map_t* pHashMap, void *key, unsigned int klen, char *value, unsigned int vlen)
+static struct hash_map_allocator_t HashStdAllocator = { hash_std_alloc, hash_std_free, (void*)0 };
+static struct hash_map_allocator_t *HashAllocator = &HashStdAllocator;
 
-Purpose
-   To insert a node within the hashmap containing key/value pair
+/* bintree.asm calls through ptrs without a ctx */
+static void* hash_bst_alloc(size_t size)
+{
+   return HashAllocator->alloc(HashAllocator->ctx, size);
+}
 
-Params
-   pHashMap - ptr to hash map to insert into
-   key - ptr to key to insert
-   klen - length of key
-   value - data corresponding to key
-   vlen - length of data value
+static void hash_bst_free(void *p)
+{
+   HashAllocator->free(HashAllocator->ctx, p);
+}
 
-Returns
-   0 if successful, otherwise error code
+static void* hash_counter_alloc(void *ctx, size_t size)
+{
+   struct hash_map_counter_t *counter = ctx;
+   unsigned char *p;
+   unsigned int sc;
 
-Notes
-   value may be null or vlen may be zero if using the hash map for keys only.
-   Duplicate keys are not supported.
+   if ( counter->limit && ( size > counter->limit - counter->bytes ) )
+   {
+      counter->failures++;
+      return (void*)0;
+   }
 
-*/
-int hash_map_insert(struct hash_map_t* pHashMap, void *key, unsigned int klen, void *value, unsigned int vlen)
+   p = malloc(size + HASH_COUNTER_HEADER);
+   if ( !p )
+   {
+      counter->failures++;
+      return p;
+   }
+   *(size_t*)p = size;
+
+   counter->allocs++;
+   counter->bytes += size;
+   if ( counter->bytes > counter->peak )
+      counter->peak = counter->bytes;
+   for ( sc = 0; ( sc < HASH_MAP_COUNTER_CLASSES - 1 ) && ( size > ( 16UL << sc ) ); sc++ )
+      ;
+   counter->sizes[sc]++;
+   return p + HASH_COUNTER_HEADER;
+}
+
+static void hash_counter_free(void *ctx, void *p)
 {
-   unsigned int hash;
-   struct bst_node_t *node;
-   struct bst_node_t **root;
+   struct hash_map_counter_t *counter = ctx;
+
+   if ( !p )
+      return;
+   p = (unsigned char*)p - HASH_COUNTER_HEADER;
+   counter->frees++;
+   counter->bytes -= *(size_t*)p;
+   free(p);
+}
 
-#ifdef _DEBUG
-   static int cCollisions = 0;
-   static int cInserts = 0;
-#endif
+/*
 
-#if 0
-   /* compute the 32-bit hash value of key */
-   hash = FNV1Hash(key, klen, 2166136261);
+   Node arena (HASH_MAP_ARENA)
+
+   Nodes, along with their key and value buffers, are carved from 64K
+   blocks instead of being malloc'ed one at a time. A deleted node goes
+   on a freelist for its size class and is reused by the next node of
+   the same size, so repeated #undef/#define of a symbol does not grow
+   the arena. Freeing the map releases the blocks without visiting the
+   nodes. Nodes larger than the biggest size class go on a single list
+   and are only reused by a node of exactly the same size, which is
+   what a redefined symbol needs; the list is searched from its start,
+   so it is meant to stay short. A node larger than a block gets a
+   block of its own, and the block being carved goes on being carved.
+   When a node does not fit into what is left of the block being
+   carved, the rest of it is put on the size class freelists before a
+   new block is started, so nothing but the rounding to 16 bytes is
+   lost.
+
+   Every piece of arena memory also has a 32-bit index made of its
+   block number and its offset within the block in 16-byte units, plus
+   one, so 0 is never a valid index and means none. HASH_MAP_COMPACT
+   nodes link to each other by these indices instead of by pointer.
+   Plain nodes are linked by pointer and keep no index, so they are
+   allocated and released without one; memory released without an
+   index is never handed to a caller that asks for one.
 
-   /* xor-fold into 16-bit value */
-   hash = (((hash >> 16) ^ hash) & pHashMap->buckets);
-#endif
+*/
 
-   hash = hash16(key, klen) & pHashMap->buckets;
+#define HASH_ARENA_BLOCK    0x10000  /* bytes per block */
+#define HASH_ARENA_ALIGN    16       /* node sizes are rounded to this */
+#define HASH_ARENA_SHIFT    12       /* log2 of units per block */
+#define HASH_ARENA_CLASSES  32       /* freelists for nodes up to 512 bytes */
+
+/* map an arena index to its memory */
+#define HASH_ARENA_PTR(arena, index) \
+   ((arena)->blocks[((index) - 1) >> HASH_ARENA_SHIFT] + ((((index) - 1) & ((1 << HASH_ARENA_SHIFT) - 1)) * HASH_ARENA_ALIGN))
+
+/* a node on a freelist */
+struct hash_arena_chunk_t {
+   struct hash_arena_chunk_t *next;
+   unsigned int index;                 /* 0 if released without one */
+   unsigned int size;
+};
+
+struct hash_arena_t {
+   struct hash_map_allocator_t *allocator;
+   unsigned char **blocks;             /* all blocks, freed with the map */
+   unsigned int nblocks;               /* blocks in use */
+   unsigned int maxblocks;             /* size of blocks array */
+   unsigned int current;               /* block being carved */
+   unsigned int offset;                /* next free byte in current block */
+   unsigned int avail;                 /* bytes left in current block */
+   unsigned long bytes;                /* memory of all blocks */
+   struct hash_arena_chunk_t *free[HASH_ARENA_CLASSES];
+   struct hash_arena_chunk_t *large;   /* freed nodes of any larger size */
+};
+
+/* rounded size of the memory holding a node and its key/value */
+static unsigned int hash_arena_size(unsigned int hlen, unsigned int klen, unsigned int vlen)
+{
+   unsigned int size;
 
-   node = binarytree_alloc_node(key, klen, value, vlen);
-   if ( !node )
-      return 2;  /* insufficient memory error */
+   size = hlen + klen + vlen;
+   return (size + HASH_ARENA_ALIGN - 1) & ~(HASH_ARENA_ALIGN - 1);
+}
 
-#ifdef _DEBUG
-   cInserts++;
-   printf("Hash=0x%04x : Total of %d inserts\n", hash, cInserts);
-#endif
+/* add a block of len bytes to the arena, returns its number */
+static unsigned int hash_arena_block(struct hash_arena_t *arena, unsigned int len)
+{
+   unsigned int max;
+   unsigned char **blocks;
+   struct hash_map_allocator_t *allocator;
+
+   allocator = arena->allocator;
+   if ( arena->nblocks == arena->maxblocks )
+   {
+      max = arena->maxblocks ? arena->maxblocks * 2 : 16;
+      if ( max > (0xFFFFFFFF >> HASH_ARENA_SHIFT) )
+         return 0xFFFFFFFF;  /* out of indices */
+      blocks = allocator->alloc(allocator->ctx, max * sizeof(void*));
+      if ( !blocks )
+         return 0xFFFFFFFF;
+      if ( arena->nblocks )
+         memcpy(blocks, arena->blocks, arena->nblocks * sizeof(void*));
+      allocator->free(allocator->ctx, arena->blocks);
+      arena->blocks = blocks;
+      arena->maxblocks = max;
+   }
 
-   root = (struct bst_node_t**)((char*)(((char*)pHashMap) + sizeof(struct hash_map_t)) + (hash * sizeof(void*)));
+   arena->blocks[arena->nblocks] = allocator->alloc(allocator->ctx, len);
+   if ( !arena->blocks[arena->nblocks] )
+      return 0xFFFFFFFF;
+   arena->bytes += len;
+   return arena->nblocks++;
+}
 
-   /* check for existing entry, if any */
-   if ( *root == 0 )
+/* put size bytes at p back on the freelist for their size, index is 0 if the caller keeps none */
+static void hash_arena_release(struct hash_arena_t *arena, void *p, unsigned int size, unsigned int index)
+{
+   unsigned int sc;
+   struct hash_arena_chunk_t *chunk;
+
+   chunk = p;
+   chunk->index = index;
+   chunk->size = size;
+   sc = (size / HASH_ARENA_ALIGN) - 1;
+   if ( sc < HASH_ARENA_CLASSES )
    {
-      /* assert: no collision, put new root node entry here */
-      *root = node;
+      chunk->next = arena->free[sc];
+      arena->free[sc] = chunk;
    }
    else
    {
-#ifdef _DEBUG
-      cCollisions++;
-      printf("Hash=0x%04x : Total of %d collisions\n", hash, cCollisions);
-#endif
-      return binarytree_insert_node(root, node);
+      chunk->next = arena->large;
+      arena->large = chunk;
    }
+}
 
-   return 0;
+/* carve size bytes from the arena, reusing a freed node if possible; index may be null if not needed */
+static void* hash_arena_alloc(struct hash_arena_t *arena, unsigned int size, unsigned int *index)
+{
+   unsigned int sc;
+   unsigned int len;
+   unsigned int block;
+   unsigned char *p;
+   struct hash_arena_chunk_t *chunk;
+   struct hash_arena_chunk_t **link;
+
+   sc = (size / HASH_ARENA_ALIGN) - 1;
+   if ( sc < HASH_ARENA_CLASSES )
+      link = &arena->free[sc];
+   else
+   {
+      for ( link = &arena->large; *link && ( (*link)->size != size ); link = &(*link)->next )
+         ;
+   }
+   chunk = *link;
+   if ( chunk && ( chunk->index || !index ) )
+   {
+      *link = chunk->next;
+      if ( index )
+         *index = chunk->index;
+      return chunk;
+   }
+
+   if ( size > arena->avail )
+   {
+      if ( size > HASH_ARENA_BLOCK )
+      {
+         /* dedicated block, the current one goes on being carved */
+         block = hash_arena_block(arena, size);
+         if ( block == 0xFFFFFFFF )
+            return (void*)0;
+         if ( index )
+            *index = (block << HASH_ARENA_SHIFT) + 1;
+         return arena->blocks[block];
+      }
+
+      block = hash_arena_block(arena, HASH_ARENA_BLOCK);
+      if ( block == 0xFFFFFFFF )
+         return (void*)0;
+      while ( arena->avail )
+      {
+         /* the rest of the current block is reused like freed nodes of the size classes */
+         len = ( arena->avail < HASH_ARENA_CLASSES * HASH_ARENA_ALIGN ) ? arena->avail : HASH_ARENA_CLASSES * HASH_ARENA_ALIGN;
+         hash_arena_release(arena, arena->blocks[arena->current] + arena->offset, len,
+            ((arena->current << HASH_ARENA_SHIFT) | (arena->offset / HASH_ARENA_ALIGN)) + 1);
+         arena->offset += len;
+         arena->avail -= len;
+      }
+      arena->current = block;
+      arena->offset = 0;
+      arena->avail = HASH_ARENA_BLOCK;
+   }
+
+   block = arena->current;
+   p = arena->blocks[block] + arena->offset;
+   if ( index )
+      *index = ((block << HASH_ARENA_SHIFT) | (arena->offset / HASH_ARENA_ALIGN)) + 1;
+   arena->offset += size;
+   arena->avail -= size;
+   return p;
 }
 
-/*****************************************************************************
+/* release all arena blocks */
+static void hash_arena_free(struct hash_arena_t *arena)
+{
+   unsigned int i;
+   struct hash_map_allocator_t *allocator;
 
-int hash_map_delete(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+   allocator = arena->allocator;
+   for ( i = 0; i < arena->nblocks; i++ )
+      allocator->free(allocator->ctx, arena->blocks[i]);
+   allocator->free(allocator->ctx, arena->blocks);
+   allocator->free(allocator->ctx, arena);
+}
 
-Purpose
-   To delete a node from the hashmap containing key
+/* fill in a node the same way binarytree_alloc_node() does, its key and value follow it */
+static struct bst_node_t* hash_map_node_init(struct bst_node_t *node, void *key, unsigned int klen, void *value, unsigned int vlen)
+{
+   memset(node, 0, sizeof(struct bst_node_t));
+   node->key = node + 1;
+   node->klen = klen;
+   memcpy(node->key, key, klen);
+   if ( vlen )
+   {
+      node->value = (unsigned char*)node->key + klen;
+      node->vlen = vlen;
+      memcpy(node->value, value, vlen);
+   }
+   return node;
+}
 
-Params
-   pHashMap - ptr to hash map to insert into
-   key - ptr to key to delete
-   klen - length of key
+/* allocate and fill a node */
+static struct bst_node_t* hash_map_node_alloc(struct hash_map_t *pHashMap, void *key, unsigned int klen, void *value, unsigned int vlen)
+{
+   struct bst_node_t *node;
 
-Returns
-   0 if successful, otherwise error code
+   if ( !value )
+      vlen = 0;
 
-Notes
+   if ( !key || !klen )
+      return (struct bst_node_t*)0;
 
-*/
-int hash_map_delete(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+   if ( pHashMap->arena )
+      node = hash_arena_alloc(pHashMap->arena, hash_arena_size(sizeof(struct bst_node_t), klen, vlen), (unsigned int*)0);
+   else
+   {
+      node = HASH_MAP_MALLOC(pHashMap, sizeof(struct bst_node_t) + klen + vlen);
+      if ( node )
+         pHashMap->node_bytes += sizeof(struct bst_node_t) + klen + vlen;
+   }
+   if ( !node )
+      return (struct bst_node_t*)0;
+
+   return hash_map_node_init(node, key, klen, value, vlen);
+}
+
+/* free a node that is no longer linked into the map, it has no arena index */
+static void hash_map_node_free(struct hash_map_t *pHashMap, struct bst_node_t *node)
 {
-   unsigned int hash;
-   struct bst_node_t** root;
+   if ( !pHashMap->arena )
+   {
+      pHashMap->node_bytes -= sizeof(struct bst_node_t) + node->klen + node->vlen;
+      HASH_MAP_MFREE(pHashMap, node);
+   }
+   else
+      hash_arena_release(pHashMap->arena, node, hash_arena_size(sizeof(struct bst_node_t), node->klen, node->vlen), 0);
+}
 
-#if 0
-   /* compute the 32-bit hash value of key */
-   hash = FNV1Hash(key, klen, 2166136261);
+/*
 
-   /* xor-fold into 16-bit value */
-   hash = (((hash >> 16) ^ hash) & pHashMap->buckets);
-#endif
+   Compact nodes (HASH_MAP_COMPACT)
 
-   hash = hash16(key, klen) & pHashMap->buckets;
+   The buckets of a compact map hold binary trees of bst_cnode_t nodes
+   instead of bst_node_t. A compact node has no parent link, its child
+   links and the bucket roots are 32-bit arena indices, and the key and
+   value are stored right after the 16-byte header. A node is a third
+   of the size of a bst_node_t and a lookup usually reads the links and
+   the start of the key from the same cache line. Keys are ordered the
+   same way as in bintree.asm.
+
+*/
 
-   root = (struct bst_node_t**)((char*)(((char*)pHashMap) + sizeof(struct hash_map_t)) + (hash * sizeof(void*)));
+/* map an arena index to a compact node */
+#define HASH_CNODE(pHashMap, index) ((struct bst_cnode_t*)HASH_ARENA_PTR((pHashMap)->arena, index))
 
-   return binarytree_delete_node(root, key, klen);
+/* obtain address of the root index for a 32-bit hash */
+static unsigned int* hash_compact_bucket(struct hash_map_t *pHashMap, unsigned int hash)
+{
+   unsigned int i;
 
+   hash = HASH_MAP_FOLD(hash);
+   if ( pHashMap->old_roots )
+   {
+      i = hash & pHashMap->old_buckets;
+      if ( i >= pHashMap->rehash )
+         return &pHashMap->old_roots[i];
+   }
+   return &pHashMap->roots[hash & pHashMap->buckets];
 }
 
-/*****************************************************************************
+/* find the link holding key, or the empty link where key belongs */
+static unsigned int* hash_compact_link(struct hash_map_t *pHashMap, unsigned int *link, void *key, unsigned int klen)
+{
+   int cmp;
+   struct bst_cnode_t *node;
 
-int hash_map_free(struct hash_map_t *pHashMap)
+   while ( *link )
+   {
+      node = HASH_CNODE(pHashMap, *link);
+      cmp = memcmp(key, node + 1, klen < node->klen ? klen : node->klen);
+      if ( cmp == 0 )
+      {
+         if ( klen == node->klen )
+            break;
+         cmp = klen < node->klen ? -1 : 1;
+      }
+      link = cmp < 0 ? &node->left : &node->right;
+   }
+   return link;
+}
 
-Purpose
-   To delete all nodes from the hashmap
+/* move all nodes of a compact tree into the current roots */
+static void hash_compact_move_tree(struct hash_map_t *pHashMap, unsigned int index)
+{
+   unsigned int hash;
+   unsigned int right;
+   unsigned int *link;
+   struct bst_cnode_t *node;
 
-Params
-   pHashMap - ptr to hash map to delete
+   while ( index )
+   {
+      node = HASH_CNODE(pHashMap, index);
+      hash_compact_move_tree(pHashMap, node->left);
+      right = node->right;
+      node->left = 0;
+      node->right = 0;
+      hash = HASH_MAP_FOLD(pHashMap->hash((unsigned char*)(node + 1), node->klen));
+      link = hash_compact_link(pHashMap, &pHashMap->roots[hash & pHashMap->buckets], node + 1, node->klen);
+      *link = index;
+      index = right;
+   }
+}
 
-Returns
-   0 if successful, otherwise error code
+/* fill in the node returned for a compact node */
+static struct bst_node_t* hash_compact_view(struct hash_map_t *pHashMap, unsigned int index, unsigned int hash)
+{
+   struct bst_cnode_t *node;
+
+   node = HASH_CNODE(pHashMap, index);
+   pHashMap->view.hash = hash;
+   pHashMap->view.key = node + 1;
+   pHashMap->view.klen = node->klen;
+   pHashMap->view.vlen = node->vlen;
+   if ( node->vlen )
+      pHashMap->view.value = (unsigned char*)(node + 1) + node->klen;
+   else
+      pHashMap->view.value = (void*)0;
+   return &pHashMap->view;
+}
 
-Notes
+static struct bst_node_t* hash_compact_find(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   unsigned int *link;
 
-*/
-int hash_map_free(struct hash_map_t *pHashMap)
+   if ( !key || !klen )
+      return (struct bst_node_t*)0;
+
+   link = hash_compact_bucket(pHashMap, hash);
+   link = hash_compact_link(pHashMap, link, key, klen);
+   if ( *link == 0 )
+      return (struct bst_node_t*)0;
+
+   return hash_compact_view(pHashMap, *link, hash);
+}
+
+static int hash_compact_insert(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen, void *value, unsigned int vlen)
 {
-   unsigned int i;
-   struct bst_node_t** root;
+   unsigned int index;
+   unsigned int *root;
+   unsigned int *link;
+   struct bst_cnode_t *node;
+   struct bst_cnode_t *old;
 
-   if ( !pHashMap )
+   if ( !key || !klen )
       return 1;  /* param error */
+   if ( !value )
+      vlen = 0;
 
-   if ( pHashMap->magic != HASH_MAP_MAGIC )
-      return 1;  /* param error */
+   node = hash_arena_alloc(pHashMap->arena, hash_arena_size(sizeof(struct bst_cnode_t), klen, vlen), &index);
+   if ( !node )
+      return 2;  /* insufficient memory error */
 
-   for ( i = 0; i < pHashMap->buckets; i++ )
+   node->left = 0;
+   node->right = 0;
+   node->klen = klen;
+   node->vlen = vlen;
+   memcpy(node + 1, key, klen);
+   if ( vlen )
+      memcpy((unsigned char*)(node + 1) + klen, value, vlen);
+
+   root = hash_compact_bucket(pHashMap, hash);
+   link = hash_compact_link(pHashMap, root, key, klen);
+   if ( *link )
    {
-      /* delete all binary trees */
-      root = (struct bst_node_t**)((char*)(((char*)pHashMap) + sizeof(struct hash_map_t)) + (i * sizeof(void*)));
-      if ( *root )
-         binarytree_delete_tree(root);
+      /* an existing key is replaced, the new node takes over its place */
+      old = HASH_CNODE(pHashMap, *link);
+      node->left = old->left;
+      node->right = old->right;
+      hash_arena_release(pHashMap->arena, old, hash_arena_size(sizeof(struct bst_cnode_t), old->klen, old->vlen), *link);
+      *link = index;
+      return 0;
    }
 
-   pHashMap->magic = 0;
+   if ( *root )
+      pHashMap->stats.collisions++;
+   *link = index;
+   pHashMap->count++;
+   return 0;
+}
+
+static int hash_compact_delete(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   unsigned int index;
+   unsigned int *link;
+   unsigned int *next;
+   struct bst_cnode_t *node;
+   struct bst_cnode_t *succ;
 
-   free(pHashMap);
+   if ( !key || !klen )
+      return 1;  /* param error */
+
+   link = hash_compact_bucket(pHashMap, hash);
+   if ( *link == 0 )
+      return 1;  /* empty tree, same as binarytree_delete_node() */
+   link = hash_compact_link(pHashMap, link, key, klen);
+   index = *link;
+   if ( index == 0 )
+      return 2;  /* key not found */
+
+   node = HASH_CNODE(pHashMap, index);
+   if ( node->left == 0 )
+      *link = node->right;
+   else if ( node->right == 0 )
+      *link = node->left;
+   else
+   {
+      /* replace the node by its in-order successor */
+      next = &node->right;
+      succ = HASH_CNODE(pHashMap, *next);
+      while ( succ->left )
+      {
+         next = &succ->left;
+         succ = HASH_CNODE(pHashMap, *next);
+      }
+      *link = *next;
+      *next = succ->right;
+      succ->left = node->left;
+      succ->right = node->right;
+   }
 
+   hash_arena_release(pHashMap->arena, node, hash_arena_size(sizeof(struct bst_cnode_t), node->klen, node->vlen), index);
+   pHashMap->count--;
    return 0;
 }
 
+/* walk a compact tree accumulating node count and depth into dist */
+static unsigned int hash_compact_tree_dist(struct hash_map_t *pHashMap, unsigned int index, unsigned int depth, struct hash_map_dist_t *dist)
+{
+   unsigned int count;
+   struct bst_cnode_t *node;
+
+   count = 0;
+   while ( index )
+   {
+      node = HASH_CNODE(pHashMap, index);
+      count++;
+      dist->total_depth += depth;
+      if ( depth > dist->max_depth )
+         dist->max_depth = depth;
+      count += hash_compact_tree_dist(pHashMap, node->left, depth + 1, dist);
+      index = node->right;
+      depth++;
+   }
+   return count;
+}
+
+static void hash_compact_distribution(struct hash_map_t* pHashMap, struct hash_map_dist_t *dist)
+{
+   unsigned int i;
+   unsigned int old;
+   unsigned int count;
+
+   /* buckets not yet moved out of the old roots count as well */
+   for ( i = 0; i <= pHashMap->buckets; i++ )
+   {
+      if ( pHashMap->old_roots && ( i <= pHashMap->old_buckets ) && ( i >= pHashMap->rehash ) )
+         old = pHashMap->old_roots[i];
+      else
+         old = 0;
+      if ( pHashMap->roots[i] || old )
+      {
+         count = hash_compact_tree_dist(pHashMap, pHashMap->roots[i], 1, dist);
+         count += hash_compact_tree_dist(pHashMap, old, 1, dist);
+         dist->used++;
+         dist->nodes += count;
+         if ( count > dist->max_nodes )
+            dist->max_nodes = count;
+      }
+   }
+}
+
+/* lowest node of a compact tree with a key above key, or equal to it unless after */
+static unsigned int hash_compact_bound(struct hash_map_t *pHashMap, unsigned int index, void *key, unsigned int klen, int after)
+{
+   int cmp;
+   unsigned int bound;
+   struct bst_cnode_t *node;
+
+   bound = 0;
+   while ( index )
+   {
+      node = HASH_CNODE(pHashMap, index);
+      cmp = memcmp(key, node + 1, klen < node->klen ? klen : node->klen);
+      if ( cmp == 0 )
+      {
+         if ( klen == node->klen )
+            cmp = after;
+         else
+            cmp = klen < node->klen ? -1 : 1;
+      }
+      if ( cmp <= 0 )
+      {
+         bound = index;
+         index = node->left;
+      }
+      else
+         index = node->right;
+   }
+   return bound;
+}
+
+/* address of the next root a walk visits, null after the last one */
+static unsigned int* hash_compact_iter_root(struct hash_map_t *pHashMap, struct hash_map_iter_t *iter)
+{
+   unsigned int i;
+
+   i = iter->bucket;
+   if ( pHashMap->old_roots )
+   {
+      if ( i <= pHashMap->old_buckets )
+      {
+         iter->bucket++;
+         return &pHashMap->old_roots[i];
+      }
+      i -= pHashMap->old_buckets + 1;
+   }
+   if ( i > pHashMap->buckets )
+      return (unsigned int*)0;
+   iter->bucket++;
+   return &pHashMap->roots[i];
+}
+
+static struct bst_node_t* hash_compact_next(struct hash_map_t* pHashMap, struct hash_map_iter_t *iter)
+{
+   unsigned int index;
+   unsigned int *root;
+   struct bst_cnode_t *node;
+
+   index = 0;
+   if ( iter->index )
+   {
+      node = HASH_CNODE(pHashMap, iter->index);
+      index = hash_compact_bound(pHashMap, iter->root, node + 1, node->klen, 1);
+   }
+
+   /* the keys starting with prefix follow each other within a tree */
+   for ( ;; )
+   {
+      if ( index )
+      {
+         node = HASH_CNODE(pHashMap, index);
+         if ( HASH_MAP_ITER_MATCH(iter, node + 1, node->klen) )
+            break;
+      }
+      root = hash_compact_iter_root(pHashMap, iter);
+      if ( !root )
+      {
+         iter->index = 0;
+         return (struct bst_node_t*)0;
+      }
+      iter->root = *root;
+      index = hash_compact_bound(pHashMap, iter->root, iter->prefix, iter->plen, 0);
+   }
+
+   iter->index = index;
+   return hash_compact_view(pHashMap, index, pHashMap->hash((unsigned char*)(node + 1), node->klen));
+}
+
+/*
+
+   Chained buckets
+
+   Each bucket holds the root of a binary tree of all nodes whose hash
+   maps to it. Unless HASH_MAP_FIXED is given the number of buckets is
+   doubled once there are more nodes than buckets. The nodes are then
+   moved to the new table a few buckets at a time by every insert and
+   delete, so no single call has to rehash the whole map; until all are
+   moved a bucket is looked up in the old table if it has not been
+   moved yet.
+
+*/
+
+/* obtain address of the bucket ( root ptr ) for a 32-bit hash */
+static struct bst_node_t** hash_map_bucket(struct hash_map_t *pHashMap, unsigned int hash)
+{
+   unsigned int i;
+
+   hash = HASH_MAP_FOLD(hash);
+   if ( pHashMap->old_table )
+   {
+      i = hash & pHashMap->old_buckets;
+      if ( i >= pHashMap->rehash )
+         return &pHashMap->old_table[i];
+   }
+   return &pHashMap->table[hash & pHashMap->buckets];
+}
+
+/* move all nodes of a binary tree into the current table */
+static void hash_map_move_tree(struct hash_map_t *pHashMap, struct bst_node_t *node)
+{
+   unsigned int hash;
+   struct bst_node_t *right;
+
+   while ( node )
+   {
+      hash_map_move_tree(pHashMap, node->left);
+      right = node->right;
+      node->parent = (struct bst_node_t*)0;
+      node->left = (struct bst_node_t*)0;
+      node->right = (struct bst_node_t*)0;
+      hash = HASH_MAP_FOLD(node->hash);
+      binarytree_insert_node(&pHashMap->table[hash & pHashMap->buckets], node);
+      node = right;
+   }
+}
+
+/* move up to count non-empty buckets from the old table */
+static void hash_map_rehash_step(struct hash_map_t *pHashMap, unsigned int count)
+{
+   unsigned int visits;
+   unsigned int index;
+   struct bst_node_t *node;
+
+   visits = count * 16;  /* bound time spent skipping empty buckets */
+   while ( count && visits && ( pHashMap->rehash <= pHashMap->old_buckets ) )
+   {
+      if ( pHashMap->flags & HASH_MAP_COMPACT )
+      {
+         index = pHashMap->old_roots[pHashMap->rehash];
+         pHashMap->old_roots[pHashMap->rehash] = 0;
+         if ( index )
+         {
+            hash_compact_move_tree(pHashMap, index);
+            count--;
+         }
+      }
+      else
+      {
+         node = pHashMap->old_table[pHashMap->rehash];
+         pHashMap->old_table[pHashMap->rehash] = (struct bst_node_t*)0;
+         if ( node )
+         {
+            hash_map_move_tree(pHashMap, node);
+            count--;
+         }
+      }
+      pHashMap->rehash++;
+      visits--;
+   }
+
+   if ( pHashMap->rehash > pHashMap->old_buckets )
+   {
+      HASH_MAP_MFREE(pHashMap, pHashMap->old_table);
+      HASH_MAP_MFREE(pHashMap, pHashMap->old_roots);
+      pHashMap->old_table = (struct bst_node_t**)0;
+      pHashMap->old_roots = (unsigned int*)0;
+   }
+}
+
+/* start moving the nodes into a table with twice the buckets */
+static void hash_map_grow(struct hash_map_t *pHashMap)
+{
+   unsigned int size;
+   unsigned int len;
+   void *table;
+
+   if ( pHashMap->buckets >= 0x7FFFFFFF )
+      return;
+
+   size = (pHashMap->buckets + 1) * 2;
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+      len = size * sizeof(unsigned int);
+   else
+      len = size * sizeof(void*);
+   table = HASH_MAP_MALLOC(pHashMap, len);
+   if ( !table )
+      return;  /* not fatal, the trees just get deeper */
+   memset(table, 0, len);
+
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+   {
+      pHashMap->old_roots = pHashMap->roots;
+      pHashMap->roots = table;
+   }
+   else
+   {
+      pHashMap->old_table = pHashMap->table;
+      pHashMap->table = table;
+   }
+   pHashMap->old_buckets = pHashMap->buckets;
+   pHashMap->rehash = 0;
+   pHashMap->buckets = size - 1;
+}
+
+/* free all nodes of a binary tree, its height keeps the recursion shallow */
+static void hash_map_free_tree(struct hash_map_t *pHashMap, struct bst_node_t *node)
+{
+   struct bst_node_t *right;
+
+   while ( node )
+   {
+      hash_map_free_tree(pHashMap, node->left);
+      right = node->right;
+      HASH_MAP_MFREE(pHashMap, node);
+      node = right;
+   }
+}
+
+/* address of the next bucket root a walk visits, null after the last one */
+static struct bst_node_t** hash_map_iter_root(struct hash_map_t *pHashMap, struct hash_map_iter_t *iter)
+{
+   unsigned int i;
+
+   i = iter->bucket;
+   if ( pHashMap->old_table )
+   {
+      if ( i <= pHashMap->old_buckets )
+      {
+         iter->bucket++;
+         return &pHashMap->old_table[i];
+      }
+      i -= pHashMap->old_buckets + 1;
+   }
+   if ( i > pHashMap->buckets )
+      return (struct bst_node_t**)0;
+   iter->bucket++;
+   return &pHashMap->table[i];
+}
+
+static struct bst_node_t* hash_map_chained_next(struct hash_map_t* pHashMap, struct hash_map_iter_t *iter)
+{
+   struct bst_node_t *node;
+   struct bst_node_t **root;
+
+   node = binarytree_next_node(iter->node);
+
+   /* the keys starting with prefix follow each other within a tree */
+   while ( !node || !HASH_MAP_ITER_MATCH(iter, node->key, node->klen) )
+   {
+      root = hash_map_iter_root(pHashMap, iter);
+      if ( !root )
+      {
+         node = (struct bst_node_t*)0;
+         break;
+      }
+      if ( iter->plen )
+         node = binarytree_find_prefix(root, iter->prefix, iter->plen);
+      else
+         node = binarytree_first_node(root);
+   }
+
+   iter->node = node;
+   return node;
+}
+
+/*
+
+   Open addressing (HASH_MAP_OPEN)
+
+   Node ptrs are kept in a flat array of slots along with a parallel
+   array of control bytes. The slots are probed in groups of 16 and the
+   control bytes of a group are compared in one go with SSE2, so most
+   lookups touch a single cache line of control bytes and call memcmp
+   only for the slot(s) whose 7-bit hash matches. A group containing an
+   empty slot terminates a probe sequence.
+
+*/
+
+/* bitmask of the slots within group whose control byte is c */
+static unsigned int hash_open_match(unsigned char *group, unsigned char c)
+{
+#ifdef HASH_OPEN_SSE2
+   return (unsigned int)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)group), _mm_set1_epi8((char)c)));
+#else
+   unsigned int i;
+   unsigned int mask;
+
+   mask = 0;
+   for ( i = 0; i < HASH_OPEN_GROUP; i++ )
+      if ( group[i] == c )
+         mask |= (1 << i);
+   return mask;
+#endif
+}
+
+/* bitmask of the slots within group that are empty or deleted */
+static unsigned int hash_open_match_free(unsigned char *group)
+{
+#ifdef HASH_OPEN_SSE2
+   return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((__m128i*)group));
+#else
+   unsigned int i;
+   unsigned int mask;
+
+   mask = 0;
+   for ( i = 0; i < HASH_OPEN_GROUP; i++ )
+      if ( group[i] & 0x80 )
+         mask |= (1 << i);
+   return mask;
+#endif
+}
+
+/* index of the lowest set bit of a non-zero mask */
+static unsigned int hash_open_first(unsigned int mask)
+{
+#ifdef __GNUC__
+   return (unsigned int)__builtin_ctz(mask);
+#else
+   unsigned int i;
+
+   for ( i = 0; ( mask & 1 ) == 0; i++ )
+      mask >>= 1;
+   return i;
+#endif
+}
+
+/* first group probed for hash, the 7-bit control value goes into *h2 */
+static unsigned int hash_open_start(struct hash_map_t *pHashMap, unsigned int hash, unsigned char *h2)
+{
+   hash *= 0x9e3779b1;  /* spread weak hashes (hash16) over all bits */
+   *h2 = (unsigned char)(hash & 0x7F);
+   return (unsigned int)(((unsigned long long)hash * ((pHashMap->buckets + 1) / HASH_OPEN_GROUP)) >> 32);
+}
+
+/* slot holding key, or HASH_OPEN_NONE if not found */
+static unsigned int hash_open_lookup(struct hash_map_t *pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   unsigned int group;
+   unsigned int gmask;
+   unsigned int step;
+   unsigned int mask;
+   unsigned int slot;
+   unsigned char h2;
+   unsigned char *ctrl;
+   struct bst_node_t *node;
+
+   gmask = ((pHashMap->buckets + 1) / HASH_OPEN_GROUP) - 1;
+   group = hash_open_start(pHashMap, hash, &h2);
+   step = 0;
+   for ( ;; )
+   {
+      ctrl = pHashMap->ctrl + (group * HASH_OPEN_GROUP);
+      mask = hash_open_match(ctrl, h2);
+      while ( mask )
+      {
+         slot = (group * HASH_OPEN_GROUP) + hash_open_first(mask);
+         node = pHashMap->table[slot];
+         if ( ( node->hash == hash ) && ( node->klen == klen ) && !memcmp(node->key, key, klen) )
+            return slot;
+         mask &= mask - 1;
+      }
+      if ( hash_open_match(ctrl, HASH_OPEN_EMPTY) )
+         return HASH_OPEN_NONE;
+      if ( ++step > gmask )
+         return HASH_OPEN_NONE;  /* every group probed */
+      group = (group + step) & gmask;
+   }
+}
+
+/* first empty or deleted slot in the probe sequence of hash */
+static unsigned int hash_open_free_slot(struct hash_map_t *pHashMap, unsigned int hash)
+{
+   unsigned int group;
+   unsigned int gmask;
+   unsigned int step;
+   unsigned int mask;
+   unsigned char h2;
+
+   gmask = ((pHashMap->buckets + 1) / HASH_OPEN_GROUP) - 1;
+   group = hash_open_start(pHashMap, hash, &h2);
+   step = 0;
+   for ( ;; )
+   {
+      mask = hash_open_match_free(pHashMap->ctrl + (group * HASH_OPEN_GROUP));
+      if ( mask )
+         return (group * HASH_OPEN_GROUP) + hash_open_first(mask);
+      step++;
+      group = (group + step) & gmask;
+   }
+}
+
+/* allocate slots and control bytes for a table of size slots */
+static int hash_open_alloc_table(struct hash_map_t *pHashMap, unsigned int size)
+{
+   struct bst_node_t **slots;
+
+   slots = HASH_MAP_MALLOC(pHashMap, (size * sizeof(void*)) + size);
+   if ( !slots )
+      return 2;  /* insufficient memory error */
+
+   memset(slots, 0, size * sizeof(void*));
+   pHashMap->table = slots;
+   pHashMap->ctrl = (unsigned char*)(slots + size);
+   memset(pHashMap->ctrl, HASH_OPEN_EMPTY, size);
+   pHashMap->buckets = size - 1;
+   pHashMap->deleted = 0;
+   return 0;
+}
+
+/* rebuild the table without deleted slots, doubling it if more than ~7/16 full */
+static int hash_open_resize(struct hash_map_t *pHashMap)
+{
+   unsigned int i;
+   unsigned int size;
+   unsigned int slot;
+   unsigned int hash;
+   unsigned char h2;
+   unsigned char *ctrl;
+   struct bst_node_t **slots;
+
+   size = pHashMap->buckets + 1;
+   ctrl = pHashMap->ctrl;
+   slots = pHashMap->table;
+
+   if ( pHashMap->count >= ((size / 16) * 7) )
+   {
+      if ( size >= 0x80000000 )
+         return 2;  /* table cannot grow */
+      if ( hash_open_alloc_table(pHashMap, size * 2) )
+         return 2;  /* insufficient memory error */
+   }
+   else
+   {
+      if ( hash_open_alloc_table(pHashMap, size) )
+         return 2;  /* insufficient memory error */
+   }
+
+   for ( i = 0; i < size; i++ )
+   {
+      if ( ctrl[i] & 0x80 )
+         continue;
+      hash = slots[i]->hash;
+      slot = hash_open_free_slot(pHashMap, hash);
+      hash_open_start(pHashMap, hash, &h2);
+      pHashMap->ctrl[slot] = h2;
+      pHashMap->table[slot] = slots[i];
+   }
+
+   HASH_MAP_MFREE(pHashMap, slots);
+   return 0;
+}
+
+static struct bst_node_t* hash_open_find(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   unsigned int slot;
+
+   slot = hash_open_lookup(pHashMap, hash, key, klen);
+   if ( slot == HASH_OPEN_NONE )
+      return (struct bst_node_t*)0;
+   return pHashMap->table[slot];
+}
+
+/* look up count keys, prefetching the groups and first candidates of all of them first */
+static void hash_open_find_batch(struct hash_map_t* pHashMap, unsigned int count, unsigned int *hash, void **keys, unsigned int *klens, struct bst_node_t **nodes)
+{
+   unsigned int i;
+   unsigned int mask;
+   unsigned int slot[HASH_MAP_BATCH];
+   unsigned char h2[HASH_MAP_BATCH];
+
+   for ( i = 0; i < count; i++ )
+   {
+      slot[i] = hash_open_start(pHashMap, hash[i], &h2[i]) * HASH_OPEN_GROUP;
+      HASH_MAP_PREFETCH(pHashMap->ctrl + slot[i]);
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      mask = hash_open_match(pHashMap->ctrl + slot[i], h2[i]);
+      slot[i] += mask ? hash_open_first(mask) : 0;
+      HASH_MAP_PREFETCH(pHashMap->table + slot[i]);
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      if ( pHashMap->table[slot[i]] )
+         HASH_MAP_PREFETCH(pHashMap->table[slot[i]]);
+   }
+
+   for ( i = 0; i < count; i++ )
+      nodes[i] = hash_open_find(pHashMap, hash[i], keys[i], klens[i]);
+}
+
+static int hash_open_insert(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen, void *value, unsigned int vlen)
+{
+   unsigned int slot;
+   unsigned char h2;
+   struct bst_node_t *node;
+   struct bst_node_t *old;
+
+   node = hash_map_node_alloc(pHashMap, key, klen, value, vlen);
+   if ( !node )
+      return 2;  /* insufficient memory error */
+   node->hash = hash;
+
+   /* replace an existing entry, if any */
+   slot = hash_open_lookup(pHashMap, hash, key, klen);
+   if ( slot != HASH_OPEN_NONE )
+   {
+      old = pHashMap->table[slot];
+      pHashMap->table[slot] = node;
+      hash_map_node_free(pHashMap, old);
+      return 0;
+   }
+
+   /* keep at most 7/8 of the slots in use, counting deleted ones */
+   if ( ( (pHashMap->count + pHashMap->deleted + 1) * 8ULL ) > ( (pHashMap->buckets + 1) * 7ULL ) )
+   {
+      if ( hash_open_resize(pHashMap) )
+      {
+         hash_map_node_free(pHashMap, node);
+         return 2;  /* insufficient memory error */
+      }
+   }
+
+   slot = hash_open_free_slot(pHashMap, hash);
+   if ( pHashMap->ctrl[slot] == HASH_OPEN_DELETED )
+      pHashMap->deleted--;
+   if ( hash_open_start(pHashMap, hash, &h2) != ( slot / HASH_OPEN_GROUP ) )
+      pHashMap->stats.collisions++;  /* home group is full */
+   pHashMap->ctrl[slot] = h2;
+   pHashMap->table[slot] = node;
+   pHashMap->count++;
+
+   return 0;
+}
+
+static int hash_open_delete(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   unsigned int slot;
+   unsigned char *group;
+
+   slot = hash_open_lookup(pHashMap, hash, key, klen);
+   if ( slot == HASH_OPEN_NONE )
+      return 2;  /* key not found */
+
+   hash_map_node_free(pHashMap, pHashMap->table[slot]);
+   pHashMap->table[slot] = (struct bst_node_t*)0;
+   pHashMap->count--;
+
+   /* no probe sequence continues past a group that has an empty slot */
+   group = pHashMap->ctrl + (slot & ~(HASH_OPEN_GROUP - 1));
+   if ( hash_open_match(group, HASH_OPEN_EMPTY) )
+   {
+      pHashMap->ctrl[slot] = HASH_OPEN_EMPTY;
+   }
+   else
+   {
+      pHashMap->ctrl[slot] = HASH_OPEN_DELETED;
+      pHashMap->deleted++;
+   }
+
+   return 0;
+}
+
+static void hash_open_free(struct hash_map_t* pHashMap)
+{
+   unsigned int i;
+
+   for ( i = 0; ( i <= pHashMap->buckets ) && !pHashMap->arena; i++ )
+   {
+      if ( ( pHashMap->ctrl[i] & 0x80 ) == 0 )
+         HASH_MAP_MFREE(pHashMap, pHashMap->table[i]);
+   }
+   HASH_MAP_MFREE(pHashMap, pHashMap->table);
+}
+
+static void hash_open_distribution(struct hash_map_t* pHashMap, struct hash_map_dist_t *dist)
+{
+   unsigned int i;
+   unsigned int gmask;
+   unsigned int group;
+   unsigned int step;
+   unsigned char h2;
+   struct bst_node_t *node;
+
+   /* a node's depth is the number of groups probed to reach it */
+   gmask = ((pHashMap->buckets + 1) / HASH_OPEN_GROUP) - 1;
+   for ( i = 0; i <= pHashMap->buckets; i++ )
+   {
+      if ( pHashMap->ctrl[i] & 0x80 )
+         continue;
+      node = pHashMap->table[i];
+      group = hash_open_start(pHashMap, node->hash, &h2);
+      step = 0;
+      while ( group != ( i / HASH_OPEN_GROUP ) )
+      {
+         step++;
+         group = (group + step) & gmask;
+      }
+      dist->used++;
+      dist->nodes++;
+      dist->total_depth += step + 1;
+      if ( step + 1 > dist->max_depth )
+         dist->max_depth = step + 1;
+   }
+   dist->max_nodes = dist->nodes ? 1 : 0;
+}
+
+static struct bst_node_t* hash_open_next(struct hash_map_t* pHashMap, struct hash_map_iter_t *iter)
+{
+   unsigned int i;
+   struct bst_node_t *node;
+
+   while ( iter->bucket <= pHashMap->buckets )
+   {
+      i = iter->bucket++;
+      if ( pHashMap->ctrl[i] & 0x80 )
+         continue;
+      node = pHashMap->table[i];
+      if ( HASH_MAP_ITER_MATCH(iter, node->key, node->klen) )
+         return node;
+   }
+   return (struct bst_node_t*)0;
+}
+
+/*
+
+   Concurrent buckets (HASH_MAP_CONCURRENT)
+
+   Each bucket holds a chain of links, each pointing to one node. Lookups
+   take no locks and write nothing shared: a chain is only changed by a
+   single ptr store with release semantics once the link it publishes
+   is filled in, so a lookup running alongside a writer sees the chain
+   either before or after the change. Writers lock one of HASH_CONC_LOCKS
+   stripes picked by the hash, so writers of unrelated keys rarely wait
+   on each other. Growing the table takes every stripe, links all nodes
+   into a new table with new links and publishes it with one store;
+   lookups that already started in the old table finish there.
+
+   Nothing a lookup may still be looking at is freed while the map is in
+   use. Deleted and replaced nodes with their links, and replaced tables
+   with theirs, are retired and only freed by hash_map_reclaim() or
+   hash_map_free(), which must be called while no other thread uses the
+   map. Until then a node returned by hash_map_find() stays valid, even
+   if its key has been deleted or replaced meanwhile. There is no epoch
+   or grace period tracking that would let a writer tell when the
+   readers are done, since that would make every lookup write shared
+   memory, so reclaiming is left to the program: the retired memory
+   grows with every delete and replace until it calls hash_map_reclaim()
+   at a point where it knows the other threads are idle.
+
+*/
+
+#define HASH_CONC_LOCKS  64  /* writer lock stripes, a power of 2 */
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HASH_CONC_LOAD(p)      (*(void * volatile *)&(p))
+#define HASH_CONC_STORE(p, v)  (*(void * volatile *)&(p) = (v))
+#define HASH_CONC_READ(n)      (*(volatile unsigned int*)&(n))
+#define HASH_CONC_TRYLOCK(l)   ( _InterlockedExchange(&(l), 1) == 0 )
+#define HASH_CONC_UNLOCK(l)    _InterlockedExchange(&(l), 0)
+#define HASH_CONC_ADD(n, v)    _InterlockedExchangeAdd((volatile long*)&(n), (long)(v))
+#else
+#define HASH_CONC_LOAD(p)      __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define HASH_CONC_STORE(p, v)  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define HASH_CONC_READ(n)      __atomic_load_n(&(n), __ATOMIC_RELAXED)
+#define HASH_CONC_TRYLOCK(l)   ( __sync_lock_test_and_set(&(l), 1) == 0 )
+#define HASH_CONC_UNLOCK(l)    __sync_lock_release(&(l))
+#define HASH_CONC_ADD(n, v)    __sync_fetch_and_add(&(n), (v))
+#endif
+
+#ifdef HASH_OPEN_SSE2
+#define HASH_CONC_PAUSE()      _mm_pause()
+#else
+#define HASH_CONC_PAUSE()
+#endif
+
+/* true if node holds key */
+#define HASH_CONC_MATCH(node, hash, key, klen) \
+   ( ( (node)->hash == (hash) ) && ( (node)->klen == (klen) ) && !memcmp((node)->key, (key), (klen)) )
+
+struct hash_conc_link_t {
+   struct hash_conc_link_t *next;      /* next link of the chain */
+   struct hash_conc_link_t *retired;   /* next link retired to the same stripe */
+   struct bst_node_t *node;
+};
+
+struct hash_conc_table_t {
+   unsigned int mask;                  /* bitmask of buckets */
+   struct hash_conc_table_t *retired;  /* next older table once replaced */
+   struct hash_conc_link_t *bucket[1]; /* mask + 1 chains */
+};
+
+/* a writer lock and what its writers retired, one cache line each */
+struct hash_conc_stripe_t {
+   volatile long lock;
+   struct hash_conc_link_t *retired;
+   char pad[64 - sizeof(long) - sizeof(void*)];
+};
+
+struct hash_conc_t {
+   struct hash_conc_table_t *table;    /* current table, read without locks */
+   struct hash_conc_table_t *retired;  /* replaced tables */
+   struct hash_conc_stripe_t stripe[HASH_CONC_LOCKS];
+};
+
+static void hash_conc_lock(volatile long *lock)
+{
+   unsigned int spins;
+
+   spins = 0;
+   while ( !HASH_CONC_TRYLOCK(*lock) )
+   {
+      /* wait for the lock to look free before trying again */
+      while ( HASH_CONC_READ(*lock) )
+      {
+         if ( ++spins & 0x3F )
+            HASH_CONC_PAUSE();
+         else
+            HASH_CONC_YIELD();  /* the holder may not be running */
+      }
+   }
+}
+
+static struct hash_conc_table_t* hash_conc_alloc_table(struct hash_map_t *pHashMap, unsigned int mask)
+{
+   unsigned int len;
+   struct hash_conc_table_t *table;
+
+   len = sizeof(struct hash_conc_table_t) + (mask * sizeof(struct hash_conc_link_t*));
+   table = HASH_MAP_MALLOC(pHashMap, len);
+   if ( table )
+   {
+      memset(table, 0, len);
+      table->mask = mask;
+   }
+   return table;
+}
+
+/* free a table along with its links, but not their nodes */
+static void hash_conc_free_table(struct hash_map_t *pHashMap, struct hash_conc_table_t *table)
+{
+   unsigned int i;
+   struct hash_conc_link_t *link;
+   struct hash_conc_link_t *next;
+
+   for ( i = 0; i <= table->mask; i++ )
+   {
+      for ( link = table->bucket[i]; link; link = next )
+      {
+         next = link->next;
+         HASH_MAP_MFREE(pHashMap, link);
+      }
+   }
+   HASH_MAP_MFREE(pHashMap, table);
+}
+
+/* link all nodes of old into table, 1 if out of memory */
+static int hash_conc_copy_table(struct hash_map_t *pHashMap, struct hash_conc_table_t *old, struct hash_conc_table_t *table)
+{
+   unsigned int i;
+   unsigned int j;
+   struct hash_conc_link_t *link;
+   struct hash_conc_link_t *copy;
+
+   for ( i = 0; i <= old->mask; i++ )
+   {
+      for ( link = old->bucket[i]; link; link = link->next )
+      {
+         copy = HASH_MAP_MALLOC(pHashMap, sizeof(struct hash_conc_link_t));
+         if ( !copy )
+            return 1;
+         j = HASH_MAP_FOLD(link->node->hash) & table->mask;
+         copy->node = link->node;
+         copy->retired = (struct hash_conc_link_t*)0;
+         copy->next = table->bucket[j];
+         table->bucket[j] = copy;
+      }
+   }
+   return 0;
+}
+
+static struct hash_conc_t* hash_conc_alloc(struct hash_map_t *pHashMap, unsigned int buckets)
+{
+   struct hash_conc_t *conc;
+
+   conc = HASH_MAP_MALLOC(pHashMap, sizeof(struct hash_conc_t));
+   if ( !conc )
+      return conc;
+   memset(conc, 0, sizeof(struct hash_conc_t));
+   conc->table = hash_conc_alloc_table(pHashMap, buckets);
+   if ( !conc->table )
+   {
+      HASH_MAP_MFREE(pHashMap, conc);
+      return (struct hash_conc_t*)0;
+   }
+   return conc;
+}
+
+/* double the buckets once there are more nodes than buckets */
+static void hash_conc_grow(struct hash_map_t *pHashMap)
+{
+   unsigned int i;
+   struct hash_conc_t *conc;
+   struct hash_conc_table_t *old;
+   struct hash_conc_table_t *table;
+
+   conc = pHashMap->conc;
+   for ( i = 0; i < HASH_CONC_LOCKS; i++ )
+      hash_conc_lock(&conc->stripe[i].lock);
+
+   /* another writer may have grown it while we waited */
+   old = conc->table;
+   if ( HASH_CONC_READ(pHashMap->count) > old->mask )
+   {
+      table = hash_conc_alloc_table(pHashMap, (old->mask << 1) | 1);
+      if ( table && hash_conc_copy_table(pHashMap, old, table) )
+      {
+         hash_conc_free_table(pHashMap, table);
+         table = (struct hash_conc_table_t*)0;
+      }
+      /* out of memory only leaves the chains longer */
+      if ( table )
+      {
+         HASH_CONC_STORE(conc->table, table);
+         old->retired = conc->retired;
+         conc->retired = old;
+         pHashMap->buckets = table->mask;
+      }
+   }
+
+   for ( i = HASH_CONC_LOCKS; i > 0; i-- )
+      HASH_CONC_UNLOCK(conc->stripe[i - 1].lock);
+}
+
+static struct bst_node_t* hash_conc_find(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   struct hash_conc_table_t *table;
+   struct hash_conc_link_t *link;
+
+   table = HASH_CONC_LOAD(pHashMap->conc->table);
+   link = HASH_CONC_LOAD(table->bucket[HASH_MAP_FOLD(hash) & table->mask]);
+   while ( link )
+   {
+      if ( HASH_CONC_MATCH(link->node, hash, key, klen) )
+         return link->node;
+      link = HASH_CONC_LOAD(link->next);
+   }
+   return (struct bst_node_t*)0;
+}
+
+static int hash_conc_insert(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen, void *value, unsigned int vlen)
+{
+   struct hash_conc_t *conc;
+   struct hash_conc_stripe_t *stripe;
+   struct hash_conc_link_t **prev;
+   struct hash_conc_link_t *link;
+   struct hash_conc_link_t *old;
+   struct bst_node_t *node;
+
+   if ( !key || !klen )
+      return 1;  /* param error */
+   if ( !value )
+      vlen = 0;
+
+   /* the node and its link are filled in before they are published */
+   link = HASH_MAP_MALLOC(pHashMap, sizeof(struct hash_conc_link_t));
+   if ( !link )
+      return 2;  /* insufficient memory error */
+   node = HASH_MAP_MALLOC(pHashMap, sizeof(struct bst_node_t) + klen + vlen);
+   if ( !node )
+   {
+      HASH_MAP_MFREE(pHashMap, link);
+      return 2;  /* insufficient memory error */
+   }
+   hash_map_node_init(node, key, klen, value, vlen);
+   node->hash = hash;
+   link->node = node;
+   link->next = (struct hash_conc_link_t*)0;
+   link->retired = (struct hash_conc_link_t*)0;
+
+   conc = pHashMap->conc;
+   stripe = &conc->stripe[HASH_MAP_FOLD(hash) & (HASH_CONC_LOCKS - 1)];
+   hash_conc_lock(&stripe->lock);
+
+   prev = &conc->table->bucket[HASH_MAP_FOLD(hash) & conc->table->mask];
+   while ( ( old = *prev ) && !HASH_CONC_MATCH(old->node, hash, key, klen) )
+      prev = &old->next;
+
+   if ( old )
+   {
+      /* an existing key is replaced, the new link takes over its place */
+      link->next = old->next;
+      HASH_CONC_STORE(*prev, link);
+      old->retired = stripe->retired;
+      stripe->retired = old;
+   }
+   else
+   {
+      if ( prev != &conc->table->bucket[HASH_MAP_FOLD(hash) & conc->table->mask] )
+         HASH_CONC_ADD(pHashMap->stats.collisions, 1);
+      HASH_CONC_STORE(*prev, link);
+      HASH_CONC_ADD(pHashMap->count, 1);
+   }
+
+   HASH_CONC_UNLOCK(stripe->lock);
+   HASH_CONC_ADD(pHashMap->node_bytes, sizeof(struct bst_node_t) + klen + vlen);
+   HASH_CONC_ADD(pHashMap->stats.inserts, 1);
+
+   if ( !( pHashMap->flags & HASH_MAP_FIXED ) && ( HASH_CONC_READ(pHashMap->count) > HASH_CONC_LOAD(conc->table)->mask ) )
+      hash_conc_grow(pHashMap);
+
+   return 0;
+}
+
+static int hash_conc_delete(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   struct hash_conc_t *conc;
+   struct hash_conc_stripe_t *stripe;
+   struct hash_conc_link_t **prev;
+   struct hash_conc_link_t *old;
+
+   if ( !key || !klen )
+      return 1;  /* param error */
+
+   conc = pHashMap->conc;
+   stripe = &conc->stripe[HASH_MAP_FOLD(hash) & (HASH_CONC_LOCKS - 1)];
+   hash_conc_lock(&stripe->lock);
+
+   prev = &conc->table->bucket[HASH_MAP_FOLD(hash) & conc->table->mask];
+   while ( ( old = *prev ) && !HASH_CONC_MATCH(old->node, hash, key, klen) )
+      prev = &old->next;
+
+   if ( old )
+   {
+      /* the link keeps its next ptr for lookups still standing on it */
+      HASH_CONC_STORE(*prev, old->next);
+      old->retired = stripe->retired;
+      stripe->retired = old;
+      HASH_CONC_ADD(pHashMap->count, -1);
+   }
+
+   HASH_CONC_UNLOCK(stripe->lock);
+   HASH_CONC_ADD(pHashMap->stats.deletes, 1);
+
+   return old ? 0 : 2;  /* key not found */
+}
+
+/* free everything retired, no other thread may be using the map */
+static void hash_conc_reclaim(struct hash_map_t* pHashMap)
+{
+   unsigned int i;
+   struct hash_conc_t *conc;
+   struct hash_conc_link_t *link;
+   struct hash_conc_table_t *table;
+
+   conc = pHashMap->conc;
+   for ( i = 0; i < HASH_CONC_LOCKS; i++ )
+   {
+      while ( ( link = conc->stripe[i].retired ) )
+      {
+         conc->stripe[i].retired = link->retired;
+         pHashMap->node_bytes -= sizeof(struct bst_node_t) + link->node->klen + link->node->vlen;
+         HASH_MAP_MFREE(pHashMap, link->node);
+         HASH_MAP_MFREE(pHashMap, link);
+      }
+   }
+   while ( ( table = conc->retired ) )
+   {
+      conc->retired = table->retired;
+      hash_conc_free_table(pHashMap, table);
+   }
+}
+
+static void hash_conc_free(struct hash_map_t* pHashMap)
+{
+   unsigned int i;
+   struct hash_conc_table_t *table;
+   struct hash_conc_link_t *link;
+
+   hash_conc_reclaim(pHashMap);
+   table = pHashMap->conc->table;
+   for ( i = 0; i <= table->mask; i++ )
+   {
+      for ( link = table->bucket[i]; link; link = link->next )
+         HASH_MAP_MFREE(pHashMap, link->node);
+   }
+   hash_conc_free_table(pHashMap, table);
+   HASH_MAP_MFREE(pHashMap, pHashMap->conc);
+}
+
+/* memory of the tables and links, the nodes are counted in node_bytes */
+static unsigned long hash_conc_bytes(struct hash_map_t* pHashMap, unsigned int nodes)
+{
+   unsigned long bytes;
+   struct hash_conc_table_t *table;
+
+   bytes = sizeof(struct hash_conc_t) + (nodes * sizeof(struct hash_conc_link_t));
+   for ( table = pHashMap->conc->table; table; table = table->retired )
+      bytes += sizeof(struct hash_conc_table_t) + (table->mask * sizeof(struct hash_conc_link_t*));
+   return bytes;
+}
+
+static void hash_conc_distribution(struct hash_map_t* pHashMap, struct hash_map_dist_t *dist)
+{
+   unsigned int i;
+   unsigned int count;
+   struct hash_conc_table_t *table;
+   struct hash_conc_link_t *link;
+
+   /* a node's depth is its place in the chain */
+   table = HASH_CONC_LOAD(pHashMap->conc->table);
+   dist->buckets = table->mask + 1;
+   for ( i = 0; i <= table->mask; i++ )
+   {
+      count = 0;
+      for ( link = HASH_CONC_LOAD(table->bucket[i]); link; link = HASH_CONC_LOAD(link->next) )
+      {
+         count++;
+         dist->total_depth += count;
+      }
+      if ( count )
+      {
+         dist->used++;
+         dist->nodes += count;
+         if ( count > dist->max_nodes )
+            dist->max_nodes = count;
+         if ( count > dist->max_depth )
+            dist->max_depth = count;
+      }
+   }
+}
+
+static struct bst_node_t* hash_conc_next(struct hash_map_t* pHashMap, struct hash_map_iter_t *iter)
+{
+   struct hash_conc_link_t *link;
+
+   /* the walk stays in the table current at its start */
+   if ( !iter->table )
+      iter->table = HASH_CONC_LOAD(pHashMap->conc->table);
+
+   link = (struct hash_conc_link_t*)0;
+   if ( iter->link )
+      link = HASH_CONC_LOAD(iter->link->next);
+   for ( ;; )
+   {
+      while ( link && !HASH_MAP_ITER_MATCH(iter, link->node->key, link->node->klen) )
+         link = HASH_CONC_LOAD(link->next);
+      if ( link || ( iter->bucket > iter->table->mask ) )
+         break;
+      link = HASH_CONC_LOAD(iter->table->bucket[iter->bucket++]);
+   }
+
+   iter->link = link;
+   return link ? link->node : (struct bst_node_t*)0;
+}
+
+/*
+
+   Forks
+
+   hash_map_fork() returns an empty map layered over the map it forks,
+   its base, which is left read only. A lookup that misses in the fork
+   goes on to the base, so a fork only holds the keys inserted into it.
+   A key of the base deleted from the fork is hidden by adding it to a
+   keys only map of the fork's own. Forking allocates a small table and
+   copies nothing, however many keys the base holds. A base freed while
+   it has forks is freed along with its last fork.
+
+   A lookup that misses goes through the bases one at a time, so it
+   costs one lookup per fork in the chain. To keep that bounded, forking
+   a map that already has HASH_MAP_FORK_DEPTH bases below it flattens
+   the chain instead: the new map is a copy of every key visible in the
+   map and has no base. The copy is paid once every HASH_MAP_FORK_DEPTH
+   forks of a chain, and a missed lookup never costs more than
+   HASH_MAP_FORK_DEPTH + 1 of them.
+
+*/
+
+/* search the nodes held by a map itself */
+static struct bst_node_t* hash_map_lookup(struct hash_map_t *pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   if ( pHashMap->flags & HASH_MAP_OPEN )
+      return hash_open_find(pHashMap, hash, key, klen);
+
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+      return hash_compact_find(pHashMap, hash, key, klen);
+
+   return binarytree_find_node(hash_map_bucket(pHashMap, hash), key, klen);
+}
+
+/* search the bases of a fork for a key the fork does not hold */
+static struct bst_node_t* hash_map_base_find(struct hash_map_t *pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   struct bst_node_t *node;
+
+   for ( ; pHashMap->base; pHashMap = pHashMap->base )
+   {
+      if ( pHashMap->hidden && hash_map_lookup(pHashMap->hidden, hash, key, klen) )
+         break;
+      node = hash_map_lookup(pHashMap->base, hash, key, klen);
+      if ( node )
+         return node;
+   }
+   return (struct bst_node_t*)0;
+}
+
+/* true if a key of layer, a base of pHashMap, is held or hidden by a map above it */
+static int hash_map_shadowed(struct hash_map_t *pHashMap, struct hash_map_t *layer, void *key, unsigned int klen)
+{
+   unsigned int hash;
+
+   hash = pHashMap->hash(key, klen);
+   for ( ; pHashMap != layer; pHashMap = pHashMap->base )
+   {
+      if ( hash_map_lookup(pHashMap, hash, key, klen) )
+         return 1;
+      if ( pHashMap->hidden && hash_map_lookup(pHashMap->hidden, hash, key, klen) )
+         return 1;
+   }
+   return 0;
+}
+
+/* copy all keys visible in a map into a new one without a base */
+static struct hash_map_t* hash_map_flatten(struct hash_map_t *pHashMap)
+{
+   struct hash_map_iter_t iter;
+   struct hash_map_t *copy;
+   struct bst_node_t *node;
+
+   copy = hash_map_alloc_with(( pHashMap->flags & HASH_MAP_FIXED ) ? pHashMap->buckets + 1 : 0x10, pHashMap->flags, pHashMap->allocator);
+   if ( !copy )
+      return copy;
+
+   for ( node = hash_map_first(pHashMap, &iter, (void*)0, 0); node; node = hash_map_next(pHashMap, &iter) )
+   {
+      if ( hash_map_insert(copy, node->key, node->klen, node->value, node->vlen) )
+      {
+         hash_map_free(copy);
+         return (struct hash_map_t*)0;
+      }
+   }
+   return copy;
+}
+
+/* hide a key of the base from a fork */
+static int hash_map_fork_hide(struct hash_map_t *pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   if ( !pHashMap->hidden )
+   {
+      pHashMap->hidden = hash_map_alloc_with(0x10, pHashMap->flags & ~HASH_MAP_FIXED, pHashMap->allocator);
+      if ( !pHashMap->hidden )
+         return 2;  /* insufficient memory error */
+   }
+   return hash_map_insert_hashed(pHashMap->hidden, hash, key, klen, (void*)0, 0);
+}
+
+/***********************************************************
+
+hash_map_t* hash_map_alloc(unsigned int buckets, unsigned int flags)
+
+Purpose
+   To allow memory for the hashmap
+
+Params
+   buckets - power of 2 number of buckets
+   flags - HASH_MAP_* flags selecting the hash function and table type
+
+Returns
+   ptr to hashmap, null ptr if error
+
+Notes
+   The map grows as keys are inserted, buckets is only the initial
+   size. A HASH_MAP_FIXED map keeps the original behavior of a fixed
+   number of buckets, limited to 32K. With HASH_MAP_ARENA the nodes
+   are allocated from an arena owned by the map. All memory of the map
+   comes from the global allocator, see hash_map_set_allocator(). HASH_MAP_COMPACT may
+   not be combined with HASH_MAP_OPEN. HASH_MAP_CONCURRENT may not be
+   combined with either, and ignores HASH_MAP_ARENA as the arena is not
+   shared between threads.
+
+*/
+struct hash_map_t* hash_map_alloc(unsigned int buckets, unsigned int flags)
+{
+   return hash_map_alloc_with(buckets, flags, HashAllocator);
+}
+
+/*****************************************************************************
+
+struct hash_map_t* hash_map_alloc_with(unsigned int buckets, unsigned int flags, struct hash_map_allocator_t *allocator)
+
+Purpose
+   To allocate memory for the hashmap from a given allocator
+
+Params
+   buckets - power of 2 number of buckets
+   flags - HASH_MAP_* flags selecting the hash function and table type
+   allocator - ptr to allocator all memory of the map comes from
+
+Returns
+   ptr to hashmap, null ptr if error
+
+Notes
+   See hash_map_alloc(). The allocator must stay valid until the map
+   is freed, and be safe to call from several threads at once if the
+   map is HASH_MAP_CONCURRENT. Forks of the map use it as well.
+
+*/
+struct hash_map_t* hash_map_alloc_with(unsigned int buckets, unsigned int flags, struct hash_map_allocator_t *allocator)
+{
+   struct hash_map_t *pHashMap;
+   unsigned int len;
+
+   if ( !allocator || !allocator->alloc || !allocator->free )
+      return (struct hash_map_t*)0;
+
+   /* ensure correct buckets bitmask */
+   if ( buckets == 0 )
+      return (struct hash_map_t*)0;
+
+   switch ( flags & HASH_MAP_HASH_MASK )
+   {
+      case HASH_MAP_HASH16:
+      case HASH_MAP_FNV1A:
+      case HASH_MAP_WIDE:
+      case HASH_MAP_ID:
+         break;
+      default:
+         return (struct hash_map_t*)0;
+   }
+
+   /* compact nodes live in buckets of binary trees and in an arena */
+   if ( flags & HASH_MAP_COMPACT )
+   {
+      if ( flags & HASH_MAP_OPEN )
+         return (struct hash_map_t*)0;
+      flags |= HASH_MAP_ARENA;
+   }
+
+   /* a concurrent map needs a bucket per writer lock stripe */
+   if ( flags & HASH_MAP_CONCURRENT )
+   {
+      if ( flags & ( HASH_MAP_OPEN | HASH_MAP_COMPACT ) )
+         return (struct hash_map_t*)0;
+      flags &= ~HASH_MAP_ARENA;
+      if ( buckets < HASH_CONC_LOCKS )
+         buckets = HASH_CONC_LOCKS;
+   }
+
+   /* we don't support fixed hashmaps > 32K */
+   if ( ( buckets > 0x8000 ) && ( flags & HASH_MAP_FIXED ) )
+      buckets = 0x8000;
+
+   /* find uppermost bit */
+   len = (1 << ((sizeof(int)*8) - 1));
+   while ( (buckets & len) == 0 )
+      len = len >> 1;
+   len--;  /* create the mask */
+   buckets = len;  /* assign bucket size / bit mask */
+
+   /* alloc memory space */
+   len = sizeof(struct hash_map_t);
+   pHashMap = allocator->alloc(allocator->ctx, len);
+   if ( pHashMap )
+   {
+      memset(pHashMap, 0, len);
+      pHashMap->allocator = allocator;
+      pHashMap->magic   = HASH_MAP_MAGIC;
+      pHashMap->buckets = buckets;
+      pHashMap->flags   = flags;
+      pHashMap->hash    = hash_map_function(flags);
+      if ( flags & HASH_MAP_ARENA )
+      {
+         pHashMap->arena = HASH_MAP_MALLOC(pHashMap, sizeof(struct hash_arena_t));
+         if ( !pHashMap->arena )
+         {
+            HASH_MAP_MFREE(pHashMap, pHashMap);
+            return (struct hash_map_t*)0;
+         }
+         memset(pHashMap->arena, 0, sizeof(struct hash_arena_t));
+         pHashMap->arena->allocator = allocator;
+      }
+      if ( flags & HASH_MAP_OPEN )
+      {
+         if ( buckets < HASH_OPEN_GROUP - 1 )
+            buckets = HASH_OPEN_GROUP - 1;
+         if ( hash_open_alloc_table(pHashMap, buckets + 1) )
+         {
+            if ( pHashMap->arena )
+               hash_arena_free(pHashMap->arena);
+            HASH_MAP_MFREE(pHashMap, pHashMap);
+            return (struct hash_map_t*)0;
+         }
+      }
+      else if ( flags & HASH_MAP_COMPACT )
+      {
+         len = (buckets + 1) * sizeof(unsigned int);
+         pHashMap->roots = HASH_MAP_MALLOC(pHashMap, len);
+         if ( !pHashMap->roots )
+         {
+            hash_arena_free(pHashMap->arena);
+            HASH_MAP_MFREE(pHashMap, pHashMap);
+            return (struct hash_map_t*)0;
+         }
+         memset(pHashMap->roots, 0, len);
+      }
+      else if ( flags & HASH_MAP_CONCURRENT )
+      {
+         pHashMap->conc = hash_conc_alloc(pHashMap, buckets);
+         if ( !pHashMap->conc )
+         {
+            HASH_MAP_MFREE(pHashMap, pHashMap);
+            return (struct hash_map_t*)0;
+         }
+      }
+      else
+      {
+         len = (buckets + 1) * sizeof(void*);
+         pHashMap->table = HASH_MAP_MALLOC(pHashMap, len);
+         if ( !pHashMap->table )
+         {
+            if ( pHashMap->arena )
+               hash_arena_free(pHashMap->arena);
+            HASH_MAP_MFREE(pHashMap, pHashMap);
+            return (struct hash_map_t*)0;
+         }
+         memset(pHashMap->table, 0, len);
+      }
+   }
+   return pHashMap;
+}
+
+/*****************************************************************************
+
+struct hash_map_t* hash_map_fork(struct hash_map_t *pHashMap)
+
+Purpose
+   To create a map holding the same keys as a hashmap, sharing them
+   instead of copying them
+
+Params
+   pHashMap - ptr to hash map to fork
+
+Returns
+   ptr to new map, null ptr if error
+
+Notes
+   The fork starts out empty and looks up any key it does not hold in
+   pHashMap, so forking costs the same however many keys pHashMap
+   holds. Keys inserted into or deleted from the fork leave pHashMap
+   unchanged, which is read only while it has forks: hash_map_insert()
+   and hash_map_delete() fail on it with error 3. A map may be forked
+   any number of times, and a fork may be forked in turn. pHashMap may
+   be freed before its forks, it is then freed along with the last one.
+   hash_map_distribution() and hash_map_stats() only cover the keys a
+   fork holds itself. A HASH_MAP_CONCURRENT map cannot be forked.
+   A missed lookup goes through every base of a fork, so it costs O(d)
+   lookups for a chain of d forks. Forking a map that already has
+   HASH_MAP_FORK_DEPTH (8) bases returns a copy of its keys instead,
+   which costs O(n) for n keys but has no base, so the chain starts
+   over and pHashMap does not become read only.
+
+*/
+struct hash_map_t* hash_map_fork(struct hash_map_t *pHashMap)
+{
+   struct hash_map_t *fork;
+   struct hash_map_t *base;
+   unsigned int buckets;
+   unsigned int depth;
+
+   if ( !pHashMap || ( pHashMap->magic != HASH_MAP_MAGIC ) )
+      return (struct hash_map_t*)0;
+
+   if ( pHashMap->flags & ( HASH_MAP_CONCURRENT | HASH_MAP_RELEASED ) )
+      return (struct hash_map_t*)0;
+
+   /* bound the bases a lookup goes through */
+   depth = 0;
+   for ( base = pHashMap->base; base; base = base->base )
+      depth++;
+   if ( depth >= HASH_MAP_FORK_DEPTH )
+      return hash_map_flatten(pHashMap);
+
+   /* a fixed map never grows, so it starts out as large as its base */
+   if ( pHashMap->flags & HASH_MAP_FIXED )
+      buckets = pHashMap->buckets + 1;
+   else
+      buckets = 0x10;
+
+   fork = hash_map_alloc_with(buckets, pHashMap->flags, pHashMap->allocator);
+   if ( fork )
+   {
+      fork->base = pHashMap;
+      pHashMap->forks++;
+   }
+   return fork;
+}
+
+/******************************************************************************************
+
+unsigned int hash_map_hash(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+
+Purpose
+   To calculate the hash of a key as used by a hashmap
+
+Params
+   pHashMap - ptr to hash map
+   key - ptr to key
+   klen - length of key
+
+Returns
+   hash of key, to be passed to the hash_map_*_hashed() functions
+
+Notes
+   Hash values depend on the HASH_MAP_* hash function of the map, so
+   they may only be used with maps created with the same flags.
+
+*/
+unsigned int hash_map_hash(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+{
+   return pHashMap->hash(key, klen);
+}
+
+/* hash_map_scan() for the hash function selected by flags */
+static unsigned int hash_scan(unsigned int flags, char *p, unsigned char *stop, char **end)
+{
+   unsigned char *s;
+   unsigned int len;
+   unsigned int h;
+   unsigned long long wh;
+   unsigned long long w;
+   short int sum1;
+   unsigned int sum2;
+
+   s = (unsigned char*)p;
+   switch ( flags & HASH_MAP_HASH_MASK )
+   {
+      case HASH_MAP_FNV1A:
+         h = HASH_FNV1A_BASIS;
+         while ( !stop[*s] )
+         {
+            h = (h ^ *s) * HASH_FNV1A_PRIME;
+            s++;
+         }
+         break;
+
+      case HASH_MAP_WIDE:
+         wh = HASH_WIDE_SEED;
+         for (;;)
+         {
+            /* load the next 8 chars as hash_wide() does once none of them ends the token,
+               the nul char ends it, so no char after the buffer is loaded */
+            for ( len = 0; ( len < 8 ) && !stop[s[len]]; len++ ) ;
+            if ( len < 8 )
+               break;
+            memcpy(&w, s, 8);
+            HASH_WIDE_MIX(wh, w);
+            s += 8;
+         }
+         if ( len )
+         {
+            w = 0;
+            memcpy(&w, s, len);
+            HASH_WIDE_MIX(wh, w);
+            s += len;
+         }
+         h = HASH_WIDE_FINAL(wh, (unsigned int)(s - (unsigned char*)p));
+         break;
+
+      case HASH_MAP_ID:
+         while ( !stop[*s] )
+            s++;
+         h = hash_id((unsigned char*)p, (unsigned int)(s - (unsigned char*)p));
+         break;
+
+      default:
+         /* same steps as hash16() */
+         sum2 = sum1 = 0;
+         while ( !stop[*s] )
+         {
+            sum1 += *s++;
+            if (sum1 >= 255) sum1 -= 255;
+            sum2 += sum1;
+         }
+         sum2 %= 255;
+         h = (sum2 << 8) | sum1;
+         break;
+   }
+
+   *end = (char*)s;
+   return h;
+}
+
+/******************************************************************************************
+
+unsigned int hash_map_scan(struct hash_map_t* pHashMap, char *p, unsigned char *stop, char **end)
+
+Purpose
+   To find the end of a token and calculate its hash in one pass
+
+Params
+   pHashMap - ptr to hash map the hash is meant for
+   p - ptr to first char of token
+   stop - table of 256 entries, nonzero for chars that end a token
+   end - receives ptr to the char that ended the token
+
+Returns
+   hash of the chars from p up to *end, same as hash_map_hash()
+
+Notes
+   The stop table must flag the nul char so the scan ends at the end
+   of the buffer.
+
+*/
+unsigned int hash_map_scan(struct hash_map_t* pHashMap, char *p, unsigned char *stop, char **end)
+{
+   return hash_scan(pHashMap->flags, p, stop, end);
+}
+
+/******************************************************************************************
+
+struct bst_node_t* hash_map_find(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+
+Purpose
+   To find a node within the hashmap containing key
+
+Params
+   pHashMap - ptr to hash map to search
+   key - ptr to key to search for
+   klen - length of key
+
+Returns
+   ptr to node if found, otherwise null
+
+Notes
+   For a HASH_MAP_COMPACT map the node returned is a copy of the key
+   and value ptrs and lengths held by the map. It is only valid until
+   the next call to hash_map_find(), and its tree links are null.
+   A HASH_MAP_CONCURRENT map may be searched by any number of threads
+   while others insert and delete, and its node stays valid until
+   hash_map_reclaim() is called. Its tree links are null as well.
+   The node found in a fork may be one of its base, see hash_map_fork().
+
+*/
+struct bst_node_t* hash_map_find(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+{
+   return hash_map_find_hashed(pHashMap, pHashMap->hash(key, klen), key, klen);
+}
+
+/*****************************************************************************
+
+struct bst_node_t* hash_map_find_hashed(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+
+Purpose
+   To find a node within the hashmap containing key, given its hash
+
+Params
+   pHashMap - ptr to hash map to search
+   hash - hash of key as returned by hash_map_hash() or hash_map_scan()
+   key - ptr to key to search for
+   klen - length of key
+
+Returns
+   ptr to node if found, otherwise null
+
+Notes
+   See hash_map_find()
+
+*/
+struct bst_node_t* hash_map_find_hashed(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   struct bst_node_t* node;
+
+   /* concurrent lookups keep no counters, see hash_map_stats() */
+   if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+      return hash_conc_find(pHashMap, hash, key, klen);
+
+   node = hash_map_lookup(pHashMap, hash, key, klen);
+   if ( !node && pHashMap->base )
+      node = hash_map_base_find(pHashMap, hash, key, klen);
+
+   pHashMap->stats.lookups++;
+   if ( node )
+      pHashMap->stats.hits++;
+   return node;
+}
+
+/*****************************************************************************
+
+int hash_map_find_batch(struct hash_map_t* pHashMap, unsigned int n, void **keys, unsigned int *klens, struct bst_node_t **nodes)
+
+Purpose
+   To find the nodes of several keys at once, overlapping the cache
+   misses of their lookups
+
+Params
+   pHashMap - ptr to hash map to search
+   n - number of keys
+   keys - array of n ptrs to keys
+   klens - array of n key lengths
+   nodes - array receiving n ptrs to the found nodes, null if not found
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+   Keys are taken HASH_MAP_BATCH at a time. The hashes of all of them
+   are calculated and their buckets prefetched, then the first node of
+   each bucket is prefetched, and only then are the keys looked up, so
+   the loads for one key are in flight while the others are resolved.
+   A HASH_MAP_COMPACT map is not supported, as its found node is a copy
+   held in the map, see hash_map_find().
+
+*/
+int hash_map_find_batch(struct hash_map_t* pHashMap, unsigned int n, void **keys, unsigned int *klens, struct bst_node_t **nodes)
+{
+   unsigned int i;
+   unsigned int j;
+   unsigned int count;
+   unsigned int hash[HASH_MAP_BATCH];
+   struct bst_node_t **root[HASH_MAP_BATCH];
+
+   if ( !pHashMap || !keys || !klens || !nodes )
+      return 1;  /* param error */
+
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+      return 1;  /* param error */
+
+   /* concurrent lookups keep no counters, see hash_map_stats() */
+   if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+   {
+      for ( i = 0; i < n; i++ )
+         nodes[i] = hash_conc_find(pHashMap, pHashMap->hash(keys[i], klens[i]), keys[i], klens[i]);
+      return 0;
+   }
+
+   for ( i = 0; i < n; i += count )
+   {
+      count = ( n - i < HASH_MAP_BATCH ) ? n - i : HASH_MAP_BATCH;
+      for ( j = 0; j < count; j++ )
+         hash[j] = pHashMap->hash(keys[i + j], klens[i + j]);
+
+      if ( pHashMap->flags & HASH_MAP_OPEN )
+         hash_open_find_batch(pHashMap, count, hash, keys + i, klens + i, nodes + i);
+      else
+      {
+         for ( j = 0; j < count; j++ )
+         {
+            root[j] = hash_map_bucket(pHashMap, hash[j]);
+            HASH_MAP_PREFETCH(root[j]);
+         }
+         for ( j = 0; j < count; j++ )
+         {
+            if ( *root[j] )
+               HASH_MAP_PREFETCH(*root[j]);
+         }
+         for ( j = 0; j < count; j++ )
+            nodes[i + j] = binarytree_find_node(root[j], keys[i + j], klens[i + j]);
+      }
+
+      for ( j = 0; j < count; j++ )
+      {
+         if ( !nodes[i + j] && pHashMap->base )
+            nodes[i + j] = hash_map_base_find(pHashMap, hash[j], keys[i + j], klens[i + j]);
+         if ( nodes[i + j] )
+            pHashMap->stats.hits++;
+      }
+   }
+
+   pHashMap->stats.lookups += n;
+   return 0;
+}
+
+/*************************************************************************************************************
+
+int hash_map_insert(struct hash_map_t* pHashMap, void *key, unsigned int klen, char *value, unsigned int vlen)
+
+Purpose
+   To insert a node within the hashmap containing key/value pair
+
+Params
+   pHashMap - ptr to hash map to insert into
+   key - ptr to key to insert
+   klen - length of key
+   value - data corresponding to key
+   vlen - length of data value
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+   value may be null or vlen may be zero if using the hash map for keys only.
+   Duplicate keys are not supported. A HASH_MAP_CONCURRENT map may be
+   changed by several threads at once.
+
+*/
+int hash_map_insert(struct hash_map_t* pHashMap, void *key, unsigned int klen, void *value, unsigned int vlen)
+{
+   return hash_map_insert_hashed(pHashMap, pHashMap->hash(key, klen), key, klen, value, vlen);
+}
+
+/*****************************************************************************
+
+int hash_map_insert_hashed(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen, void *value, unsigned int vlen)
+
+Purpose
+   To insert a node within the hashmap containing key/value pair, given
+   the hash of key
+
+Params
+   pHashMap - ptr to hash map to insert into
+   hash - hash of key as returned by hash_map_hash() or hash_map_scan()
+   key - ptr to key to insert
+   klen - length of key
+   value - data corresponding to key
+   vlen - length of data value
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+   See hash_map_insert()
+
+*/
+int hash_map_insert_hashed(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen, void *value, unsigned int vlen)
+{
+   struct bst_node_t *node;
+   struct bst_node_t *old;
+   struct bst_node_t **root;
+
+   if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+      return hash_conc_insert(pHashMap, hash, key, klen, value, vlen);
+
+   if ( pHashMap->forks )
+      return 3;  /* read only while forked */
+
+   /* a key hidden from the base of a fork is visible again */
+   if ( pHashMap->hidden && pHashMap->hidden->count )
+      hash_map_delete_hashed(pHashMap->hidden, hash, key, klen);
+
+   pHashMap->stats.inserts++;
+
+   if ( pHashMap->flags & HASH_MAP_OPEN )
+      return hash_open_insert(pHashMap, hash, key, klen, value, vlen);
+
+   if ( pHashMap->old_table || pHashMap->old_roots )
+      hash_map_rehash_step(pHashMap, HASH_MAP_REHASH_STEP);
+   else if ( ( pHashMap->count > pHashMap->buckets ) && !( pHashMap->flags & HASH_MAP_FIXED ) )
+      hash_map_grow(pHashMap);
+
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+      return hash_compact_insert(pHashMap, hash, key, klen, value, vlen);
+
+   node = hash_map_node_alloc(pHashMap, key, klen, value, vlen);
+   if ( !node )
+      return 2;  /* insufficient memory error */
+   node->hash = hash;
+
+   root = hash_map_bucket(pHashMap, hash);
+
+   /* an existing key is replaced */
+   if ( *root )
+   {
+      old = binarytree_remove_node(root, key, klen);
+      if ( old )
+      {
+         hash_map_node_free(pHashMap, old);
+         pHashMap->count--;
+      }
+   }
+
+   if ( *root )
+      pHashMap->stats.collisions++;
+
+   /* also for an empty bucket, this sets the key prefix of the node */
+   if ( binarytree_insert_node(root, node) )
+   {
+      hash_map_node_free(pHashMap, node);
+      return 1;
+   }
+
+   pHashMap->count++;
+
+   return 0;
+}
+
+/*****************************************************************************
+
+int hash_map_delete(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+
+Purpose
+   To delete a node from the hashmap containing key
+
+Params
+   pHashMap - ptr to hash map to insert into
+   key - ptr to key to delete
+   klen - length of key
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+
+*/
+int hash_map_delete(struct hash_map_t* pHashMap, void *key, unsigned int klen)
+{
+   return hash_map_delete_hashed(pHashMap, pHashMap->hash(key, klen), key, klen);
+}
+
+/* delete a node held by the map itself */
+static int hash_map_remove(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   struct bst_node_t** root;
+   struct bst_node_t* node;
+
+   pHashMap->stats.deletes++;
+
+   if ( pHashMap->flags & HASH_MAP_OPEN )
+      return hash_open_delete(pHashMap, hash, key, klen);
+
+   if ( pHashMap->old_table || pHashMap->old_roots )
+      hash_map_rehash_step(pHashMap, HASH_MAP_REHASH_STEP);
+
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+      return hash_compact_delete(pHashMap, hash, key, klen);
+
+   root = hash_map_bucket(pHashMap, hash);
+
+   if ( !*root || !key || !klen )
+      return 1;  /* param error */
+
+   node = binarytree_remove_node(root, key, klen);
+   if ( !node )
+      return 2;  /* key not found */
+
+   hash_map_node_free(pHashMap, node);
+   pHashMap->count--;
+
+   return 0;
+
+}
+
+/*****************************************************************************
+
+int hash_map_delete_hashed(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+
+Purpose
+   To delete a node from the hashmap containing key, given its hash
+
+Params
+   pHashMap - ptr to hash map to delete from
+   hash - hash of key as returned by hash_map_hash() or hash_map_scan()
+   key - ptr to key to delete
+   klen - length of key
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+
+*/
+int hash_map_delete_hashed(struct hash_map_t* pHashMap, unsigned int hash, void *key, unsigned int klen)
+{
+   int err;
+
+   if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+      return hash_conc_delete(pHashMap, hash, key, klen);
+
+   if ( pHashMap->forks )
+      return 3;  /* read only while forked */
+
+   err = hash_map_remove(pHashMap, hash, key, klen);
+
+   /* a key of the base of a fork is hidden instead */
+   if ( pHashMap->base && hash_map_base_find(pHashMap, hash, key, klen) )
+      return hash_map_fork_hide(pHashMap, hash, key, klen);
+
+   return err;
+}
+
+/*****************************************************************************
+
+int hash_map_free(struct hash_map_t *pHashMap)
+
+Purpose
+   To delete all nodes from the hashmap
+
+Params
+   pHashMap - ptr to hash map to delete
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+
+*/
+int hash_map_free(struct hash_map_t *pHashMap)
+{
+   unsigned int i;
+   struct bst_node_t** root;
+   struct hash_map_t* base;
+
+   if ( !pHashMap )
+      return 1;  /* param error */
+
+   if ( pHashMap->magic != HASH_MAP_MAGIC )
+      return 1;  /* param error */
+
+   /* forks still look up keys in the map, the last one frees it */
+   if ( pHashMap->forks )
+   {
+      pHashMap->flags |= HASH_MAP_RELEASED;
+      return 0;
+   }
+
+   if ( pHashMap->flags & HASH_MAP_OPEN )
+   {
+      hash_open_free(pHashMap);
+   }
+   else if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+   {
+      hash_conc_free(pHashMap);
+   }
+   else if ( pHashMap->flags & HASH_MAP_COMPACT )
+   {
+      HASH_MAP_MFREE(pHashMap, pHashMap->roots);
+      HASH_MAP_MFREE(pHashMap, pHashMap->old_roots);
+   }
+   else
+   {
+      for ( i = 0; ( i <= pHashMap->buckets ) && !pHashMap->arena; i++ )
+      {
+         /* delete all binary trees */
+         root = &pHashMap->table[i];
+         if ( *root )
+            hash_map_free_tree(pHashMap, *root);
+      }
+      HASH_MAP_MFREE(pHashMap, pHashMap->table);
+
+      if ( pHashMap->old_table )
+      {
+         for ( i = pHashMap->rehash; ( i <= pHashMap->old_buckets ) && !pHashMap->arena; i++ )
+         {
+            root = &pHashMap->old_table[i];
+            if ( *root )
+               hash_map_free_tree(pHashMap, *root);
+         }
+         HASH_MAP_MFREE(pHashMap, pHashMap->old_table);
+      }
+   }
+
+   /* arena nodes are released along with their blocks */
+   if ( pHashMap->arena )
+      hash_arena_free(pHashMap->arena);
+
+   if ( pHashMap->hidden )
+      hash_map_free(pHashMap->hidden);
+
+   base = pHashMap->base;
+
+   pHashMap->magic = 0;
+
+   HASH_MAP_MFREE(pHashMap, pHashMap);
+
+   if ( base && !--base->forks && ( base->flags & HASH_MAP_RELEASED ) )
+      hash_map_free(base);
+
+   return 0;
+}
+
+
+/* walk a binary tree accumulating node count and depth into dist */
+static unsigned int hash_map_tree_dist(struct bst_node_t *node, unsigned int depth, struct hash_map_dist_t *dist)
+{
+   unsigned int count;
+
+   count = 0;
+   while ( node )
+   {
+      count++;
+      dist->total_depth += depth;
+      if ( depth > dist->max_depth )
+         dist->max_depth = depth;
+      count += hash_map_tree_dist(node->left, depth + 1, dist);
+      node = node->right;
+      depth++;
+   }
+   return count;
+}
+
+/*****************************************************************************
+
+int hash_map_distribution(struct hash_map_t *pHashMap, struct hash_map_dist_t *dist)
+
+Purpose
+   To report how the keys of a hashmap are distributed over its buckets
+
+Params
+   pHashMap - ptr to hash map to examine
+   dist - ptr to struct receiving the distribution
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+   Node depth is 1 for a bucket root node. The average tree depth is
+   total_depth / nodes. This walks every node so it is meant to be
+   called once, e.g. at exit, rather than in any hot path.
+
+*/
+int hash_map_distribution(struct hash_map_t *pHashMap, struct hash_map_dist_t *dist)
+{
+   unsigned int i;
+   unsigned int count;
+   struct bst_node_t** root;
+   struct bst_node_t* old;
+
+   if ( !pHashMap || !dist )
+      return 1;  /* param error */
+
+   if ( pHashMap->magic != HASH_MAP_MAGIC )
+      return 1;  /* param error */
+
+   memset(dist, 0, sizeof(struct hash_map_dist_t));
+   dist->buckets = pHashMap->buckets + 1;
+
+   if ( pHashMap->flags & HASH_MAP_OPEN )
+   {
+      hash_open_distribution(pHashMap, dist);
+      return 0;
+   }
+
+   if ( pHashMap->flags & HASH_MAP_COMPACT )
+   {
+      hash_compact_distribution(pHashMap, dist);
+      return 0;
+   }
+
+   if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+   {
+      hash_conc_distribution(pHashMap, dist);
+      return 0;
+   }
+
+   /* buckets not yet moved out of the old table count as well */
+   for ( i = 0; i <= pHashMap->buckets; i++ )
+   {
+      root = &pHashMap->table[i];
+      if ( pHashMap->old_table && ( i <= pHashMap->old_buckets ) && ( i >= pHashMap->rehash ) )
+         old = pHashMap->old_table[i];
+      else
+         old = (struct bst_node_t*)0;
+      if ( *root || old )
+      {
+         count = hash_map_tree_dist(*root, 1, dist);
+         count += hash_map_tree_dist(old, 1, dist);
+         dist->used++;
+         dist->nodes += count;
+         if ( count > dist->max_nodes )
+            dist->max_nodes = count;
+      }
+   }
+
+   return 0;
+}
+
+/*****************************************************************************
+
+int hash_map_stats(struct hash_map_t *pHashMap, struct hash_map_stats_t *stats)
+
+Purpose
+   To report the counters of a hashmap along with its memory use and
+   tree depth
+
+Params
+   pHashMap - ptr to hash map to examine
+   stats - ptr to struct receiving the counters
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+   The counters cost an increment per call and are always kept, except
+   for lookups and hits of a HASH_MAP_CONCURRENT map, as those would
+   make every reader write to memory shared with all the others.
+   The depth is taken from hash_map_distribution(), so like it this
+   walks every node and is meant to be called at exit.
+
+*/
+int hash_map_stats(struct hash_map_t *pHashMap, struct hash_map_stats_t *stats)
+{
+   struct hash_map_dist_t dist;
+   unsigned long bytes;
+
+   if ( !stats || hash_map_distribution(pHashMap, &dist) )
+      return 1;  /* param error */
+
+   bytes = sizeof(struct hash_map_t) + pHashMap->node_bytes;
+   if ( pHashMap->flags & HASH_MAP_OPEN )
+      bytes += (pHashMap->buckets + 1UL) * (sizeof(void*) + 1);
+   else if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+      bytes += hash_conc_bytes(pHashMap, dist.nodes);
+   else if ( pHashMap->flags & HASH_MAP_COMPACT )
+   {
+      bytes += (pHashMap->buckets + 1UL) * sizeof(unsigned int);
+      if ( pHashMap->old_roots )
+         bytes += (pHashMap->old_buckets + 1UL) * sizeof(unsigned int);
+   }
+   else
+   {
+      bytes += (pHashMap->buckets + 1UL) * sizeof(void*);
+      if ( pHashMap->old_table )
+         bytes += (pHashMap->old_buckets + 1UL) * sizeof(void*);
+   }
+   if ( pHashMap->arena )
+      bytes += sizeof(struct hash_arena_t) + pHashMap->arena->bytes + (pHashMap->arena->maxblocks * sizeof(void*));
+
+   *stats = pHashMap->stats;
+   stats->bytes = bytes;
+   stats->max_depth = dist.max_depth;
+   stats->avg_depth = dist.nodes ? (double)dist.total_depth / dist.nodes : 0.0;
+   return 0;
+}
+
+/*****************************************************************************
+
+struct bst_node_t* hash_map_first(struct hash_map_t *pHashMap, struct hash_map_iter_t *iter, void *prefix, unsigned int plen)
+
+Purpose
+   To start a walk over all nodes of a hashmap, or over all nodes whose
+   key starts with prefix
+
+Params
+   pHashMap - ptr to hash map to walk
+   iter - ptr to struct keeping the position of the walk
+   prefix - ptr to key prefix, null to visit all keys
+   plen - length of prefix
+
+Returns
+   ptr to first node visited, null if there is none
+
+Notes
+   Nodes are visited bucket by bucket, so they are in key order only
+   within a bucket. A fork visits its own nodes, then those of its base
+   it has not replaced or deleted. There is no index by prefix: the
+   hash spreads the keys sharing a prefix over all buckets, so a
+   prefix walk costs as much as a full walk, O(buckets + nodes), and
+   only spares the caller the keys that do not match. Within a
+   chained or compact bucket it descends to the first match instead of
+   visiting every node, an open or concurrent map has each of its
+   slots or nodes checked. A walk allocates no memory. The map must not be
+   changed until the walk has ended, though hash_map_find() may be
+   called. For a HASH_MAP_COMPACT map the node returned is only valid
+   until the next call, see hash_map_find(). A HASH_MAP_CONCURRENT map
+   may be changed by other threads during a walk; keys inserted or
+   deleted meanwhile may or may not be visited.
+
+*/
+struct bst_node_t* hash_map_first(struct hash_map_t *pHashMap, struct hash_map_iter_t *iter, void *prefix, unsigned int plen)
+{
+   if ( !pHashMap || !iter )
+      return (struct bst_node_t*)0;
+
+   memset(iter, 0, sizeof(struct hash_map_iter_t));
+   iter->prefix = prefix ? prefix : "";
+   iter->plen = prefix ? plen : 0;
+
+   return hash_map_next(pHashMap, iter);
+}
+
+/*****************************************************************************
+
+struct bst_node_t* hash_map_next(struct hash_map_t *pHashMap, struct hash_map_iter_t *iter)
+
+Purpose
+   To continue a walk started with hash_map_first()
+
+Params
+   pHashMap - ptr to hash map being walked
+   iter - ptr to struct keeping the position of the walk
+
+Returns
+   ptr to next node visited, null once all nodes were visited
+
+Notes
+   See hash_map_first()
+
+*/
+struct bst_node_t* hash_map_next(struct hash_map_t *pHashMap, struct hash_map_iter_t *iter)
+{
+   struct hash_map_t *layer;
+   struct bst_node_t *node;
+   void *prefix;
+   unsigned int plen;
+
+   if ( !pHashMap || !iter )
+      return (struct bst_node_t*)0;
+
+   for ( ;; )
+   {
+      layer = iter->map ? iter->map : pHashMap;
+      if ( layer->flags & HASH_MAP_OPEN )
+         node = hash_open_next(layer, iter);
+      else if ( layer->flags & HASH_MAP_COMPACT )
+         node = hash_compact_next(layer, iter);
+      else if ( layer->flags & HASH_MAP_CONCURRENT )
+         node = hash_conc_next(layer, iter);
+      else
+         node = hash_map_chained_next(layer, iter);
+
+      if ( node )
+      {
+         if ( ( layer == pHashMap ) || !hash_map_shadowed(pHashMap, layer, node->key, node->klen) )
+            return node;
+         continue;
+      }
+      if ( !layer->base )
+         return node;
+
+      /* go on with the base of a fork */
+      prefix = iter->prefix;
+      plen = iter->plen;
+      memset(iter, 0, sizeof(struct hash_map_iter_t));
+      iter->prefix = prefix;
+      iter->plen = plen;
+      iter->map = layer->base;
+   }
+}
+
+/*****************************************************************************
+
+int hash_map_reclaim(struct hash_map_t *pHashMap)
+
+Purpose
+   To free the nodes and tables a HASH_MAP_CONCURRENT map has retired
+
+Params
+   pHashMap - ptr to hash map
+
+Returns
+   0 if successful, otherwise error code
+
+Notes
+   Deleted and replaced nodes of a concurrent map are kept until this is
+   called, as another thread may still be looking at them. It must only
+   be called while no other thread uses the map, and invalidates every
+   node found before that has since been deleted or replaced. Other
+   maps free their nodes right away, so this does nothing for them.
+
+*/
+int hash_map_reclaim(struct hash_map_t *pHashMap)
+{
+   if ( !pHashMap || ( pHashMap->magic != HASH_MAP_MAGIC ) )
+      return 1;  /* param error */
+
+   if ( pHashMap->flags & HASH_MAP_CONCURRENT )
+      hash_conc_reclaim(pHashMap);
+
+   return 0;
+}
+
+/*****************************************************************************
+
+struct hash_map_allocator_t* hash_map_set_allocator(struct hash_map_allocator_t *allocator)
+
+Purpose
+   To set the global allocator, used by maps created with
+   hash_map_alloc() and for the nodes allocated by bintree.asm
+
+Params
+   allocator - ptr to allocator, null to go back to malloc() and free()
+
+Returns
+   ptr to previous global allocator
+
+Notes
+   Maps keep the allocator they were created with, so it may be set
+   at any time, as long as no node is freed by binarytree_delete_node()
+   or binarytree_delete_tree() with a different allocator than the one
+   it was allocated with. The allocator must stay valid while in use.
+
+*/
+struct hash_map_allocator_t* hash_map_set_allocator(struct hash_map_allocator_t *allocator)
+{
+   struct hash_map_allocator_t *old;
+
+   old = HashAllocator;
+   if ( allocator && allocator->alloc && allocator->free )
+   {
+      HashAllocator = allocator;
+      binarytree_malloc = hash_bst_alloc;
+      binarytree_free = hash_bst_free;
+   }
+   else
+   {
+      HashAllocator = &HashStdAllocator;
+      binarytree_malloc = malloc;
+      binarytree_free = free;
+   }
+   return old;
+}
+
+/*****************************************************************************
+
+struct hash_map_allocator_t* hash_map_get_allocator(void)
+
+Purpose
+   To obtain the global allocator, e.g. to allocate other memory of a
+   program along with that of its hash maps
+
+Params
+   none
+
+Returns
+   ptr to global allocator
+
+Notes
+   See hash_map_set_allocator()
+
+*/
+struct hash_map_allocator_t* hash_map_get_allocator(void)
+{
+   return HashAllocator;
+}
+
+/*****************************************************************************
+
+void hash_map_counter_init(struct hash_map_counter_t *counter, unsigned long limit)
+
+Purpose
+   To set up an allocator counting the memory it allocates
+
+Params
+   counter - ptr to counter, its allocator member is the allocator
+   limit - most bytes allocated at once, 0 for no limit
+
+Returns
+   nothing
+
+Notes
+   Pass &counter->allocator to hash_map_alloc_with() or
+   hash_map_set_allocator(). The counter keeps the bytes allocated
+   now and at most, the number of allocations and frees, and a
+   histogram of allocation sizes; sizes[i] counts the allocations of
+   up to 16 << i bytes not counted in sizes[i - 1], the last class
+   all larger ones. An allocation that would go over the limit fails.
+   The counter is not thread safe, so a HASH_MAP_CONCURRENT map using
+   it must not be changed by several threads at once.
+
+*/
+void hash_map_counter_init(struct hash_map_counter_t *counter, unsigned long limit)
+{
+   memset(counter, 0, sizeof(struct hash_map_counter_t));
+   counter->allocator.alloc = hash_counter_alloc;
+   counter->allocator.free = hash_counter_free;
+   counter->allocator.ctx = counter;
+   counter->limit = limit;
+}
+
+/*
+
+   Interning
+
+   An intern table keeps each string once and hands out a 32-bit ID for
+   it, so maps can key on IDs instead of on copies of the strings, and
+   two interned strings are equal only if their IDs are. The strings
+   are packed into an arena, each after a header with its hash, length
+   and a data word, and the ID of a string is its arena index. The
+   table itself is an array of IDs with linear probing, kept at most 3/4
+   full. A string costs its length plus 12 bytes, rounded to 16, and a
+   slot or two, against a bst_node_t and its bucket for a key in a hash
+   map, so the data word is the cheapest place to keep a small value
+   per string. IDs are never reused and strings are only freed along
+   with the table. A map keyed on IDs is best created with HASH_MAP_ID
+   and searched with the hash_map_*_hashed() functions, passing the ID
+   as its hash, so a lookup by ID hashes nothing.
+
+*/
+
+#define HASH_INTERN_SLOTS  0x100  /* least number of slots */
+
+/* header of an interned string, its chars follow */
+struct hash_intern_str_t {
+   unsigned int hash;
+   unsigned int len;
+   unsigned int data;                  /* see hash_intern_data() */
+};
+
+/* map an ID to its string header */
+#define HASH_INTERN_STR(pIntern, id) ((struct hash_intern_str_t*)HASH_ARENA_PTR((pIntern)->arena, id))
+
+/* find the slot holding a string, or the empty slot where it belongs */
+static unsigned int* hash_intern_slot(struct hash_intern_t *pIntern, unsigned int hash, void *str, unsigned int len)
+{
+   unsigned int i;
+   struct hash_intern_str_t *entry;
+
+   for ( i = HASH_MAP_FOLD(hash) & pIntern->mask; pIntern->slots[i]; i = ( i + 1 ) & pIntern->mask )
+   {
+      entry = HASH_INTERN_STR(pIntern, pIntern->slots[i]);
+      if ( ( entry->hash == hash ) && ( entry->len == len ) && !memcmp(entry + 1, str, len) )
+         break;
+   }
+   return &pIntern->slots[i];
+}
+
+/* double the number of slots, 0 if successful */
+static int hash_intern_grow(struct hash_intern_t *pIntern)
+{
+   unsigned int i;
+   unsigned int j;
+   unsigned int mask;
+   unsigned int *slots;
+   unsigned int *old;
+
+   mask = ( pIntern->mask << 1 ) | 1;
+   slots = pIntern->allocator->alloc(pIntern->allocator->ctx, ( mask + 1 ) * sizeof(unsigned int));
+   if ( !slots )
+      return 2;  /* memory error */
+   memset(slots, 0, ( mask + 1 ) * sizeof(unsigned int));
+
+   old = pIntern->slots;
+   for ( i = 0; i <= pIntern->mask; i++ )
+   {
+      if ( !old[i] )
+         continue;
+      j = HASH_MAP_FOLD(HASH_INTERN_STR(pIntern, old[i])->hash) & mask;
+      while ( slots[j] )
+         j = ( j + 1 ) & mask;
+      slots[j] = old[i];
+   }
+
+   pIntern->allocator->free(pIntern->allocator->ctx, old);
+   pIntern->slots = slots;
+   pIntern->mask = mask;
+   return 0;
+}
+
+/*****************************************************************************
+
+struct hash_intern_t* hash_intern_alloc(unsigned int slots, unsigned int flags)
+
+Purpose
+   To create an intern table
+
+Params
+   slots - number of strings expected, rounded up to a power of 2
+   flags - HASH_MAP_* flags selecting the hash function, others are
+      ignored; HASH_MAP_ID is not a string hash and is refused
+
+Returns
+   ptr to intern table, null if out of memory or a param is invalid
+
+Notes
+   The table uses the global allocator, see hash_map_set_allocator().
+   It is not thread safe.
+
+*/
+struct hash_intern_t* hash_intern_alloc(unsigned int slots, unsigned int flags)
+{
+   unsigned int mask;
+   struct hash_intern_t *pIntern;
+   struct hash_map_allocator_t *allocator;
+
+   switch ( flags & HASH_MAP_HASH_MASK )
+   {
+      case HASH_MAP_HASH16:
+      case HASH_MAP_FNV1A:
+      case HASH_MAP_WIDE:
+         break;
+      default:
+         return (struct hash_intern_t*)0;
+   }
+
+   mask = HASH_INTERN_SLOTS - 1;
+   while ( ( mask + 1 < slots ) && ( mask < 0x3FFFFFFF ) )
+      mask = ( mask << 1 ) | 1;
+
+   allocator = HashAllocator;
+   pIntern = allocator->alloc(allocator->ctx, sizeof(struct hash_intern_t));
+   if ( !pIntern )
+      return pIntern;
+   memset(pIntern, 0, sizeof(struct hash_intern_t));
+   pIntern->allocator = allocator;
+   pIntern->hash = hash_map_function(flags);
+   pIntern->flags = flags & HASH_MAP_HASH_MASK;
+   pIntern->mask = mask;
+
+   pIntern->arena = allocator->alloc(allocator->ctx, sizeof(struct hash_arena_t));
+   pIntern->slots = allocator->alloc(allocator->ctx, ( mask + 1 ) * sizeof(unsigned int));
+   if ( !pIntern->arena || !pIntern->slots )
+   {
+      allocator->free(allocator->ctx, pIntern->arena);
+      allocator->free(allocator->ctx, pIntern->slots);
+      allocator->free(allocator->ctx, pIntern);
+      return (struct hash_intern_t*)0;
+   }
+   memset(pIntern->arena, 0, sizeof(struct hash_arena_t));
+   pIntern->arena->allocator = allocator;
+   memset(pIntern->slots, 0, ( mask + 1 ) * sizeof(unsigned int));
+
+   return pIntern;
+}
+
+/*****************************************************************************
+
+unsigned int hash_intern(struct hash_intern_t *pIntern, void *str, unsigned int len)
+
+Purpose
+   To obtain the ID of a string, adding the string if it is new
+
+Params
+   pIntern - ptr to intern table
+   str - ptr to string, need not be nul terminated
+   len - length of string
+
+Returns
+   ID of string, 0 if out of memory or a param is invalid
+
+*/
+unsigned int hash_intern(struct hash_intern_t *pIntern, void *str, unsigned int len)
+{
+   if ( !pIntern || !str || !len )
+      return 0;
+
+   return hash_intern_hashed(pIntern, pIntern->hash(str, len), str, len);
+}
+
+/*****************************************************************************
+
+unsigned int hash_intern_hash(struct hash_intern_t *pIntern, void *str, unsigned int len)
+
+Purpose
+   To calculate the hash of a string as used by an intern table
+
+Params
+   pIntern - ptr to intern table
+   str - ptr to string
+   len - length of string
+
+Returns
+   hash of string, to be passed to hash_intern_hashed() and
+   hash_intern_find_hashed()
+
+*/
+unsigned int hash_intern_hash(struct hash_intern_t *pIntern, void *str, unsigned int len)
+{
+   return pIntern->hash(str, len);
+}
+
+/*****************************************************************************
+
+unsigned int hash_intern_scan(struct hash_intern_t *pIntern, char *p, unsigned char *stop, char **end)
+
+Purpose
+   To find the end of a token and calculate its hash as used by an
+   intern table in one pass
+
+Params
+   pIntern - ptr to intern table
+   p - ptr to first char of token
+   stop - table of 256 entries, nonzero for chars that end a token
+   end - receives ptr to the char that ended the token
+
+Returns
+   hash of the chars from p up to *end, same as hash_intern_hash()
+
+Notes
+   See hash_map_scan(). h2incn_lex() hashes each name of a directive
+   line with it, so the symbols are looked up without hashing the name
+   again.
+
+*/
+unsigned int hash_intern_scan(struct hash_intern_t *pIntern, char *p, unsigned char *stop, char **end)
+{
+   return hash_scan(pIntern->flags, p, stop, end);
+}
+
+/*****************************************************************************
+
+unsigned int hash_intern_hashed(struct hash_intern_t *pIntern, unsigned int hash, void *str, unsigned int len)
+
+Purpose
+   To obtain the ID of a string, adding the string if it is new
+
+Params
+   pIntern - ptr to intern table
+   hash - hash of string
+   str - ptr to string, need not be nul terminated
+   len - length of string
+
+Returns
+   ID of string, 0 if out of memory or a param is invalid
+
+Notes
+   The hash must come from hash_intern_hash() or hash_intern_scan() of
+   the table, or from hash_map_hash() or hash_map_scan() of a map
+   created with the same hash function flags as the table.
+
+*/
+unsigned int hash_intern_hashed(struct hash_intern_t *pIntern, unsigned int hash, void *str, unsigned int len)
+{
+   unsigned int id;
+   unsigned int *slot;
+   struct hash_intern_str_t *entry;
+
+   if ( !pIntern || !str || !len )
+      return 0;
+
+   slot = hash_intern_slot(pIntern, hash, str, len);
+   if ( *slot )
+      return *slot;
+
+   if ( ( pIntern->count + 1 ) > ( pIntern->mask - ( pIntern->mask >> 2 ) ) )
+   {
+      if ( hash_intern_grow(pIntern) )
+         return 0;
+      slot = hash_intern_slot(pIntern, hash, str, len);
+   }
+
+   entry = hash_arena_alloc(pIntern->arena, hash_arena_size(sizeof(struct hash_intern_str_t), len, 0), &id);
+   if ( !entry )
+      return 0;
+   entry->hash = hash;
+   entry->len = len;
+   entry->data = 0;
+   memcpy(entry + 1, str, len);
+
+   *slot = id;
+   pIntern->count++;
+   pIntern->bytes += len;
+   return id;
+}
+
+/*****************************************************************************
+
+unsigned int hash_intern_find_hashed(struct hash_intern_t *pIntern, unsigned int hash, void *str, unsigned int len)
+
+Purpose
+   To obtain the ID of a string without adding it
+
+Params
+   pIntern - ptr to intern table
+   hash - hash of string, see hash_intern_hashed()
+   str - ptr to string
+   len - length of string
+
+Returns
+   ID of string, 0 if not interned
+
+*/
+unsigned int hash_intern_find_hashed(struct hash_intern_t *pIntern, unsigned int hash, void *str, unsigned int len)
+{
+   if ( !pIntern || !str || !len )
+      return 0;
+
+   return *hash_intern_slot(pIntern, hash, str, len);
+}
+
+/*****************************************************************************
+
+void* hash_intern_string(struct hash_intern_t *pIntern, unsigned int id, unsigned int *len)
+
+Purpose
+   To obtain the string of an ID
+
+Params
+   pIntern - ptr to intern table
+   id - ID returned by hash_intern()
+   len - receives length of string, may be null
+
+Returns
+   ptr to string, not nul terminated
+
+Notes
+   The ID must have been returned by the same table, it is not checked.
+
+*/
+void* hash_intern_string(struct hash_intern_t *pIntern, unsigned int id, unsigned int *len)
+{
+   struct hash_intern_str_t *entry;
+
+   entry = HASH_INTERN_STR(pIntern, id);
+   if ( len )
+      *len = entry->len;
+   return entry + 1;
+}
+
+/*****************************************************************************
+
+unsigned int* hash_intern_data(struct hash_intern_t *pIntern, unsigned int id)
+
+Purpose
+   To obtain the data word of an ID
+
+Params
+   pIntern - ptr to intern table
+   id - ID returned by hash_intern()
+
+Returns
+   ptr to data word, which is 0 when the string is added and
+   otherwise left to the caller
+
+Notes
+   The ID must have been returned by the same table, it is not checked.
+
+*/
+unsigned int* hash_intern_data(struct hash_intern_t *pIntern, unsigned int id)
+{
+   return &HASH_INTERN_STR(pIntern, id)->data;
+}
+
+/*****************************************************************************
+
+unsigned long hash_intern_bytes(struct hash_intern_t *pIntern)
+
+Purpose
+   To obtain the memory held by an intern table
+
+Params
+   pIntern - ptr to intern table
+
+Returns
+   bytes allocated for the table and its strings
+
+*/
+unsigned long hash_intern_bytes(struct hash_intern_t *pIntern)
+{
+   return sizeof(struct hash_intern_t) + sizeof(struct hash_arena_t) + pIntern->arena->bytes
+      + ( pIntern->arena->maxblocks * sizeof(void*) ) + ( ( pIntern->mask + 1 ) * sizeof(unsigned int) );
+}
+
+/*****************************************************************************
+
+int hash_intern_free(struct hash_intern_t *pIntern)
+
+Purpose
+   To free an intern table and all of its strings
+
+Params
+   pIntern - ptr to intern table
+
+Returns
+   0 if successful, otherwise error code
+
+*/
+int hash_intern_free(struct hash_intern_t *pIntern)
+{
+   struct hash_map_allocator_t *allocator;
+
+   if ( !pIntern )
+      return 1;  /* param error */
+
+   allocator = pIntern->allocator;
+   hash_arena_free(pIntern->arena);
+   allocator->free(allocator->ctx, pIntern->slots);
+   allocator->free(allocator->ctx, pIntern);
+   return 0;
+}
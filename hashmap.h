@@ -10,6 +10,8 @@
 #ifndef __HASHMAP_INCLUDED__
 #define __HASHMAP_INCLUDED__
 
+#include <stddef.h>
+
 /* as defined in bintree.inc */
 struct bst_node_t {
    struct bst_node_t *parent;
@@ -19,28 +21,193 @@ struct bst_node_t {
    void *value;
    unsigned int klen;
    unsigned int vlen;
+   unsigned int height;                /* subtree height, kept by bintree.asm/.c */
+   unsigned int hash;                  /* hash of key, set by hash_map_t */
+   unsigned long long prefix;          /* first 8 key bytes as a big endian number */
+};
+
+/* HASH_MAP_COMPACT node, klen bytes of key then vlen bytes of value follow */
+struct bst_cnode_t {
+   unsigned int left;                  /* arena index of left child, 0 if none */
+   unsigned int right;                 /* arena index of right child, 0 if none */
+   unsigned int klen;
+   unsigned int vlen;
+};
+
+/* hash_map_alloc() flags: hash function used to distribute keys into buckets */
+#define HASH_MAP_HASH16     0x00000000  /* 16-bit modified Fletcher sum */
+#define HASH_MAP_FNV1A      0x00000001  /* 32-bit FNV-1a, see fnv1hash.asm */
+#define HASH_MAP_WIDE       0x00000002  /* word-at-a-time multiply/xor hash */
+#define HASH_MAP_ID         0x00000003  /* 32-bit keys, e.g. hash_intern() IDs, are their own hash */
+#define HASH_MAP_HASH_MASK  0x0000000F
+
+/* hash_map_alloc() flags: table type */
+#define HASH_MAP_CHAINED    0x00000000  /* buckets of binary trees */
+#define HASH_MAP_OPEN       0x00000010  /* open addressing, SSE2 probed */
+#define HASH_MAP_FIXED      0x00000020  /* chained, never grows, max 32K buckets */
+
+/* hash_map_alloc() flags: node allocation */
+#define HASH_MAP_ARENA      0x00000040  /* carve nodes from large blocks */
+#define HASH_MAP_COMPACT    0x00000080  /* chained, bst_cnode_t nodes, implies arena */
+
+/* hash_map_alloc() flags: thread safety. Nodes deleted or replaced in a
+   concurrent map, and the tables it outgrows, are not freed until
+   hash_map_reclaim() is called at a point where no other thread uses
+   the map, so a map changed for a long time must be reclaimed now and
+   then or its memory keeps growing. */
+#define HASH_MAP_CONCURRENT 0x00000100  /* lock-free lookups, striped writer locks */
+
+/* most bases a lookup in a fork goes through, see hash_map_fork() */
+#define HASH_MAP_FORK_DEPTH 8
+
+/* memory allocator of a hash map, see hash_map_set_allocator() */
+struct hash_map_allocator_t {
+   void* (*alloc)(void *ctx, size_t size);  /* returns null if out of memory */
+   void (*free)(void *ctx, void *p);
+   void *ctx;                               /* passed to alloc and free */
+};
+
+#define HASH_MAP_COUNTER_CLASSES  20
+
+/* allocator counting its memory, see hash_map_counter_init() */
+struct hash_map_counter_t {
+   struct hash_map_allocator_t allocator;
+   unsigned long bytes;       /* bytes allocated now */
+   unsigned long peak;        /* most bytes allocated at once */
+   unsigned long limit;       /* most bytes that may be allocated, 0 for no limit */
+   unsigned long allocs;      /* allocations made */
+   unsigned long frees;       /* allocations freed */
+   unsigned long failures;    /* allocations failed or refused over the limit */
+   unsigned long sizes[HASH_MAP_COUNTER_CLASSES];  /* allocations by size class */
+};
+
+struct hash_arena_t;
+struct hash_conc_t;
+struct hash_conc_table_t;
+struct hash_conc_link_t;
+
+/* counters of a hash map, see hash_map_stats() */
+struct hash_map_stats_t {
+   unsigned long inserts;     /* calls to hash_map_insert() */
+   unsigned long deletes;     /* calls to hash_map_delete() */
+   unsigned long lookups;     /* calls to hash_map_find() */
+   unsigned long hits;        /* lookups that found the key */
+   unsigned long collisions;  /* new keys put in an occupied bucket or group */
+   unsigned long bytes;       /* memory held by the map */
+   unsigned int max_depth;    /* depth of the deepest tree or probe sequence */
+   double avg_depth;          /* average node depth */
 };
 
 struct hash_map_t {
    unsigned int magic;
    unsigned int buckets;
+   unsigned int flags;
+   unsigned int count;                 /* nodes in use */
+   unsigned int deleted;               /* HASH_MAP_OPEN: deleted slots */
+   unsigned int old_buckets;           /* bitmask of old_table */
+   unsigned int rehash;                /* next old_table bucket to move */
+   unsigned char *ctrl;                /* HASH_MAP_OPEN: control byte per slot */
+   struct bst_node_t **table;          /* bucket roots, or HASH_MAP_OPEN slots */
+   struct bst_node_t **old_table;      /* bucket roots being moved to table */
+   struct hash_arena_t *arena;         /* HASH_MAP_ARENA: node memory */
+   unsigned int *roots;                /* HASH_MAP_COMPACT bucket roots */
+   unsigned int *old_roots;            /* HASH_MAP_COMPACT roots being moved */
+   struct bst_node_t view;             /* HASH_MAP_COMPACT node returned by find */
+   unsigned int (*hash)(unsigned char *key, unsigned int len);
+   struct hash_map_stats_t stats;      /* counters, see hash_map_stats() */
+   unsigned long node_bytes;           /* memory of nodes not in the arena */
+   struct hash_conc_t *conc;           /* HASH_MAP_CONCURRENT: tables and locks */
+   struct hash_map_allocator_t *allocator;  /* source of all memory of the map */
+   struct hash_map_t *base;            /* map forked from, see hash_map_fork() */
+   struct hash_map_t *hidden;          /* keys of base deleted from this fork */
+   unsigned int forks;                 /* forks of this map, read only while any */
+};
+
+/* key distribution of a hash map, see hash_map_distribution() */
+struct hash_map_dist_t {
+   unsigned int buckets;      /* number of buckets */
+   unsigned int used;         /* buckets holding at least one node */
+   unsigned int nodes;        /* total number of nodes */
+   unsigned int max_nodes;    /* most nodes held by a single bucket */
+   unsigned int max_depth;    /* depth of the deepest binary tree */
+   unsigned long total_depth; /* sum of all node depths */
+};
+
+/* position of a walk over a hash map, see hash_map_first() */
+struct hash_map_iter_t {
+   void *prefix;              /* only keys starting with prefix are visited */
+   unsigned int plen;         /* length of prefix, 0 to visit all keys */
+   unsigned int bucket;       /* next bucket or slot to visit */
+   unsigned int root;         /* HASH_MAP_COMPACT: root of current bucket */
+   unsigned int index;        /* HASH_MAP_COMPACT: current node */
+   struct bst_node_t *node;   /* current node */
+   struct hash_conc_table_t *table;  /* HASH_MAP_CONCURRENT: table walked */
+   struct hash_conc_link_t *link;    /* HASH_MAP_CONCURRENT: current link */
+   struct hash_map_t *map;    /* fork or base being walked, null for the map itself */
+};
+
+/* strings kept once and numbered, see hash_intern_alloc() */
+struct hash_intern_t {
+   struct hash_arena_t *arena;         /* the strings, an ID is the arena index of one */
+   unsigned int *slots;                /* IDs placed by hash, 0 if empty */
+   unsigned int mask;                  /* number of slots - 1 */
+   unsigned int count;                 /* strings interned */
+   unsigned int flags;                 /* HASH_MAP_* hash function */
+   unsigned long bytes;                /* length of all strings */
+   unsigned int (*hash)(unsigned char *key, unsigned int len);
+   struct hash_map_allocator_t *allocator;
 };
 
 /* contained in fnv1hash.asm */
 unsigned int FNV1Hash(char *buffer, unsigned int len, unsigned int offset_basis);
 
-/* contained in bintree.asm */
+/* contained in bintree.asm, or bintree.c if built with bintree=c */
+extern void* (*binarytree_malloc)(size_t size);
+extern void (*binarytree_free)(void *p);
 struct bst_node_t * binarytree_alloc_node(void *key, unsigned int klen, char *value, unsigned int vlen);
 struct bst_node_t * binarytree_find_node(struct bst_node_t **root, void *key, unsigned int klen);
 int binarytree_insert_node(struct bst_node_t **root, struct bst_node_t *node);
+struct bst_node_t * binarytree_remove_node(struct bst_node_t **root, void *key, unsigned int klen);
 int binarytree_delete_node(struct bst_node_t **root, void *key, unsigned int klen);
 int binarytree_delete_tree(struct bst_node_t **root);
+struct bst_node_t * binarytree_first_node(struct bst_node_t **root);
+struct bst_node_t * binarytree_next_node(struct bst_node_t *node);
+struct bst_node_t * binarytree_find_prefix(struct bst_node_t **root, void *key, unsigned int klen);
 
 /* contained in hashmap.c */
-struct hash_map_t* hash_map_alloc(unsigned int buckets);
+struct hash_map_t* hash_map_alloc(unsigned int buckets, unsigned int flags);
+struct hash_map_t* hash_map_alloc_with(unsigned int buckets, unsigned int flags, struct hash_map_allocator_t *allocator);
+struct hash_map_t* hash_map_fork(struct hash_map_t *map);
 struct bst_node_t* hash_map_find(struct hash_map_t* map, void *key, unsigned int len);
 int hash_map_insert(struct hash_map_t *map, void *key, unsigned int klen, void *value, unsigned int vlen);
 int hash_map_delete(struct hash_map_t *map, void *key, unsigned int klen);
+unsigned int hash_map_hash(struct hash_map_t *map, void *key, unsigned int klen);
+unsigned int hash_map_scan(struct hash_map_t *map, char *p, unsigned char *stop, char **end);
+struct bst_node_t* hash_map_find_hashed(struct hash_map_t *map, unsigned int hash, void *key, unsigned int klen);
+int hash_map_find_batch(struct hash_map_t *map, unsigned int n, void **keys, unsigned int *klens, struct bst_node_t **nodes);
+int hash_map_insert_hashed(struct hash_map_t *map, unsigned int hash, void *key, unsigned int klen, void *value, unsigned int vlen);
+int hash_map_delete_hashed(struct hash_map_t *map, unsigned int hash, void *key, unsigned int klen);
 int hash_map_free(struct hash_map_t* map);
+int hash_map_distribution(struct hash_map_t *map, struct hash_map_dist_t *dist);
+int hash_map_stats(struct hash_map_t *map, struct hash_map_stats_t *stats);
+struct bst_node_t* hash_map_first(struct hash_map_t *map, struct hash_map_iter_t *iter, void *prefix, unsigned int plen);
+struct bst_node_t* hash_map_next(struct hash_map_t *map, struct hash_map_iter_t *iter);
+/* a HASH_MAP_CONCURRENT map never frees a node deleted or replaced while
+   readers may still hold it; such nodes are freed only when the caller
+   reclaims them here, where no reader uses the map, or by hash_map_free() */
+int hash_map_reclaim(struct hash_map_t *map);
+struct hash_map_allocator_t* hash_map_set_allocator(struct hash_map_allocator_t *allocator);
+struct hash_map_allocator_t* hash_map_get_allocator(void);
+void hash_map_counter_init(struct hash_map_counter_t *counter, unsigned long limit);
+struct hash_intern_t* hash_intern_alloc(unsigned int slots, unsigned int flags);
+unsigned int hash_intern(struct hash_intern_t *table, void *str, unsigned int len);
+unsigned int hash_intern_hash(struct hash_intern_t *table, void *str, unsigned int len);
+unsigned int hash_intern_scan(struct hash_intern_t *table, char *p, unsigned char *stop, char **end);
+unsigned int hash_intern_hashed(struct hash_intern_t *table, unsigned int hash, void *str, unsigned int len);
+unsigned int hash_intern_find_hashed(struct hash_intern_t *table, unsigned int hash, void *str, unsigned int len);
+void* hash_intern_string(struct hash_intern_t *table, unsigned int id, unsigned int *len);
+unsigned int* hash_intern_data(struct hash_intern_t *table, unsigned int id);
+unsigned long hash_intern_bytes(struct hash_intern_t *table);
+int hash_intern_free(struct hash_intern_t *table);
 
 #endif  /* ifndef __HASHMAP_INCLUDED__ */
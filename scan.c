@@ -0,0 +1,511 @@
+/*
+   scan.c : character scanning routines
+
+   Copyright (C)2010 Rob Neff - All rights reserved.
+   Source code licensed under the new/simplified 2-clause BSD OSI license.
+
+   The parser spends most of its time stepping over comments, macro
+   bodies and code it does not convert. These routines find the end of
+   such runs, 16 or 32 bytes at a time where the cpu allows it. Every
+   kernel returns the same pointer as its table driven scalar version.
+
+*/
+#include <stddef.h>
+#include "scan.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SCAN_HAVE_SSE2 1
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#include <immintrin.h>
+#define SCAN_HAVE_AVX2 1
+#define SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+/* the vector kernels load whole aligned blocks, which may extend past the
+   nul ending the text but never into the next page, so they are not
+   checked by the address sanitizer */
+#if defined(__SANITIZE_ADDRESS__)
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef SCAN_NO_SANITIZE
+#define SCAN_NO_SANITIZE
+#endif
+
+const unsigned char scan_class[256] = {
+   9, 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 0, 0, 9, 0, 0,  /* 00-0F */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 10-1F */
+   2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 20-2F */
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0,  /* 30-3F */
+   0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  /* 40-4F */
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 8, 0, 0, 4,  /* 50-5F */
+   0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  /* 60-6F */
+   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0,  /* 70-7F */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 80-8F */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 90-9F */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* A0-AF */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* B0-BF */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* C0-CF */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* D0-DF */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* E0-EF */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* F0-FF */
+};
+
+static char* scan_eol_scalar(char *p)
+{
+   while ( !( scan_class[(unsigned char)*p] & SCAN_EOL ) ) p++;
+   return p;
+}
+
+static char* scan_space_scalar(char *p)
+{
+   while ( scan_class[(unsigned char)*p] & SCAN_SPACE ) p++;
+   return p;
+}
+
+static char* scan_ident_scalar(char *p)
+{
+   while ( scan_class[(unsigned char)*p] & SCAN_IDENT ) p++;
+   return p;
+}
+
+static char* scan_splice_scalar(char *p)
+{
+   while ( !( scan_class[(unsigned char)*p] & SCAN_SPLICE ) ) p++;
+   return p;
+}
+
+static char* scan_comment_scalar(char *p)
+{
+   for (;;)
+   {
+      while ( ( *p != 0 ) && ( *p != '\n' ) && ( *p != '*' ) ) p++;
+      if ( ( *p != '*' ) || ( *(p+1) == '/' ) )
+         return p;
+      p++;
+   }
+}
+
+static size_t scan_lines_scalar(char *p, char *end)
+{
+   size_t lines;
+
+   for ( lines = 0; p < end; p++ )
+      lines += ( *p == '\n' );
+   return lines;
+}
+
+char* (*scan_eol)(char *p) = scan_eol_scalar;
+char* (*scan_space)(char *p) = scan_space_scalar;
+char* (*scan_ident)(char *p) = scan_ident_scalar;
+char* (*scan_comment)(char *p) = scan_comment_scalar;
+char* (*scan_splice)(char *p) = scan_splice_scalar;
+size_t (*scan_lines)(char *p, char *end) = scan_lines_scalar;
+
+#ifdef SCAN_HAVE_SSE2
+
+/* index of lowest set bit of a non-zero mask */
+static unsigned int scan_first(unsigned int mask)
+{
+#ifdef __GNUC__
+   return (unsigned int)__builtin_ctz(mask);
+#else
+   unsigned int i;
+
+   for ( i = 0; ( mask & 1 ) == 0; i++ )
+      mask >>= 1;
+   return i;
+#endif
+}
+
+/* bit per byte of v that is nul, '\r' or '\n' */
+static unsigned int scan_eol_mask16(__m128i v)
+{
+   __m128i m;
+
+   m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+   return (unsigned int)_mm_movemask_epi8(m);
+}
+
+/* bit per byte of v that is not ' ' or '\t' */
+static unsigned int scan_space_mask16(__m128i v)
+{
+   __m128i m;
+
+   m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+   return ~(unsigned int)_mm_movemask_epi8(m) & 0xFFFF;
+}
+
+/* bit per byte of v that is not a letter, digit or '_', bytes over 0x7F
+   are negative and fail the signed range compares */
+static unsigned int scan_ident_mask16(__m128i v)
+{
+   __m128i lower;
+   __m128i m;
+
+   lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+   m = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+   m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v)));
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+   return ~(unsigned int)_mm_movemask_epi8(m) & 0xFFFF;
+}
+
+/* bit per byte of v that is nul, '\n' or '*' */
+static unsigned int scan_comment_mask16(__m128i v)
+{
+   __m128i m;
+
+   m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+   return (unsigned int)_mm_movemask_epi8(m);
+}
+
+/* bit per byte of v that is nul, '\r' or '\\' */
+static unsigned int scan_splice_mask16(__m128i v)
+{
+   __m128i m;
+
+   m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+   m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+   return (unsigned int)_mm_movemask_epi8(m);
+}
+
+/* the first block is loaded from the aligned address at or before p and
+   the bytes before p are shifted out of its mask */
+#define SCAN_SSE2_KERNEL(name, maskfn) \
+SCAN_NO_SANITIZE static char* name(char *p) \
+{ \
+   char *block; \
+   unsigned int mask; \
+ \
+   block = (char*)( (size_t)p & ~(size_t)15 ); \
+   mask = maskfn(_mm_load_si128((__m128i*)block)) >> ( p - block ); \
+   if ( mask ) \
+      return p + scan_first(mask); \
+   for (;;) \
+   { \
+      block += 16; \
+      mask = maskfn(_mm_load_si128((__m128i*)block)); \
+      if ( mask ) \
+         return block + scan_first(mask); \
+   } \
+}
+
+SCAN_SSE2_KERNEL(scan_eol_sse2, scan_eol_mask16)
+SCAN_SSE2_KERNEL(scan_space_sse2, scan_space_mask16)
+SCAN_SSE2_KERNEL(scan_ident_sse2, scan_ident_mask16)
+SCAN_SSE2_KERNEL(scan_splice_sse2, scan_splice_mask16)
+
+SCAN_NO_SANITIZE static char* scan_comment_sse2(char *p)
+{
+   char *block;
+   char *q;
+   unsigned int mask;
+
+   block = (char*)( (size_t)p & ~(size_t)15 );
+   mask = scan_comment_mask16(_mm_load_si128((__m128i*)block)) >> ( p - block );
+   block = p;
+   for (;;)
+   {
+      /* a '*' not followed by '/' is part of the comment */
+      while ( mask )
+      {
+         q = block + scan_first(mask);
+         if ( ( *q != '*' ) || ( *(q+1) == '/' ) )
+            return q;
+         mask &= mask - 1;
+      }
+      block = (char*)( (size_t)block & ~(size_t)15 ) + 16;
+      mask = scan_comment_mask16(_mm_load_si128((__m128i*)block));
+   }
+}
+
+/* sum of the byte counts of acc, at most 255 each */
+static size_t scan_sum16(__m128i acc)
+{
+   acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+   return (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+/* the aligned blocks are counted a byte lane at a time, which is summed
+   before a lane can overflow */
+static size_t scan_lines_sse2(char *p, char *end)
+{
+   __m128i acc;
+   size_t lines;
+   int n;
+
+   lines = 0;
+   while ( ( p < end ) && ( (size_t)p & 15 ) )
+      lines += ( *p++ == '\n' );
+   acc = _mm_setzero_si128();
+   n = 0;
+   for ( ; end - p >= 16; p += 16 )
+   {
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_load_si128((__m128i*)p), _mm_set1_epi8('\n')));
+      if ( ++n == 255 )
+      {
+         lines += scan_sum16(acc);
+         acc = _mm_setzero_si128();
+         n = 0;
+      }
+   }
+   lines += scan_sum16(acc);
+   return lines + scan_lines_scalar(p, end);
+}
+
+#endif  /* SCAN_HAVE_SSE2 */
+
+#ifdef SCAN_HAVE_AVX2
+
+SCAN_TARGET_AVX2 static unsigned int scan_eol_mask32(__m256i v)
+{
+   __m256i m;
+
+   m = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+   return (unsigned int)_mm256_movemask_epi8(m);
+}
+
+SCAN_TARGET_AVX2 static unsigned int scan_space_mask32(__m256i v)
+{
+   __m256i m;
+
+   m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+   return ~(unsigned int)_mm256_movemask_epi8(m);
+}
+
+SCAN_TARGET_AVX2 static unsigned int scan_ident_mask32(__m256i v)
+{
+   __m256i lower;
+   __m256i m;
+
+   lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+   m = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+   m = _mm256_or_si256(m, _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v)));
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+   return ~(unsigned int)_mm256_movemask_epi8(m);
+}
+
+SCAN_TARGET_AVX2 static unsigned int scan_comment_mask32(__m256i v)
+{
+   __m256i m;
+
+   m = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+   return (unsigned int)_mm256_movemask_epi8(m);
+}
+
+SCAN_TARGET_AVX2 static unsigned int scan_splice_mask32(__m256i v)
+{
+   __m256i m;
+
+   m = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+   m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+   return (unsigned int)_mm256_movemask_epi8(m);
+}
+
+#define SCAN_AVX2_KERNEL(name, maskfn) \
+SCAN_NO_SANITIZE SCAN_TARGET_AVX2 static char* name(char *p) \
+{ \
+   char *block; \
+   unsigned int mask; \
+ \
+   block = (char*)( (size_t)p & ~(size_t)31 ); \
+   mask = maskfn(_mm256_load_si256((__m256i*)block)) >> ( p - block ); \
+   if ( mask ) \
+      return p + scan_first(mask); \
+   for (;;) \
+   { \
+      block += 32; \
+      mask = maskfn(_mm256_load_si256((__m256i*)block)); \
+      if ( mask ) \
+         return block + scan_first(mask); \
+   } \
+}
+
+SCAN_AVX2_KERNEL(scan_eol_avx2, scan_eol_mask32)
+SCAN_AVX2_KERNEL(scan_space_avx2, scan_space_mask32)
+SCAN_AVX2_KERNEL(scan_ident_avx2, scan_ident_mask32)
+SCAN_AVX2_KERNEL(scan_splice_avx2, scan_splice_mask32)
+
+SCAN_NO_SANITIZE SCAN_TARGET_AVX2 static char* scan_comment_avx2(char *p)
+{
+   char *block;
+   char *q;
+   unsigned int mask;
+
+   block = (char*)( (size_t)p & ~(size_t)31 );
+   mask = scan_comment_mask32(_mm256_load_si256((__m256i*)block)) >> ( p - block );
+   block = p;
+   for (;;)
+   {
+      while ( mask )
+      {
+         q = block + scan_first(mask);
+         if ( ( *q != '*' ) || ( *(q+1) == '/' ) )
+            return q;
+         mask &= mask - 1;
+      }
+      block = (char*)( (size_t)block & ~(size_t)31 ) + 32;
+      mask = scan_comment_mask32(_mm256_load_si256((__m256i*)block));
+   }
+}
+
+SCAN_TARGET_AVX2 static size_t scan_lines_avx2(char *p, char *end)
+{
+   __m256i acc;
+   size_t lines;
+   int n;
+
+   lines = 0;
+   while ( ( p < end ) && ( (size_t)p & 31 ) )
+      lines += ( *p++ == '\n' );
+   acc = _mm256_setzero_si256();
+   n = 0;
+   for ( ; end - p >= 32; p += 32 )
+   {
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_load_si256((__m256i*)p), _mm256_set1_epi8('\n')));
+      if ( ++n == 255 )
+      {
+         lines += scan_sum16(_mm256_castsi256_si128(acc)) + scan_sum16(_mm256_extracti128_si256(acc, 1));
+         acc = _mm256_setzero_si256();
+         n = 0;
+      }
+   }
+   lines += scan_sum16(_mm256_castsi256_si128(acc)) + scan_sum16(_mm256_extracti128_si256(acc, 1));
+   return lines + scan_lines_scalar(p, end);
+}
+
+#endif  /* SCAN_HAVE_AVX2 */
+
+/*****************************************************************************
+
+char* scan_stop(char *p, unsigned char *stop)
+
+Purpose
+   To find the first character of a set
+
+Params
+   p - ptr to nul terminated text
+   stop - table of 256 entries, non-zero for each character of the set
+          and for the nul byte
+
+Returns
+   ptr to the first character of p in the set
+
+Notes
+   Used for the sets the scan_eol() family has no kernel for, such as the
+   delimiters of a struct tag.
+
+*/
+char* scan_stop(char *p, unsigned char *stop)
+{
+   while ( !stop[(unsigned char)*p] ) p++;
+   return p;
+}
+
+/*****************************************************************************
+
+int scan_init(int kernels)
+
+Purpose
+   To select the fastest scanning kernels the cpu supports
+
+Params
+   kernels - SCAN_SCALAR, SCAN_SSE2 or SCAN_AVX2, the widest kernels
+             that may be selected
+
+Returns
+   the kernels selected
+
+Notes
+   Until this is called, the scalar kernels are used. The AVX2 kernels
+   are only selected if the cpu and os support them, as reported by
+   __builtin_cpu_supports(). SSE2 is part of every x86-64 cpu.
+
+   scan_eol() returns a ptr to the first nul, '\r' or '\n' of p
+   scan_space() returns a ptr to the first character of p not ' ' or '\t'
+   scan_ident() returns a ptr to the first character of p not a letter,
+                digit or '_'
+   scan_comment() returns a ptr to the first nul or '\n' of p, or to the
+                  '*' of the first "*\/", whichever comes first
+   scan_splice() returns a ptr to the first nul, '\r' or '\\' of p, where
+                 a line may have to be joined or its end normalized
+   scan_lines() returns the number of '\n' from p up to end, which may
+                hold nul bytes and is not read past
+
+*/
+int scan_init(int kernels)
+{
+   int supported;
+
+   supported = SCAN_SCALAR;
+#ifdef SCAN_HAVE_SSE2
+   supported = SCAN_SSE2;
+#endif
+#ifdef SCAN_HAVE_AVX2
+   __builtin_cpu_init();
+   if ( __builtin_cpu_supports("avx2") )
+      supported = SCAN_AVX2;
+#endif
+   if ( kernels > supported )
+      kernels = supported;
+   if ( kernels < SCAN_SCALAR )
+      kernels = SCAN_SCALAR;
+
+   scan_eol = scan_eol_scalar;
+   scan_space = scan_space_scalar;
+   scan_ident = scan_ident_scalar;
+   scan_comment = scan_comment_scalar;
+   scan_splice = scan_splice_scalar;
+   scan_lines = scan_lines_scalar;
+#ifdef SCAN_HAVE_SSE2
+   if ( kernels == SCAN_SSE2 )
+   {
+      scan_eol = scan_eol_sse2;
+      scan_space = scan_space_sse2;
+      scan_ident = scan_ident_sse2;
+      scan_comment = scan_comment_sse2;
+      scan_splice = scan_splice_sse2;
+      scan_lines = scan_lines_sse2;
+   }
+#endif
+#ifdef SCAN_HAVE_AVX2
+   if ( kernels == SCAN_AVX2 )
+   {
+      scan_eol = scan_eol_avx2;
+      scan_space = scan_space_avx2;
+      scan_ident = scan_ident_avx2;
+      scan_comment = scan_comment_avx2;
+      scan_splice = scan_splice_avx2;
+      scan_lines = scan_lines_avx2;
+   }
+#endif
+
+   return kernels;
+}
+
+/* name of kernels as returned by scan_init() */
+const char* scan_name(int kernels)
+{
+   if ( kernels == SCAN_AVX2 )
+      return "avx2";
+   if ( kernels == SCAN_SSE2 )
+      return "sse2";
+   return "scalar";
+}
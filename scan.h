@@ -0,0 +1,38 @@
+/*
+
+   scan.h : header defining character scanning operations
+
+   Copyright (C)2010 Rob Neff - All rights reserved.
+   Source code licensed under the new/simplified 2-clause BSD OSI license.
+
+*/
+
+#ifndef __SCAN_INCLUDED__
+#define __SCAN_INCLUDED__
+
+#include <stddef.h>
+
+/* scan_class[] bits */
+#define SCAN_EOL      0x01  /* nul, '\r' or '\n' */
+#define SCAN_SPACE    0x02  /* ' ' or '\t' */
+#define SCAN_IDENT    0x04  /* letter, digit or '_' */
+#define SCAN_SPLICE   0x08  /* nul, '\r' or '\\' */
+
+/* scan_init() kernels */
+#define SCAN_SCALAR   0     /* table driven, any cpu */
+#define SCAN_SSE2     1     /* 16 bytes at a time */
+#define SCAN_AVX2     2     /* 32 bytes at a time */
+
+/* contained in scan.c, the text scanned must end with a nul byte */
+extern const unsigned char scan_class[256];
+extern char* (*scan_eol)(char *p);
+extern char* (*scan_space)(char *p);
+extern char* (*scan_ident)(char *p);
+extern char* (*scan_comment)(char *p);
+extern char* (*scan_splice)(char *p);
+extern size_t (*scan_lines)(char *p, char *end);
+char* scan_stop(char *p, unsigned char *stop);
+int scan_init(int kernels);
+const char* scan_name(int kernels);
+
+#endif  /* ifndef __SCAN_INCLUDED__ */